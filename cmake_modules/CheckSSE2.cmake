@@ -48,6 +48,9 @@ if(SYSTEM_IS_X86)
     check_c_compiler_flag("-msse4" HAVE_FLAG_M_SSE4)
     check_c_compiler_flag("-msse4.1" HAVE_FLAG_M_SSE41)
     check_c_compiler_flag("-mavx" HAVE_FLAG_M_AVX)
+    check_c_compiler_flag("-mavx2" HAVE_FLAG_M_AVX2)
+    check_c_compiler_flag("-mfma" HAVE_FLAG_M_FMA)
+    check_c_compiler_flag("-mavx512f" HAVE_FLAG_M_AVX512F)
 
 
     # These all fail for some reason
@@ -120,6 +123,20 @@ if(SYSTEM_IS_X86)
       str_append(AVX_FLAGS "-xarch=avx")
     endif()
 
+    # Every AVX2 processor has FMA3, and the dispatchers check for both
+    set(AVX2_FLAGS ${AVX_FLAGS})
+    if(HAVE_FLAG_M_AVX2)
+      str_append(AVX2_FLAGS "-mavx2")
+    endif()
+    if(HAVE_FLAG_M_FMA)
+      str_append(AVX2_FLAGS "-mfma")
+    endif()
+
+    set(AVX512F_FLAGS ${AVX2_FLAGS})
+    if(HAVE_FLAG_M_AVX512F)
+      str_append(AVX512F_FLAGS "-mavx512f")
+    endif()
+
 
     check_c_compiler_flag("-mfpmath=387" HAVE_FLAG_M_FPMATH_387)
     check_c_compiler_flag("-mno-sse" HAVE_FLAG_M_NO_SSE)
@@ -177,6 +194,8 @@ if(SYSTEM_IS_X86)
     set(SSE3_FLAGS "${SSE2_FLAGS}")
     set(SSE41_FLAGS "${SSE3_FLAGS}")
     set(AVX_FLAGS "/arch:AVX")
+    set(AVX2_FLAGS "/arch:AVX2")
+    set(AVX512F_FLAGS "/arch:AVX512")
   endif()
 
   if(NEED_SSE_DEFINES)
@@ -207,6 +226,24 @@ if(AVX_CHECK)
 endif()
 mark_as_advanced(HAVE_AVX)
 
+set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} ${AVX2_FLAGS}")
+try_compile(AVX2_CHECK ${CMAKE_BINARY_DIR} ${MILKYWAYATHOME_CLIENT_CMAKE_MODULES}/test_avx2.c)
+set(CMAKE_C_FLAGS ${_CMAKE_C_FLAGS})
+if(AVX2_CHECK)
+  message(STATUS "AVX2 compiler flags - '${AVX2_FLAGS}'")
+  set(HAVE_AVX2 TRUE CACHE INTERNAL "Compiler has AVX2 support")
+endif()
+mark_as_advanced(HAVE_AVX2)
+
+set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} ${AVX512F_FLAGS}")
+try_compile(AVX512F_CHECK ${CMAKE_BINARY_DIR} ${MILKYWAYATHOME_CLIENT_CMAKE_MODULES}/test_avx512f.c)
+set(CMAKE_C_FLAGS ${_CMAKE_C_FLAGS})
+if(AVX512F_CHECK)
+  message(STATUS "AVX-512F compiler flags - '${AVX512F_FLAGS}'")
+  set(HAVE_AVX512F TRUE CACHE INTERNAL "Compiler has AVX-512F support")
+endif()
+mark_as_advanced(HAVE_AVX512F)
+
 
 set(CMAKE_REQUIRED_FLAGS "${SSE41_FLAGS}")
 check_include_files(smmintrin.h HAVE_SSE41 CACHE INTERNAL "Compiler has SSE4.1 headers")
@@ -312,6 +349,28 @@ function(enable_avx target)
                             COMPILE_FLAGS "${comp_flags} ${AVX_FLAGS}")
 endfunction()
 
+function(enable_avx2 target)
+  get_target_property(comp_flags ${target} COMPILE_FLAGS)
+  if(comp_flags STREQUAL "comp_flags-NOTFOUND")
+    set(comp_flags "")
+  endif()
+
+  set_target_properties(${target}
+                          PROPERTIES
+                            COMPILE_FLAGS "${comp_flags} ${AVX2_FLAGS}")
+endfunction()
+
+function(enable_avx512f target)
+  get_target_property(comp_flags ${target} COMPILE_FLAGS)
+  if(comp_flags STREQUAL "comp_flags-NOTFOUND")
+    set(comp_flags "")
+  endif()
+
+  set_target_properties(${target}
+                          PROPERTIES
+                            COMPILE_FLAGS "${comp_flags} ${AVX512F_FLAGS}")
+endfunction()
+
 
 function(maybe_disable_ssen)
   if(SYSTEM_IS_X86)
@@ -0,0 +1,10 @@
+
+#include <immintrin.h>
+
+int main(int argc, const char* argv[])
+{
+    __m256d a = _mm256_fmadd_pd(_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd());
+    __m256i b = _mm256_add_epi64(_mm256_castpd_si256(a), _mm256_castpd_si256(a));
+    return _mm256_movemask_pd(_mm256_castsi256_pd(b));
+}
+
@@ -33,8 +33,25 @@ int mwHasSSE41(const int abcd[4]);
 int mwHasSSE3(const int abcd[4]);
 int mwHasSSE2(const int abcd[4]);
 int mwHasAVX(const int abcd[4]);
+int mwHasFMA(const int abcd[4]);
+
+/* These take the result of leaf 7 */
+int mwHasAVX2(const int abcd[4]);
+int mwHasAVX512F(const int abcd[4]);
 
 int mwOSHasAVXSupport(void);
+int mwOSHasAVX512Support(void);
+
+typedef enum
+{
+    MW_SIMD_NONE,
+    MW_SIMD_SSE2,
+    MW_SIMD_AVX2,      /* Along with FMA */
+    MW_SIMD_AVX512F
+} MWSIMDLevel;
+
+/* The widest of these that both the processor and the OS support */
+MWSIMDLevel mwBestSIMDLevel(void);
 
 #ifdef __cplusplus
 }
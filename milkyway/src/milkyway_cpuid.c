@@ -21,6 +21,10 @@
 #include "milkyway_cpuid.h"
 #include "milkyway_util.h"
 
+#if defined(_MSC_VER) && MW_IS_X86
+  #include <intrin.h>
+#endif
+
 #if defined(__APPLE__) && MW_IS_X86
   #include <sys/param.h>
   #include <sys/sysctl.h>
@@ -34,11 +38,20 @@
 #define bit_SSE3 (1 << 0)
 #define bit_SSE41 (1 << 19)
 #define bit_AVX (1 << 28)
+#define bit_FMA (1 << 12)
+#define bit_OSXSAVE (1 << 27)
 #define bit_CMPXCHG16B (1 << 13)
 #define bit_3DNOW (1 << 31)
 #define bit_3DNOWP (1 << 30)
 #define bit_LM (1 << 29)
 
+/* Leaf 7, subleaf 0 in ebx */
+#define bit_AVX2 (1 << 5)
+#define bit_AVX512F (1 << 16)
+
+/* XCR0 bits for the SSE, AVX, opmask and upper ZMM register state */
+#define xcr0_AVX512_STATE 0xe6
+
 
 #if MW_IS_X86
 
@@ -74,7 +87,7 @@ void mw_cpuid(int abcd[4], int a, int c)
     __cpuid(abcd, 0);
     if (abcd[0] >= 1) /* Is this really necessary? */
     {
-        __cpuid(abcd, a);
+        __cpuidex(abcd, a, c);
     }
     else
     {
@@ -94,6 +107,21 @@ void mw_cpuid(int abcd[4], int a, int c)
 
 #endif /* MW_IS_X86 */
 
+int mwHasAVX512F(const int abcd[4])
+{
+    return !!(abcd[1] & bit_AVX512F);
+}
+
+int mwHasAVX2(const int abcd[4])
+{
+    return !!(abcd[1] & bit_AVX2);
+}
+
+int mwHasFMA(const int abcd[4])
+{
+    return !!(abcd[2] & bit_FMA);
+}
+
 int mwHasAVX(const int abcd[4])
 {
     return !!(abcd[2] & bit_AVX);
@@ -114,6 +142,44 @@ int mwHasSSE2(const int abcd[4])
     return !!(abcd[3] & bit_SSE2);
 }
 
+#if MW_IS_X86
+
+static unsigned long long mw_xgetbv0(void)
+{
+  #ifdef _MSC_VER
+    return _xgetbv(0);
+  #else
+    unsigned int eax, edx;
+
+    /* xgetbv, spelled out for old assemblers */
+    __asm__ volatile(".byte 0x0f, 0x01, 0xd0" : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((unsigned long long) edx << 32) | eax;
+  #endif
+}
+
+/* Rather than guessing from the OS version, ask the processor if the
+ * OS has enabled saving the opmask and full ZMM registers */
+int mwOSHasAVX512Support(void)
+{
+    int abcd[4];
+
+    mw_cpuid(abcd, 1, 0);
+    if (!(abcd[2] & bit_OSXSAVE))
+    {
+        return FALSE;
+    }
+
+    return (mw_xgetbv0() & xcr0_AVX512_STATE) == xcr0_AVX512_STATE;
+}
+
+#else
+
+int mwOSHasAVX512Support(void)
+{
+    return FALSE;
+}
+
+#endif /* MW_IS_X86 */
 
 
 #if defined(_WIN32)
@@ -221,5 +287,35 @@ int mwOSHasAVXSupport()
 
 #endif /* _WIN32 */
 
+MWSIMDLevel mwBestSIMDLevel(void)
+{
+  #if MW_IS_X86
+    int abcd[4], abcd7[4];
 
+    mw_cpuid(abcd, 0, 0);
+    if (abcd[0] >= 7)
+    {
+        mw_cpuid(abcd7, 7, 0);
+    }
+    else
+    {
+        abcd7[0] = abcd7[1] = abcd7[2] = abcd7[3] = 0;
+    }
+
+    mw_cpuid(abcd, 1, 0);
+
+    if (mwHasAVX(abcd) && mwOSHasAVXSupport() && mwHasAVX2(abcd7) && mwHasFMA(abcd))
+    {
+        if (mwHasAVX512F(abcd7) && mwOSHasAVX512Support())
+            return MW_SIMD_AVX512F;
+
+        return MW_SIMD_AVX2;
+    }
+
+    if (mwHasSSE2(abcd))
+        return MW_SIMD_SSE2;
+  #endif /* MW_IS_X86 */
+
+    return MW_SIMD_NONE;
+}
 
@@ -49,6 +49,7 @@ typedef struct
     char* matchHistBetaVelDisp; /* Just match this histogram to other histogram, no simulation -- with beta and vel dispersion calc*/
     char* graphicsBin;
     char* visArgs;
+    char* orbitCacheFile;   /* Keep reverse orbits here between runs */
 
     const char** forwardedArgs;
     unsigned int numForwardedArgs;
@@ -80,9 +81,12 @@ typedef struct
     int noCleanCheckpoint;
     int disableGPUCheckpointing;
     int verbose;
+    int reportEnergy;   /* Print the energy drift over the run */
+    int orbitCacheSize; /* Most reverse orbits to keep */
+    int emdNetworkSimplex; /* Use the network simplex EMD solver */
 } NBodyFlags;
 
-#define EMPTY_NBODY_FLAGS { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+#define EMPTY_NBODY_FLAGS { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
 
 NBodyStatus nbStepSystem(const NBodyCtx* ctx, NBodyState* st);
 NBodyStatus nbRunSystem(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf);
@@ -30,8 +30,19 @@
 #include "nbody_util.h"
 #include "milkyway_math.h"
 #include "milkyway_extra.h"
+#include "nbody_caustic_grid.h"
+
+/* Ring parameters, indexed from 1 */
+#define CAUSTIC_N_RINGS 20
+
+extern const double a_n[];
+extern const double V_n[];
+extern const double rate_n[];
+extern const double p_n[];
 
 mwvector causticHaloAccel(const Halo* h, mwvector pos, real r);
+void causticRingField(real rho, real z, int n, real* rfield, real* zfield);
+void causticHaloField(real rho, real z, real* rfield, real* zfield);
 
 
 #endif
\ No newline at end of file
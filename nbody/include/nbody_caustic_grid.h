@@ -0,0 +1,46 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_CAUSTIC_GRID_H_
+#define _NBODY_CAUSTIC_GRID_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where the table is kept between runs */
+#define CAUSTIC_GRID_FILE "caustic_grid.dat"
+
+/* Read or build the table if the context wants it */
+void nbSetupCausticGrid(const NBodyCtx* ctx);
+void nbFreeCausticGrid(void);
+
+/* Interpolated field of the caustic rings at (rho, z). FALSE if there
+ * is no table or the point is outside it. */
+int nbCausticGridField(real rho, real z, real* rfield, real* zfield);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_CAUSTIC_GRID_H_ */
+
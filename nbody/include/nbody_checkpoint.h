@@ -33,6 +33,7 @@ int nbReadCheckpoint(NBodyCtx* ctx, NBodyState* st);
 int nbWriteCheckpoint(const NBodyCtx* ctx, const NBodyState* st);
 int nbWriteCheckpointWithTmpFile(const NBodyCtx* ctx, const NBodyState* st, const char* tmpFile);
 NBodyStatus nbWriteFinalCheckpoint(const NBodyCtx* ctx, NBodyState* st);
+int nbCanCheckpoint(const NBodyCtx* ctx, const NBodyState* st);
 int nbTimeToCheckpoint(const NBodyCtx* ctx, NBodyState* st);
 
 #ifdef __cplusplus
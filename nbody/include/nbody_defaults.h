@@ -29,6 +29,7 @@ extern "C" {
 
 #define DEFAULT_CHECKPOINT_FILE "nbody_checkpoint"
 #define DEFAULT_HISTOGRAM_FILE  "histogram"
+#define DEFAULT_ORBIT_CACHE_SIZE 1024
 
 #define DEFAULT_LIKELIHOOD_METHOD NBODY_EMD
 
@@ -38,11 +39,23 @@ extern "C" {
 
 #define DEFAULT_SUN_GC_DISTANCE ((real) 8.0)
 #define DEFAULT_CRITERION TreeCode
+#define DEFAULT_INTEGRATOR Leapfrog
 #define DEFAULT_TREE_ROOT_SIZE ((real) 4.0)
 
 #define DEFAULT_USE_QUADRUPOLE_MOMENTS TRUE
 #define DEFAULT_ALLOW_INCEST FALSE
 #define DEFAULT_QUIET_ERRORS FALSE
+#define DEFAULT_USE_MORTON_TREE FALSE
+#define DEFAULT_USE_GROUP_WALK FALSE
+#define DEFAULT_USE_TILED_EXACT FALSE
+#define DEFAULT_USE_BLOCK_STEPS FALSE
+#define DEFAULT_USE_CAUSTIC_GRID FALSE
+#define DEFAULT_TREE_REBUILD_INTERVAL 1.0
+#define DEFAULT_FMM_ORDER 4.0
+#define DEFAULT_BLOCK_STEP_LEVELS 4.0
+#define DEFAULT_BLOCK_STEP_ACCURACY 0.025
+#define DEFAULT_POTENTIAL_GRID_TOLERANCE 0.0
+#define DEFAULT_TEST_PARTICLE_THREADS 0.0
 
 #define DEFAULT_USE_BEST_LIKELIHOOD FALSE
 #define DEFAULT_USE_VEL_DISP FALSE
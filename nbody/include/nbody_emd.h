@@ -32,6 +32,15 @@ typedef struct
     real beta; /* Beta Position */
 } WeightPos;
 
+typedef enum
+{
+    EMD_SOLVER_TRANSPORTATION,   /* emdCalc() */
+    EMD_SOLVER_NETWORK_SIMPLEX   /* emdCalcNetworkSimplex() */
+} EMDSolver;
+
+/* Network simplex basis kept from one solve to the next */
+typedef struct EMDNetwork EMDNetwork;
+
 
 
 #ifdef __cplusplus
@@ -44,7 +53,33 @@ real emdCalc(const real* RESTRICT signature_arr1,
               unsigned int size2,
               real* RESTRICT lower_bound);
 
-real nbMatchEMD(const NBodyHistogram* data, const NBodyHistogram* histogram);
+real emdCalcNetworkSimplex(const real* RESTRICT signature_arr1,
+                           const real* RESTRICT signature_arr2,
+                           unsigned int size1,
+                           unsigned int size2,
+                           real* RESTRICT lower_bound);
+
+/* Starts from the basis of the last solve on net when it had the same
+ * bins and the same signature_arr1, so only the weights of
+ * signature_arr2 changed, which is much quicker when they changed
+ * little. Otherwise it starts over. */
+real emdCalcNetworkSimplexWarm(EMDNetwork* net,
+                               const real* RESTRICT signature_arr1,
+                               const real* RESTRICT signature_arr2,
+                               unsigned int size1,
+                               unsigned int size2);
+
+EMDNetwork* emdCreateNetwork(void);
+
+/* Also prints how many pivots the solves took, if there were any */
+void emdDestroyNetwork(EMDNetwork* net);
+
+/* Which of them nbMatchEMD() uses */
+void nbSetEMDSolver(EMDSolver solver);
+
+/* net is used by the network simplex to start from the last match with
+ * the same data, and may be NULL */
+real nbMatchEMD(const NBodyHistogram* data, const NBodyHistogram* histogram, EMDNetwork* net);
 
 real nbWorstCaseEMD(const NBodyHistogram* hist);
 
@@ -0,0 +1,43 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_FMM_H_
+#define _NBODY_FMM_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NBODY_FMM_MAX_ORDER 8
+
+/* Number of terms of a Cartesian expansion up to order p */
+#define NBODY_FMM_TERMS(p) ((((p) + 1) * ((p) + 2) * ((p) + 3)) / 6)
+
+void nbMapForceBody_FMM(const NBodyCtx* ctx, NBodyState* st);
+void nbFreeFMM(NBodyFMM* fmm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_FMM_H_ */
+
@@ -30,6 +30,9 @@ extern "C" {
 /* compute force on all the bodies */
 NBodyStatus nbGravMap(const NBodyCtx* ctx, NBodyState* st);
 
+/* compute force on only some of the bodies */
+NBodyStatus nbGravMapBodies(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_GRAV_EXACT_H_
+#define _NBODY_GRAV_EXACT_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bodies in a tile. Two tiles take 28K, so a pair of them stays in L1. */
+#define NBODY_EXACT_TILE 256
+
+/* Tiles are padded with massless bodies to a multiple of the widest
+ * vector so the kernels don't need a remainder loop */
+#define NBODY_EXACT_PAD 8
+
+typedef struct
+{
+    real x[NBODY_EXACT_TILE];
+    real y[NBODY_EXACT_TILE];
+    real z[NBODY_EXACT_TILE];
+    real m[NBODY_EXACT_TILE];
+
+    real ax[NBODY_EXACT_TILE];
+    real ay[NBODY_EXACT_TILE];
+    real az[NBODY_EXACT_TILE];
+
+    unsigned int n;           /* bodies in the tile */
+    unsigned int nPad;        /* n rounded up to NBODY_EXACT_PAD */
+} NBodyExactTile;
+
+/* Add the forces between every body in a and every body in b to both
+ * tiles' accelerations. If a and b are the same tile, each body gets
+ * the force of all the others. Relies on eps2 > 0 to make a body's
+ * interaction with itself 0. */
+typedef void (*NBodyExactKernel)(NBodyExactTile* a, NBodyExactTile* b, real eps2);
+
+/* The kernel is rebuilt for each instruction set */
+#if MW_IS_X86
+  #if defined(__AVX512F__)
+    #define NB_EXACT_KERNEL nbExactKernel_AVX512F
+  #elif defined(__AVX2__)
+    #define NB_EXACT_KERNEL nbExactKernel_AVX2
+  #elif defined(__SSE2__)
+    #define NB_EXACT_KERNEL nbExactKernel_SSE2
+  #endif
+#endif /* MW_IS_X86 */
+
+#if MW_IS_X86
+void nbExactKernel_AVX512F(NBodyExactTile* a, NBodyExactTile* b, real eps2);
+void nbExactKernel_AVX2(NBodyExactTile* a, NBodyExactTile* b, real eps2);
+void nbExactKernel_SSE2(NBodyExactTile* a, NBodyExactTile* b, real eps2);
+#endif
+
+void nbMapForceBody_ExactTiled(const NBodyCtx* ctx, NBodyState* st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_GRAV_EXACT_H_ */
+
@@ -0,0 +1,102 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_GRAV_GROUP_H_
+#define _NBODY_GRAV_GROUP_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Interaction lists are padded with massless entries to a multiple of
+ * the widest vector so the kernels don't need a remainder loop */
+#define NBODY_LIST_PAD 8
+
+/* Sources found by a group's walk. The quadrupole moments are only
+ * used in the list of cells. */
+typedef struct
+{
+    real* x;
+    real* y;
+    real* z;
+    real* m;
+
+    real* xx;
+    real* xy;
+    real* xz;
+    real* yy;
+    real* yz;
+    real* zz;
+
+    unsigned int n;
+    unsigned int alloc;
+} NBodyInteractionList;
+
+#define EMPTY_INTERACTION_LIST { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0 }
+
+/* Positions of a group's bodies, and where their accelerations go */
+typedef struct
+{
+    real x[NBODY_GROUP_SIZE];
+    real y[NBODY_GROUP_SIZE];
+    real z[NBODY_GROUP_SIZE];
+
+    real ax[NBODY_GROUP_SIZE];
+    real ay[NBODY_GROUP_SIZE];
+    real az[NBODY_GROUP_SIZE];
+
+    unsigned int n;
+} NBodyGroupTargets;
+
+/* Sum the monopole list and the quadrupole list onto every target.
+ * Relies on eps2 > 0 to make a body's interaction with itself 0. */
+typedef void (*NBodyGroupKernel)(NBodyGroupTargets* tg,
+                                 const NBodyInteractionList* mono,
+                                 const NBodyInteractionList* quad,
+                                 real eps2);
+
+/* The kernel is rebuilt for each instruction set */
+#if MW_IS_X86
+  #if defined(__AVX512F__)
+    #define NB_GROUP_KERNEL nbGroupKernel_AVX512F
+  #elif defined(__AVX2__)
+    #define NB_GROUP_KERNEL nbGroupKernel_AVX2
+  #elif defined(__SSE2__)
+    #define NB_GROUP_KERNEL nbGroupKernel_SSE2
+  #endif
+#endif /* MW_IS_X86 */
+
+#if MW_IS_X86
+void nbGroupKernel_AVX512F(NBodyGroupTargets* tg, const NBodyInteractionList* mono, const NBodyInteractionList* quad, real eps2);
+void nbGroupKernel_AVX2(NBodyGroupTargets* tg, const NBodyInteractionList* mono, const NBodyInteractionList* quad, real eps2);
+void nbGroupKernel_SSE2(NBodyGroupTargets* tg, const NBodyInteractionList* mono, const NBodyInteractionList* quad, real eps2);
+#endif
+
+void nbMapForceBody_Group(const NBodyCtx* ctx, NBodyState* st);
+void nbMapForceTestParticles(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_GRAV_GROUP_H_ */
+
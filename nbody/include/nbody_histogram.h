@@ -25,16 +25,45 @@
 
 #include "nbody_types.h"
 #include "nbody.h"
+#include "nbody_coordinates.h"
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Room for nbFillHistogram() kept between histograms of the same bodies */
+typedef struct
+{
+    unsigned int* light;      /* Indices of the bodies that aren't ignored */
+    unsigned int* bin;        /* Bin of each of them, or nBin if out of range */
+    real* vlos;
+    real* beta;
+    unsigned int* binStart;   /* Where each bin starts in binVlos and binBeta */
+    real* binVlos;            /* Sorted by bin, and then only the kept ones */
+    real* binBeta;
+    unsigned int* counts;     /* Count of each bin for each thread */
+    unsigned int nLight;
+    int nbody;
+    unsigned int nBin;
+    int nThread;
+} NBodyHistogramScratch;
+
+#define EMPTY_HISTOGRAM_SCRATCH { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0 }
+
+void nbFreeHistogramScratch(NBodyHistogramScratch* hs);
+
 NBodyHistogram* nbReadHistogram(const char* histogramFile);
 
 NBodyHistogram* nbCreateHistogram(const NBodyCtx* ctx, const NBodyState* st, const HistogramParams* hp);
 
+void nbFillHistogram(NBodyHistogram* histogram,
+                     const NBodyCtx* ctx,
+                     const NBodyState* st,
+                     const HistogramParams* hp,
+                     const NBHistTrig* histTrig,
+                     NBodyHistogramScratch* hs);
+
 void nbPrintHistogram(FILE* f, const NBodyHistogram* histogram);
 
 void nbWriteHistogram(const char* histoutFileName,
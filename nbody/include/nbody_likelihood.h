@@ -24,11 +24,28 @@
 
 #include "nbody_types.h"
 #include "nbody.h"
+#include "nbody_coordinates.h"
+#include "nbody_histogram.h"
+#include "nbody_emd.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Everything about the likelihood that stays the same from step to
+ * step, so the best likelihood search only has to make the histogram
+ * of the bodies and compare it each time */
+struct NBodyLikelihoodContext
+{
+    HistogramParams hp;
+    NBodyLikelihoodMethod method;
+    NBHistTrig histTrig;
+    NBodyHistogram* data;       /* Histogram to match, or NULL if there is none */
+    NBodyHistogram* histogram;  /* Filled in again for each step */
+    NBodyHistogramScratch scratch;
+    EMDNetwork* emdNetwork;     /* Basis of the last EMD, for the next step to start from */
+};
+
 real nbSystemLikelihood(const NBodyState* st,
                      const NBodyHistogram* data,
                      const NBodyHistogram* histogram,
@@ -36,6 +53,9 @@ real nbSystemLikelihood(const NBodyState* st,
 
 int nbGetLikelihoodInfo(const NBodyFlags* nbf, HistogramParams* hp, NBodyLikelihoodMethod* method);
 
+NBodyLikelihoodContext* nbCreateLikelihoodContext(const NBodyFlags* nbf);
+void nbDestroyLikelihoodContext(NBodyLikelihoodContext* lc);
+
 real nbMatchHistogramFiles(const char* datHist, const char* matchHist, mwbool vel_disp, mwbool beta_disp);
 
 #ifdef __cplusplus
@@ -30,6 +30,10 @@ extern "C" {
 
 int nbOpenPotentialEvalStatePerThread(NBodyState* st, const NBodyFlags* nbf);
 void nbEvalPotentialClosure(NBodyState* st, mwvector pos, mwvector* aOut);
+void nbEvalPotentialClosureBatch(NBodyState* st,
+                                 const real* x, const real* y, const real* z,
+                                 real* ax, real* ay, real* az,
+                                 unsigned int n);
 int nbEvaluateHistogramParams(lua_State* luaSt, HistogramParams* hp);
 NBodyLikelihoodMethod nbEvaluateLikelihoodMethod(lua_State* luaSt);
 int nbHistogramParamsCheck(const NBodyFlags* nbf, HistogramParams* hp);
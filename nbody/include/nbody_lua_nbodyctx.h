@@ -34,6 +34,7 @@ NBodyCtx* expectNBodyCtx(lua_State* luaSt, int idx);
 int registerNBodyCtx(lua_State* luaSt);
 
 criterion_t readCriterion(lua_State* luaSt, const char* name);
+integrator_t readIntegrator(lua_State* luaSt, const char* name);
 
 #endif /* _NBODY_LUA_NBODYCTX_H_ */
 
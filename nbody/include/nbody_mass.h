@@ -38,11 +38,16 @@ real nbCostComponent(const NBodyHistogram* data, const NBodyHistogram* histogram
 
 real calc_vLOS(const mwvector v, const mwvector p, real sunGCdist);
 
+void nbCalcBinVelDisp(HistData* bin, mwbool initial, real correction_factor);
+void nbCalcBinBetaDisp(HistData* bin, mwbool initial, real correction_factor);
 void nbCalcVelDisp(NBodyHistogram* histogram, mwbool initial, real correction_factor);
 void nbCalcBetaDisp(NBodyHistogram* histogram, mwbool initial, real correction_factor);
 
-void nbRemoveVelOutliers(const NBodyState* st, NBodyHistogram* histogram, real * use_velbody, real * vlos, real sigma_cutoff);
-void nbRemoveBetaOutliers(const NBodyState* st, NBodyHistogram* histogram, real * use_betabody, real * betas, real sigma_cutoff);
+/* Most rounds of outlier rejection. It converges somewhere between 3 and 6 */
+#define NBODY_OUTLIER_ITERATIONS 6
+
+void nbRemoveBinVelOutliers(HistData* bin, real* vlos, unsigned int n, real sigma_cutoff, real correction_factor);
+void nbRemoveBinBetaOutliers(HistData* bin, real* betas, unsigned int n, real sigma_cutoff, real correction_factor);
 
 real nbVelocityDispersion(const NBodyHistogram* data, const NBodyHistogram* histogram);
 real nbBetaDispersion(const NBodyHistogram* data, const NBodyHistogram* histogram);
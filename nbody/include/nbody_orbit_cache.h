@@ -0,0 +1,64 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_ORBIT_CACHE_H_
+#define _NBODY_ORBIT_CACHE_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Keep the results of reverse orbits in the file between runs, at most
+ * maxEntries of them. The least recently used are dropped first. */
+void nbOpenOrbitCache(const char* filename, unsigned int maxEntries);
+
+/* Write the cache back if it changed, and print the hits and misses */
+void nbCloseOrbitCache(void);
+
+/* TRUE and the results of an earlier reverse orbit with exactly these
+ * arguments if the cache is open and has one */
+int nbOrbitCacheLookup(const Potential* pot,
+                       integrator_t integrator,
+                       mwvector pos,
+                       mwvector vel,
+                       real tstop,
+                       real dt,
+                       mwvector* finalPos,
+                       mwvector* finalVel,
+                       real* energyDrift);
+
+void nbOrbitCacheInsert(const Potential* pot,
+                        integrator_t integrator,
+                        mwvector pos,
+                        mwvector vel,
+                        real tstop,
+                        real dt,
+                        mwvector finalPos,
+                        mwvector finalVel,
+                        real energyDrift);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_ORBIT_CACHE_H_ */
+
@@ -0,0 +1,51 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_ORBIT_FILE_H_
+#define _NBODY_ORBIT_FILE_H_
+
+#include <stdint.h>
+
+/* Binary orbits from PrintReverseOrbit. After the header are blocks of
+ * up to blockRows rows, each a uint32_t row count, 4 bytes of padding,
+ * then every column in turn. The columns are l, b, r, vx, vy and vz,
+ * the same as the text output, in reals of realSize bytes. */
+
+#define NBODY_ORBIT_FILE_MAGIC "mworbit"
+#define NBODY_ORBIT_FILE_VERSION 1
+#define NBODY_ORBIT_FILE_COLUMNS 6
+
+/* Rows per block, which is also how many are buffered before writing */
+#define NBODY_ORBIT_FILE_BLOCK_ROWS 8192
+
+/* Format of each row of the text output */
+#define NBODY_ORBIT_TEXT_FORMAT "%.15f\t%.15f\t%.15f\t%.15f\t%.15f\t%.15f\n"
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t realSize;
+    uint32_t nColumn;
+    uint32_t blockRows;
+} NBodyOrbitFileHeader;
+
+#endif /* _NBODY_ORBIT_FILE_H_ */
+
@@ -25,22 +25,75 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "nbody_types.h"
 
+#define NBODY_MAX_INTEGRATOR_DRIFTS 5
+
+/* One step of an integrator as alternating kicks (velocity updates) and
+ * drifts (position updates), each over the given fraction of the
+ * timestep. With kickFirst a step is kick[0], drift[0], kick[1], ...,
+ * drift[nDrift - 1], kick[nDrift], and the forces after the last drift
+ * are the ones the next step starts with. Otherwise it is drift[0],
+ * kick[0], ..., kick[nDrift - 2], drift[nDrift - 1]. */
+typedef struct
+{
+    mwbool kickFirst;
+    unsigned int nDrift;
+    real drift[NBODY_MAX_INTEGRATOR_DRIFTS];
+    real kick[NBODY_MAX_INTEGRATOR_DRIFTS + 1];
+} NBodyIntegratorScheme;
+
+const NBodyIntegratorScheme* nbIntegratorScheme(integrator_t integrator);
+
+/* Number of force evaluations in a step of the scheme */
+unsigned int nbIntegratorForces(const NBodyIntegratorScheme* s);
+
 void nbReverseOrbit(mwvector* finalPos,
                     mwvector* finalVel,
+                    real* energyDrift,
                     const Potential* pot,
+                    integrator_t integrator,
                     mwvector pos,
                     mwvector vel,
                     real tstop,
                     real dt);
 
+/* nbReverseOrbit() for n orbits, each in its own potential. Orbits next
+ * to each other with the same potential are stepped together, with
+ * their accelerations batched. If tolerance > 0 the integrator is
+ * ignored and each orbit goes to exactly tstop with adaptive
+ * Dormand-Prince steps, the first of them dt. energyDrift may be
+ * NULL. */
+void nbReverseOrbits(mwvector* finalPos,
+                     mwvector* finalVel,
+                     real* energyDrift,
+                     const Potential* const* pots,
+                     integrator_t integrator,
+                     real tolerance,
+                     const mwvector* pos,
+                     const mwvector* vel,
+                     unsigned int n,
+                     real tstop,
+                     real dt);
+
+/* How nbPrintReverseOrbit() writes the orbits */
+typedef struct
+{
+    mwbool binary;         /* Blocks of columns, see nbody_orbit_file.h */
+    unsigned int every;    /* Write every nth step, and the last */
+    real arcLength;        /* If > 0, write when the orbit has gone this far instead */
+} NBodyOrbitOutput;
+
+#define DEFAULT_ORBIT_OUTPUT { FALSE, 1, 0.0 }
+
 void nbPrintReverseOrbit(mwvector* finalPos,
                          mwvector* finalVel,
                          const Potential* pot,
+                         integrator_t integrator,
                          mwvector pos,
                          mwvector vel,
                          real tstop,
                          real tstopforward,
-                         real dt);
+                         real dt,
+                         const NBodyOrbitOutput* out);
     
 #endif /* _NBODY_ORBIT_INTEGRATOR_H_ */
 
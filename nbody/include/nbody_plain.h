@@ -27,6 +27,9 @@
 extern "C" {
 #endif
 
+/* Largest block timestep is 2^(levels - 1) timesteps */
+#define NBODY_MAX_BLOCK_STEP_LEVELS 16
+
 NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st);
 NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf);
 
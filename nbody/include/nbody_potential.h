@@ -27,7 +27,48 @@
 extern "C" {
 #endif
 
+/* The batched kernels work on a multiple of this many positions */
+#define NBODY_POTENTIAL_PAD 8
+
+/* External acceleration at n positions, which must be a multiple of
+ * NBODY_POTENTIAL_PAD. Only Miyamoto-Nagai disks with logarithmic or
+ * triaxial halos. */
+typedef void (*NBodyPotentialKernel)(const Potential* pot,
+                                     const real* x, const real* y, const real* z,
+                                     real* ax, real* ay, real* az,
+                                     unsigned int n);
+
+/* The kernel is rebuilt for each instruction set */
+#if MW_IS_X86
+  #if defined(__AVX512F__)
+    #define NB_POTENTIAL_KERNEL nbPotentialKernel_AVX512F
+  #elif defined(__AVX2__)
+    #define NB_POTENTIAL_KERNEL nbPotentialKernel_AVX2
+  #elif defined(__SSE2__)
+    #define NB_POTENTIAL_KERNEL nbPotentialKernel_SSE2
+  #endif
+#endif /* MW_IS_X86 */
+
+#if MW_IS_X86
+void nbPotentialKernel_AVX512F(const Potential* pot, const real* x, const real* y, const real* z,
+                               real* ax, real* ay, real* az, unsigned int n);
+void nbPotentialKernel_AVX2(const Potential* pot, const real* x, const real* y, const real* z,
+                            real* ax, real* ay, real* az, unsigned int n);
+void nbPotentialKernel_SSE2(const Potential* pot, const real* x, const real* y, const real* z,
+                            real* ax, real* ay, real* az, unsigned int n);
+#endif
+
 mwvector nbExtAcceleration(const Potential* pot, mwvector pos);
+real nbExtPotential(const Potential* pot, mwvector pos);
+
+/* Fill in pot->consts from the parameters */
+void nbSetPotentialConsts(Potential* pot);
+
+/* nbExtAcceleration() at each of n positions, bit for bit */
+void nbExtAccelerationBatch(const Potential* pot,
+                            const real* x, const real* y, const real* z,
+                            real* ax, real* ay, real* az,
+                            unsigned int n);
 
 #ifdef __cplusplus
 }
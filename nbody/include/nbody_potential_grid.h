@@ -0,0 +1,47 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_POTENTIAL_GRID_H_
+#define _NBODY_POTENTIAL_GRID_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sample the Lua potential closure if the context wants it. Fails if
+ * the closure does. */
+int nbSetupPotentialGrid(const NBodyCtx* ctx, NBodyState* st);
+void nbFreePotentialGrid(void);
+
+/* Interpolated accelerations at n points. Points outside the grid get
+ * the closure's acceleration. FALSE if there is no grid. */
+int nbPotentialGridAccel(NBodyState* st,
+                         const real* x, const real* y, const real* z,
+                         real* ax, real* ay, real* az,
+                         unsigned int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_POTENTIAL_GRID_H_ */
+
@@ -128,11 +128,32 @@ typedef struct MW_ALIGN_TYPE
 #define DWARF_TYPE "Dwarf"
 
 
+/* Combinations of the parameters above for the batched external
+ * acceleration, filled in by checkPotentialConstants(). Each is found
+ * the same way as in the one body version so the results match. */
+typedef struct MW_ALIGN_TYPE
+{
+    real sphereNegMass;   /* -mass */
+    real sphereScale;
+
+    real diskNegMass;     /* -mass */
+    real diskA;           /* scale length */
+    real diskBSqr;        /* scale height squared */
+
+    real haloV;           /* -2 vhalo^2 for logarithmic, -vhalo^2 for triaxial */
+    real haloV2;          /* 2 haloV, for z of triaxial */
+    real haloDSqr;        /* scale length squared */
+    real haloQSqr;        /* flattenZ squared */
+    real haloC1x2;        /* 2 c1 and 2 c2 of triaxial */
+    real haloC2x2;
+} PotentialConsts;
+
 typedef struct MW_ALIGN_TYPE
 {
     Spherical sphere[1];
     Disk disk;
     Halo halo;
+    PotentialConsts consts;
     void* rings;       /* currently unused */
 } Potential;
 
@@ -143,7 +164,8 @@ typedef struct MW_ALIGN_TYPE
 #define EMPTY_DISK { InvalidDisk, 0.0, 0.0, 0.0 }
 #define EMPTY_HALO { InvalidHalo, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 }
 #define EMPTY_DWARF { InvalidDwarf, 0.0, 0.0, 0.0, 0.0, 0.0 }
-#define EMPTY_POTENTIAL { {EMPTY_SPHERICAL}, EMPTY_DISK, EMPTY_HALO, NULL }
+#define EMPTY_POTENTIAL_CONSTS { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 }
+#define EMPTY_POTENTIAL { {EMPTY_SPHERICAL}, EMPTY_DISK, EMPTY_HALO, EMPTY_POTENTIAL_CONSTS, NULL }
 
 #endif /* _NBODY_POTENTIAL_TYPES_H_ */
 
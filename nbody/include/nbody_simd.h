@@ -0,0 +1,135 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Vector operations on doubles for the kernels that are built once for
+ * each instruction set. Only include from those files. */
+
+#ifndef _NBODY_SIMD_H_
+#define _NBODY_SIMD_H_
+
+#include <immintrin.h>
+
+
+#if defined(__AVX512F__)
+
+typedef __m512d vreal;
+#define VWIDTH 8
+
+#define v_load(p)     _mm512_loadu_pd(p)
+#define v_store(p, a) _mm512_storeu_pd(p, a)
+#define v_set1(x)     _mm512_set1_pd(x)
+#define v_zero()      _mm512_setzero_pd()
+#define v_add(a, b)   _mm512_add_pd(a, b)
+#define v_sub(a, b)   _mm512_sub_pd(a, b)
+#define v_mul(a, b)   _mm512_mul_pd(a, b)
+#define v_div(a, b)   _mm512_div_pd(a, b)
+#define v_sqrt(a)     _mm512_sqrt_pd(a)
+#define v_madd(a, b, c) _mm512_fmadd_pd(a, b, c)
+
+static inline double v_hsum(vreal a)
+{
+    return _mm512_reduce_add_pd(a);
+}
+
+/* 14 bit estimate */
+#define v_rsqrt_estimate(a) _mm512_rsqrt14_pd(a)
+#define V_RSQRT_STEPS 2
+
+#elif defined(__AVX2__)
+
+typedef __m256d vreal;
+#define VWIDTH 4
+
+#define v_load(p)     _mm256_loadu_pd(p)
+#define v_store(p, a) _mm256_storeu_pd(p, a)
+#define v_set1(x)     _mm256_set1_pd(x)
+#define v_zero()      _mm256_setzero_pd()
+#define v_add(a, b)   _mm256_add_pd(a, b)
+#define v_sub(a, b)   _mm256_sub_pd(a, b)
+#define v_mul(a, b)   _mm256_mul_pd(a, b)
+#define v_div(a, b)   _mm256_div_pd(a, b)
+#define v_sqrt(a)     _mm256_sqrt_pd(a)
+
+#ifdef __FMA__
+  #define v_madd(a, b, c) _mm256_fmadd_pd(a, b, c)
+#else
+  #define v_madd(a, b, c) _mm256_add_pd(_mm256_mul_pd(a, b), c)
+#endif
+
+static inline double v_hsum(vreal a)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+/* 12 bit estimate in single precision. Fine for the squared distances
+ * of softened bodies, which are nowhere near the ends of float range. */
+#define v_rsqrt_estimate(a) _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(a)))
+#define V_RSQRT_STEPS 3
+
+#else
+
+typedef __m128d vreal;
+#define VWIDTH 2
+
+#define v_load(p)     _mm_loadu_pd(p)
+#define v_store(p, a) _mm_storeu_pd(p, a)
+#define v_set1(x)     _mm_set1_pd(x)
+#define v_zero()      _mm_setzero_pd()
+#define v_add(a, b)   _mm_add_pd(a, b)
+#define v_sub(a, b)   _mm_sub_pd(a, b)
+#define v_mul(a, b)   _mm_mul_pd(a, b)
+#define v_div(a, b)   _mm_div_pd(a, b)
+#define v_sqrt(a)     _mm_sqrt_pd(a)
+#define v_madd(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c)
+
+static inline double v_hsum(vreal a)
+{
+    return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a)));
+}
+
+/* Refining a single precision estimate two lanes at a time is slower
+ * than just dividing */
+#define v_rsqrt_estimate(a) _mm_div_pd(_mm_set1_pd(1.0), _mm_sqrt_pd(a))
+#define V_RSQRT_STEPS 0
+
+#endif /* __AVX512F__ */
+
+
+/* 1 / sqrt(a), refined from the estimate with Newton steps that each
+ * double the number of correct bits */
+static inline vreal v_rsqrt(vreal a)
+{
+    int i;
+    const vreal half = v_set1(0.5);
+    const vreal threeHalves = v_set1(1.5);
+    const vreal halfA = v_mul(half, a);
+    vreal y = v_rsqrt_estimate(a);
+
+    for (i = 0; i < V_RSQRT_STEPS; ++i)
+    {
+        y = v_mul(y, v_sub(threeHalves, v_mul(halfA, v_mul(y, y))));
+    }
+
+    return y;
+}
+
+#endif /* _NBODY_SIMD_H_ */
+
@@ -0,0 +1,64 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_SOA_H_
+#define _NBODY_SOA_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void nbAllocSoA(NBodySoA* soa, int nbody);
+void nbFreeSoA(NBodySoA* soa);
+void nbCopySoA(NBodySoA* dest, const NBodySoA* src, int nbody);
+
+void nbBodiesToSoA(NBodySoA* soa, const Body* bodies, int nbody);
+void nbSoAToBodies(Body* bodies, const NBodySoA* soa, int nbody);
+
+void nbLoadBodyStore(NBodyState* st);
+void nbSyncBodyView(NBodyState* st);
+
+static inline mwvector nbSoAPos(const NBodySoA* soa, unsigned int i)
+{
+    mwvector r = mw_vec(soa->pos[0][i], soa->pos[1][i], soa->pos[2][i]);
+    return r;
+}
+
+static inline mwvector nbSoAAcc(const NBodySoA* soa, unsigned int i)
+{
+    mwvector a = mw_vec(soa->acc[0][i], soa->acc[1][i], soa->acc[2][i]);
+    return a;
+}
+
+static inline void nbSoASetAcc(NBodySoA* soa, unsigned int i, mwvector a)
+{
+    soa->acc[0][i] = X(a);
+    soa->acc[1][i] = Y(a);
+    soa->acc[2][i] = Z(a);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_SOA_H_ */
+
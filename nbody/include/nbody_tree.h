@@ -28,6 +28,12 @@ extern "C" {
 #endif
 
 NBodyStatus nbMakeTree(const NBodyCtx*, NBodyState*);    /* construct tree structure */
+void nbMakeTreeGroups(NBodyTree* t, const NBodySoA* soa, int nbody);
+const unsigned int* nbOrderTestParticles(NBodyTree* t,
+                                         const NBodySoA* soa,
+                                         const uint32_t* bodies,
+                                         unsigned int first,
+                                         unsigned int n);
 
 #if 0
 void registerFindRCrit(lua_State* luaSt);
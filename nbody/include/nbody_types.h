@@ -99,17 +99,29 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 
 typedef short body_t;
 
+/* Link to a node of the tree. Bodies are referred to by their index
+ * in the body table, cells by their index in the tree's cell arena
+ * with NODE_CELL_BIT set. */
+typedef uint32_t noderef_t;
+
+#define NODE_CELL_BIT ((noderef_t) 0x80000000)
+#define NODE_NULL ((noderef_t) 0xffffffff)
+
+#define isCellRef(r) (((r) & NODE_CELL_BIT) != 0)
+#define cellRef(i) ((noderef_t) (i) | NODE_CELL_BIT)
+#define refIndex(r) ((r) & ~NODE_CELL_BIT)
+
 /* node: data common to BODY and CELL structures. */
-typedef struct MW_ALIGN_TYPE _NBodyNode
+typedef struct MW_ALIGN_TYPE
 {
     mwvector pos;             /* position of node */
-    struct _NBodyNode* next;  /* link to next force-calc */
+    noderef_t next;           /* link to next force-calc */
     real mass;                /* total mass of node */
     body_t type;              /* code for node type */
     unsigned int id;          /* body id */
 } NBodyNode;
 
-#define EMPTY_NODE { ZERO_VECTOR, NULL, 0.0, 0, 0  }
+#define EMPTY_NODE { ZERO_VECTOR, NODE_NULL, 0.0, 0, 0  }
 
 #define Type(x) (((NBodyNode*) (x))->type)
 #define Mass(x) (((NBodyNode*) (x))->mass)
@@ -147,10 +159,10 @@ typedef struct MW_ALIGN_TYPE
 {
     NBodyNode cellnode;         /* data common to all nodes */
     real rcrit2;                /* critical c-of-m radius^2 */
-    NBodyNode* more;            /* link to first descendent */
+    noderef_t more;             /* link to first descendent */
     union MW_ALIGN_V(16)        /* shared storage for... */
     {
-        NBodyNode* subp[NSUB];  /* descendents of cell */
+        noderef_t subp[NSUB];   /* descendents of cell */
         NBodyQuadMatrix quad;   /* quad. moment of cell. Unique symmetric matrix components */
     } stuff;
 } NBodyCell;
@@ -162,9 +174,20 @@ typedef enum
     TreeCode, 
     SW93,
     BH86,
-    Exact
+    Exact,
+    FMM
 } criterion_t;
 
+/* Integration schemes for the bodies and the reverse orbit. All are
+   symplectic. The 4th order ones take 3 or 4 force evaluations a step. */
+typedef enum
+{
+    InvalidIntegrator = InvalidEnum,
+    Leapfrog,
+    ForestRuth,
+    PEFRL
+} integrator_t;
+
 
 typedef enum
 {
@@ -179,19 +202,106 @@ typedef enum
 #define Subp(x)   (((NBodyCell*) (x))->stuff.subp)
 #define Quad(x)   (((NBodyCell*) (x))->stuff.quad)
 
+/* Most bodies that share a walk in the grouped force calculation.
+ * Larger groups mean fewer walks but longer interaction lists, since
+ * cells have to be opened for the closest body of the group. */
+#define NBODY_GROUP_SIZE 32
+
+/* A run of bodies in groupBodies that share one tree walk */
+typedef struct
+{
+    unsigned int start;
+    unsigned int count;
+} NBodyGroup;
+
+/* Expansions of the cells used by the fast multipole method */
+typedef struct
+{
+    real* multipole;          /* moments of each cell about its center of mass */
+    real* local;              /* local expansion of each cell about its center of mass */
+    real* radius;             /* distance from the center of mass to the farthest corner of each cell */
+    unsigned int* count;      /* number of bodies in each cell */
+    unsigned int cellAlloc;   /* number of cells the arrays can hold */
+    unsigned int nTerm;       /* terms in each expansion */
+
+    noderef_t* targets;       /* subtrees whose forces are found separately */
+    unsigned int nTarget;
+    unsigned int targetAlloc;
+} NBodyFMM;
+
+#define EMPTY_FMM { NULL, NULL, NULL, NULL, 0, 0, NULL, 0, 0 }
+
 /* Variables used in tree construction. */
 
 typedef struct MW_ALIGN_TYPE
 {
-    NBodyCell* root;         /* pointer to root cell */
+    NBodyCell* root;         /* pointer to root cell, the first in the arena */
     real rsize;              /* side-length of root cell */
 
+    NBodyCell* cells;        /* arena of cells in depth first order */
+    NBodyCell* cellsTmp;     /* space for reordering the arena */
+    unsigned int cellAlloc;  /* number of cells the arena can hold */
+
     unsigned int cellUsed;   /* count of cells in tree */
     unsigned int maxDepth;   /* count of levels in tree */
     int structureError;
+
+    /* Cells by level, for the passes that sweep the tree a level at a time */
+    unsigned int* cellLevel;   /* level of each cell in the arena */
+    unsigned int* levelCells;  /* cell indices sorted by level */
+    unsigned int* levelStart;  /* where each level starts in levelCells */
+    unsigned int levelAlloc;   /* number of levels levelStart can hold */
+
+    /* Scratch space for the Morton key tree build, kept between steps */
+    uint64_t* keys;          /* Morton key of each body, sorted */
+    unsigned int* keyOrder;  /* body index corresponding to each key */
+    uint64_t* keysTmp;
+    unsigned int* keyOrderTmp;
+    unsigned int keysAlloc;  /* number of keys the scratch arrays can hold */
+
+    /* Walk groups for the grouped force calculation */
+    NBodyGroup* groups;
+    unsigned int* groupBodies; /* bodies of each group, in depth first order */
+    unsigned int* groupOf;     /* group of each body */
+    unsigned int nGroup;
+    unsigned int groupAlloc;   /* number of bodies the group arrays can hold */
+
+    /* Kept between steps for refitting the tree instead of building it again */
+    NBodyCell* cellsBuilt;         /* cells as built, before hackCofM replaced the midpoints */
+    mwvector cmBuilt;              /* center of mass of the bodies when cellsBuilt was kept */
+    mwbool* relocate;              /* bodies to insert again after leaving their cell */
+    unsigned int relocateAlloc;
+    unsigned int refitCount;       /* refits since the last full build */
+    unsigned int nRelocated;       /* bodies moved to another cell by the last refit */
+    unsigned int nRelocatedTotal;  /* bodies moved since the last full build */
+
+    NBodyFMM fmm;
 } NBodyTree;
 
-#define EMPTY_TREE { NULL, 0.0, 0, 0, FALSE }
+#define EMPTY_TREE { NULL, 0.0, NULL, NULL, 0, 0, 0, FALSE, NULL, NULL, NULL, 0,     \
+                     NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0, 0,              \
+                     NULL, ZERO_VECTOR, NULL, 0, 0, 0, 0, EMPTY_FMM }
+
+/* Cell a link refers to */
+#define CellPtr(t, r) (&(t)->cells[refIndex(r)])
+
+/* Structure of arrays copy of the bodies used by the CPU integrator
+ * and force calculation. During a CPU run this is the authoritative
+ * copy, and bodytab is only a view of it brought up to date by
+ * nbSyncBodyView() before anything else looks at the bodies.
+ */
+typedef struct MW_ALIGN_TYPE
+{
+    real* pos[3];
+    real* vel[3];
+    real* acc[3];           /* accelerations from the last force calculation */
+    real* mass;
+    noderef_t* next;        /* tree links of bodies */
+    body_t* type;
+    unsigned int* id;
+} NBodySoA;
+
+#define EMPTY_SOA { { NULL, NULL, NULL }, { NULL, NULL, NULL }, { NULL, NULL, NULL }, NULL, NULL, NULL, NULL }
 
 
 #if NBODY_OPENCL
@@ -338,20 +448,35 @@ typedef struct
 } NBodyHistogram;
 
 
+/* A Lua potential closure compiled by nbody_potential_expr.c */
+typedef struct NBodyPotentialExpr NBodyPotentialExpr;
+
+/* What the best likelihood search needs each step, in nbody_likelihood.h */
+typedef struct NBodyLikelihoodContext NBodyLikelihoodContext;
+
 /* Mutable state used during an evaluation */
 typedef struct MW_ALIGN_TYPE
 {
     NBodyTree tree;
-    NBodyNode* freeCell;      /* list of free cells */
     char* checkpointResolved;
     Body* bodytab;            /* points to array of bodies */
-    mwvector* acctab;         /* Corresponding accelerations of bodies */
+    NBodySoA soa;             /* bodies and accelerations used by the CPU path */
+    real* threadAcc;          /* each thread's accelerations for the tiled Exact sum */
+    size_t threadAccAlloc;
+    uint32_t* stepLevel;      /* with block timesteps, each body's step is 2^stepLevel timesteps */
+    uint32_t* activeBodies;   /* bodies whose step ended with the last timestep */
+    int nActive;
+    uint64_t forceEvals;      /* forces found and skipped with block timesteps this run */
+    uint64_t forceEvalsSaved;
     mwvector* orbitTrace;     /* Trail of center of masses for display purposes */
     scene_t* scene;
 
     lua_State** potEvalStates;  /* If using a Lua closure as a potential, the evaluation states.
                                    We need one per thread in the general case. */
     int* potEvalClosures;       /* Lua closure for each state */
+    NBodyPotentialExpr* potentialExpr;  /* The closure compiled, if it could be. Then
+                                           only the first thread has a state. */
+    NBodyLikelihoodContext* likelihoodCtx;  /* Made by the first likelihood found during the run */
 
     size_t nOrbitTrace;         /* Number of items in orbitTrace */
     time_t lastCheckpoint;
@@ -359,6 +484,7 @@ typedef struct MW_ALIGN_TYPE
     unsigned int step;
     int nbody;
     int effNBody;            /* Sometimes needed rounded up number of bodies. >= nbody are just padding */
+    int nMassive;            /* Bodies with mass come first in the SoA store, and the rest are test particles */
     int treeIncest;          /* Tree incest has occured */
     int potentialEvalError;  /* Error occured in calling custom Lua potential */
 
@@ -374,10 +500,11 @@ typedef struct MW_ALIGN_TYPE
     mwbool usesExact;
     mwbool usesQuad;
     mwbool usesConsistentMemory;
-    mwbool dirty;      /* Whether the view of the bodies is consistent with the view in the CL buffers */
+    mwbool dirty;      /* Whether bodytab is out of date with the CL buffers or the SoA store */
     mwbool usesCL;
     mwbool useCLCheckpointing;
     mwbool reportProgress;
+    mwbool accuracyReported;  /* approximate forces compared with the direct sum yet */
 
   #if NBODY_OPENCL
     CLInfo* ci;
@@ -393,7 +520,7 @@ typedef struct MW_ALIGN_TYPE
 
 #define NBODYSTATE_TYPE "NBodyState"
 
-#define EMPTY_NBODYSTATE { EMPTY_TREE, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, NULL, NULL, NULL, NULL }
+#define EMPTY_NBODYSTATE { EMPTY_TREE, NULL, NULL, EMPTY_SOA, NULL, 0, NULL, NULL, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, NULL, NULL, NULL, NULL }
 
 
 
@@ -415,6 +542,7 @@ typedef struct MW_ALIGN_TYPE
     real sunGCDist;
 
     criterion_t criterion;
+    integrator_t integrator;
     ExternalPotentialType potentialType;
     
     mwbool Nstep_control;     /* manually control how many timesteps simulation runs */
@@ -436,6 +564,19 @@ typedef struct MW_ALIGN_TYPE
     real VelCorrect;          /* correction factor for correcting the distribution after outlier rejection */
     
     real Ntsteps;     /* number of time steps to run when manual control is on */
+
+    mwbool useMortonTree;     /* build the tree from sorted Morton keys instead of inserting bodies one at a time */
+    mwbool useGroupWalk;      /* walk the tree once per group of nearby bodies instead of once per body */
+    mwbool useTiledExact;     /* sum the Exact criterion in vectorized tiles, each pair once */
+    mwbool useBlockSteps;     /* let each body take a power of two multiple of the timestep */
+    mwbool useCausticGrid;    /* interpolate the caustic halo from a table instead of finding it exactly */
+    real treeRebuildInterval; /* build the tree from scratch every this many steps, refitting it in between */
+    real fmmOrder;            /* order of the multipole expansions used by the FMM criterion */
+    real blockStepLevels;     /* number of block timestep sizes, the largest being 2^(levels - 1) timesteps */
+    real blockStepAccuracy;   /* a body's timestep is at most this times sqrt(softening / |acceleration|) */
+    real potentialGridTolerance; /* if > 0, interpolate a Lua potential from a grid with this rms relative error */
+    real testParticleThreads; /* threads finding the forces on test particles, or 0 for the usual number */
+
     time_t checkpointT;       /* Period to checkpoint when not using BOINC */
     unsigned int nStep;
 
@@ -444,9 +585,12 @@ typedef struct MW_ALIGN_TYPE
 
 #define NBODYCTX_TYPE "NBodyCtx"
 #define EMPTY_NBODYCTX { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,                               \
-                         InvalidCriterion, EXTERNAL_POTENTIAL_DEFAULT,               \
+                         InvalidCriterion, InvalidIntegrator,                        \
+                         EXTERNAL_POTENTIAL_DEFAULT,                                 \
                          FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE,     \
-                         0, 0, 0, 0, 0, 0, 0, 0, 0,                                  \
+                         0, 0, 0, 0, 0, 0, 0,                                        \
+                         FALSE, FALSE, FALSE, FALSE, FALSE, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, \
+                         0, 0,                                                       \
                          EMPTY_POTENTIAL }
 
 /* Negative codes can be nonfatal but useful return statuses.
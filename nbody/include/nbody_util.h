@@ -44,6 +44,33 @@ real nbEstimateTime(const NBodyCtx* ctx, int nbody, real flops);
 
 void nbReportTreeIncest(const NBodyCtx* ctx, NBodyState* st);
 
+/* Weights of the 4 nodes around t in [0, 1) for Catmull-Rom
+ * interpolation between the middle two */
+static inline void nbCubicWeights(real t, real w[4])
+{
+    const real t2 = t * t;
+    const real t3 = t2 * t;
+
+    w[0] = 0.5 * (2.0 * t2 - t3 - t);
+    w[1] = 0.5 * (3.0 * t3 - 5.0 * t2 + 2.0);
+    w[2] = 0.5 * (4.0 * t2 - 3.0 * t3 + t);
+    w[3] = 0.5 * (t3 - t2);
+}
+
+/* Mix the bytes into a 64 bit FNV-1a hash, which should start at
+ * 14695981039346656037 */
+static inline void nbHashBytes(uint64_t* hash, const void* data, size_t size)
+{
+    size_t i;
+    const unsigned char* bytes = (const unsigned char*) data;
+
+    for (i = 0; i < size; ++i)
+    {
+        *hash ^= bytes[i];
+        *hash *= 1099511628211ull;
+    }
+}
+
 #ifdef _OPENMP
 #define nbGetMaxThreads() omp_get_max_threads()
 #else
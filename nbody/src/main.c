@@ -31,6 +31,7 @@
 #include "milkyway_util.h"
 #include "nbody.h"
 #include "nbody_likelihood.h"
+#include "nbody_emd.h"
 #include "nbody_defaults.h"
 #include "milkyway_git_version.h"
 
@@ -415,6 +416,30 @@ static mwbool nbReadParameters(const int argc, const char* argv[], NBodyFlags* n
             0, "Print some extra debugging information", NULL
         },
 
+        {
+            "report-energy", '\0',
+            POPT_ARG_NONE, &nbf.reportEnergy,
+            0, "Print how much the total energy changed over the run. Sums the self potential directly", NULL
+        },
+
+        {
+            "orbit-cache", '\0',
+            POPT_ARG_STRING, &nbf.orbitCacheFile,
+            0, "Reuse reverse orbits from earlier runs kept in this file", NULL
+        },
+
+        {
+            "orbit-cache-size", '\0',
+            POPT_ARG_INT, &nbf.orbitCacheSize,
+            0, "Most reverse orbits to keep in the orbit cache (default 1024)", NULL
+        },
+
+        {
+            "emd-network-simplex", '\0',
+            POPT_ARG_NONE, &nbf.emdNetworkSimplex,
+            0, "Find the EMD with the network simplex method instead of the transportation simplex", NULL
+        },
+
         {
             "version", 'v',
             POPT_ARG_NONE, &version,
@@ -514,6 +539,11 @@ static void nbSetDefaultFlags(NBodyFlags* nbf)
     /* Use a specified seed or time seeding */
     nbf->seed = nbf->setSeed ? nbf->seed : (uint32_t) time(NULL);
 
+    if (nbf->orbitCacheSize <= 0)
+    {
+        nbf->orbitCacheSize = DEFAULT_ORBIT_CACHE_SIZE;
+    }
+
     if (nbf->checkpointPeriod == 0)
     {
         nbf->checkpointPeriod = NOBOINC_DEFAULT_CHECKPOINT_PERIOD;
@@ -537,6 +567,7 @@ static void freeNBodyFlags(NBodyFlags* nbf)
     free(nbf->forwardedArgs);
     free(nbf->graphicsBin);
     free(nbf->visArgs);
+    free(nbf->orbitCacheFile);
 }
 
 static int nbSetNumThreads(int numThreads)
@@ -624,6 +655,8 @@ int main(int argc, const char* argv[])
         mw_finish(EXIT_FAILURE);
     }
 
+    nbSetEMDSolver(nbf.emdNetworkSimplex ? EMD_SOLVER_NETWORK_SIMPLEX : EMD_SOLVER_TRANSPORTATION);
+
     if (nbf.verifyOnly)
     {
         rc = nbVerifyFile(&nbf);
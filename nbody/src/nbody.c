@@ -31,6 +31,9 @@
 #include "nbody_plain.h"
 #include "nbody_likelihood.h"
 #include "nbody_histogram.h"
+#include "nbody_caustic_grid.h"
+#include "nbody_potential_grid.h"
+#include "nbody_orbit_cache.h"
 
 #if NBODY_OPENCL
   #include "nbody_cl.h"
@@ -361,7 +364,13 @@ int nbMain(const NBodyFlags* nbf)
         }
     }
 
+    if (nbf->orbitCacheFile)
+    {
+        nbOpenOrbitCache(nbf->orbitCacheFile, (unsigned int) nbf->orbitCacheSize);
+    }
+
     rc = nbResumeOrNewRun(ctx, st, nbf);
+    nbCloseOrbitCache();
     if (nbStatusIsFatal(rc))
     {
         destroyNBodyState(st);
@@ -381,6 +390,14 @@ int nbMain(const NBodyFlags* nbf)
         }
     }
 
+    nbSetupCausticGrid(ctx);
+
+    if (nbSetupPotentialGrid(ctx, st))
+    {
+        destroyNBodyState(st);
+        return NBODY_LUA_POTENTIAL_ERROR;
+    }
+
     if (nbCreateSharedScene(st, ctx))
     {
         mw_printf("Failed to create shared scene\n");
@@ -409,6 +426,9 @@ int nbMain(const NBodyFlags* nbf)
     
     te = mwGetTime();
 
+    nbFreeCausticGrid();
+    nbFreePotentialGrid();
+
     if (nbf->reportProgress)
     {
         nbCleanupCursesOutput();
@@ -247,45 +247,58 @@ static void gfield_close(double rho, double z, int n, double *rfield, double *zf
     }  
 }
  
-mwvector causticHaloAccel(const Halo* h, mwvector pos, real r)
+/* Add the field of the nth caustic ring at (rho, z) */
+void causticRingField(real rho, real z, int n, real* rfield, real* zfield)
 {
+    real R, l, tr, tl;
 
-    mwvector accel;
+    /* tricusp */
+    R=(3.0-mw_sqrt(1.0+(8.0/p_n[n])*(rho-a_n[n])))/4.0;
+    l=(3.0+mw_sqrt(1.0+(8.0/p_n[n])*(rho-a_n[n])))/4.0;
+    tr=2.0*p_n[n]*mw_sqrt(cube(R)*(1.0-R));
+    tl=2.0*p_n[n]*mw_sqrt(cube(l)*(1.0-l));
 
-/* 20070507 bwillett used hypot from math.h */
 
+    if( (z<=tr && z>=0.0 && rho>=a_n[n] && rho<=a_n[n]+p_n[n]) || (z>=tl && z<=tr && rho>=(a_n[n]-p_n[n]/8.0) && rho<=a_n[n]) || (z>=-tr && z<=0.0 && rho>=a_n[n] && rho<=a_n[n]+p_n[n]) || (z<=-tl && z>=-tr && rho>=(a_n[n]-p_n[n]/8.0) && rho<=a_n[n]) )  //close
+    {
+        gfield_close(rho,z,n,rfield,zfield);
+    }
 
-    real rho=0.0, z=0.0, rfield, zfield;
-    real R, l, tr, tl;
-    int n;
+    else /* far */
+    {
+        gfield_far(rho,z,n,rfield,zfield);
+    }
+}
 
-    rfield = 0.0;
-    zfield = 0.0;
+/* Radial and vertical field of all the caustic rings at (rho, z) */
+void causticHaloField(real rho, real z, real* rfield, real* zfield)
+{
+    int n;
 
+    *rfield = 0.0;
+    *zfield = 0.0;
 
+    for (n = 1; n <= CAUSTIC_N_RINGS; n++)
+    {
+        causticRingField(rho, z, n, rfield, zfield);
+    }
+}
 
-    rho = mw_sqrt(sqr(X(pos))+sqr(Y(pos)));
+mwvector causticHaloAccel(const Halo* h, mwvector pos, real r)
+{
 
-    for (n = 1; n <= 20; n++)
-    {
+    mwvector accel;
 
-        /* tricusp */
-        R=(3.0-mw_sqrt(1.0+(8.0/p_n[n])*(rho-a_n[n])))/4.0;
-        l=(3.0+mw_sqrt(1.0+(8.0/p_n[n])*(rho-a_n[n])))/4.0;
-        tr=2.0*p_n[n]*mw_sqrt(cube(R)*(1.0-R));
-        tl=2.0*p_n[n]*mw_sqrt(cube(l)*(1.0-l));
+/* 20070507 bwillett used hypot from math.h */
 
 
-        if( (Z(pos)<=tr && Z(pos)>=0.0 && rho>=a_n[n] && rho<=a_n[n]+p_n[n]) || (Z(pos)>=tl && Z(pos)<=tr && rho>=(a_n[n]-p_n[n]/8.0) && rho<=a_n[n]) || (Z(pos)>=-tr && Z(pos)<=0.0 && rho>=a_n[n] && rho<=a_n[n]+p_n[n]) || (Z(pos)<=-tl && Z(pos)>=-tr && rho>=(a_n[n]-p_n[n]/8.0) && rho<=a_n[n]) )  //close
-        {
-            gfield_close(rho,Z(pos),n,&rfield,&zfield);
-        }
+    real rho=0.0, rfield, zfield;
 
-        else /* far */
-        {
-            gfield_far(rho,Z(pos),n,&rfield,&zfield);        
-        }
+    rho = mw_sqrt(sqr(X(pos))+sqr(Y(pos)));
 
+    if (!nbCausticGridField(rho, Z(pos), &rfield, &zfield))
+    {
+        causticHaloField(rho, Z(pos), &rfield, &zfield);
     }
 
     if(rho<0.000001)
@@ -304,4 +317,4 @@ mwvector causticHaloAccel(const Halo* h, mwvector pos, real r)
     //printf("%f, %f, %f, %f, %f, %f\n", X(pos), Y(pos), Z(pos), X(accel), Y(accel), Z(accel));
     
     return accel;
-}
\ No newline at end of file
+}
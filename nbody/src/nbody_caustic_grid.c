@@ -0,0 +1,601 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Table of the caustic halo's field for the useCausticGrid option.
+ *
+ * The rings are axisymmetric, so the field only depends on (rho, z).
+ * The radial part is even in z and the vertical part odd, so only
+ * z >= 0 is kept. There is a patch of evenly spaced nodes around the
+ * cusp of each ring, one over the inner rings and one over everything
+ * out to CAUSTIC_GRID_EXTENT. A point is interpolated with bicubic
+ * Catmull-Rom splines from the first patch it is in, rings first. Each
+ * patch has an extra layer of nodes on every side, so every cell has
+ * the 4 x 4 nodes around it.
+ *
+ * The field's gradient is infinite on the surface of each cusp, where
+ * no spacing interpolates it well. So the patch around a cusp only
+ * tables the rings whose cusps are well outside it, which are smooth
+ * there, and the rings close by are added exactly. The margin around
+ * a cusp is twice the spacing of the patch around it, so the nodes
+ * used for a point never reach a cusp that is in the table. The inner
+ * patch is finer so the cusps in it can have smaller margins, and
+ * fewer rings have to be found exactly. The spacing of each patch is
+ * halved until the error at the centres of its cells is small enough.
+ *
+ * The field only depends on the ring table in nbody_caustic.c, not on
+ * the halo's vhalo or scale length, so the saved table is keyed by a
+ * hash of the ring table and the layout of the table.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_caustic.h"
+#include "nbody_caustic_grid.h"
+#include "nbody_util.h"
+#include "milkyway_util.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+
+/* The coarsest patch covers 0 <= rho, |z| <= this many kpc */
+#define CAUSTIC_GRID_EXTENT 64.0
+
+/* Patches with no exact rings, finest first, each covering 0 <= rho
+ * <= levelRho and |z| <= levelZ. A cusp in one gets a margin of twice
+ * its spacing, and it reaches at least twice the next one's spacing
+ * past that margin. */
+#define CAUSTIC_GRID_N_LEVEL 2
+static const real levelRho[CAUSTIC_GRID_N_LEVEL] = { 16.0, CAUSTIC_GRID_EXTENT };
+static const real levelZ[CAUSTIC_GRID_N_LEVEL] = { 2.0, CAUSTIC_GRID_EXTENT };
+static const real levelH[CAUSTIC_GRID_N_LEVEL] = { 0.0625, 0.25 };
+
+/* Refine a patch until the rms relative error at its cell centres is
+ * under this, or it would have too many nodes */
+#define CAUSTIC_GRID_TOLERANCE 1.0e-4
+#define CAUSTIC_GRID_MAX_NODES (1 << 20)
+
+/* Cell centres checked per patch while refining */
+#define CAUSTIC_GRID_REFINE_SAMPLES 4096
+
+/* Points compared with the exact field in the error report */
+#define CAUSTIC_GRID_REPORT_SAMPLES 8192
+
+/* The field can pass through 0, so errors are relative to at least
+ * this, in kpc / gyr^2 */
+#define CAUSTIC_GRID_FIELD_FLOOR 1.0
+
+#define CAUSTIC_GRID_VERSION 1
+#define CAUSTIC_GRID_MAGIC "mwcgrid"
+#define CAUSTIC_GRID_N_PATCH (CAUSTIC_N_RINGS + CAUSTIC_GRID_N_LEVEL)
+
+typedef struct
+{
+    real rhoMin, rhoMax;  /* lookups in [rhoMin, rhoMax] x [0, zMax] */
+    real zMax;
+    real h;               /* node spacing in rho and z */
+    uint32_t nRho, nZ;    /* nodes, starting at (rhoMin - h, -h) */
+    uint32_t exactRings;  /* bit n set for rings found exactly instead of from the table */
+    real* field;          /* rfield and zfield of each node, in rows of constant z */
+} CausticPatch;
+
+typedef struct
+{
+    char magic[8];
+    uint64_t key;
+    uint32_t nPatch;
+    uint32_t realSize;
+} CausticGridHeader;
+
+static CausticPatch* causticGrid = NULL;
+
+
+static int nbCausticPatchContains(const CausticPatch* p, real rho, real z)
+{
+    return rho >= p->rhoMin && rho <= p->rhoMax && z <= p->zMax;
+}
+
+/* Interpolate at (rho, z) with z >= 0 inside the patch */
+static void nbCausticPatchTable(const CausticPatch* p, real rho, real z, real* rfield, real* zfield)
+{
+    int i, j, ir, iz;
+    real wr[4], wz[4];
+    real rf = 0.0, zf = 0.0;
+    const real u = (rho - p->rhoMin) / p->h + 1.0;
+    const real v = z / p->h + 1.0;
+
+    ir = MIN(MAX((int) u, 1), (int) p->nRho - 3);
+    iz = MIN(MAX((int) v, 1), (int) p->nZ - 3);
+
+    nbCubicWeights(u - (real) ir, wr);
+    nbCubicWeights(v - (real) iz, wz);
+
+    for (j = 0; j < 4; ++j)
+    {
+        const real* node = &p->field[2 * ((size_t) (iz - 1 + j) * p->nRho + (size_t) (ir - 1))];
+        real rrow = 0.0, zrow = 0.0;
+
+        for (i = 0; i < 4; ++i)
+        {
+            rrow += wr[i] * node[2 * i];
+            zrow += wr[i] * node[2 * i + 1];
+        }
+
+        rf += wz[j] * rrow;
+        zf += wz[j] * zrow;
+    }
+
+    *rfield = rf;
+    *zfield = zf;
+}
+
+static void nbCausticPatchField(const CausticPatch* p, real rho, real z, real* rfield, real* zfield)
+{
+    int n;
+
+    nbCausticPatchTable(p, rho, z, rfield, zfield);
+
+    for (n = 1; n <= CAUSTIC_N_RINGS; ++n)
+    {
+        if (p->exactRings & (1u << n))
+            causticRingField(rho, z, n, rfield, zfield);
+    }
+}
+
+/* Field of the rings that are in the table of the patch */
+static void nbCausticPatchNode(const CausticPatch* p, real rho, real z, real* rfield, real* zfield)
+{
+    int n;
+
+    *rfield = 0.0;
+    *zfield = 0.0;
+
+    for (n = 1; n <= CAUSTIC_N_RINGS; ++n)
+    {
+        if (!(p->exactRings & (1u << n)))
+            causticRingField(rho, z, n, rfield, zfield);
+    }
+}
+
+static real nbCausticRelError(real rfield, real zfield, real rExact, real zExact)
+{
+    real norm = mw_sqrt(sqr(rExact) + sqr(zExact));
+
+    return mw_sqrt(sqr(rfield - rExact) + sqr(zfield - zExact)) / mw_fmax(norm, CAUSTIC_GRID_FIELD_FLOOR);
+}
+
+static void nbFillCausticPatch(CausticPatch* p, real h)
+{
+    int k;
+
+    p->h = h;
+    p->nRho = (uint32_t) mw_ceil((p->rhoMax - p->rhoMin) / h) + 3;
+    p->nZ = (uint32_t) mw_ceil(p->zMax / h) + 3;
+
+    free(p->field);
+    p->field = (real*) mwMalloc(2 * (size_t) p->nRho * p->nZ * sizeof(real));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(dynamic, 1)
+  #endif
+    for (k = 0; k < (int) p->nZ; ++k)
+    {
+        uint32_t i;
+        const real z = ((real) k - 1.0) * h;
+        real* row = &p->field[2 * (size_t) k * p->nRho];
+
+        for (i = 0; i < p->nRho; ++i)
+        {
+            /* Nodes at rho < 0 are fine, the radial part is just odd */
+            nbCausticPatchNode(p, p->rhoMin + ((real) i - 1.0) * h, z, &row[2 * i], &row[2 * i + 1]);
+        }
+    }
+}
+
+/* rms error at a spread of cell centres in patch n that no earlier
+ * patch covers */
+static real nbCausticPatchError(const CausticPatch* grid, int n)
+{
+    int k;
+    const CausticPatch* p = &grid[n];
+    const uint32_t nCellRho = p->nRho - 3;
+    const uint32_t nCellZ = p->nZ - 3;
+    const uint64_t nCell = (uint64_t) nCellRho * nCellZ;
+    const uint64_t stride = MAX(nCell / CAUSTIC_GRID_REFINE_SAMPLES, 1);
+    const int nSample = (int) MIN(nCell, CAUSTIC_GRID_REFINE_SAMPLES);
+    real sumSq = 0.0;
+    int nUsed = 0;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(dynamic, 16) reduction(+ : sumSq, nUsed)
+  #endif
+    for (k = 0; k < nSample; ++k)
+    {
+        int m;
+        real rf, zf, rExact, zExact;
+        const uint64_t cell = (uint64_t) k * stride + ((uint64_t) k * 7919) % stride;
+        const real rho = p->rhoMin + ((real) (cell % nCellRho) + 0.5) * p->h;
+        const real z = ((real) (cell / nCellRho) + 0.5) * p->h;
+        int covered = FALSE;
+
+        for (m = 0; m < n; ++m)
+        {
+            covered = covered || nbCausticPatchContains(&grid[m], rho, z);
+        }
+
+        if (covered || !nbCausticPatchContains(p, rho, z))
+            continue;
+
+        nbCausticPatchField(p, rho, z, &rf, &zf);
+        causticHaloField(rho, z, &rExact, &zExact);
+        sumSq += sqr(nbCausticRelError(rf, zf, rExact, zExact));
+        ++nUsed;
+    }
+
+    return nUsed > 0 ? mw_sqrt(sumSq / (real) nUsed) : 0.0;
+}
+
+/* Halve the spacing from h until the patch is good enough */
+static void nbRefineCausticPatch(CausticPatch* grid, int n, real h)
+{
+    CausticPatch* p = &grid[n];
+
+    nbFillCausticPatch(p, h);
+
+    while (nbCausticPatchError(grid, n) > CAUSTIC_GRID_TOLERANCE)
+    {
+        real nNext = (mw_ceil((p->rhoMax - p->rhoMin) / (0.5 * p->h)) + 3.0) * (mw_ceil(p->zMax / (0.5 * p->h)) + 3.0);
+
+        if (nNext > (real) CAUSTIC_GRID_MAX_NODES)
+            break;
+
+        nbFillCausticPatch(p, 0.5 * p->h);
+    }
+}
+
+/* Box around the cusp of ring n, which is in a_n - p_n / 8 <= rho <=
+ * a_n + p_n and |z| < 0.65 p_n */
+static void nbCausticCuspBox(int n, real margin, real* rhoMin, real* rhoMax, real* zMax)
+{
+    *rhoMin = a_n[n] - 0.125 * p_n[n] - margin;
+    *rhoMax = a_n[n] + p_n[n] + margin;
+    *zMax = 0.65 * p_n[n] + margin;
+}
+
+/* Twice the spacing of the finest level that has room for the cusp
+ * of ring n with that margin */
+static real nbCausticMargin(int n)
+{
+    int L;
+    real rhoMin, rhoMax, zMax;
+
+    for (L = 0; L < CAUSTIC_GRID_N_LEVEL - 1; ++L)
+    {
+        nbCausticCuspBox(n, 2.0 * (levelH[L] + levelH[L + 1]), &rhoMin, &rhoMax, &zMax);
+        if (rhoMax <= levelRho[L] && zMax <= levelZ[L])
+            break;
+    }
+
+    return 2.0 * levelH[L];
+}
+
+static CausticPatch* nbBuildCausticGrid(void)
+{
+    int n, m, L;
+    CausticPatch* grid = (CausticPatch*) mwCalloc(CAUSTIC_GRID_N_PATCH, sizeof(CausticPatch));
+
+    for (n = 0; n < CAUSTIC_N_RINGS; ++n)
+    {
+        CausticPatch* p = &grid[n];
+        const real margin = nbCausticMargin(n + 1);
+
+        nbCausticCuspBox(n + 1, margin, &p->rhoMin, &p->rhoMax, &p->zMax);
+
+        /* Rings with a cusp within a margin of the patch. The others
+         * are at least two spacings away from its nodes. */
+        for (m = 1; m <= CAUSTIC_N_RINGS; ++m)
+        {
+            real rhoMin, rhoMax, zMax;
+
+            nbCausticCuspBox(m, margin, &rhoMin, &rhoMax, &zMax);
+            if (rhoMax >= p->rhoMin && rhoMin <= p->rhoMax)
+                p->exactRings |= 1u << m;
+        }
+
+        nbRefineCausticPatch(grid, n, 0.5 * margin);
+    }
+
+    /* Points in these are outside every earlier patch, so more than
+     * two spacings from every cusp */
+    for (L = 0; L < CAUSTIC_GRID_N_LEVEL; ++L)
+    {
+        CausticPatch* p = &grid[CAUSTIC_N_RINGS + L];
+
+        p->rhoMin = 0.0;
+        p->rhoMax = levelRho[L];
+        p->zMax = levelZ[L];
+        nbRefineCausticPatch(grid, CAUSTIC_N_RINGS + L, levelH[L]);
+    }
+
+    return grid;
+}
+
+static void nbFreeCausticPatches(CausticPatch* grid)
+{
+    int n;
+
+    if (!grid)
+        return;
+
+    for (n = 0; n < CAUSTIC_GRID_N_PATCH; ++n)
+    {
+        free(grid[n].field);
+    }
+
+    free(grid);
+}
+
+/* Changes whenever a saved table could be different */
+static uint64_t nbCausticGridKey(void)
+{
+    uint64_t key = 14695981039346656037ull;
+    const size_t tableSize = (CAUSTIC_N_RINGS + 1) * sizeof(double);
+    const double layout[] = { CAUSTIC_GRID_VERSION, CAUSTIC_GRID_TOLERANCE, CAUSTIC_GRID_MAX_NODES,
+                              CAUSTIC_GRID_REFINE_SAMPLES, CAUSTIC_GRID_FIELD_FLOOR };
+
+    nbHashBytes(&key, a_n, tableSize);
+    nbHashBytes(&key, V_n, tableSize);
+    nbHashBytes(&key, rate_n, tableSize);
+    nbHashBytes(&key, p_n, tableSize);
+    nbHashBytes(&key, layout, sizeof(layout));
+    nbHashBytes(&key, levelRho, sizeof(levelRho));
+    nbHashBytes(&key, levelZ, sizeof(levelZ));
+    nbHashBytes(&key, levelH, sizeof(levelH));
+
+    return key;
+}
+
+static CausticPatch* nbReadCausticGrid(const char* filename, uint64_t key)
+{
+    int n;
+    FILE* f;
+    CausticGridHeader hdr;
+    CausticPatch* grid;
+    int failed = FALSE;
+
+    f = mw_fopen(filename, "rb");
+    if (!f)
+        return NULL;
+
+    if (   fread(&hdr, sizeof(hdr), 1, f) != 1
+        || strncmp(hdr.magic, CAUSTIC_GRID_MAGIC, sizeof(hdr.magic))
+        || hdr.key != key
+        || hdr.nPatch != CAUSTIC_GRID_N_PATCH
+        || hdr.realSize != sizeof(real))
+    {
+        mw_printf("Caustic grid '%s' is for different parameters\n", filename);
+        fclose(f);
+        return NULL;
+    }
+
+    grid = (CausticPatch*) mwCalloc(CAUSTIC_GRID_N_PATCH, sizeof(CausticPatch));
+
+    for (n = 0; n < CAUSTIC_GRID_N_PATCH && !failed; ++n)
+    {
+        CausticPatch* p = &grid[n];
+        size_t nReal;
+
+        failed = fread(&p->rhoMin, sizeof(real), 1, f) != 1
+              || fread(&p->rhoMax, sizeof(real), 1, f) != 1
+              || fread(&p->zMax, sizeof(real), 1, f) != 1
+              || fread(&p->h, sizeof(real), 1, f) != 1
+              || fread(&p->nRho, sizeof(uint32_t), 1, f) != 1
+              || fread(&p->nZ, sizeof(uint32_t), 1, f) != 1
+              || fread(&p->exactRings, sizeof(uint32_t), 1, f) != 1
+              || p->nRho < 4 || p->nZ < 4
+              || (uint64_t) p->nRho * p->nZ > CAUSTIC_GRID_MAX_NODES;
+        if (failed)
+            break;
+
+        nReal = 2 * (size_t) p->nRho * p->nZ;
+        p->field = (real*) mwMalloc(nReal * sizeof(real));
+        failed = fread(p->field, sizeof(real), nReal, f) != nReal;
+    }
+
+    fclose(f);
+
+    if (failed)
+    {
+        mw_printf("Error reading caustic grid '%s'\n", filename);
+        nbFreeCausticPatches(grid);
+        return NULL;
+    }
+
+    return grid;
+}
+
+/* Write to a temporary file first, like checkpoints */
+static int nbWriteCausticGrid(const CausticPatch* grid, const char* filename, uint64_t key)
+{
+    int n;
+    FILE* f;
+    char tmpFile[256];
+    CausticGridHeader hdr;
+    int failed = FALSE;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, CAUSTIC_GRID_MAGIC, sizeof(hdr.magic));
+    hdr.key = key;
+    hdr.nPatch = CAUSTIC_GRID_N_PATCH;
+    hdr.realSize = sizeof(real);
+
+    snprintf(tmpFile, sizeof(tmpFile), "caustic_grid_tmp_%d", (int) getpid());
+
+    f = mw_fopen(tmpFile, "wb");
+    if (!f)
+    {
+        mwPerror("Failed to open caustic grid '%s'", tmpFile);
+        return TRUE;
+    }
+
+    failed = fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+
+    for (n = 0; n < CAUSTIC_GRID_N_PATCH && !failed; ++n)
+    {
+        const CausticPatch* p = &grid[n];
+        const size_t nReal = 2 * (size_t) p->nRho * p->nZ;
+
+        failed = fwrite(&p->rhoMin, sizeof(real), 1, f) != 1
+              || fwrite(&p->rhoMax, sizeof(real), 1, f) != 1
+              || fwrite(&p->zMax, sizeof(real), 1, f) != 1
+              || fwrite(&p->h, sizeof(real), 1, f) != 1
+              || fwrite(&p->nRho, sizeof(uint32_t), 1, f) != 1
+              || fwrite(&p->nZ, sizeof(uint32_t), 1, f) != 1
+              || fwrite(&p->exactRings, sizeof(uint32_t), 1, f) != 1
+              || fwrite(p->field, sizeof(real), nReal, f) != nReal;
+    }
+
+    if (fclose(f) || failed)
+    {
+        mw_printf("Failed to write caustic grid '%s'\n", tmpFile);
+        mw_remove(tmpFile);
+        return TRUE;
+    }
+
+    if (mw_rename(tmpFile, filename))
+    {
+        mwPerror("Failed to update caustic grid '%s'", filename);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Compare with the exact field at points spread over each patch */
+static void nbReportCausticGridError(const CausticPatch* grid)
+{
+    int k;
+    const int nPer = CAUSTIC_GRID_REPORT_SAMPLES / CAUSTIC_GRID_N_PATCH;
+    const int nSample = nPer * CAUSTIC_GRID_N_PATCH;
+    real* err;
+    real sumSq = 0.0, maxErr = 0.0;
+
+    err = (real*) mwMalloc(nSample * sizeof(real));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(dynamic, 16)
+  #endif
+    for (k = 0; k < nSample; ++k)
+    {
+        real rf, zf, rExact, zExact;
+        const CausticPatch* p = &grid[k / nPer];
+
+        /* 2D golden ratio sequence over the patch */
+        const real u = mw_fmod(0.5 + (real) k * 0.7548776662466927, 1.0);
+        const real v = mw_fmod(0.5 + (real) k * 0.5698402909980532, 1.0);
+        const real rho = p->rhoMin + u * (p->rhoMax - p->rhoMin);
+        const real z = v * p->zMax;
+
+        nbCausticGridField(rho, z, &rf, &zf);
+        causticHaloField(rho, z, &rExact, &zExact);
+        err[k] = nbCausticRelError(rf, zf, rExact, zExact);
+    }
+
+    for (k = 0; k < nSample; ++k)
+    {
+        sumSq += sqr(err[k]);
+        maxErr = mw_fmax(maxErr, err[k]);
+    }
+
+    mw_printf("Caustic grid relative field error over %d points: rms = %g, max = %g\n",
+              nSample,
+              mw_sqrt(sumSq / (real) nSample),
+              maxErr);
+
+    free(err);
+}
+
+void nbSetupCausticGrid(const NBodyCtx* ctx)
+{
+    int n;
+    uint64_t nNode = 0;
+    const uint64_t key = nbCausticGridKey();
+
+    if (!ctx->useCausticGrid
+        || ctx->potentialType != EXTERNAL_POTENTIAL_DEFAULT
+        || ctx->pot.halo.type != CausticHalo
+        || causticGrid)
+    {
+        return;
+    }
+
+    causticGrid = nbReadCausticGrid(CAUSTIC_GRID_FILE, key);
+    if (causticGrid)
+    {
+        mw_printf("Read caustic grid from '%s'\n", CAUSTIC_GRID_FILE);
+    }
+    else
+    {
+        double ts = mwGetTime();
+
+        causticGrid = nbBuildCausticGrid();
+        for (n = 0; n < CAUSTIC_GRID_N_PATCH; ++n)
+        {
+            nNode += (uint64_t) causticGrid[n].nRho * causticGrid[n].nZ;
+        }
+
+        mw_printf("Built caustic grid of "LLU" nodes in %.2f seconds\n", nNode, mwGetTime() - ts);
+
+        /* Still usable if it can't be saved */
+        nbWriteCausticGrid(causticGrid, CAUSTIC_GRID_FILE, key);
+    }
+
+    nbReportCausticGridError(causticGrid);
+}
+
+void nbFreeCausticGrid(void)
+{
+    nbFreeCausticPatches(causticGrid);
+    causticGrid = NULL;
+}
+
+int nbCausticGridField(real rho, real z, real* rfield, real* zfield)
+{
+    int n;
+    const real absZ = mw_abs(z);
+
+    if (!causticGrid)
+        return FALSE;
+
+    for (n = 0; n < CAUSTIC_GRID_N_PATCH; ++n)
+    {
+        if (nbCausticPatchContains(&causticGrid[n], rho, absZ))
+        {
+            nbCausticPatchField(&causticGrid[n], rho, absZ, rfield, zfield);
+            if (z < 0.0)
+                *zfield = -*zfield;
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
@@ -21,6 +21,9 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #include "nbody_priv.h"
 #include "milkyway_util.h"
 #include "nbody_check_params.h"
+#include "nbody_fmm.h"
+#include "nbody_plain.h"
+#include "nbody_potential.h"
 
 mwbool checkSphericalConstants(Spherical* s)
 {
@@ -142,7 +145,11 @@ mwbool checkHaloConstants(Halo* h)
 
 mwbool checkPotentialConstants(Potential* p)
 {
-    return checkSphericalConstants(&p->sphere[0]) || checkDiskConstants(&p->disk) || checkHaloConstants(&p->halo);
+    if (checkSphericalConstants(&p->sphere[0]) || checkDiskConstants(&p->disk) || checkHaloConstants(&p->halo))
+        return TRUE;
+
+    nbSetPotentialConsts(p);
+    return FALSE;
 }
 
 static int hasAcceptableTheta(const NBodyCtx* ctx)
@@ -184,8 +191,115 @@ static int hasAcceptableSteps(const NBodyCtx* ctx)
     return rc;
 }
 
+static int hasAcceptableRebuildInterval(const NBodyCtx* ctx)
+{
+    if (!(ctx->treeRebuildInterval >= 0.0) || ctx->treeRebuildInterval >= (real) UINT_MAX)
+    {
+        mw_printf("Got an unacceptable tree rebuild interval (%f)\n", ctx->treeRebuildInterval);
+        return TRUE;
+    }
+    else
+    {
+        return FALSE;
+    }
+}
+
+static int hasAcceptableFMMOrder(const NBodyCtx* ctx)
+{
+    if (ctx->criterion != FMM)
+        return FALSE;
+
+    if (   !(ctx->fmmOrder >= 1.0)
+        || ctx->fmmOrder > (real) NBODY_FMM_MAX_ORDER
+        || ctx->fmmOrder - mw_floor(ctx->fmmOrder) > 0.0)
+    {
+        mw_printf("Got an unacceptable FMM order (%f), must be an integer from 1 to %d\n",
+                  ctx->fmmOrder,
+                  NBODY_FMM_MAX_ORDER);
+        return TRUE;
+    }
+    else
+    {
+        return FALSE;
+    }
+}
+
+static int hasAcceptableBlockSteps(const NBodyCtx* ctx)
+{
+    if (!ctx->useBlockSteps)
+        return FALSE;
+
+    if (ctx->criterion == FMM || ctx->useGroupWalk || ctx->useTiledExact)
+    {
+        mw_printf("Block timesteps need forces for single bodies, which "
+                  "the FMM, group walk and tiled exact sum don't do\n");
+        return TRUE;
+    }
+
+    if (   !(ctx->blockStepLevels >= 1.0)
+        || ctx->blockStepLevels > (real) NBODY_MAX_BLOCK_STEP_LEVELS
+        || ctx->blockStepLevels - mw_floor(ctx->blockStepLevels) > 0.0)
+    {
+        mw_printf("Got an unacceptable number of block timestep levels (%f), must be an integer from 1 to %d\n",
+                  ctx->blockStepLevels,
+                  NBODY_MAX_BLOCK_STEP_LEVELS);
+        return TRUE;
+    }
+
+    if (!(ctx->blockStepAccuracy > 0.0) || !isfinite(ctx->blockStepAccuracy))
+    {
+        mw_printf("Got an unacceptable block timestep accuracy (%f)\n", ctx->blockStepAccuracy);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptablePotentialGrid(const NBodyCtx* ctx)
+{
+    if (!(ctx->potentialGridTolerance >= 0.0) || !isfinite(ctx->potentialGridTolerance))
+    {
+        mw_printf("Got an unacceptable potential grid tolerance (%f)\n", ctx->potentialGridTolerance);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptableTestParticleThreads(const NBodyCtx* ctx)
+{
+    if (   !(ctx->testParticleThreads >= 0.0)
+        || ctx->testParticleThreads > (real) INT_MAX
+        || ctx->testParticleThreads - mw_floor(ctx->testParticleThreads) > 0.0)
+    {
+        mw_printf("Got an unacceptable number of test particle threads (%f)\n", ctx->testParticleThreads);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptableIntegrator(const NBodyCtx* ctx)
+{
+    if (ctx->integrator == InvalidIntegrator)
+    {
+        mw_printf("Got an invalid integrator\n");
+        return TRUE;
+    }
+
+    if (ctx->useBlockSteps && ctx->integrator != Leapfrog)
+    {
+        mw_printf("Block timesteps are only supported with the Leapfrog integrator\n");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
 mwbool checkNBodyCtxConstants(const NBodyCtx* ctx)
 {
-    return hasAcceptableTimes(ctx) || hasAcceptableSteps(ctx) || hasAcceptableEps2(ctx) || hasAcceptableTheta(ctx);
+    return hasAcceptableTimes(ctx) || hasAcceptableSteps(ctx) || hasAcceptableEps2(ctx) || hasAcceptableTheta(ctx)
+        || hasAcceptableRebuildInterval(ctx) || hasAcceptableFMMOrder(ctx) || hasAcceptableBlockSteps(ctx)
+        || hasAcceptablePotentialGrid(ctx) || hasAcceptableTestParticleThreads(ctx) || hasAcceptableIntegrator(ctx);
 }
 
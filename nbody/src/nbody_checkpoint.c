@@ -22,6 +22,7 @@
 #include "nbody_checkpoint.h"
 #include "milkyway_util.h"
 #include "nbody_defaults.h"
+#include "nbody_soa.h"
 
 #if HAVE_FCNTL_H
   #include <fcntl.h>
@@ -75,6 +76,7 @@ typedef struct
    NBodyCheckpointHeader
    bodytab       Body[]     anything   Array of bodies
    orbitTrace    mwvector[] anything   Array of center of mass history
+   stepLevel     uint32_t[] anything   Block timestep level of each body, if used
    ending        string     "end"      Kind of dumb and pointless
  */
 
@@ -91,6 +93,7 @@ typedef struct
     uint32_t ptrSize;
     uint32_t nOrbitTrace;
     uint32_t treeIncest;
+    uint32_t nStepLevel;                 /* nbody if block timesteps are used, otherwise 0 */
     real rsize;
     NBodyCtx ctx;
 } NBodyCheckpointHeader;
@@ -105,6 +108,7 @@ static void nbPrepareWriteCheckpointHeader(NBodyCheckpointHeader* cp, const NBod
     cp->realSize = sizeof(real);
     cp->ptrSize = sizeof(void*);
     cp->nOrbitTrace = st->nOrbitTrace;
+    cp->nStepLevel = st->stepLevel ? st->nbody : 0;
 
     cp->majorVersion = NBODY_VERSION_MAJOR;
     cp->minorVersion= NBODY_VERSION_MINOR;
@@ -205,7 +209,8 @@ static int nbOpenCheckpointHandle(const NBodyState* st,
 
     if (writing)
     {
-        cp->cpFileSize = hdrSize + st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector);
+        cp->cpFileSize = hdrSize + st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector)
+                        + (st->stepLevel ? st->nbody * sizeof(uint32_t) : 0);
         /* Make the file the right size in case it's a new file */
         if (ftruncate(cp->fd, cp->cpFileSize) < 0)
         {
@@ -311,7 +316,8 @@ static int nbOpenCheckpointHandle(const NBodyState* st,
 
     if (writing)
     {
-        cp->cpFileSize = (DWORD) (hdrSize + st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector));
+        cp->cpFileSize = (DWORD) (hdrSize + st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector)
+                                      + (st->stepLevel ? st->nbody * sizeof(uint32_t) : 0));
     }
     else
     {
@@ -389,7 +395,7 @@ static int nbCloseCheckpointHandle(CheckpointHandle* cp)
 /* Should be given the same context as the dump. Returns nonzero if the state failed to be thawed */
 static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
 {
-    size_t bodySize, traceSize, supposedCheckpointSize;
+    size_t bodySize, traceSize, levelSize, supposedCheckpointSize;
     NBodyCheckpointHeader cpHdr;
     char* p = cp->mptr;
 
@@ -402,7 +408,8 @@ static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
     assert(cp->cpFileSize != 0);
     bodySize = st->nbody * sizeof(Body);
     traceSize = cpHdr.nOrbitTrace * sizeof(mwvector);
-    supposedCheckpointSize = hdrSize + bodySize + traceSize;
+    levelSize = cpHdr.nStepLevel * sizeof(uint32_t);
+    supposedCheckpointSize = hdrSize + bodySize + traceSize + levelSize;
 
     if (nbVerifyCheckpointHeader(&cpHdr, cp, st, supposedCheckpointSize))
     {
@@ -422,6 +429,13 @@ static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
         p += traceSize;
     }
 
+    if (levelSize != 0)
+    {
+        st->stepLevel = (uint32_t*) mwMallocA(levelSize);
+        memcpy(st->stepLevel, p, levelSize);
+        p += levelSize;
+    }
+
     if (strncmp(p, tail, sizeof(tail)))
     {
         mwFreeA(st->bodytab);
@@ -430,6 +444,9 @@ static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
         mwFreeA(st->orbitTrace);
         st->orbitTrace = NULL;
 
+        mwFreeA(st->stepLevel);
+        st->stepLevel = NULL;
+
         mw_printf("Failed to find end marker in checkpoint file.\n");
         return TRUE;
     }
@@ -460,6 +477,12 @@ static void nbFreezeState(const NBodyCtx* ctx, const NBodyState* st, CheckpointH
         p += traceSize;
     }
 
+    if (st->stepLevel)
+    {
+        memcpy(p, st->stepLevel, st->nbody * sizeof(uint32_t));
+        p += st->nbody * sizeof(uint32_t);
+    }
+
     strcpy(p, tail);
 }
 
@@ -546,7 +569,7 @@ int nbReadCheckpoint(NBodyCtx* ctx, NBodyState* st)
     }
 
     /* Make sure state is ready to use */
-    st->acctab = (mwvector*) mwCallocA(st->nbody, sizeof(mwvector));
+    nbAllocSoA(&st->soa, st->nbody);
 
     return FALSE;
 }
@@ -600,6 +623,19 @@ int nbWriteCheckpoint(const NBodyCtx* ctx, const NBodyState* st)
     return nbWriteCheckpointWithTmpFile(ctx, st, path);
 }
 
+/* Whether a run resumed from a checkpoint of st now would go on the
+ * same as st does */
+int nbCanCheckpoint(const NBodyCtx* ctx, const NBodyState* st)
+{
+    /* With block timesteps, only when every body is at the end of its step */
+    if (ctx->useBlockSteps && st->nActive != st->nbody)
+        return FALSE;
+
+    /* Only after a full tree build, which is what a resumed run starts
+     * with, so it goes on refitting the same trees */
+    return (st->tree.refitCount == 0);
+}
+
 int nbTimeToCheckpoint(const NBodyCtx* ctx, NBodyState* st)
 {
     time_t now;
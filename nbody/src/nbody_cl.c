@@ -27,6 +27,7 @@
 #include "nbody_shmem.h"
 #include "nbody_checkpoint.h"
 #include "nbody_tree.h"
+#include "nbody_soa.h"
 
 #ifdef NBODY_BLENDER_OUTPUT
     #include "blender_visualizer.h"
@@ -750,7 +751,29 @@ cl_bool nbCheckDevCapabilities(const DevInfo* di, const NBodyCtx* ctx, cl_uint n
     cl_ulong nNode = (cl_ulong) nbFindNNode(di, nbody) + 1;
     cl_ulong maxNodes = di->maxMemAlloc / (NSUB * sizeof(cl_int));
 
-    (void) ctx;
+    if (ctx->criterion == FMM)
+    {
+        mw_printf("FMM criterion is only supported on the CPU\n");
+        return CL_FALSE;
+    }
+
+    if (ctx->useBlockSteps)
+    {
+        mw_printf("Block timesteps are only supported on the CPU\n");
+        return CL_FALSE;
+    }
+
+    if (ctx->integrator != Leapfrog)
+    {
+        mw_printf("Integrator '%s' is only supported on the CPU\n", showIntegratorT(ctx->integrator));
+        return CL_FALSE;
+    }
+
+    if (ctx->useCausticGrid)
+    {
+        mw_printf("The caustic halo grid is only supported on the CPU\n");
+        return CL_FALSE;
+    }
 
     if (di->devType != CL_DEVICE_TYPE_GPU)
     {
@@ -2044,6 +2067,8 @@ static cl_int nbPrintQuadMomentDifferences(const NBodyCtx* ctx, NBodyState* st)
     if (err != CL_SUCCESS)
         return err;
 
+    /* The tree is built from the body store, which the CL path doesn't use */
+    nbBodiesToSoA(&st->soa, st->bodytab, st->nbody);
     nbMakeTree(ctx, st);
     quadRef = Quad(st->tree.root);
 
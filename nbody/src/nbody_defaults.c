@@ -33,6 +33,7 @@ const NBodyCtx defaultNBodyCtx =
     /* .sunGCDist       */  DEFAULT_SUN_GC_DISTANCE,
 
     /* .criterion       */  DEFAULT_CRITERION,
+    /* .integrator      */  DEFAULT_INTEGRATOR,
     /* .potentialType   */  EXTERNAL_POTENTIAL_DEFAULT,
 
     /* .MultiOutput     */  FALSE,
@@ -54,6 +55,17 @@ const NBodyCtx defaultNBodyCtx =
     /* .allowIncest     */  DEFAULT_ALLOW_INCEST,
     /* .quietErrors     */  DEFAULT_QUIET_ERRORS,
 
+    /* .useMortonTree   */  DEFAULT_USE_MORTON_TREE,
+    /* .useGroupWalk    */  DEFAULT_USE_GROUP_WALK,
+    /* .useTiledExact   */  DEFAULT_USE_TILED_EXACT,
+    /* .useBlockSteps   */  DEFAULT_USE_BLOCK_STEPS,
+    /* .useCausticGrid  */  DEFAULT_USE_CAUSTIC_GRID,
+    /* .treeRebuildInterval */  DEFAULT_TREE_REBUILD_INTERVAL,
+    /* .fmmOrder        */  DEFAULT_FMM_ORDER,
+    /* .blockStepLevels */  DEFAULT_BLOCK_STEP_LEVELS,
+    /* .blockStepAccuracy */  DEFAULT_BLOCK_STEP_ACCURACY,
+    /* .potentialGridTolerance */  DEFAULT_POTENTIAL_GRID_TOLERANCE,
+    /* .testParticleThreads */  DEFAULT_TEST_PARTICLE_THREADS,
 
     /* .checkpointT     */  NOBOINC_DEFAULT_CHECKPOINT_PERIOD,
     /* .nStep           */  0,
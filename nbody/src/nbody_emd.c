@@ -1264,6 +1264,1087 @@ real emdCalc(const real* RESTRICT signature_arr1,
 }
 
 
+/****************************************************************************************\
+*                                   network simplex                                      *
+\****************************************************************************************/
+
+/* The same transportation problem as above, solved with the primal
+ * network simplex method the way LEMON does it. The sources and sinks
+ * with some weight are nodes, connected by an uncapacitated arc from
+ * every source to every sink. The spanning tree of basic arcs is kept
+ * with parent, thread and successor lists, so each pivot only touches
+ * the cycle and the subtree that moves, and the entering arc is the
+ * best of a block of arcs instead of all of them.
+ *
+ * It starts from the tree of artificial arcs between every node and an
+ * extra root, where the arcs into the sinks cost "big M". M is kept
+ * apart from the rest of each potential instead of being a large number,
+ * so it doesn't swallow the precision of the real costs.
+ *
+ * In the best likelihood search the histogram changes little from one
+ * step to the next, so emdCalcNetworkSimplexWarm() keeps the tree of the
+ * last solve. The flows it needs for the new weights come from the
+ * subtrees, and only the subtrees they don't suit go back to the root,
+ * which usually leaves a few pivots to do instead of starting over.
+ */
+
+#define EMD_NS_STATE_TREE 0
+#define EMD_NS_STATE_LOWER 1
+
+#define EMD_NS_DIR_UP 1
+#define EMD_NS_DIR_DOWN (-1)
+
+#define EMD_NS_EPS ((real)1.0e-12)
+#define EMD_NS_MIN_BLOCK_SIZE 10
+#define EMD_NS_MAX_PIVOTS_PER_NODE 100
+
+struct EMDNetwork
+{
+    int ns;              /* Sources */
+    int nd;              /* Sinks */
+    int nNode;           /* Sources, sinks and the root */
+    int root;
+    int nArc;            /* Real arcs, source i to sink j is i * nd + j */
+
+    real* cost;          /* Of each real arc */
+    char* state;         /* Of each real arc */
+
+    /* Artificial arc root + u between node u and the root */
+    int* artSource;
+    int* artTarget;
+
+    /* The spanning tree */
+    int* parent;
+    int* pred;           /* Arc to the parent */
+    int* predDir;        /* EMD_NS_DIR_UP if pred goes to the parent */
+    real* predFlow;      /* Flow on pred */
+    int* thread;         /* Preorder */
+    int* revThread;
+    int* succNum;        /* Size of the subtree */
+    int* lastSucc;       /* Last of the subtree in thread order */
+    int* dirtyRevs;
+
+    /* Potentials are piM * M + pi */
+    int* piM;
+    real* pi;
+
+    int blockSize;
+    int nextArc;
+    real tol;
+
+    /* The current pivot */
+    int inArc;
+    int join;
+    int uIn, vIn, uOut;
+    real delta;
+
+    /* Which bin each node is, or -1 for the dummies */
+    int* idx1;
+    int* idx2;
+    real* supply;
+    real sSum, dSum;     /* Weights of the bins on each side */
+    real weight;         /* The larger of them */
+
+    /* What the basis was found for, to tell if it can be kept */
+    mwbool hasBasis;
+    unsigned int size1, size2;
+    real* signature1;    /* Copy of the sources */
+    real* positions2;    /* Where the sinks are */
+
+    /* For building the thread again after a repair */
+    int* firstChild;
+    int* nextSibling;
+
+    unsigned long nPivot;              /* In the last solve */
+    unsigned long nColdSolve, nColdPivot;
+    unsigned long nWarmSolve, nWarmPivot;
+};
+
+static inline int emdNSSource(const EMDNetwork* net, int e)
+{
+    return e < net->nArc ? e / net->nd : net->artSource[e - net->nArc];
+}
+
+static inline int emdNSTarget(const EMDNetwork* net, int e)
+{
+    return e < net->nArc ? net->ns + e % net->nd : net->artTarget[e - net->nArc];
+}
+
+static inline real emdNSCost(const EMDNetwork* net, int e)
+{
+    return e < net->nArc ? net->cost[e] : 0.0;
+}
+
+/* Only the artificial arcs from the root into the sinks cost M */
+static inline int emdNSCostM(const EMDNetwork* net, int e)
+{
+    return e >= net->nArc && net->artSource[e - net->nArc] == net->root;
+}
+
+static void emdNSFree(EMDNetwork* net)
+{
+    free(net->cost);
+    free(net->state);
+    free(net->artSource);
+    free(net->artTarget);
+    free(net->parent);
+    free(net->pred);
+    free(net->predDir);
+    free(net->predFlow);
+    free(net->thread);
+    free(net->revThread);
+    free(net->succNum);
+    free(net->lastSucc);
+    free(net->dirtyRevs);
+    free(net->piM);
+    free(net->pi);
+    free(net->idx1);
+    free(net->idx2);
+    free(net->supply);
+    free(net->signature1);
+    free(net->positions2);
+    free(net->firstChild);
+    free(net->nextSibling);
+}
+
+/* Set up the tree of artificial arcs. supply has nNode - 1 entries and
+ * adds up to 0. The costs of the real arcs are left to fill in. */
+static void emdNSInit(EMDNetwork* net, const real* supply)
+{
+    int u, e;
+    const int n = net->nNode - 1;
+    const int root = n;
+
+    net->root = root;
+    net->cost = (real*) mwMalloc(MAX(net->nArc, 1) * sizeof(real));
+    net->state = (char*) mwMalloc(MAX(net->nArc, 1) * sizeof(char));
+    net->artSource = (int*) mwMalloc(n * sizeof(int));
+    net->artTarget = (int*) mwMalloc(n * sizeof(int));
+    net->parent = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->pred = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->predDir = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->predFlow = (real*) mwMalloc(net->nNode * sizeof(real));
+    net->thread = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->revThread = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->succNum = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->lastSucc = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->dirtyRevs = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->piM = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->pi = (real*) mwMalloc(net->nNode * sizeof(real));
+
+    memset(net->state, EMD_NS_STATE_LOWER, net->nArc * sizeof(char));
+
+    for (u = 0, e = net->nArc; u < n; ++u, ++e)
+    {
+        net->parent[u] = root;
+        net->pred[u] = e;
+        net->thread[u] = u + 1;
+        net->revThread[u + 1] = u;
+        net->succNum[u] = 1;
+        net->lastSucc[u] = u;
+        net->pi[u] = 0.0;
+
+        if (supply[u] >= 0.0)
+        {
+            net->predDir[u] = EMD_NS_DIR_UP;
+            net->piM[u] = 0;
+            net->artSource[u] = u;
+            net->artTarget[u] = root;
+            net->predFlow[u] = supply[u];
+        }
+        else
+        {
+            net->predDir[u] = EMD_NS_DIR_DOWN;
+            net->piM[u] = 1;
+            net->artSource[u] = root;
+            net->artTarget[u] = u;
+            net->predFlow[u] = -supply[u];
+        }
+    }
+
+    net->parent[root] = -1;
+    net->pred[root] = -1;
+    net->predDir[root] = 0;
+    net->predFlow[root] = 0.0;
+    net->thread[root] = 0;
+    net->revThread[0] = root;
+    net->succNum[root] = net->nNode;
+    net->lastSucc[root] = root - 1;
+    net->piM[root] = 0;
+    net->pi[root] = 0.0;
+
+    net->blockSize = MAX((int) mw_ceil(mw_sqrt((real) net->nArc)), EMD_NS_MIN_BLOCK_SIZE);
+    net->nextArc = 0;
+}
+
+/* Best arc with a negative reduced cost in the next block that has
+ * one. FALSE if there is none left. */
+static mwbool emdNSFindEnteringArc(EMDNetwork* net)
+{
+    int k, e, i, j;
+    int minM = 0;
+    real minCost = -net->tol;
+    int cnt = net->blockSize;
+    const int nd = net->nd;
+    const int ns = net->ns;
+
+    net->inArc = -1;
+
+    e = net->nextArc;
+    i = e / nd;
+    j = e % nd;
+
+    for (k = 0; k < net->nArc; ++k)
+    {
+        if (net->state[e] == EMD_NS_STATE_LOWER)
+        {
+            int cm = net->piM[i] - net->piM[ns + j];
+            real c = net->cost[e] + net->pi[i] - net->pi[ns + j];
+
+            if (cm < minM || (cm == minM && c < minCost))
+            {
+                minM = cm;
+                minCost = c;
+                net->inArc = e;
+            }
+        }
+
+        if (++e == net->nArc)
+        {
+            e = i = j = 0;
+        }
+        else if (++j == nd)
+        {
+            j = 0;
+            ++i;
+        }
+
+        if (--cnt == 0)
+        {
+            if (net->inArc >= 0)
+                break;
+            cnt = net->blockSize;
+        }
+    }
+
+    net->nextArc = e;
+    return net->inArc >= 0;
+}
+
+static void emdNSFindJoinNode(EMDNetwork* net)
+{
+    int u = emdNSSource(net, net->inArc);
+    int v = emdNSTarget(net, net->inArc);
+
+    while (u != v)
+    {
+        if (net->succNum[u] < net->succNum[v])
+            u = net->parent[u];
+        else
+            v = net->parent[v];
+    }
+
+    net->join = u;
+}
+
+/* The arcs are uncapacitated, so only the ones the cycle takes flow off
+ * can leave. The ties are broken so the tree stays strongly feasible. */
+static mwbool emdNSFindLeavingArc(EMDNetwork* net)
+{
+    int u;
+    int result = 0;
+    const int first = emdNSSource(net, net->inArc);
+    const int second = emdNSTarget(net, net->inArc);
+
+    net->delta = EMD_INF;
+
+    for (u = first; u != net->join; u = net->parent[u])
+    {
+        if (net->predDir[u] == EMD_NS_DIR_UP && net->predFlow[u] < net->delta)
+        {
+            net->delta = net->predFlow[u];
+            net->uOut = u;
+            result = 1;
+        }
+    }
+
+    for (u = second; u != net->join; u = net->parent[u])
+    {
+        if (net->predDir[u] == EMD_NS_DIR_DOWN && net->predFlow[u] <= net->delta)
+        {
+            net->delta = net->predFlow[u];
+            net->uOut = u;
+            result = 2;
+        }
+    }
+
+    if (result == 1)
+    {
+        net->uIn = first;
+        net->vIn = second;
+    }
+    else
+    {
+        net->uIn = second;
+        net->vIn = first;
+    }
+
+    return result != 0;
+}
+
+static void emdNSChangeFlow(EMDNetwork* net)
+{
+    int u;
+    const real val = net->delta;
+
+    if (val > 0.0)
+    {
+        for (u = emdNSSource(net, net->inArc); u != net->join; u = net->parent[u])
+        {
+            net->predFlow[u] -= net->predDir[u] * val;
+        }
+
+        for (u = emdNSTarget(net, net->inArc); u != net->join; u = net->parent[u])
+        {
+            net->predFlow[u] += net->predDir[u] * val;
+        }
+    }
+
+    net->state[net->inArc] = EMD_NS_STATE_TREE;
+    if (net->pred[net->uOut] < net->nArc)
+    {
+        net->state[net->pred[net->uOut]] = EMD_NS_STATE_LOWER;
+    }
+}
+
+/* Hang the subtree of uOut from the entering arc, reversing the path
+ * from uIn up to uOut, and fix the thread and the successor counts */
+static void emdNSUpdateTreeStructure(EMDNetwork* net)
+{
+    int u, p;
+    const int uIn = net->uIn;
+    const int vIn = net->vIn;
+    const int uOut = net->uOut;
+    const int join = net->join;
+    const int oldRevThread = net->revThread[uOut];
+    const int oldSuccNum = net->succNum[uOut];
+    const int oldLastSucc = net->lastSucc[uOut];
+    const int vOut = net->parent[uOut];
+    int* parent = net->parent;
+    int* thread = net->thread;
+    int* revThread = net->revThread;
+    int* lastSucc = net->lastSucc;
+    int* succNum = net->succNum;
+    int upLimitOut, lastSuccOut;
+
+    if (uIn == uOut)
+    {
+        parent[uIn] = vIn;
+        net->pred[uIn] = net->inArc;
+        net->predDir[uIn] = uIn == emdNSSource(net, net->inArc) ? EMD_NS_DIR_UP : EMD_NS_DIR_DOWN;
+        net->predFlow[uIn] = net->delta;
+
+        if (thread[vIn] != uOut)
+        {
+            int after = thread[oldLastSucc];
+            thread[oldRevThread] = after;
+            revThread[after] = oldRevThread;
+            after = thread[vIn];
+            thread[vIn] = uOut;
+            revThread[uOut] = vIn;
+            thread[oldLastSucc] = after;
+            revThread[after] = oldLastSucc;
+        }
+    }
+    else
+    {
+        int i, nDirty = 0;
+        int tmpSc = 0, tmpLs;
+
+        /* When oldRevThread is vIn, join and vOut are the same */
+        const int threadContinue = oldRevThread == vIn ? thread[oldLastSucc] : thread[vIn];
+
+        /* Move the stem nodes between uIn and uOut in the thread and
+         * change their parents */
+        int stem = uIn;
+        int parStem = vIn;
+        int nextStem;
+        int last = lastSucc[uIn];
+        int before, after = thread[last];
+
+        thread[vIn] = uIn;
+        net->dirtyRevs[nDirty++] = vIn;
+
+        while (stem != uOut)
+        {
+            nextStem = parent[stem];
+            thread[last] = nextStem;
+            net->dirtyRevs[nDirty++] = last;
+
+            /* Take the subtree of stem out of the thread */
+            before = revThread[stem];
+            thread[before] = after;
+            revThread[after] = before;
+
+            parent[stem] = parStem;
+            parStem = stem;
+            stem = nextStem;
+
+            last = lastSucc[stem] == lastSucc[parStem] ? revThread[parStem] : lastSucc[stem];
+            after = thread[last];
+        }
+
+        parent[uOut] = parStem;
+        thread[last] = threadContinue;
+        revThread[threadContinue] = last;
+        lastSucc[uOut] = last;
+
+        if (oldRevThread != vIn)
+        {
+            thread[oldRevThread] = after;
+            revThread[after] = oldRevThread;
+        }
+
+        for (i = 0; i < nDirty; ++i)
+        {
+            u = net->dirtyRevs[i];
+            revThread[thread[u]] = u;
+        }
+
+        /* The stem arcs now point the other way */
+        tmpLs = lastSucc[uOut];
+        for (u = uOut, p = parent[u]; u != uIn; u = p, p = parent[u])
+        {
+            net->pred[u] = net->pred[p];
+            net->predDir[u] = -net->predDir[p];
+            net->predFlow[u] = net->predFlow[p];
+            tmpSc += succNum[u] - succNum[p];
+            succNum[u] = tmpSc;
+            lastSucc[p] = tmpLs;
+        }
+
+        net->pred[uIn] = net->inArc;
+        net->predDir[uIn] = uIn == emdNSSource(net, net->inArc) ? EMD_NS_DIR_UP : EMD_NS_DIR_DOWN;
+        net->predFlow[uIn] = net->delta;
+        succNum[uIn] = oldSuccNum;
+    }
+
+    /* Fix lastSucc from vIn up to the root */
+    upLimitOut = lastSucc[join] == vIn ? join : -1;
+    lastSuccOut = lastSucc[uOut];
+    for (u = vIn; u != -1 && lastSucc[u] == vIn; u = parent[u])
+    {
+        lastSucc[u] = lastSuccOut;
+    }
+
+    /* And from vOut */
+    if (join != oldRevThread && vIn != oldRevThread)
+    {
+        for (u = vOut; u != upLimitOut && lastSucc[u] == oldLastSucc; u = parent[u])
+        {
+            lastSucc[u] = oldRevThread;
+        }
+    }
+    else if (lastSuccOut != oldLastSucc)
+    {
+        for (u = vOut; u != upLimitOut && lastSucc[u] == oldLastSucc; u = parent[u])
+        {
+            lastSucc[u] = lastSuccOut;
+        }
+    }
+
+    for (u = vIn; u != join; u = parent[u])
+    {
+        succNum[u] += oldSuccNum;
+    }
+
+    for (u = vOut; u != join; u = parent[u])
+    {
+        succNum[u] -= oldSuccNum;
+    }
+}
+
+/* Shift the potentials of the subtree that moved */
+static void emdNSUpdatePotential(EMDNetwork* net)
+{
+    int u;
+    const int uIn = net->uIn;
+    const int dir = net->predDir[uIn];
+    const int sigmaM = net->piM[net->vIn] - net->piM[uIn] - dir * emdNSCostM(net, net->inArc);
+    const real sigma = net->pi[net->vIn] - net->pi[uIn] - dir * emdNSCost(net, net->inArc);
+    const int end = net->thread[net->lastSucc[uIn]];
+
+    for (u = uIn; u != end; u = net->thread[u])
+    {
+        net->piM[u] += sigmaM;
+        net->pi[u] += sigma;
+    }
+}
+
+/* Find the potentials again from the tree, without the rounding that
+ * builds up from shifting them */
+static void emdNSComputePotentials(EMDNetwork* net)
+{
+    int u;
+
+    for (u = net->thread[net->root]; u != net->root; u = net->thread[u])
+    {
+        const int p = net->parent[u];
+        const int e = net->pred[u];
+        const int dir = net->predDir[u];
+
+        net->piM[u] = net->piM[p] - dir * emdNSCostM(net, e);
+        net->pi[u] = net->pi[p] - dir * emdNSCost(net, e);
+    }
+}
+
+/* Returns TRUE if it failed */
+static mwbool emdNSSolve(EMDNetwork* net)
+{
+    unsigned long nPivot = 0;
+    const unsigned long maxPivot = (unsigned long) EMD_NS_MAX_PIVOTS_PER_NODE * net->nNode + MAX_ITERATIONS;
+    mwbool shifted = FALSE;
+
+    for (;;)
+    {
+        if (!emdNSFindEnteringArc(net))
+        {
+            if (!shifted)
+                break;
+
+            /* Make sure it's still optimal with exact potentials */
+            emdNSComputePotentials(net);
+            shifted = FALSE;
+            continue;
+        }
+
+        emdNSFindJoinNode(net);
+        if (!emdNSFindLeavingArc(net))
+        {
+            mw_printf("Network simplex found an unbounded cycle\n");
+            return TRUE;
+        }
+
+        emdNSChangeFlow(net);
+        emdNSUpdateTreeStructure(net);
+        emdNSUpdatePotential(net);
+        shifted = TRUE;
+
+        if (++nPivot > maxPivot)
+        {
+            mw_printf("Network simplex didn't converge\n");
+            net->nPivot = nPivot;
+            return TRUE;
+        }
+    }
+
+    net->nPivot = nPivot;
+    return FALSE;
+}
+
+/* Make the nodes: the sources with some weight, then the sinks with
+ * some weight, or all of them if allSinks. Each side ends with a dummy
+ * that costs nothing to reach and takes up the difference in weight.
+ * Returns TRUE if a weight is out of range. */
+static mwbool emdNSSetNodes(EMDNetwork* net,
+                            const real* signature_arr1,
+                            const real* signature_arr2,
+                            unsigned int size1,
+                            unsigned int size2,
+                            mwbool allSinks)
+{
+    unsigned int i, j;
+    int ns = 0, nd = 0;
+    const int dims = 2; /* We have 2 dimensions, lambda and beta */
+
+    net->idx1 = (int*) mwMalloc((size1 + 1) * sizeof(int));
+    net->idx2 = (int*) mwMalloc((size2 + 1) * sizeof(int));
+
+    for (i = 0; i < size1; ++i)
+    {
+        real w = signature_arr1[i * (dims + 1)];
+
+        if (w < 0.0)
+        {
+            mw_printf("Weight out of range\n");
+            return TRUE;
+        }
+
+        if (w > 0.0)
+            net->idx1[ns++] = (int) i;
+    }
+
+    for (j = 0; j < size2; ++j)
+    {
+        real w = signature_arr2[j * (dims + 1)];
+
+        if (w < 0.0)
+        {
+            mw_printf("Weight out of range\n");
+            return TRUE;
+        }
+
+        if (w > 0.0 || allSinks)
+            net->idx2[nd++] = (int) j;
+    }
+
+    net->idx1[ns++] = -1;
+    net->idx2[nd++] = -1;
+
+    net->ns = ns;
+    net->nd = nd;
+    net->nNode = ns + nd + 1;
+    net->nArc = ns * nd;
+    net->supply = (real*) mwMalloc((ns + nd) * sizeof(real));
+
+    return FALSE;
+}
+
+/* Supplies of the nodes from the weights of their bins. Returns TRUE if
+ * a weight is out of range, or either side has none. */
+static mwbool emdNSSetSupply(EMDNetwork* net,
+                             const real* signature_arr1,
+                             const real* signature_arr2)
+{
+    int u, v;
+    real s_sum = 0.0, d_sum = 0.0, diff;
+    const int ns = net->ns;
+    const int nd = net->nd;
+    const int dims = 2;
+
+    for (u = 0; u < ns - 1; ++u)
+    {
+        net->supply[u] = signature_arr1[net->idx1[u] * (dims + 1)];
+        s_sum += net->supply[u];
+    }
+
+    for (v = 0; v < nd - 1; ++v)
+    {
+        real w = signature_arr2[net->idx2[v] * (dims + 1)];
+
+        if (w < 0.0)
+        {
+            mw_printf("Weight out of range\n");
+            return TRUE;
+        }
+
+        net->supply[ns + v] = -w;
+        d_sum += w;
+    }
+
+    if (s_sum <= 0.0 || d_sum <= 0.0)
+    {
+        mw_printf("ssize or dsize out of range\n");
+        return TRUE;
+    }
+
+    diff = s_sum - d_sum;
+    net->sSum = s_sum;
+    net->dSum = d_sum;
+    net->weight = s_sum > d_sum ? s_sum : d_sum;
+    net->supply[ns - 1] = diff < 0.0 ? -diff : 0.0;
+    net->supply[ns + nd - 1] = diff > 0.0 ? -diff : 0.0;
+
+    return FALSE;
+}
+
+/* The tolerance on the reduced costs goes with the largest cost */
+static void emdNSSetCosts(EMDNetwork* net, const real* signature_arr1, const real* signature_arr2)
+{
+    int u, v;
+    real maxCost = 0.0;
+    const int nd = net->nd;
+    const int dims = 2;
+    void* user_param = (void*) (size_t) dims;
+
+    for (u = 0; u < net->ns; ++u)
+    {
+        const int ci = net->idx1[u];
+
+        for (v = 0; v < nd; ++v)
+        {
+            const int cj = net->idx2[v];
+            real c = 0.0;
+
+            if (ci >= 0 && cj >= 0)
+            {
+                c = emdDistL2(signature_arr1 + ci * (dims + 1) + 1,
+                              signature_arr2 + cj * (dims + 1) + 1,
+                              user_param);
+                maxCost = MAX(maxCost, c);
+            }
+
+            net->cost[u * nd + v] = c;
+        }
+    }
+
+    net->tol = EMD_NS_EPS * maxCost;
+}
+
+/* Cost of the flow per unit of weight */
+static real emdNSResult(const EMDNetwork* net)
+{
+    int u;
+    real totalCost = 0.0;
+    real artFlow = 0.0;
+
+    for (u = 0; u < net->root; ++u)
+    {
+        if (net->pred[u] < net->nArc)
+            totalCost += net->predFlow[u] * net->cost[net->pred[u]];
+        else
+            artFlow += net->predFlow[u];
+    }
+
+    if (artFlow >= EMD_EPS * net->weight)
+    {
+        mw_printf("Network simplex left flow on the artificial arcs\n");
+        return (real) EMD_INVALID;
+    }
+
+    return totalCost / net->weight;
+}
+
+/* Same as emdCalc(), with the network simplex method */
+real emdCalcNetworkSimplex(const real* RESTRICT signature_arr1,
+                           const real* RESTRICT signature_arr2,
+                           unsigned int size1,
+                           unsigned int size2,
+                           real* RESTRICT lower_bound)
+{
+    EMDNetwork net;
+    unsigned int i, j;
+    real emd = (real) EMD_INVALID;
+    const int dims = 2; /* We have 2 dimensions, lambda and beta */
+    void* user_param = (void*) (size_t) dims;
+
+    memset(&net, 0, sizeof(net));
+
+    if (   emdNSSetNodes(&net, signature_arr1, signature_arr2, size1, size2, FALSE)
+        || emdNSSetSupply(&net, signature_arr1, signature_arr2))
+    {
+        emdNSFree(&net);
+        return (real) EMD_INVALID;
+    }
+
+    if (lower_bound && mw_fabs(net.sSum - net.dSum) < EMD_EPS * net.sSum)
+    {
+        real xs[2] = { 0.0, 0.0 };
+        real xd[2] = { 0.0, 0.0 };
+        real lb;
+        mwbool done;
+
+        for (i = 0; i < size1; ++i)
+        {
+            xs[0] += signature_arr1[i * (dims + 1) + 1] * signature_arr1[i * (dims + 1)];
+            xs[1] += signature_arr1[i * (dims + 1) + 2] * signature_arr1[i * (dims + 1)];
+        }
+
+        for (j = 0; j < size2; ++j)
+        {
+            xd[0] += signature_arr2[j * (dims + 1) + 1] * signature_arr2[j * (dims + 1)];
+            xd[1] += signature_arr2[j * (dims + 1) + 2] * signature_arr2[j * (dims + 1)];
+        }
+
+        lb = emdDistL2(xs, xd, user_param) / net.weight;
+        done = *lower_bound <= lb;
+        *lower_bound = lb;
+
+        if (done)
+        {
+            emdNSFree(&net);
+            return lb;
+        }
+    }
+
+    emdNSInit(&net, net.supply);
+    emdNSSetCosts(&net, signature_arr1, signature_arr2);
+
+    if (!emdNSSolve(&net))
+    {
+        emd = emdNSResult(&net);
+    }
+
+    emdNSFree(&net);
+    return emd;
+}
+
+/* Thread, subtree sizes and subtree ends from the parents alone */
+static void emdNSRebuildThread(EMDNetwork* net)
+{
+    int u, p, k;
+    int n = 0;
+    int last = net->root;
+    int* stack = net->dirtyRevs;
+    const int root = net->root;
+
+    for (u = 0; u < net->nNode; ++u)
+    {
+        net->firstChild[u] = -1;
+        net->succNum[u] = 1;
+        net->lastSucc[u] = u;
+    }
+
+    for (u = root - 1; u >= 0; --u)
+    {
+        p = net->parent[u];
+        net->nextSibling[u] = net->firstChild[p];
+        net->firstChild[p] = u;
+    }
+
+    /* Preorder */
+    u = root;
+    for (;;)
+    {
+        for (k = net->firstChild[u]; k != -1; k = net->nextSibling[k])
+        {
+            stack[n++] = k;
+        }
+
+        if (n == 0)
+            break;
+
+        u = stack[--n];
+        net->thread[last] = u;
+        net->revThread[u] = last;
+        last = u;
+    }
+
+    net->thread[last] = root;
+    net->revThread[root] = last;
+
+    /* Backwards, every node comes after all of its subtree. The first
+     * child of p seen this way is the last one in the thread. */
+    for (u = last; u != root; u = net->revThread[u])
+    {
+        p = net->parent[u];
+        net->succNum[p] += net->succNum[u];
+        if (net->lastSucc[p] == p)
+            net->lastSucc[p] = net->lastSucc[u];
+    }
+}
+
+/* Hang u from the root by its artificial arc, pointing whichever way
+ * carries the excess of its subtree */
+static void emdNSHangFromRoot(EMDNetwork* net, int u, real excess)
+{
+    const int root = net->root;
+
+    net->parent[u] = root;
+    net->pred[u] = net->nArc + u;
+
+    if (excess >= 0.0)
+    {
+        net->predDir[u] = EMD_NS_DIR_UP;
+        net->artSource[u] = u;
+        net->artTarget[u] = root;
+        net->predFlow[u] = excess;
+    }
+    else
+    {
+        net->predDir[u] = EMD_NS_DIR_DOWN;
+        net->artSource[u] = root;
+        net->artTarget[u] = u;
+        net->predFlow[u] = -excess;
+    }
+}
+
+/* Make the tree of the last solve feasible for new supplies. The flow
+ * on the arc above each node is what its subtree has left over. Where
+ * that is negative, or zero on an arc pointing away from the root, the
+ * subtree hangs from the root by its artificial arc instead, so the
+ * tree stays strongly feasible and the pivots after it can't cycle. */
+static void emdNSRepair(EMDNetwork* net)
+{
+    int u;
+    const int root = net->root;
+    real* excess = net->pi;     /* The potentials are found again after */
+
+    for (u = 0; u < root; ++u)
+    {
+        excess[u] = net->supply[u];
+    }
+    excess[root] = 0.0;
+
+    for (u = net->revThread[root]; u != root; u = net->revThread[u])
+    {
+        const int e = net->pred[u];
+        const int dir = net->predDir[u];
+        const real f = dir == EMD_NS_DIR_UP ? excess[u] : -excess[u];
+
+        if (e >= net->nArc || f < 0.0 || (f <= 0.0 && dir == EMD_NS_DIR_DOWN))
+        {
+            if (e < net->nArc)
+                net->state[e] = EMD_NS_STATE_LOWER;
+
+            emdNSHangFromRoot(net, u, excess[u]);
+        }
+        else
+        {
+            net->predFlow[u] = f;
+        }
+
+        excess[net->parent[u]] += excess[u];
+    }
+
+    emdNSRebuildThread(net);
+
+    net->piM[root] = 0;
+    net->pi[root] = 0.0;
+    emdNSComputePotentials(net);
+}
+
+/* If the last solve had the same bins at the same places, and the same
+ * weights for the sources */
+static mwbool emdNSSameBins(const EMDNetwork* net,
+                            const real* signature_arr1,
+                            const real* signature_arr2,
+                            unsigned int size1,
+                            unsigned int size2)
+{
+    unsigned int j;
+    const int dims = 2;
+
+    if (!net->hasBasis || size1 != net->size1 || size2 != net->size2)
+        return FALSE;
+
+    if (memcmp(net->signature1, signature_arr1, size1 * (dims + 1) * sizeof(real)))
+        return FALSE;
+
+    for (j = 0; j < size2; ++j)
+    {
+        if (memcmp(&net->positions2[j * dims], &signature_arr2[j * (dims + 1) + 1], dims * sizeof(real)))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Free everything but the pivot counts */
+static void emdNSReset(EMDNetwork* net)
+{
+    const unsigned long nColdSolve = net->nColdSolve;
+    const unsigned long nColdPivot = net->nColdPivot;
+    const unsigned long nWarmSolve = net->nWarmSolve;
+    const unsigned long nWarmPivot = net->nWarmPivot;
+
+    emdNSFree(net);
+    memset(net, 0, sizeof(*net));
+
+    net->nColdSolve = nColdSolve;
+    net->nColdPivot = nColdPivot;
+    net->nWarmSolve = nWarmSolve;
+    net->nWarmPivot = nWarmPivot;
+}
+
+/* Set up the network for new bins, with every sink a node so the next
+ * solve can start from this one whatever their weights become */
+static mwbool emdNSBuild(EMDNetwork* net,
+                         const real* signature_arr1,
+                         const real* signature_arr2,
+                         unsigned int size1,
+                         unsigned int size2)
+{
+    unsigned int j;
+    const int dims = 2;
+
+    emdNSReset(net);
+
+    if (   emdNSSetNodes(net, signature_arr1, signature_arr2, size1, size2, TRUE)
+        || emdNSSetSupply(net, signature_arr1, signature_arr2))
+    {
+        emdNSReset(net);
+        return TRUE;
+    }
+
+    emdNSInit(net, net->supply);
+    emdNSSetCosts(net, signature_arr1, signature_arr2);
+
+    net->firstChild = (int*) mwMalloc(net->nNode * sizeof(int));
+    net->nextSibling = (int*) mwMalloc(net->nNode * sizeof(int));
+
+    net->size1 = size1;
+    net->size2 = size2;
+    net->signature1 = (real*) mwMalloc(MAX(size1, 1) * (dims + 1) * sizeof(real));
+    net->positions2 = (real*) mwMalloc(MAX(size2, 1) * dims * sizeof(real));
+
+    memcpy(net->signature1, signature_arr1, size1 * (dims + 1) * sizeof(real));
+    for (j = 0; j < size2; ++j)
+    {
+        net->positions2[j * dims] = signature_arr2[j * (dims + 1) + 1];
+        net->positions2[j * dims + 1] = signature_arr2[j * (dims + 1) + 2];
+    }
+
+    return FALSE;
+}
+
+EMDNetwork* emdCreateNetwork(void)
+{
+    return (EMDNetwork*) mwCalloc(1, sizeof(EMDNetwork));
+}
+
+void emdDestroyNetwork(EMDNetwork* net)
+{
+    if (!net)
+        return;
+
+    if (net->nColdSolve + net->nWarmSolve > 0)
+    {
+        mw_printf("EMD network simplex: %lu solves from scratch, %.1f pivots each, "
+                  "%lu warm started, %.1f pivots each\n",
+                  net->nColdSolve,
+                  net->nColdSolve ? (double) net->nColdPivot / (double) net->nColdSolve : 0.0,
+                  net->nWarmSolve,
+                  net->nWarmSolve ? (double) net->nWarmPivot / (double) net->nWarmSolve : 0.0);
+    }
+
+    emdNSFree(net);
+    free(net);
+}
+
+real emdCalcNetworkSimplexWarm(EMDNetwork* net,
+                               const real* RESTRICT signature_arr1,
+                               const real* RESTRICT signature_arr2,
+                               unsigned int size1,
+                               unsigned int size2)
+{
+    const mwbool warm = emdNSSameBins(net, signature_arr1, signature_arr2, size1, size2);
+
+    if (warm)
+    {
+        if (emdNSSetSupply(net, signature_arr1, signature_arr2))
+            return (real) EMD_INVALID;
+
+        emdNSRepair(net);
+    }
+    else if (emdNSBuild(net, signature_arr1, signature_arr2, size1, size2))
+    {
+        return (real) EMD_INVALID;
+    }
+
+    net->hasBasis = !emdNSSolve(net);
+
+    if (warm)
+    {
+        ++net->nWarmSolve;
+        net->nWarmPivot += net->nPivot;
+    }
+    else
+    {
+        ++net->nColdSolve;
+        net->nColdPivot += net->nPivot;
+    }
+
+    return net->hasBasis ? emdNSResult(net) : (real) EMD_INVALID;
+}
+
+static EMDSolver emdSolver = EMD_SOLVER_TRANSPORTATION;
+
+void nbSetEMDSolver(EMDSolver solver)
+{
+    emdSolver = solver;
+}
+
 real nbWorstCaseEMD(const NBodyHistogram* hist)
 {
     //(This makes no sense to be defined this way now that histograms are not normalized.
@@ -1271,7 +2352,7 @@ real nbWorstCaseEMD(const NBodyHistogram* hist)
     return DEFAULT_WORST_CASE;
 }
 
-real nbMatchEMD(const NBodyHistogram* data, const NBodyHistogram* histogram)
+real nbMatchEMD(const NBodyHistogram* data, const NBodyHistogram* histogram, EMDNetwork* net)
 {
     unsigned int lambdaBins = data->lambdaBins;
     unsigned int betaBins = data->betaBins;
@@ -1325,7 +2406,18 @@ real nbMatchEMD(const NBodyHistogram* data, const NBodyHistogram* histogram)
         dat[i].beta = (real) data->data[i].beta;
     }
 
-    emd = emdCalc((const real*) dat, (const real*) hist, bins, bins, NULL);
+    if (emdSolver == EMD_SOLVER_NETWORK_SIMPLEX && net)
+    {
+        emd = emdCalcNetworkSimplexWarm(net, (const real*) dat, (const real*) hist, bins, bins);
+    }
+    else if (emdSolver == EMD_SOLVER_NETWORK_SIMPLEX)
+    {
+        emd = emdCalcNetworkSimplex((const real*) dat, (const real*) hist, bins, bins, NULL);
+    }
+    else
+    {
+        emd = emdCalc((const real*) dat, (const real*) hist, bins, bins, NULL);
+    }
 
     emd *= 1.0e9;
     emd = mw_round(emd);
@@ -0,0 +1,699 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fast multipole method on the octree built by nbMakeTree().
+ *
+ * The field of the bodies in a cell is expanded in a Cartesian Taylor
+ * series about the cell's center of mass, up to order p = fmmOrder,
+ * using the same softened kernel g(r) = 1 / sqrt(r^2 + eps2) as the
+ * tree walk:
+ *
+ *   M_k = sum_i m_i (x_i - z)^k / k!                      (multipole)
+ *   L_n = sum_k (-1)^|k| M_k D_{n+k}(z_B - z_A)           (local, M2L)
+ *   a_j(z_B + y) = sum_n L_{n+e_j} y^n / n!
+ *
+ * where k and n are multi-indices and D_k is the k'th derivative of g.
+ * A dual tree traversal pairs target nodes with source nodes. Pairs
+ * that are well separated, (rA + rB) < theta * |zA - zB|, interact
+ * through their expansions, and the rest are split until they are
+ * either separated or both bodies. The cell size r is the distance
+ * from the center of mass to the farthest corner, which findRCrit()
+ * leaves in Rcrit2 for this criterion. Pairs with only a few bodies
+ * between them are summed directly whether or not they are separated,
+ * which is cheaper than any expansion. The local expansions are then
+ * passed down the tree and evaluated at the bodies.
+ *
+ * The traversal only writes to the target side, so the tree is split
+ * into subtrees of at most NBODY_FMM_TARGET_BODIES bodies which are
+ * done in parallel, each against the whole tree.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_fmm.h"
+#include "nbody_soa.h"
+#include "milkyway_util.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+#endif
+
+
+#define NBODY_FMM_MAX_TERMS NBODY_FMM_TERMS(NBODY_FMM_MAX_ORDER)
+
+/* Pairs of terms (i, j, k) for all |i| + |j| <= p */
+#define NBODY_FMM_MAX_PAIRS ((NBODY_FMM_MAX_ORDER + 1) * (NBODY_FMM_MAX_ORDER + 2) * (NBODY_FMM_MAX_ORDER + 3) \
+                             * (NBODY_FMM_MAX_ORDER + 4) * (NBODY_FMM_MAX_ORDER + 5) * (NBODY_FMM_MAX_ORDER + 6) / 720)
+
+/* Largest subtree done as a single parallel task */
+#define NBODY_FMM_TARGET_BODIES 256
+
+typedef struct
+{
+    int a, b, c;
+} NBodyFMMPair;
+
+/* Terms are ordered by degree, so the terms up to order p are the
+ * first NBODY_FMM_TERMS(p) */
+typedef struct
+{
+    int order;
+    int nTerm;
+
+    int expo[NBODY_FMM_MAX_TERMS][3];
+    int degree[NBODY_FMM_MAX_TERMS];
+    real sign[NBODY_FMM_MAX_TERMS];       /* (-1)^|k| */
+
+    /* Each term is found from the one a step down in direction dir */
+    int dir[NBODY_FMM_MAX_TERMS];
+    int down[NBODY_FMM_MAX_TERMS];        /* k - e_dir */
+    int down2[NBODY_FMM_MAX_TERMS];       /* k - 2 e_dir, if k_dir > 1 */
+    int plus[NBODY_FMM_MAX_TERMS][3];     /* k + e_j */
+
+    /* Local from multipole: L[a] += sign[b] M[b] D[c], c = a + b */
+    NBodyFMMPair m2l[NBODY_FMM_MAX_PAIRS];
+    int nM2L;
+
+    /* Moving the center of an expansion: c = a - b, b <= a */
+    NBodyFMMPair shift[NBODY_FMM_MAX_PAIRS];
+    int nShift;
+} NBodyFMMTables;
+
+static NBodyFMMTables tables;      /* order 0 until first used */
+
+/* Constant parts of the traversal */
+typedef struct
+{
+    const NBodyTree* t;
+    NBodyFMM* fmm;
+    NBodySoA* soa;
+    real eps2;
+    real theta2;
+    int nTerm;
+    unsigned int directPairs;   /* sum pairs of nodes with fewer body pairs than this directly */
+} NBodyFMMWalk;
+
+
+static void nbFMMInitTables(int order)
+{
+    int index[NBODY_FMM_MAX_ORDER + 1][NBODY_FMM_MAX_ORDER + 1][NBODY_FMM_MAX_ORDER + 1];
+    int d, a, b, i, j, n = 0;
+    NBodyFMMTables* tb = &tables;
+
+    if (tb->order == order)
+        return;
+
+    assert(order >= 1 && order <= NBODY_FMM_MAX_ORDER);
+
+    for (d = 0; d <= order; ++d)
+    {
+        for (a = d; a >= 0; --a)
+        {
+            for (b = d - a; b >= 0; --b)
+            {
+                tb->expo[n][0] = a;
+                tb->expo[n][1] = b;
+                tb->expo[n][2] = d - a - b;
+                tb->degree[n] = d;
+                tb->sign[n] = (d % 2 == 0) ? 1.0 : -1.0;
+                index[a][b][d - a - b] = n++;
+            }
+        }
+    }
+    tb->nTerm = n;
+    assert(n == NBODY_FMM_TERMS(order));
+
+    for (i = 0; i < n; ++i)
+    {
+        int k[3];
+
+        k[0] = tb->expo[i][0];
+        k[1] = tb->expo[i][1];
+        k[2] = tb->expo[i][2];
+
+        for (j = 0; j < 3; ++j)
+        {
+            ++k[j];
+            tb->plus[i][j] = (tb->degree[i] < order) ? index[k[0]][k[1]][k[2]] : -1;
+            --k[j];
+        }
+
+        if (i == 0)
+        {
+            tb->dir[i] = tb->down[i] = tb->down2[i] = -1;
+            continue;
+        }
+
+        for (j = 0; k[j] == 0; ++j)
+            ;
+        tb->dir[i] = j;
+        --k[j];
+        tb->down[i] = index[k[0]][k[1]][k[2]];
+        if (k[j] > 0)
+        {
+            --k[j];
+            tb->down2[i] = index[k[0]][k[1]][k[2]];
+        }
+        else
+        {
+            tb->down2[i] = -1;
+        }
+    }
+
+    tb->nM2L = tb->nShift = 0;
+    for (i = 0; i < n; ++i)
+    {
+        for (j = 0; j < n; ++j)
+        {
+            const int* p = tb->expo[i];
+            const int* q = tb->expo[j];
+
+            if (tb->degree[i] + tb->degree[j] <= order)
+            {
+                NBodyFMMPair* m = &tb->m2l[tb->nM2L++];
+                m->a = i;
+                m->b = j;
+                m->c = index[p[0] + q[0]][p[1] + q[1]][p[2] + q[2]];
+            }
+
+            if (q[0] <= p[0] && q[1] <= p[1] && q[2] <= p[2])
+            {
+                NBodyFMMPair* s = &tb->shift[tb->nShift++];
+                s->a = i;
+                s->b = j;
+                s->c = index[p[0] - q[0]][p[1] - q[1]][p[2] - q[2]];
+            }
+        }
+    }
+
+    tb->order = order;
+}
+
+/* y^k / k! for the first nTerm terms */
+static inline void nbFMMPowers(real* RESTRICT pw, mwvector y, int nTerm)
+{
+    int i;
+    const real yv[3] = { X(y), Y(y), Z(y) };
+
+    pw[0] = 1.0;
+    for (i = 1; i < nTerm; ++i)
+    {
+        const int j = tables.dir[i];
+        pw[i] = pw[tables.down[i]] * yv[j] / (real) tables.expo[i][j];
+    }
+}
+
+/* Derivatives of the softened kernel at r for all terms up to order.
+ *
+ * With h_m = 2^m d^m/ds^m (s + eps2)^-1/2 at s = r^2, the derivatives
+ * H^m_k of h_m follow from d/dx_j h_m = x_j h_{m+1}:
+ *
+ *   H^m_{k+e_j} = x_j H^{m+1}_k + k_j H^{m+1}_{k-e_j}
+ *
+ * and D_k = H^0_k.
+ */
+static void nbFMMDerivatives(real* RESTRICT D, mwvector r, real eps2, int order)
+{
+    real h[NBODY_FMM_MAX_ORDER + 1][NBODY_FMM_MAX_TERMS];
+    const real rv[3] = { X(r), Y(r), Z(r) };
+    const real u2 = 1.0 / (mw_sqrv(r) + eps2);
+    const int nTerm = NBODY_FMM_TERMS(order);
+    int i, m;
+
+    h[0][0] = mw_sqrt(u2);
+    for (m = 1; m <= order; ++m)
+    {
+        h[m][0] = -(real) (2 * m - 1) * u2 * h[m - 1][0];
+    }
+
+    for (i = 1; i < nTerm; ++i)
+    {
+        const int j = tables.dir[i];
+        const int k = tables.down[i];
+        const int k2 = tables.down2[i];
+        const real kj = (real) (tables.expo[i][j] - 1);
+
+        for (m = 0; m <= order - tables.degree[i]; ++m)
+        {
+            h[m][i] = rv[j] * h[m + 1][k];
+            if (k2 >= 0)
+                h[m][i] += kj * h[m + 1][k2];
+        }
+    }
+
+    for (i = 0; i < nTerm; ++i)
+    {
+        D[i] = h[0][i];
+    }
+}
+
+static inline real* nbFMMMultipole(const NBodyFMMWalk* w, unsigned int c)
+{
+    return &w->fmm->multipole[(size_t) c * w->nTerm];
+}
+
+static inline real* nbFMMLocal(const NBodyFMMWalk* w, unsigned int c)
+{
+    return &w->fmm->local[(size_t) c * w->nTerm];
+}
+
+static inline noderef_t nbFMMNext(const NBodyTree* t, const NBodySoA* soa, noderef_t q)
+{
+    return isCellRef(q) ? Next(CellPtr(t, q)) : soa->next[q];
+}
+
+static inline void nbFMMAddAcc(NBodySoA* soa, unsigned int p, real ax, real ay, real az)
+{
+    soa->acc[0][p] += ax;
+    soa->acc[1][p] += ay;
+    soa->acc[2][p] += az;
+}
+
+
+/* P2M and M2M: moments of cell c from its children */
+static void nbFMMCellMultipole(const NBodyFMMWalk* w, unsigned int c)
+{
+    real pw[NBODY_FMM_MAX_TERMS];
+    int i;
+    noderef_t q;
+    const NBodyCell* p = &w->t->cells[c];
+    const mwvector z = Pos(p);
+    const NBodySoA* soa = w->soa;
+    real* RESTRICT M = nbFMMMultipole(w, c);
+    unsigned int count = 0;
+
+    memset(M, 0, w->nTerm * sizeof(real));
+
+    for (q = More(p); q != Next(p); q = nbFMMNext(w->t, soa, q))
+    {
+        if (isCellRef(q))
+        {
+            const real* RESTRICT Mc = nbFMMMultipole(w, refIndex(q));
+
+            nbFMMPowers(pw, mw_subv(Pos(CellPtr(w->t, q)), z), w->nTerm);
+            for (i = 0; i < tables.nShift; ++i)
+            {
+                const NBodyFMMPair* s = &tables.shift[i];
+                if (s->a < w->nTerm)
+                    M[s->a] += Mc[s->b] * pw[s->c];
+            }
+
+            count += w->fmm->count[refIndex(q)];
+        }
+        else
+        {
+            nbFMMPowers(pw, mw_subv(nbSoAPos(soa, q), z), w->nTerm);
+            for (i = 0; i < w->nTerm; ++i)
+            {
+                M[i] += soa->mass[q] * pw[i];
+            }
+
+            ++count;
+        }
+    }
+
+    w->fmm->count[c] = count;
+    w->fmm->radius[c] = mw_sqrt(Rcrit2(p));
+}
+
+/* L2L and L2P: pass the local expansion of cell c on to its children */
+static void nbFMMCellLocal(const NBodyFMMWalk* w, unsigned int c)
+{
+    real pw[NBODY_FMM_MAX_TERMS];
+    int i;
+    noderef_t q;
+    const NBodyCell* p = &w->t->cells[c];
+    const mwvector z = Pos(p);
+    NBodySoA* soa = w->soa;
+    const real* RESTRICT L = nbFMMLocal(w, c);
+    const int nGrad = NBODY_FMM_TERMS(tables.order - 1);
+
+    for (q = More(p); q != Next(p); q = nbFMMNext(w->t, soa, q))
+    {
+        if (isCellRef(q))
+        {
+            real* RESTRICT Lc = nbFMMLocal(w, refIndex(q));
+
+            nbFMMPowers(pw, mw_subv(Pos(CellPtr(w->t, q)), z), w->nTerm);
+            for (i = 0; i < tables.nShift; ++i)
+            {
+                const NBodyFMMPair* s = &tables.shift[i];
+                if (s->a < w->nTerm)
+                    Lc[s->b] += L[s->a] * pw[s->c];
+            }
+        }
+        else
+        {
+            real ax = 0.0, ay = 0.0, az = 0.0;
+
+            nbFMMPowers(pw, mw_subv(nbSoAPos(soa, q), z), nGrad);
+            for (i = 0; i < nGrad; ++i)
+            {
+                ax += L[tables.plus[i][0]] * pw[i];
+                ay += L[tables.plus[i][1]] * pw[i];
+                az += L[tables.plus[i][2]] * pw[i];
+            }
+
+            nbFMMAddAcc(soa, q, ax, ay, az);
+        }
+    }
+}
+
+
+/* Direct interaction of body b on body a */
+static inline void nbFMMP2P(const NBodyFMMWalk* w, unsigned int a, unsigned int b)
+{
+    NBodySoA* soa = w->soa;
+    mwvector dr = mw_subv(nbSoAPos(soa, b), nbSoAPos(soa, a));
+    real drSq = mw_sqrv(dr) + w->eps2;
+    real drab = mw_sqrt(drSq);
+    real mor3 = soa->mass[b] / (drab * drSq);
+
+    nbFMMAddAcc(soa, a, mor3 * X(dr), mor3 * Y(dr), mor3 * Z(dr));
+}
+
+/* Multipole of cell b on body a */
+static void nbFMMM2P(const NBodyFMMWalk* w, unsigned int a, unsigned int b, mwvector r)
+{
+    real D[NBODY_FMM_MAX_TERMS];
+    int i;
+    real ax = 0.0, ay = 0.0, az = 0.0;
+    const real* RESTRICT M = nbFMMMultipole(w, b);
+    const int nGrad = NBODY_FMM_TERMS(tables.order - 1);
+
+    nbFMMDerivatives(D, r, w->eps2, tables.order);
+    for (i = 0; i < nGrad; ++i)
+    {
+        const real sm = tables.sign[i] * M[i];
+
+        ax += sm * D[tables.plus[i][0]];
+        ay += sm * D[tables.plus[i][1]];
+        az += sm * D[tables.plus[i][2]];
+    }
+
+    nbFMMAddAcc(w->soa, a, ax, ay, az);
+}
+
+/* Body b on the local expansion of cell a */
+static void nbFMMP2L(const NBodyFMMWalk* w, unsigned int a, unsigned int b, mwvector r)
+{
+    real D[NBODY_FMM_MAX_TERMS];
+    int i;
+    real* RESTRICT L = nbFMMLocal(w, a);
+    const real m = w->soa->mass[b];
+
+    nbFMMDerivatives(D, r, w->eps2, tables.order);
+    for (i = 0; i < w->nTerm; ++i)
+    {
+        L[i] += m * D[i];
+    }
+}
+
+/* Multipole of cell b on the local expansion of cell a */
+static void nbFMMM2L(const NBodyFMMWalk* w, unsigned int a, unsigned int b, mwvector r)
+{
+    real D[NBODY_FMM_MAX_TERMS];
+    real sM[NBODY_FMM_MAX_TERMS];
+    int i;
+    real* RESTRICT L = nbFMMLocal(w, a);
+    const real* RESTRICT M = nbFMMMultipole(w, b);
+
+    nbFMMDerivatives(D, r, w->eps2, tables.order);
+    for (i = 0; i < w->nTerm; ++i)
+    {
+        sM[i] = tables.sign[i] * M[i];
+    }
+
+    for (i = 0; i < tables.nM2L; ++i)
+    {
+        const NBodyFMMPair* m = &tables.m2l[i];
+        L[m->a] += sM[m->b] * D[m->c];
+    }
+}
+
+/* Direct sum of all bodies under b on body p */
+static void nbFMMP2PNode(const NBodyFMMWalk* w, unsigned int p, noderef_t b)
+{
+    const NBodyTree* t = w->t;
+    const NBodySoA* soa = w->soa;
+    const noderef_t end = isCellRef(b) ? Next(CellPtr(t, b)) : soa->next[b];
+    noderef_t q = b;
+
+    while (q != end)
+    {
+        if (isCellRef(q))
+        {
+            q = More(CellPtr(t, q));
+        }
+        else
+        {
+            if (q != p)
+                nbFMMP2P(w, p, q);
+            q = soa->next[q];
+        }
+    }
+}
+
+/* Direct sum of all bodies under b on all bodies under a. Test
+ * particles aren't threaded into the tree, so a body a is done alone. */
+static void nbFMMP2PNodes(const NBodyFMMWalk* w, noderef_t a, noderef_t b)
+{
+    const NBodyTree* t = w->t;
+    const NBodySoA* soa = w->soa;
+    noderef_t end, q;
+
+    if (!isCellRef(a))
+    {
+        nbFMMP2PNode(w, a, b);
+        return;
+    }
+
+    end = Next(CellPtr(t, a));
+    q = a;
+    while (q != end)
+    {
+        if (isCellRef(q))
+        {
+            q = More(CellPtr(t, q));
+        }
+        else
+        {
+            nbFMMP2PNode(w, q, b);
+            q = soa->next[q];
+        }
+    }
+}
+
+/* Add the field of source node b to target node a */
+static void nbFMMInteract(const NBodyFMMWalk* w, noderef_t a, noderef_t b)
+{
+    const NBodyTree* t = w->t;
+    const NBodySoA* soa = w->soa;
+    const mwbool aCell = isCellRef(a);
+    const mwbool bCell = isCellRef(b);
+    const mwvector za = aCell ? Pos(CellPtr(t, a)) : nbSoAPos(soa, a);
+    const mwvector zb = bCell ? Pos(CellPtr(t, b)) : nbSoAPos(soa, b);
+    const real ra = aCell ? w->fmm->radius[refIndex(a)] : 0.0;
+    const real rb = bCell ? w->fmm->radius[refIndex(b)] : 0.0;
+    const unsigned int na = aCell ? w->fmm->count[refIndex(a)] : 1;
+    const unsigned int nb = bCell ? w->fmm->count[refIndex(b)] : 1;
+    const mwvector r = mw_subv(za, zb);
+    noderef_t q;
+
+    if (a == b && !aCell)
+        return;                                 /* skip self-interaction */
+
+    if (na <= w->directPairs / nb)              /* cheaper than any expansion */
+    {
+        nbFMMP2PNodes(w, a, b);
+    }
+    else if (a != b && sqr(ra + rb) < w->theta2 * mw_sqrv(r))
+    {
+        if (aCell && bCell)
+            nbFMMM2L(w, refIndex(a), refIndex(b), r);
+        else if (aCell)
+            nbFMMP2L(w, refIndex(a), b, r);
+        else if (bCell)
+            nbFMMM2P(w, a, refIndex(b), r);
+        else
+            nbFMMP2P(w, a, b);
+    }
+    else if (aCell && (!bCell || ra >= rb))      /* split the bigger one */
+    {
+        const NBodyCell* c = CellPtr(t, a);
+        for (q = More(c); q != Next(c); q = nbFMMNext(t, soa, q))
+            nbFMMInteract(w, q, b);
+    }
+    else if (bCell)
+    {
+        const NBodyCell* c = CellPtr(t, b);
+        for (q = More(c); q != Next(c); q = nbFMMNext(t, soa, q))
+            nbFMMInteract(w, a, q);
+    }
+    else
+    {
+        nbFMMP2P(w, a, b);                      /* bodies on top of each other */
+    }
+}
+
+
+static void nbFMMReserve(NBodyFMM* fmm, unsigned int nCell, unsigned int nTerm, unsigned int nbody)
+{
+    if (fmm->cellAlloc < nCell || fmm->nTerm != nTerm)
+    {
+        mwFreeA(fmm->multipole);
+        mwFreeA(fmm->local);
+        mwFreeA(fmm->radius);
+        mwFreeA(fmm->count);
+
+        nCell = MAX(nCell, fmm->cellAlloc);
+        fmm->multipole = (real*) mwMallocA((size_t) nCell * nTerm * sizeof(real));
+        fmm->local = (real*) mwMallocA((size_t) nCell * nTerm * sizeof(real));
+        fmm->radius = (real*) mwMallocA(nCell * sizeof(real));
+        fmm->count = (unsigned int*) mwMallocA(nCell * sizeof(unsigned int));
+        fmm->cellAlloc = nCell;
+        fmm->nTerm = nTerm;
+    }
+
+    if (fmm->targetAlloc < nbody)
+    {
+        mwFreeA(fmm->targets);
+        fmm->targets = (noderef_t*) mwMallocA(nbody * sizeof(noderef_t));
+        fmm->targetAlloc = nbody;
+    }
+}
+
+void nbFreeFMM(NBodyFMM* fmm)
+{
+    static const NBodyFMM emptyFMM = EMPTY_FMM;
+
+    mwFreeA(fmm->multipole);
+    mwFreeA(fmm->local);
+    mwFreeA(fmm->radius);
+    mwFreeA(fmm->count);
+    mwFreeA(fmm->targets);
+
+    *fmm = emptyFMM;
+}
+
+/* Split the subtree at q into parallel tasks */
+static void nbFMMCollectTargets(const NBodyFMMWalk* w, noderef_t q)
+{
+    NBodyFMM* fmm = w->fmm;
+
+    if (!isCellRef(q) || fmm->count[refIndex(q)] <= NBODY_FMM_TARGET_BODIES)
+    {
+        fmm->targets[fmm->nTarget++] = q;
+    }
+    else
+    {
+        const NBodyCell* c = CellPtr(w->t, q);
+        noderef_t r;
+
+        for (r = More(c); r != Next(c); r = nbFMMNext(w->t, w->soa, r))
+            nbFMMCollectTargets(w, r);
+    }
+}
+
+/* Self gravity of all bodies into the accelerations of the body store,
+ * using the threaded tree. */
+void nbMapForceBody_FMM(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i, k, lev;
+    NBodyTree* t = &st->tree;
+    NBodySoA* soa = &st->soa;
+    NBodyFMM* fmm = &t->fmm;
+    NBodyFMMWalk w;
+    const int nbody = st->nbody;
+    int nTarget;
+
+    nbFMMInitTables((int) ctx->fmmOrder);
+    nbFMMReserve(fmm, t->cellUsed, (unsigned int) tables.nTerm, (unsigned int) nbody);
+
+    w.t = t;
+    w.fmm = fmm;
+    w.soa = soa;
+    w.eps2 = ctx->eps2;
+    w.theta2 = sqr(ctx->theta);
+    w.nTerm = tables.nTerm;
+    w.directPairs = 4 * (unsigned int) tables.nTerm;
+
+    memset(fmm->local, 0, (size_t) t->cellUsed * w.nTerm * sizeof(real));
+    for (i = 0; i < 3; ++i)
+    {
+        memset(soa->acc[i], 0, nbody * sizeof(real));
+    }
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(lev, k)
+  #endif
+    for (lev = (int) t->maxDepth; lev >= 0; --lev)   /* moments from the bottom up */
+    {
+        const int start = (int) t->levelStart[lev];
+        const int end = (int) t->levelStart[lev + 1];
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(static)
+      #endif
+        for (k = start; k < end; ++k)
+        {
+            nbFMMCellMultipole(&w, t->levelCells[k]);
+        }
+    }
+
+    fmm->nTarget = 0;
+    nbFMMCollectTargets(&w, cellRef(0));
+    for (i = 0; i < nbody; ++i)
+    {
+        if (soa->mass[i] == 0.0)                /* test particles aren't in the tree */
+            fmm->targets[fmm->nTarget++] = (noderef_t) i;
+    }
+
+    nTarget = (int) fmm->nTarget;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nTarget; ++i)
+    {
+        nbFMMInteract(&w, fmm->targets[i], cellRef(0));
+    }
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(lev, k)
+  #endif
+    for (lev = 0; lev <= (int) t->maxDepth; ++lev)   /* and local expansions back down */
+    {
+        const int start = (int) t->levelStart[lev];
+        const int end = (int) t->levelStart[lev + 1];
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(static)
+      #endif
+        for (k = start; k < end; ++k)
+        {
+            nbFMMCellLocal(&w, t->levelCells[k]);
+        }
+    }
+}
+
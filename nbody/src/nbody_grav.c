@@ -22,6 +22,11 @@
 #include "nbody_priv.h"
 #include "nbody_util.h"
 #include "nbody_grav.h"
+#include "nbody_grav_group.h"
+#include "nbody_fmm.h"
+#include "nbody_grav_exact.h"
+#include "nbody_potential_grid.h"
+#include "nbody_soa.h"
 #include "milkyway_util.h"
 
 #ifdef _OPENMP
@@ -38,24 +43,43 @@
  *   - Not inlined without inline from multiple calls in
  *     mapForceBody(). Measurably better with the inline, but only
  *     slightly.
+ *   - useQuad is a constant in each instance below, so the quadrupole
+ *     test is gone from the walk without them.
  */
-static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body* p)
+static inline ALWAYS_INLINE mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, unsigned int p, const mwbool useQuad)
 {
     mwbool skipSelf = FALSE;
 
-    mwvector pos0 = Pos(p);
+    const NBodySoA* soa = &st->soa;
+    const NBodyTree* t = &st->tree;
+
+    mwvector pos0 = nbSoAPos(soa, p);
     mwvector acc0 = ZERO_VECTOR;
 
-    const NBodyNode* q = (const NBodyNode*) st->tree.root; /* Start at the root */
+    noderef_t q = cellRef(0);       /* Start at the root */
 
-    while (q != NULL)               /* while not at end of scan */
+    while (q != NODE_NULL)          /* while not at end of scan */
     {
-        mwvector dr = mw_subv(Pos(q), pos0);   /* Then compute distance */
-        real drSq = mw_sqrv(dr);               /* and distance squared */
+        const NBodyCell* c = NULL;  /* Set if q is a cell */
+        mwvector dr;
+        real drSq, mass;
+
+        if (isCellRef(q))
+        {
+            c = CellPtr(t, q);
+            dr = mw_subv(Pos(c), pos0);        /* Then compute distance */
+            mass = Mass(c);
+        }
+        else
+        {
+            dr = mw_subv(nbSoAPos(soa, q), pos0);
+            mass = soa->mass[q];
+        }
+        drSq = mw_sqrv(dr);                    /* and distance squared */
 
-        if (isBody(q) || (drSq >= Rcrit2(q)))      /* If is a body or far enough away to approximate */
+        if (!c || (drSq >= Rcrit2(c)))         /* If is a body or far enough away to approximate */
         {
-            if (mw_likely((const Body*) q != p))   /* self-interaction? */
+            if (mw_likely(q != p))             /* self-interaction? */
             {
                 real drab, phii, mor3;
 
@@ -63,22 +87,22 @@ static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body
 
                 drSq += ctx->eps2;   /* use standard softening */
                 drab = mw_sqrt(drSq);
-                phii = Mass(q) / drab;
+                phii = mass / drab;
                 mor3 = phii / drSq;
 
                 acc0.x += mor3 * dr.x;
                 acc0.y += mor3 * dr.y;
                 acc0.z += mor3 * dr.z;
 
-                if (ctx->useQuad && isCell(q))          /* if cell, add quad term */
+                if (useQuad && c)                       /* if cell, add quad term */
                 {
                     real dr5inv, drQdr, phiQ;
                     mwvector Qdr;
 
                     /* form Q * dr */
-                    Qdr.x = Quad(q).xx * dr.x + Quad(q).xy * dr.y + Quad(q).xz * dr.z;
-                    Qdr.y = Quad(q).xy * dr.x + Quad(q).yy * dr.y + Quad(q).yz * dr.z;
-                    Qdr.z = Quad(q).xz * dr.x + Quad(q).yz * dr.y + Quad(q).zz * dr.z;
+                    Qdr.x = Quad(c).xx * dr.x + Quad(c).xy * dr.y + Quad(c).xz * dr.z;
+                    Qdr.y = Quad(c).xy * dr.x + Quad(c).yy * dr.y + Quad(c).yz * dr.z;
+                    Qdr.z = Quad(c).xz * dr.x + Quad(c).yz * dr.y + Quad(c).zz * dr.z;
 
 
                     /* form dr * Q * dr */
@@ -104,11 +128,11 @@ static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body
                 skipSelf = TRUE;   /* Encountered self */
             }
 
-            q = Next(q);  /* Follow next link */
+            q = c ? Next(c) : soa->next[q];  /* Follow next link */
         }
         else
         {
-             q = More(q); /* Follow to the next level if need to go deeper */
+             q = More(c); /* Follow to the next level if need to go deeper */
         }
     }
 
@@ -123,69 +147,51 @@ static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body
     return acc0;
 }
 
-static inline void nbMapForceBody(const NBodyCtx* ctx, NBodyState* st)
+/* Self gravity on the given bodies, or all of them if bodies is NULL */
+static inline ALWAYS_INLINE void nbMapForceBody(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n, const mwbool useQuad)
 {
     int i;
-    const int nbody = st->nbody;  /* Prevent reload on each loop */
-    mwvector a, externAcc;
-    const Body* b;
+    unsigned int p;
 
-    const Body* bodies = mw_assume_aligned(st->bodytab, 16);
-    mwvector* accels = mw_assume_aligned(st->acctab, 16);
+    NBodySoA* soa = &st->soa;
 
   #ifdef _OPENMP
-    #pragma omp parallel for private(i, b, a, externAcc) shared(bodies, accels) schedule(dynamic, 4096 / sizeof(accels[0]))
+    #pragma omp parallel for private(i, p) shared(soa) schedule(dynamic, 4096 / sizeof(mwvector))
   #endif
-    for (i = 0; i < nbody; ++i)      /* get force on each body */
+    for (i = 0; i < n; ++i)      /* get force on each body */
     {
-        /* Repeat the base hackGrav part in each case or else GCC's
-         * -funswitch-loops doesn't happen. Without that this constant
-         * gets checked on every body on every step which is dumb.  */
-        switch (ctx->potentialType)
-        {
-            case EXTERNAL_POTENTIAL_DEFAULT:
-                /* Include the external potential */
-                b = &bodies[i];
-                a = nbGravity(ctx, st, b);
-
-                externAcc = nbExtAcceleration(&ctx->pot, Pos(b));
-                mw_incaddv(a, externAcc);
-                accels[i] = a;
-                break;
-
-            case EXTERNAL_POTENTIAL_NONE:
-                accels[i] = nbGravity(ctx, st, &bodies[i]);
-                break;
-
-            case EXTERNAL_POTENTIAL_CUSTOM_LUA:
-                a = nbGravity(ctx, st, &bodies[i]);
-                nbEvalPotentialClosure(st, Pos(&bodies[i]), &externAcc);
-                mw_incaddv(a, externAcc)
-                accels[i] = a;
-                break;
-
-            default:
-                mw_fail("Bad external potential type: %d\n", ctx->potentialType);
-        }
+        p = bodies ? bodies[i] : (unsigned int) i;
+        nbSoASetAcc(soa, p, nbGravity(ctx, st, p, useQuad));
     }
 }
 
-static mwvector nbGravity_Exact(const NBodyCtx* ctx, NBodyState* st, const Body* p)
+static void nbMapForceBody_Mono(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n)
+{
+    nbMapForceBody(ctx, st, bodies, n, FALSE);
+}
+
+static void nbMapForceBody_Quad(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n)
+{
+    nbMapForceBody(ctx, st, bodies, n, TRUE);
+}
+
+/* Only the bodies with mass pull, so the test particles after them
+ * are left out */
+static mwvector nbGravity_Exact(const NBodyCtx* ctx, NBodyState* st, const mwvector pos)
 {
     int i;
-    const int nbody = st->nbody;
+    const int nbody = st->nMassive;
     mwvector a = ZERO_VECTOR;
     const real eps2 = ctx->eps2;
+    const NBodySoA* soa = &st->soa;
 
     for (i = 0; i < nbody; ++i)
     {
-        const Body* b = &st->bodytab[i];
-
-        mwvector dr = mw_subv(Pos(b), Pos(p));
+        mwvector dr = mw_subv(nbSoAPos(soa, i), pos);
         real drSq = mw_sqrv(dr) + eps2;
 
         real drab = mw_sqrt(drSq);
-        real phii = Mass(b) / drab;
+        real phii = soa->mass[i] / drab;
         real mor3 = phii / drSq;
 
         mw_incaddv(a, mw_mulvs(dr, mor3));
@@ -194,44 +200,156 @@ static mwvector nbGravity_Exact(const NBodyCtx* ctx, NBodyState* st, const Body*
     return a;
 }
 
-static inline void nbMapForceBody_Exact(const NBodyCtx* ctx, NBodyState* st)
+/* Self gravity on the given bodies, or all of them if bodies is NULL */
+static void nbMapForceBody_Exact(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n)
 {
     int i;
-    const int nbody = st->nbody;  /* Prevent reload on each loop */
-    mwvector a, externAcc;
-    const Body* b;
+    unsigned int p;
 
-    Body* bodies = mw_assume_aligned(st->bodytab, 16);
-    mwvector* accels = mw_assume_aligned(st->acctab, 16);
+    NBodySoA* soa = &st->soa;
 
   #ifdef _OPENMP
-    #pragma omp parallel for private(i, b, a, externAcc) shared(bodies, accels) schedule(dynamic, 4096 / sizeof(accels[0]))
+    #pragma omp parallel for private(i, p) shared(soa) schedule(dynamic, 4096 / sizeof(mwvector))
   #endif
-    for (i = 0; i < nbody; ++i)      /* get force on each body */
+    for (i = 0; i < n; ++i)      /* get force on each body */
     {
-        switch (ctx->potentialType)
+        p = bodies ? bodies[i] : (unsigned int) i;
+        nbSoASetAcc(soa, p, nbGravity_Exact(ctx, st, nbSoAPos(soa, p)));
+    }
+}
+
+typedef void (*NBodyForceMap)(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n);
+
+/* Per body tree walks, indexed by useQuad. The opening criterion is
+ * already in each cell's Rcrit2, so it needs no instances of its own. */
+static const NBodyForceMap treeForceMaps[2] = { nbMapForceBody_Mono, nbMapForceBody_Quad };
+
+/* The per body force loop for the context, picked once per step */
+static NBodyForceMap nbSelectForceMap(const NBodyCtx* ctx)
+{
+    if (ctx->criterion == Exact)
+        return nbMapForceBody_Exact;
+
+    return treeForceMaps[ctx->useQuad ? 1 : 0];
+}
+
+/* Bodies sampled when checking against the direct sum */
+#define NBODY_ACCURACY_SAMPLES 256
+
+/* Compare the self gravity found some other way with the direct sum
+ * for a sample of the bodies */
+static void nbReportAccuracy(const NBodyCtx* ctx, NBodyState* st, const char* method)
+{
+    int i;
+    const int nbody = st->nbody;
+    const int stride = MAX(1, nbody / NBODY_ACCURACY_SAMPLES);
+    const int nSample = (nbody + stride - 1) / stride;
+    const NBodySoA* soa = &st->soa;
+    real* err;
+    real sumSq = 0.0, maxErr = 0.0;
+
+    err = (real*) mwMalloc(nSample * sizeof(real));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nSample; ++i)
+    {
+        const unsigned int p = (unsigned int) (i * stride);
+        mwvector exact = nbGravity_Exact(ctx, st, nbSoAPos(soa, p));
+        mwvector diff = mw_subv(nbSoAAcc(soa, p), exact);
+        real norm = mw_absv(exact);
+
+        err[i] = norm > 0.0 ? mw_absv(diff) / norm : mw_absv(diff);
+    }
+
+    for (i = 0; i < nSample; ++i)
+    {
+        sumSq += sqr(err[i]);
+        maxErr = mw_fmax(maxErr, err[i]);
+    }
+
+    mw_printf("%s relative force error over %d bodies: rms = %g, max = %g\n",
+              method,
+              nSample,
+              mw_sqrt(sumSq / (real) nSample),
+              maxErr);
+
+    free(err);
+}
+
+/* Bodies given to the batched external acceleration at once */
+#define NBODY_EXT_BATCH 256
+
+/* Add the default external potential or the Lua closure in batches of
+ * bodies */
+static void nbAddExternalAccBatched(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n)
+{
+    int b;
+    const int nBatch = (n + NBODY_EXT_BATCH - 1) / NBODY_EXT_BATCH;
+    NBodySoA* soa = &st->soa;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(b) shared(soa) schedule(static)
+  #endif
+    for (b = 0; b < nBatch; ++b)
+    {
+        unsigned int i;
+        const unsigned int start = (unsigned int) b * NBODY_EXT_BATCH;
+        const unsigned int m = (unsigned int) MIN(NBODY_EXT_BATCH, n - (int) start);
+        real x[NBODY_EXT_BATCH], y[NBODY_EXT_BATCH], z[NBODY_EXT_BATCH];
+        real ax[NBODY_EXT_BATCH], ay[NBODY_EXT_BATCH], az[NBODY_EXT_BATCH];
+
+        if (bodies)
         {
-            case EXTERNAL_POTENTIAL_DEFAULT:
-                b = &bodies[i];
-                a = nbGravity_Exact(ctx, st, b);
-                mw_incaddv(a, nbExtAcceleration(&ctx->pot, Pos(b)));
-                accels[i] = a;
-                break;
-
-            case EXTERNAL_POTENTIAL_NONE:
-                accels[i] = nbGravity_Exact(ctx, st, &bodies[i]);
-                break;
-
-            case EXTERNAL_POTENTIAL_CUSTOM_LUA:
-                a = nbGravity_Exact(ctx, st, &bodies[i]);
-                nbEvalPotentialClosure(st, Pos(&bodies[i]), &externAcc);
-                mw_incaddv(a, externAcc);
-                accels[i] = a;
-                break;
-
-            default:
-                mw_fail("Bad external potential type: %d\n", ctx->potentialType);
+            for (i = 0; i < m; ++i)
+            {
+                const uint32_t p = bodies[start + i];
+
+                x[i] = soa->pos[0][p];
+                y[i] = soa->pos[1][p];
+                z[i] = soa->pos[2][p];
+            }
         }
+        else
+        {
+            memcpy(x, &soa->pos[0][start], m * sizeof(real));
+            memcpy(y, &soa->pos[1][start], m * sizeof(real));
+            memcpy(z, &soa->pos[2][start], m * sizeof(real));
+        }
+
+        if (ctx->potentialType == EXTERNAL_POTENTIAL_DEFAULT)
+            nbExtAccelerationBatch(&ctx->pot, x, y, z, ax, ay, az, m);
+        else if (!nbPotentialGridAccel(st, x, y, z, ax, ay, az, m))
+            nbEvalPotentialClosureBatch(st, x, y, z, ax, ay, az, m);
+
+        for (i = 0; i < m; ++i)
+        {
+            const uint32_t p = bodies ? bodies[start + i] : start + i;
+
+            soa->acc[0][p] += ax[i];
+            soa->acc[1][p] += ay[i];
+            soa->acc[2][p] += az[i];
+        }
+    }
+}
+
+/* Add the external potential to self gravity already in the body
+ * store, for the given bodies or all of them if bodies is NULL */
+static void nbAddExternalAcc(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n)
+{
+    switch (ctx->potentialType)
+    {
+        case EXTERNAL_POTENTIAL_DEFAULT:
+        case EXTERNAL_POTENTIAL_CUSTOM_LUA:
+            nbAddExternalAccBatched(ctx, st, bodies, n);
+            break;
+
+        case EXTERNAL_POTENTIAL_NONE:
+            break;
+
+        default:
+            mw_fail("Bad external potential type: %d\n", ctx->potentialType);
     }
 }
 
@@ -255,13 +373,45 @@ NBodyStatus nbGravMap(const NBodyCtx* ctx, NBodyState* st)
         if (nbStatusIsFatal(rc))
             return rc;
 
-        nbMapForceBody(ctx, st);
+        if (ctx->criterion == FMM)
+        {
+            nbMapForceBody_FMM(ctx, st);
+            if (!st->accuracyReported)
+            {
+                char method[32];
+
+                snprintf(method, sizeof(method), "FMM order %d", (int) ctx->fmmOrder);
+                nbReportAccuracy(ctx, st, method);
+                st->accuracyReported = TRUE;
+            }
+        }
+        else
+        {
+            if (ctx->useGroupWalk)
+                nbMapForceBody_Group(ctx, st);
+            else
+                nbSelectForceMap(ctx)(ctx, st, NULL, st->nMassive);
+
+            /* Test particles aren't in the tree and never find themselves */
+            nbMapForceTestParticles(ctx, st, NULL, st->nbody - st->nMassive);
+        }
+    }
+    else if (ctx->useTiledExact)
+    {
+        nbMapForceBody_ExactTiled(ctx, st);
+        if (!st->accuracyReported)
+        {
+            nbReportAccuracy(ctx, st, "Tiled exact");
+            st->accuracyReported = TRUE;
+        }
     }
     else
     {
-        nbMapForceBody_Exact(ctx, st);
+        nbSelectForceMap(ctx)(ctx, st, NULL, st->nbody);
     }
 
+    nbAddExternalAcc(ctx, st, NULL, st->nbody);
+
     if (st->potentialEvalError)
     {
         return NBODY_LUA_POTENTIAL_ERROR;
@@ -270,3 +420,41 @@ NBodyStatus nbGravMap(const NBodyCtx* ctx, NBodyState* st)
     return nbIncestStatusCheck(ctx, st); /* Check if incest occured during step */
 }
 
+/* Forces on only the given bodies, in increasing order, with the per
+ * body tree walk or the plain Exact sum. The tree is still built from
+ * all of them. */
+NBodyStatus nbGravMapBodies(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n)
+{
+    NBodyStatus rc;
+
+    assert(ctx->criterion != FMM && !ctx->useGroupWalk && !ctx->useTiledExact);
+
+    if (mw_likely(ctx->criterion != Exact))
+    {
+        int nMassive = n;
+
+        rc = nbMakeTree(ctx, st);
+        if (nbStatusIsFatal(rc))
+            return rc;
+
+        while (nMassive > 0 && bodies[nMassive - 1] >= (uint32_t) st->nMassive)
+            --nMassive;
+
+        nbSelectForceMap(ctx)(ctx, st, bodies, nMassive);
+        nbMapForceTestParticles(ctx, st, &bodies[nMassive], n - nMassive);
+    }
+    else
+    {
+        nbSelectForceMap(ctx)(ctx, st, bodies, n);
+    }
+
+    nbAddExternalAcc(ctx, st, bodies, n);
+
+    if (st->potentialEvalError)
+    {
+        return NBODY_LUA_POTENTIAL_ERROR;
+    }
+
+    return nbIncestStatusCheck(ctx, st);
+}
+
@@ -0,0 +1,276 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Direct summation for the Exact criterion in tiles.
+ *
+ * The bodies are cut into tiles of NBODY_EXACT_TILE consecutive bodies.
+ * Each thread takes a row of tiles I and sums the pairs (I, J) for
+ * J >= I, so each pair of bodies is found once and applied to both.
+ * The tile of the row stays in cache while the others go by. The
+ * forces on the other tiles go to the thread's own copy of the
+ * accelerations, and the copies are added at the end.
+ *
+ * This is the same sum as nbMapForceBody_Exact() in a different order
+ * and with a different 1 / sqrt, so it only differs by rounding.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_grav_exact.h"
+#include "nbody_soa.h"
+#include "nbody_util.h"
+#include "milkyway_cpuid.h"
+#include "milkyway_util.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+
+/* MSVC can't do weak imports. */
+#if !HAVE_AVX512F || !DOUBLEPREC
+  #define nbExactKernel_AVX512F NULL
+#endif
+
+#if !HAVE_AVX2 || !DOUBLEPREC
+  #define nbExactKernel_AVX2 NULL
+#endif
+
+#if !HAVE_SSE2 || !DOUBLEPREC
+  #define nbExactKernel_SSE2 NULL
+#endif
+
+#if MW_IS_X86
+/* Can't use the functions themselves if defined to NULL */
+static NBodyExactKernel kernelAVX512F = nbExactKernel_AVX512F;
+static NBodyExactKernel kernelAVX2 = nbExactKernel_AVX2;
+static NBodyExactKernel kernelSSE2 = nbExactKernel_SSE2;
+#endif
+
+static NBodyExactKernel exactKernel = NULL;
+
+
+/* Plain C version of the kernel for when nothing else is usable */
+static void nbExactKernel(NBodyExactTile* a, NBodyExactTile* b, real eps2)
+{
+    unsigned int i, j;
+    const mwbool same = (a == b);
+
+    for (i = 0; i < a->n; ++i)
+    {
+        real ax = 0.0, ay = 0.0, az = 0.0;
+
+        for (j = 0; j < b->n; ++j)
+        {
+            real dx = b->x[j] - a->x[i];
+            real dy = b->y[j] - a->y[i];
+            real dz = b->z[j] - a->z[i];
+
+            real drSq = dx * dx + dy * dy + dz * dz + eps2;
+            real rInv = 1.0 / mw_sqrt(drSq);
+            real rInv3 = rInv * (rInv * rInv);
+            real mor3 = b->m[j] * rInv3;
+
+            ax += mor3 * dx;
+            ay += mor3 * dy;
+            az += mor3 * dz;
+
+            if (!same)
+            {
+                real mir3 = a->m[i] * rInv3;
+
+                b->ax[j] -= mir3 * dx;
+                b->ay[j] -= mir3 * dy;
+                b->az[j] -= mir3 * dz;
+            }
+        }
+
+        a->ax[i] += ax;
+        a->ay[i] += ay;
+        a->az[i] += az;
+    }
+}
+
+/* Use the widest kernel the processor and OS can run */
+static void nbSelectExactKernel(void)
+{
+  #if MW_IS_X86
+    const MWSIMDLevel simd = mwBestSIMDLevel();
+
+    if (simd >= MW_SIMD_AVX512F && kernelAVX512F)
+    {
+        mw_printf("Using AVX-512F tiled exact kernel\n");
+        exactKernel = kernelAVX512F;
+    }
+    else if (simd >= MW_SIMD_AVX2 && kernelAVX2)
+    {
+        mw_printf("Using AVX2 tiled exact kernel\n");
+        exactKernel = kernelAVX2;
+    }
+    else if (simd >= MW_SIMD_SSE2 && kernelSSE2)
+    {
+        mw_printf("Using SSE2 tiled exact kernel\n");
+        exactKernel = kernelSSE2;
+    }
+    else
+  #endif /* MW_IS_X86 */
+    {
+        mw_printf("Using plain tiled exact kernel\n");
+        exactKernel = nbExactKernel;
+    }
+}
+
+/* Copy bodies [start, start + n) into a tile with no accelerations yet */
+static void nbLoadExactTile(NBodyExactTile* tile, const NBodySoA* soa, unsigned int start, unsigned int n)
+{
+    unsigned int i;
+
+    tile->n = n;
+    tile->nPad = (n + NBODY_EXACT_PAD - 1) & ~(NBODY_EXACT_PAD - 1);
+
+    memcpy(tile->x, &soa->pos[0][start], n * sizeof(real));
+    memcpy(tile->y, &soa->pos[1][start], n * sizeof(real));
+    memcpy(tile->z, &soa->pos[2][start], n * sizeof(real));
+    memcpy(tile->m, &soa->mass[start], n * sizeof(real));
+
+    for (i = n; i < tile->nPad; ++i)
+    {
+        tile->x[i] = tile->y[i] = tile->z[i] = 0.0;
+        tile->m[i] = 0.0;
+    }
+
+    memset(tile->ax, 0, tile->nPad * sizeof(real));
+    memset(tile->ay, 0, tile->nPad * sizeof(real));
+    memset(tile->az, 0, tile->nPad * sizeof(real));
+}
+
+static void nbAddExactTile(real* RESTRICT acc, size_t stride, const NBodyExactTile* tile, unsigned int start)
+{
+    unsigned int i;
+    real* RESTRICT ax = &acc[start];
+    real* RESTRICT ay = &acc[stride + start];
+    real* RESTRICT az = &acc[2 * stride + start];
+
+    for (i = 0; i < tile->n; ++i)
+    {
+        ax[i] += tile->ax[i];
+        ay[i] += tile->ay[i];
+        az[i] += tile->az[i];
+    }
+}
+
+/* Room for each thread's accelerations, stride reals per component */
+static void nbReserveThreadAcc(NBodyState* st, int nThread, size_t stride)
+{
+    size_t size = (size_t) nThread * 3 * stride;
+
+    if (st->threadAccAlloc < size)
+    {
+        mwFreeA(st->threadAcc);
+        st->threadAcc = (real*) mwMallocA(size * sizeof(real));
+        st->threadAccAlloc = size;
+    }
+}
+
+/* Self gravity of all bodies into the accelerations of the body store */
+void nbMapForceBody_ExactTiled(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i;
+    const int nbody = st->nbody;
+    const int nTile = (nbody + NBODY_EXACT_TILE - 1) / NBODY_EXACT_TILE;
+    const size_t stride = ((size_t) nbody + NBODY_EXACT_PAD - 1) & ~((size_t) NBODY_EXACT_PAD - 1);
+    NBodySoA* soa = &st->soa;
+    const real eps2 = ctx->eps2;
+    int nThread = 1;
+
+    if (!exactKernel)
+        nbSelectExactKernel();
+
+    nbReserveThreadAcc(st, nbGetMaxThreads(), stride);
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(i) shared(soa, nThread)
+  #endif
+    {
+        NBodyExactTile a, b;
+        int I, J;
+        int tid = 0;
+        real* acc;
+
+      #ifdef _OPENMP
+        tid = omp_get_thread_num();
+
+        #pragma omp single
+        nThread = omp_get_num_threads();
+      #endif
+
+        acc = &st->threadAcc[(size_t) tid * 3 * stride];
+        memset(acc, 0, 3 * stride * sizeof(real));
+
+        /* Rows dealt out in turn, which evens out the triangle and puts
+         * each row in the same thread's sums every time, so the forces
+         * don't depend on the schedule */
+      #ifdef _OPENMP
+        #pragma omp for schedule(static, 1)
+      #endif
+        for (I = 0; I < nTile; ++I)       /* longest rows first */
+        {
+            const unsigned int startI = (unsigned int) I * NBODY_EXACT_TILE;
+
+            nbLoadExactTile(&a, soa, startI, (unsigned int) MIN(NBODY_EXACT_TILE, nbody - (int) startI));
+            exactKernel(&a, &a, eps2);
+
+            for (J = I + 1; J < nTile; ++J)
+            {
+                const unsigned int startJ = (unsigned int) J * NBODY_EXACT_TILE;
+
+                nbLoadExactTile(&b, soa, startJ, (unsigned int) MIN(NBODY_EXACT_TILE, nbody - (int) startJ));
+                exactKernel(&a, &b, eps2);
+                nbAddExactTile(acc, stride, &b, startJ);
+            }
+
+            nbAddExactTile(acc, stride, &a, startI);
+        }
+
+        /* Implicit barrier, so every thread's copy is finished */
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(static)
+      #endif
+        for (i = 0; i < nbody; ++i)
+        {
+            int t;
+            real ax = 0.0, ay = 0.0, az = 0.0;
+
+            for (t = 0; t < nThread; ++t)
+            {
+                const real* tacc = &st->threadAcc[(size_t) t * 3 * stride];
+
+                ax += tacc[i];
+                ay += tacc[stride + i];
+                az += tacc[2 * stride + i];
+            }
+
+            soa->acc[0][i] = ax;
+            soa->acc[1][i] = ay;
+            soa->acc[2][i] = az;
+        }
+    }
+}
+
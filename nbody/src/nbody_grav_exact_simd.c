@@ -0,0 +1,86 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Built once for each of SSE2, AVX2 and AVX-512F. The dispatch in
+ * nbody_grav_exact.c picks one at runtime. */
+
+#include "nbody_config.h"
+#include "nbody_grav_exact.h"
+
+#ifndef NB_EXACT_KERNEL
+  #error "Exact kernel needs to be built with SSE2 or better"
+#endif
+
+#include "nbody_simd.h"
+
+#if NBODY_EXACT_PAD % VWIDTH != 0
+  #error "Tiles must be padded to a multiple of the vector width"
+#endif
+
+
+void NB_EXACT_KERNEL(NBodyExactTile* a, NBodyExactTile* b, real eps2)
+{
+    unsigned int i, j;
+    const vreal veps2 = v_set1(eps2);
+    const mwbool same = (a == b);
+
+    for (i = 0; i < a->n; ++i)
+    {
+        const vreal px = v_set1(a->x[i]);
+        const vreal py = v_set1(a->y[i]);
+        const vreal pz = v_set1(a->z[i]);
+        const vreal pm = v_set1(a->m[i]);
+        vreal ax = v_zero();
+        vreal ay = v_zero();
+        vreal az = v_zero();
+
+        for (j = 0; j < b->nPad; j += VWIDTH)
+        {
+            vreal dx = v_sub(v_load(&b->x[j]), px);
+            vreal dy = v_sub(v_load(&b->y[j]), py);
+            vreal dz = v_sub(v_load(&b->z[j]), pz);
+
+            vreal drSq = v_madd(dx, dx, v_madd(dy, dy, v_madd(dz, dz, veps2)));
+            vreal rInv = v_rsqrt(drSq);
+            vreal rInv3 = v_mul(rInv, v_mul(rInv, rInv));
+            vreal mor3 = v_mul(v_load(&b->m[j]), rInv3);
+
+            ax = v_madd(mor3, dx, ax);
+            ay = v_madd(mor3, dy, ay);
+            az = v_madd(mor3, dz, az);
+
+            if (!same)
+            {
+                /* Equal and opposite on b. The padding gets junk
+                 * that is never read. */
+                vreal mir3 = v_mul(pm, rInv3);
+
+                v_store(&b->ax[j], v_sub(v_load(&b->ax[j]), v_mul(mir3, dx)));
+                v_store(&b->ay[j], v_sub(v_load(&b->ay[j]), v_mul(mir3, dy)));
+                v_store(&b->az[j], v_sub(v_load(&b->az[j]), v_mul(mir3, dz)));
+            }
+        }
+
+        a->ax[i] += v_hsum(ax);
+        a->ay[i] += v_hsum(ay);
+        a->az[i] += v_hsum(az);
+    }
+}
+
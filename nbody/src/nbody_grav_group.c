@@ -0,0 +1,459 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Grouped tree walk. Instead of walking the tree once per body, each
+ * group of nearby bodies made by nbMakeTreeGroups() walks it once,
+ * opening a cell if any point of the group's bounding box is too close
+ * to it. The cells and bodies it ends up with are collected in
+ * interaction lists which a vectorized kernel sums for every body of
+ * the group.
+ *
+ * Since a cell is only accepted if it would be accepted for every body
+ * of the group, the forces are at least as accurate as those of
+ * nbGravity(), but they are not bit for bit the same.
+ *
+ * Test particles are walked the same way in groups of their own, made
+ * from runs of them sorted by Morton key. They aren't in the tree, so
+ * there is no self interaction to look for.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_grav_group.h"
+#include "nbody_soa.h"
+#include "milkyway_cpuid.h"
+#include "milkyway_util.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+
+/* MSVC can't do weak imports. */
+#if !HAVE_AVX512F || !DOUBLEPREC
+  #define nbGroupKernel_AVX512F NULL
+#endif
+
+#if !HAVE_AVX2 || !DOUBLEPREC
+  #define nbGroupKernel_AVX2 NULL
+#endif
+
+#if !HAVE_SSE2 || !DOUBLEPREC
+  #define nbGroupKernel_SSE2 NULL
+#endif
+
+#if MW_IS_X86
+/* Can't use the functions themselves if defined to NULL */
+static NBodyGroupKernel kernelAVX512F = nbGroupKernel_AVX512F;
+static NBodyGroupKernel kernelAVX2 = nbGroupKernel_AVX2;
+static NBodyGroupKernel kernelSSE2 = nbGroupKernel_SSE2;
+#endif
+
+static NBodyGroupKernel groupKernel = NULL;
+
+
+/* Plain C version of the kernel for when nothing else is usable */
+static void nbGroupKernel(NBodyGroupTargets* tg,
+                          const NBodyInteractionList* mono,
+                          const NBodyInteractionList* quad,
+                          real eps2)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < tg->n; ++i)
+    {
+        real ax = 0.0, ay = 0.0, az = 0.0;
+
+        for (j = 0; j < mono->n; ++j)
+        {
+            real dx = mono->x[j] - tg->x[i];
+            real dy = mono->y[j] - tg->y[i];
+            real dz = mono->z[j] - tg->z[i];
+
+            real drSq = dx * dx + dy * dy + dz * dz + eps2;
+            real rInv = 1.0 / mw_sqrt(drSq);
+            real mor3 = mono->m[j] * rInv * (rInv * rInv);
+
+            ax += mor3 * dx;
+            ay += mor3 * dy;
+            az += mor3 * dz;
+        }
+
+        for (j = 0; j < quad->n; ++j)
+        {
+            real dx = quad->x[j] - tg->x[i];
+            real dy = quad->y[j] - tg->y[i];
+            real dz = quad->z[j] - tg->z[i];
+
+            real drSq = dx * dx + dy * dy + dz * dz + eps2;
+            real rInv = 1.0 / mw_sqrt(drSq);
+            real rInv2 = rInv * rInv;
+            real mor3 = quad->m[j] * rInv * rInv2;
+            real dr5inv = rInv2 * rInv2 * rInv;
+
+            /* Q * dr, then dr * Q * dr */
+            real qx = quad->xx[j] * dx + quad->xy[j] * dy + quad->xz[j] * dz;
+            real qy = quad->xy[j] * dx + quad->yy[j] * dy + quad->yz[j] * dz;
+            real qz = quad->xz[j] * dx + quad->yz[j] * dy + quad->zz[j] * dz;
+            real drQdr = qx * dx + qy * dy + qz * dz;
+
+            real phiQ = 2.5 * dr5inv * (drQdr * rInv2);
+
+            ax += (mor3 + phiQ) * dx - dr5inv * qx;
+            ay += (mor3 + phiQ) * dy - dr5inv * qy;
+            az += (mor3 + phiQ) * dz - dr5inv * qz;
+        }
+
+        tg->ax[i] = ax;
+        tg->ay[i] = ay;
+        tg->az[i] = az;
+    }
+}
+
+/* Use the widest kernel the processor and OS can run */
+static void nbSelectGroupKernel(void)
+{
+  #if MW_IS_X86
+    const MWSIMDLevel simd = mwBestSIMDLevel();
+
+    if (simd >= MW_SIMD_AVX512F && kernelAVX512F)
+    {
+        mw_printf("Using AVX-512F group walk kernel\n");
+        groupKernel = kernelAVX512F;
+    }
+    else if (simd >= MW_SIMD_AVX2 && kernelAVX2)
+    {
+        mw_printf("Using AVX2 group walk kernel\n");
+        groupKernel = kernelAVX2;
+    }
+    else if (simd >= MW_SIMD_SSE2 && kernelSSE2)
+    {
+        mw_printf("Using SSE2 group walk kernel\n");
+        groupKernel = kernelSSE2;
+    }
+    else
+  #endif /* MW_IS_X86 */
+    {
+        mw_printf("Using plain group walk kernel\n");
+        groupKernel = nbGroupKernel;
+    }
+}
+
+static void nbFreeInteractionList(NBodyInteractionList* l)
+{
+    mwFreeA(l->x);
+    mwFreeA(l->y);
+    mwFreeA(l->z);
+    mwFreeA(l->m);
+
+    mwFreeA(l->xx);
+    mwFreeA(l->xy);
+    mwFreeA(l->xz);
+    mwFreeA(l->yy);
+    mwFreeA(l->yz);
+    mwFreeA(l->zz);
+}
+
+static real* nbGrowListArray(real* a, unsigned int n, unsigned int newAlloc)
+{
+    real* b = (real*) mwMallocA(newAlloc * sizeof(real));
+
+    if (a)
+    {
+        memcpy(b, a, n * sizeof(real));
+        mwFreeA(a);
+    }
+
+    return b;
+}
+
+/* Make room for one more entry. The capacity stays a multiple of the
+ * padding, so padding never needs to grow the list */
+static void nbGrowInteractionList(NBodyInteractionList* l, mwbool withQuad)
+{
+    unsigned int newAlloc = l->alloc == 0 ? 64 * NBODY_LIST_PAD : 2 * l->alloc;
+
+    l->x = nbGrowListArray(l->x, l->n, newAlloc);
+    l->y = nbGrowListArray(l->y, l->n, newAlloc);
+    l->z = nbGrowListArray(l->z, l->n, newAlloc);
+    l->m = nbGrowListArray(l->m, l->n, newAlloc);
+
+    if (withQuad)
+    {
+        l->xx = nbGrowListArray(l->xx, l->n, newAlloc);
+        l->xy = nbGrowListArray(l->xy, l->n, newAlloc);
+        l->xz = nbGrowListArray(l->xz, l->n, newAlloc);
+        l->yy = nbGrowListArray(l->yy, l->n, newAlloc);
+        l->yz = nbGrowListArray(l->yz, l->n, newAlloc);
+        l->zz = nbGrowListArray(l->zz, l->n, newAlloc);
+    }
+
+    l->alloc = newAlloc;
+}
+
+static inline void nbAddMonopole(NBodyInteractionList* l, real x, real y, real z, real m)
+{
+    if (l->n == l->alloc)
+        nbGrowInteractionList(l, FALSE);
+
+    l->x[l->n] = x;
+    l->y[l->n] = y;
+    l->z[l->n] = z;
+    l->m[l->n] = m;
+    ++l->n;
+}
+
+static inline void nbAddQuadrupole(NBodyInteractionList* l, const NBodyCell* c)
+{
+    if (l->n == l->alloc)
+        nbGrowInteractionList(l, TRUE);
+
+    l->x[l->n] = X(Pos(c));
+    l->y[l->n] = Y(Pos(c));
+    l->z[l->n] = Z(Pos(c));
+    l->m[l->n] = Mass(c);
+
+    l->xx[l->n] = Quad(c).xx;
+    l->xy[l->n] = Quad(c).xy;
+    l->xz[l->n] = Quad(c).xz;
+    l->yy[l->n] = Quad(c).yy;
+    l->yz[l->n] = Quad(c).yz;
+    l->zz[l->n] = Quad(c).zz;
+    ++l->n;
+}
+
+/* Fill out to a multiple of NBODY_LIST_PAD with massless entries */
+static void nbPadInteractionList(NBodyInteractionList* l, mwbool withQuad)
+{
+    while (l->n % NBODY_LIST_PAD != 0)
+    {
+        l->x[l->n] = l->y[l->n] = l->z[l->n] = l->m[l->n] = 0.0;
+        if (withQuad)
+        {
+            l->xx[l->n] = l->xy[l->n] = l->xz[l->n] = 0.0;
+            l->yy[l->n] = l->yz[l->n] = l->zz[l->n] = 0.0;
+        }
+        ++l->n;
+    }
+}
+
+/* Not a group of nbMakeTreeGroups() */
+#define NBODY_NO_GROUP UINT_MAX
+
+/* Walk the tree for group g, filling the lists. Returns how many of
+ * the group's bodies were found in the walk; any that weren't are tree
+ * incest. */
+static unsigned int nbWalkGroup(const NBodyCtx* ctx,
+                                const NBodyState* st,
+                                unsigned int g,
+                                const NBodyGroupTargets* tg,
+                                NBodyInteractionList* mono,
+                                NBodyInteractionList* quad)
+{
+    unsigned int i, found = 0;
+    real minX, minY, minZ, maxX, maxY, maxZ;
+    real cx, cy, cz, hx, hy, hz;
+
+    const NBodyTree* t = &st->tree;
+    const NBodySoA* soa = &st->soa;
+    noderef_t q = cellRef(0);       /* Start at the root */
+
+    minX = maxX = tg->x[0];
+    minY = maxY = tg->y[0];
+    minZ = maxZ = tg->z[0];
+    for (i = 1; i < tg->n; ++i)
+    {
+        minX = mw_fmin(minX, tg->x[i]);
+        minY = mw_fmin(minY, tg->y[i]);
+        minZ = mw_fmin(minZ, tg->z[i]);
+        maxX = mw_fmax(maxX, tg->x[i]);
+        maxY = mw_fmax(maxY, tg->y[i]);
+        maxZ = mw_fmax(maxZ, tg->z[i]);
+    }
+
+    cx = 0.5 * (minX + maxX);
+    cy = 0.5 * (minY + maxY);
+    cz = 0.5 * (minZ + maxZ);
+    hx = 0.5 * (maxX - minX);
+    hy = 0.5 * (maxY - minY);
+    hz = 0.5 * (maxZ - minZ);
+
+    mono->n = 0;
+    quad->n = 0;
+
+    while (q != NODE_NULL)
+    {
+        if (isCellRef(q))
+        {
+            const NBodyCell* c = CellPtr(t, q);
+
+            /* Distance from the cell's center of mass to the nearest
+             * point of the group's box */
+            real dx = mw_fmax(mw_abs(X(Pos(c)) - cx) - hx, 0.0);
+            real dy = mw_fmax(mw_abs(Y(Pos(c)) - cy) - hy, 0.0);
+            real dz = mw_fmax(mw_abs(Z(Pos(c)) - cz) - hz, 0.0);
+
+            if (dx * dx + dy * dy + dz * dz >= Rcrit2(c))  /* far enough from every body */
+            {
+                if (ctx->useQuad)
+                    nbAddQuadrupole(quad, c);
+                else
+                    nbAddMonopole(mono, X(Pos(c)), Y(Pos(c)), Z(Pos(c)), Mass(c));
+
+                q = Next(c);
+            }
+            else
+            {
+                q = More(c);
+            }
+        }
+        else
+        {
+            nbAddMonopole(mono, soa->pos[0][q], soa->pos[1][q], soa->pos[2][q], soa->mass[q]);
+            if (g != NBODY_NO_GROUP && t->groupOf[q] == g)
+                ++found;
+
+            q = soa->next[q];
+        }
+    }
+
+    nbPadInteractionList(mono, FALSE);
+    nbPadInteractionList(quad, TRUE);
+
+    return found;
+}
+
+/* Self gravity of all bodies into the accelerations of the body store */
+void nbMapForceBody_Group(const NBodyCtx* ctx, NBodyState* st)
+{
+    int g;
+    const int nGroup = (int) st->tree.nGroup;
+    const NBodyTree* t = &st->tree;
+    NBodySoA* soa = &st->soa;
+
+    if (!groupKernel)
+        nbSelectGroupKernel();
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(g) shared(soa)
+  #endif
+    {
+        NBodyInteractionList mono = EMPTY_INTERACTION_LIST;
+        NBodyInteractionList quad = EMPTY_INTERACTION_LIST;
+        NBodyGroupTargets tg;
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 4)
+      #endif
+        for (g = 0; g < nGroup; ++g)
+        {
+            unsigned int i;
+            const NBodyGroup* grp = &t->groups[g];
+            const unsigned int* bodies = &t->groupBodies[grp->start];
+
+            tg.n = grp->count;
+            for (i = 0; i < tg.n; ++i)
+            {
+                tg.x[i] = soa->pos[0][bodies[i]];
+                tg.y[i] = soa->pos[1][bodies[i]];
+                tg.z[i] = soa->pos[2][bodies[i]];
+            }
+
+            if (nbWalkGroup(ctx, st, (unsigned int) g, &tg, &mono, &quad) != tg.n)
+            {
+                /* Some body did not encounter itself in the walk */
+                #ifdef _OPENMP
+                  #pragma omp critical
+                #endif
+                nbReportTreeIncest(ctx, st);
+            }
+
+            groupKernel(&tg, &mono, &quad, ctx->eps2);
+
+            for (i = 0; i < tg.n; ++i)
+            {
+                soa->acc[0][bodies[i]] = tg.ax[i];
+                soa->acc[1][bodies[i]] = tg.ay[i];
+                soa->acc[2][bodies[i]] = tg.az[i];
+            }
+        }
+
+        nbFreeInteractionList(&mono);
+        nbFreeInteractionList(&quad);
+    }
+}
+
+/* Forces on test particles, the given ones or the n after the bodies
+ * with mass if bodies is NULL. Nothing here depends on the others, so
+ * this can use a different number of threads from the rest. */
+void nbMapForceTestParticles(const NBodyCtx* ctx, NBodyState* st, const uint32_t* bodies, int n)
+{
+    int g;
+    const int nGroup = (n + NBODY_GROUP_SIZE - 1) / NBODY_GROUP_SIZE;
+    const int nThread = ctx->testParticleThreads > 0.0 ? (int) ctx->testParticleThreads : nbGetMaxThreads();
+    const unsigned int* order;
+    NBodySoA* soa = &st->soa;
+
+    if (n <= 0)
+        return;
+
+    if (!groupKernel)
+        nbSelectGroupKernel();
+
+    order = nbOrderTestParticles(&st->tree, soa, bodies, (unsigned int) st->nMassive, (unsigned int) n);
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(g) shared(soa) num_threads(nThread)
+  #endif
+    {
+        NBodyInteractionList mono = EMPTY_INTERACTION_LIST;
+        NBodyInteractionList quad = EMPTY_INTERACTION_LIST;
+        NBodyGroupTargets tg;
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 4)
+      #endif
+        for (g = 0; g < nGroup; ++g)
+        {
+            unsigned int i;
+            const unsigned int* group = &order[g * NBODY_GROUP_SIZE];
+
+            tg.n = (unsigned int) MIN(NBODY_GROUP_SIZE, n - g * NBODY_GROUP_SIZE);
+            for (i = 0; i < tg.n; ++i)
+            {
+                tg.x[i] = soa->pos[0][group[i]];
+                tg.y[i] = soa->pos[1][group[i]];
+                tg.z[i] = soa->pos[2][group[i]];
+            }
+
+            nbWalkGroup(ctx, st, NBODY_NO_GROUP, &tg, &mono, &quad);
+            groupKernel(&tg, &mono, &quad, ctx->eps2);
+
+            for (i = 0; i < tg.n; ++i)
+            {
+                soa->acc[0][group[i]] = tg.ax[i];
+                soa->acc[1][group[i]] = tg.ay[i];
+                soa->acc[2][group[i]] = tg.az[i];
+            }
+        }
+
+        nbFreeInteractionList(&mono);
+        nbFreeInteractionList(&quad);
+    }
+}
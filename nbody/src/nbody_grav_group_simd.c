@@ -0,0 +1,110 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Built once for each of SSE2, AVX2 and AVX-512F. The dispatch in
+ * nbody_grav_group.c picks one at runtime. */
+
+#include "nbody_config.h"
+#include "nbody_grav_group.h"
+
+#ifndef NB_GROUP_KERNEL
+  #error "Group kernel needs to be built with SSE2 or better"
+#endif
+
+#include "nbody_simd.h"
+
+#if NBODY_LIST_PAD % VWIDTH != 0
+  #error "Interaction lists must be padded to a multiple of the vector width"
+#endif
+
+
+void NB_GROUP_KERNEL(NBodyGroupTargets* tg,
+                     const NBodyInteractionList* mono,
+                     const NBodyInteractionList* quad,
+                     real eps2)
+{
+    unsigned int i, j;
+    const vreal veps2 = v_set1(eps2);
+    const vreal one = v_set1(1.0);
+    const vreal twoPointFive = v_set1(2.5);
+
+    for (i = 0; i < tg->n; ++i)
+    {
+        const vreal px = v_set1(tg->x[i]);
+        const vreal py = v_set1(tg->y[i]);
+        const vreal pz = v_set1(tg->z[i]);
+        vreal ax = v_zero();
+        vreal ay = v_zero();
+        vreal az = v_zero();
+
+        for (j = 0; j < mono->n; j += VWIDTH)
+        {
+            vreal dx = v_sub(v_load(&mono->x[j]), px);
+            vreal dy = v_sub(v_load(&mono->y[j]), py);
+            vreal dz = v_sub(v_load(&mono->z[j]), pz);
+
+            vreal drSq = v_madd(dx, dx, v_madd(dy, dy, v_madd(dz, dz, veps2)));
+            vreal rInv = v_div(one, v_sqrt(drSq));
+            vreal mor3 = v_mul(v_mul(v_load(&mono->m[j]), rInv), v_mul(rInv, rInv));
+
+            ax = v_madd(mor3, dx, ax);
+            ay = v_madd(mor3, dy, ay);
+            az = v_madd(mor3, dz, az);
+        }
+
+        for (j = 0; j < quad->n; j += VWIDTH)
+        {
+            vreal dx = v_sub(v_load(&quad->x[j]), px);
+            vreal dy = v_sub(v_load(&quad->y[j]), py);
+            vreal dz = v_sub(v_load(&quad->z[j]), pz);
+
+            vreal drSq = v_madd(dx, dx, v_madd(dy, dy, v_madd(dz, dz, veps2)));
+            vreal rInv = v_div(one, v_sqrt(drSq));
+            vreal rInv2 = v_mul(rInv, rInv);
+            vreal mor3 = v_mul(v_mul(v_load(&quad->m[j]), rInv), rInv2);
+            vreal dr5inv = v_mul(v_mul(rInv2, rInv2), rInv);
+
+            vreal xx = v_load(&quad->xx[j]);
+            vreal xy = v_load(&quad->xy[j]);
+            vreal xz = v_load(&quad->xz[j]);
+            vreal yy = v_load(&quad->yy[j]);
+            vreal yz = v_load(&quad->yz[j]);
+            vreal zz = v_load(&quad->zz[j]);
+
+            /* Q * dr, then dr * Q * dr */
+            vreal qx = v_madd(xx, dx, v_madd(xy, dy, v_mul(xz, dz)));
+            vreal qy = v_madd(xy, dx, v_madd(yy, dy, v_mul(yz, dz)));
+            vreal qz = v_madd(xz, dx, v_madd(yz, dy, v_mul(zz, dz)));
+            vreal drQdr = v_madd(qx, dx, v_madd(qy, dy, v_mul(qz, dz)));
+
+            vreal phiQ = v_mul(v_mul(twoPointFive, dr5inv), v_mul(drQdr, rInv2));
+            vreal s = v_add(mor3, phiQ);
+
+            ax = v_add(ax, v_sub(v_mul(s, dx), v_mul(dr5inv, qx)));
+            ay = v_add(ay, v_sub(v_mul(s, dy), v_mul(dr5inv, qy)));
+            az = v_add(az, v_sub(v_mul(s, dz), v_mul(dr5inv, qz)));
+        }
+
+        tg->ax[i] = v_hsum(ax);
+        tg->ay[i] = v_hsum(ay);
+        tg->az[i] = v_hsum(az);
+    }
+}
+
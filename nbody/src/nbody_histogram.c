@@ -30,6 +30,7 @@
 #include "milkyway_util.h"
 #include "nbody_coordinates.h"
 #include "nbody_show.h"
+#include "nbody_util.h"
 
 /*Calculates the center of two numbers */
 static real nbHistogramCenter(real start, real end)
@@ -372,23 +373,85 @@ beta), and then constructs a histogram of the density in lambda and beta.
 Then calculates the cross correlation between the model histogram and
 the data histogram A maximum correlation means the best fit */
 
-/* Returns null on failure */
-NBodyHistogram* nbCreateHistogram(const NBodyCtx* ctx,        /* Simulation context */
-                                  const NBodyState* st,       /* Final state of the simulation */
-                                  const HistogramParams* hp)  /* Range of histogram to create */
+void nbFreeHistogramScratch(NBodyHistogramScratch* hs)
+{
+    static const NBodyHistogramScratch emptyScratch = EMPTY_HISTOGRAM_SCRATCH;
+
+    free(hs->light);
+    free(hs->bin);
+    free(hs->vlos);
+    free(hs->beta);
+    free(hs->binStart);
+    free(hs->binVlos);
+    free(hs->binBeta);
+    free(hs->counts);
+
+    *hs = emptyScratch;
+}
+
+/* Find the bodies that aren't ignored the first time, and make room
+ * for the rest */
+static void nbReserveHistogramScratch(NBodyHistogramScratch* hs, const NBodyState* st, unsigned int nBin)
+{
+    int i;
+    const int nThreadMax = nbGetMaxThreads();
+
+    if (hs->nbody != st->nbody)
+    {
+        nbFreeHistogramScratch(hs);
+
+        hs->light = (unsigned int*) mwMalloc(MAX(st->nbody, 1) * sizeof(unsigned int));
+        hs->nLight = 0;
+        for (i = 0; i < st->nbody; ++i)
+        {
+            if (!ignoreBody(&st->bodytab[i]))
+                hs->light[hs->nLight++] = (unsigned int) i;
+        }
+
+        hs->bin = (unsigned int*) mwMalloc(MAX(hs->nLight, 1) * sizeof(unsigned int));
+        hs->vlos = (real*) mwMalloc(MAX(hs->nLight, 1) * sizeof(real));
+        hs->beta = (real*) mwMalloc(MAX(hs->nLight, 1) * sizeof(real));
+        hs->binVlos = (real*) mwMalloc(MAX(hs->nLight, 1) * sizeof(real));
+        hs->binBeta = (real*) mwMalloc(MAX(hs->nLight, 1) * sizeof(real));
+        hs->nbody = st->nbody;
+    }
+
+    if (hs->nBin != nBin || hs->nThread != nThreadMax)
+    {
+        free(hs->binStart);
+        free(hs->counts);
+
+        hs->binStart = (unsigned int*) mwMalloc((nBin + 1) * sizeof(unsigned int));
+        hs->counts = (unsigned int*) mwMalloc((size_t) nThreadMax * (nBin + 1) * sizeof(unsigned int));
+        hs->nBin = nBin;
+        hs->nThread = nThreadMax;
+    }
+}
+
+/* Bin the bodies into histogram, which needs room for the bins of hp.
+ * histTrig is from nbGetHistTrig() for hp. The bodies that aren't
+ * ignored are found the first time hs is used, so it can only be kept
+ * for more histograms of the same bodies in the same order.
+ *
+ * Each body's bin, line of sight velocity and beta are found in
+ * parallel, and the bodies are then sorted by bin, keeping their order
+ * inside each bin, the same way the Morton keys are sorted. Since no
+ * bin depends on another, the sums and the outlier rejection are then
+ * done for each bin in parallel, adding the bodies in the same order
+ * the serial loop over the bodies would, so the histogram doesn't
+ * depend on the number of threads.
+ */
+void nbFillHistogram(NBodyHistogram* histogram,  /* Filled in from scratch */
+                     const NBodyCtx* ctx,        /* Simulation context */
+                     const NBodyState* st,       /* Final state of the simulation */
+                     const HistogramParams* hp,  /* Range of histogram to create */
+                     const NBHistTrig* histTrig,
+                     NBodyHistogramScratch* hs)
 {
-    real lambda;
-    real beta;
-    mwvector lambdaBetaR;
-    unsigned int lambdaIndex;
-    unsigned int betaIndex;
+    int i, k;
+    int nThread = 1;
     unsigned int Histindex;
-    unsigned int totalNum = 0;
-    Body* p;
-    NBodyHistogram* histogram;
     HistData* histData;
-    NBHistTrig histTrig;
-    const Body* endp = st->bodytab + st->nbody;
     real lambdaSize = nbHistogramLambdaBinSize(hp);
     real betaSize = nbHistogramBetaBinSize(hp);
     /* Calculate the bounds of the bin range, making sure to use a
@@ -400,128 +463,163 @@ NBodyHistogram* nbCreateHistogram(const NBodyCtx* ctx,        /* Simulation cont
     unsigned int lambdaBins = hp->lambdaBins;
     unsigned int betaBins = hp->betaBins;
     unsigned int nBin = lambdaBins * betaBins;
-    unsigned int body_count = 0;
-    unsigned int ub_counter = 0;
-    
-    real Nbodies = st->nbody;
-    mwbool islight = FALSE;//is it light matter?
-    
+    int nLight;
+
+    nbReserveHistogramScratch(hs, st, nBin);
+    nLight = (int) hs->nLight;
     
-    nbGetHistTrig(&histTrig, hp);
-    histogram = mwCalloc(sizeof(NBodyHistogram) + nBin * sizeof(HistData), sizeof(char));
+    memset(histogram, 0, sizeof(NBodyHistogram) + nBin * sizeof(HistData));
     histogram->lambdaBins = lambdaBins;
     histogram->betaBins = betaBins;
     histogram->hasRawCounts = TRUE;
     histogram->params = *hp;
-    
-    real v_line_of_sight;
-    
-    for (int i = 0; i < Nbodies; i++)
+    histogram->totalSimulated = (unsigned int) nLight;
+    if (nLight > 0)
+        histogram->massPerParticle = Mass(&st->bodytab[hs->light[nLight - 1]]);
+    histData = histogram->data;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nLight; ++i)
     {
-        const Body* b = &st->bodytab[i];
-        if(Type(b) == BODY(islight))
+        const Body* p = &st->bodytab[hs->light[i]];
+        unsigned int lambdaIndex, betaIndex;
+        real lambda, beta;
+        mwvector lambdaBetaR;
+
+        /* Get the position in lbr coorinates */
+        lambdaBetaR = nbXYZToLambdaBeta(histTrig, Pos(p), ctx->sunGCDist);
+        lambda = L(lambdaBetaR);
+        beta = B(lambdaBetaR);
+
+        /* Find the indices */
+        lambdaIndex = (unsigned int) mw_floor((lambda - lambdaStart) / lambdaSize);
+        betaIndex = (unsigned int) mw_floor((beta - betaStart) / betaSize);
+
+        /* Check if the position is within the bounds of the histogram */
+        if (lambdaIndex < lambdaBins && betaIndex < betaBins)
+        {
+            hs->bin[i] = lambdaIndex * betaBins + betaIndex;
+            hs->vlos[i] = calc_vLOS(Vel(p), Pos(p), ctx->sunGCDist);//calc the heliocentric line of sight vel
+            hs->beta[i] = beta;
+        }
+        else
         {
-            histogram->massPerParticle = Mass(b);
-            body_count++;
+            hs->bin[i] = nBin;
         }
     }
 
-    real * use_velbody  = mwCalloc(body_count, sizeof(real));
-    real * use_betabody  = mwCalloc(body_count, sizeof(real));
-    real * vlos      = mwCalloc(body_count, sizeof(real));
-    real * betas     = mwCalloc(body_count, sizeof(real));
-    
-    histogram->totalSimulated = (unsigned int) body_count;
-    histData = histogram->data;
-    
-    /* It does not make sense to ignore bins in a generated histogram */
-    for (Histindex = 0; Histindex < nBin; ++Histindex)
+    /* Sort the bodies by bin. Each thread counts its own contiguous
+     * chunk, and the chunks are scattered in order. */
+  #ifdef _OPENMP
+    #pragma omp parallel shared(nThread)
+  #endif
     {
-        histData[Histindex].rawCount = 0;
-        histData[Histindex].v_sum    = 0.0;
-        histData[Histindex].vsq_sum  = 0.0;
-        histData[Histindex].vdisp    = 0.0;
-        histData[Histindex].vdisperr = 0.0;
-        
-        histData[Histindex].beta_sum    = 0.0;
-        histData[Histindex].betasq_sum  = 0.0;
-        histData[Histindex].beta_disp    = 0.0;
-        histData[Histindex].beta_disperr = 0.0;
-        
-        histData[Histindex].outliersBetaRemoved = 0.0;
-        histData[Histindex].outliersVelRemoved = 0.0;
-        histData[Histindex].useBin = TRUE;
-    }
+        int tid = 0;
+        int lo, hi;
+        unsigned int* count;
+
+      #ifdef _OPENMP
+        tid = omp_get_thread_num();
+        #pragma omp single
+        nThread = omp_get_num_threads();
+      #endif
+
+        lo = (int) (((int64_t) nLight * tid) / nThread);
+        hi = (int) (((int64_t) nLight * (tid + 1)) / nThread);
+        count = &hs->counts[tid * (nBin + 1)];
+
+        memset(count, 0, (nBin + 1) * sizeof(unsigned int));
+        for (k = lo; k < hi; ++k)
+        {
+            ++count[hs->bin[k]];
+        }
+
+      #ifdef _OPENMP
+        #pragma omp barrier
+        #pragma omp single
+      #endif
+        {
+            unsigned int offset = 0;
+            int th;
 
+            for (Histindex = 0; Histindex <= nBin; ++Histindex)
+            {
+                hs->binStart[Histindex] = offset;
+                for (th = 0; th < nThread; ++th)
+                {
+                    unsigned int c = hs->counts[th * (nBin + 1) + Histindex];
+                    hs->counts[th * (nBin + 1) + Histindex] = offset;
+                    offset += c;
+                }
+            }
+        }
 
-    for (p = st->bodytab; p < endp; ++p)
-    {
-        /* Only include bodies in models we aren't ignoring (like dark matter) */
-        if (!ignoreBody(p))
+        for (k = lo; k < hi; ++k)
         {
-            
-            /* Get the position in lbr coorinates */
-            lambdaBetaR = nbXYZToLambdaBeta(&histTrig, Pos(p), ctx->sunGCDist);
-            lambda = L(lambdaBetaR);
-            beta = B(lambdaBetaR);
-            
-            use_betabody[ub_counter] = DEFAULT_NOT_USE;//defaulted to not use body
-            use_velbody[ub_counter] = DEFAULT_NOT_USE;//defaulted to not use body
-            
-            vlos[ub_counter]     = DEFAULT_NOT_USE;//default vlos
-            betas[ub_counter]    = DEFAULT_NOT_USE;
-
-            /* Find the indices */
-            lambdaIndex = (unsigned int) mw_floor((lambda - lambdaStart) / lambdaSize);
-            betaIndex = (unsigned int) mw_floor((beta - betaStart) / betaSize);
-
-            /* Check if the position is within the bounds of the histogram */
-            if (lambdaIndex < lambdaBins && betaIndex < betaBins)   
-            {   
-                Histindex = lambdaIndex * betaBins + betaIndex;
-                use_betabody[ub_counter] = Histindex;//if body is in hist, mark which hist bin
-                use_velbody[ub_counter] = Histindex;//if body is in hist, mark which hist bin
-                
-                histData[Histindex].rawCount++;
-                ++totalNum;
-                
-                
-                v_line_of_sight = calc_vLOS(Vel(p), Pos(p), ctx->sunGCDist);//calc the heliocentric line of sight vel
-                vlos[ub_counter] = v_line_of_sight;//store the vlos's so as to not have to recalc
-                betas[ub_counter] = beta;
-                /* each of these are components of the vel disp */
-                histData[Histindex].v_sum += v_line_of_sight;
-                histData[Histindex].vsq_sum += sqr(v_line_of_sight);
-                
-                /* each of these are components of the beta disp */
-                histData[Histindex].beta_sum += beta;
-                histData[Histindex].betasq_sum += sqr(beta);
+            if (hs->bin[k] != nBin)
+            {
+                unsigned int j = count[hs->bin[k]]++;
+                hs->binVlos[j] = hs->vlos[k];
+                hs->binBeta[j] = hs->beta[k];
             }
-            ub_counter++;
         }
     }
-    histogram->totalNum = totalNum; /* Total particles in range */
 
-    nbCalcVelDisp(histogram, TRUE, ctx->VelCorrect);
-    nbCalcBetaDisp(histogram, TRUE, ctx->BetaCorrect);
-    /* this converges somewhere between 3 and 6 iterations */
-    for(int i = 0; i < 6; i++)
+    histogram->totalNum = hs->binStart[nBin]; /* Total particles in range */
+
+    /* It does not make sense to ignore bins in a generated histogram */
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(dynamic, 1)
+  #endif
+    for (k = 0; k < (int) nBin; ++k)
     {
-        nbRemoveBetaOutliers(st, histogram, use_betabody, betas, ctx->BetaSigma);
-        nbCalcBetaDisp(histogram, FALSE, ctx->BetaCorrect);
-        
-        nbRemoveVelOutliers(st, histogram, use_velbody, vlos, ctx->VelSigma);
-        nbCalcVelDisp(histogram, FALSE, ctx->VelCorrect);
-        
+        unsigned int j;
+        HistData* h = &histData[k];
+        const unsigned int start = hs->binStart[k];
+        const unsigned int n = hs->binStart[k + 1] - start;
+
+        h->useBin = TRUE;
+        h->rawCount = n;
+
+        for (j = start; j < start + n; ++j)
+        {
+            /* each of these are components of the vel disp */
+            h->v_sum += hs->binVlos[j];
+            h->vsq_sum += sqr(hs->binVlos[j]);
+
+            /* each of these are components of the beta disp */
+            h->beta_sum += hs->binBeta[j];
+            h->betasq_sum += sqr(hs->binBeta[j]);
+        }
+
+        nbCalcBinVelDisp(h, TRUE, ctx->VelCorrect);
+        nbCalcBinBetaDisp(h, TRUE, ctx->BetaCorrect);
+
+        /* The velocities and betas are rejected separately */
+        nbRemoveBinBetaOutliers(h, &hs->binBeta[start], n, ctx->BetaSigma, ctx->BetaCorrect);
+        nbRemoveBinVelOutliers(h, &hs->binVlos[start], n, ctx->VelSigma, ctx->VelCorrect);
     }
     
     nbNormalizeHistogram(histogram);
-    
-    free(use_velbody);
-    free(use_betabody);
-    free(vlos);
-    free(betas);
-    
+}
+
+/* Returns null on failure */
+NBodyHistogram* nbCreateHistogram(const NBodyCtx* ctx,        /* Simulation context */
+                                  const NBodyState* st,       /* Final state of the simulation */
+                                  const HistogramParams* hp)  /* Range of histogram to create */
+{
+    NBodyHistogram* histogram;
+    NBHistTrig histTrig;
+    NBodyHistogramScratch hs = EMPTY_HISTOGRAM_SCRATCH;
+
+    nbGetHistTrig(&histTrig, hp);
+    histogram = mwCalloc(sizeof(NBodyHistogram) + hp->lambdaBins * hp->betaBins * sizeof(HistData), sizeof(char));
+
+    nbFillHistogram(histogram, ctx, st, hp, &histTrig, &hs);
+
+    nbFreeHistogramScratch(&hs);
     return histogram;
 }
 
@@ -23,6 +23,7 @@
 #include "nbody_config.h"
 
 #include "nbody_histogram.h"
+#include "nbody_likelihood.h"
 #include "nbody_chisq.h"
 #include "nbody_emd.h"
 #include "nbody_mass.h"
@@ -61,6 +62,52 @@ int nbGetLikelihoodInfo(const NBodyFlags* nbf, HistogramParams* hp, NBodyLikelih
     return FALSE;
 }
 
+/* Read the script and the data histogram once for the whole run.
+ * Returns NULL if the script doesn't give a histogram and method. A
+ * missing data histogram is left NULL, and the histogram is still made
+ * so it can be written. */
+NBodyLikelihoodContext* nbCreateLikelihoodContext(const NBodyFlags* nbf)
+{
+    NBodyLikelihoodContext* lc;
+    HistogramParams hp;
+    NBodyLikelihoodMethod method;
+    unsigned int nBin;
+
+    if (nbGetLikelihoodInfo(nbf, &hp, &method) || method == NBODY_INVALID_METHOD)
+    {
+        return NULL;
+    }
+
+    nBin = hp.lambdaBins * hp.betaBins;
+
+    lc = (NBodyLikelihoodContext*) mwCalloc(1, sizeof(NBodyLikelihoodContext));
+    lc->hp = hp;
+    lc->method = method;
+    nbGetHistTrig(&lc->histTrig, &hp);
+
+    if (nbf->histogramFileName)
+    {
+        lc->data = nbReadHistogram(nbf->histogramFileName);
+    }
+
+    lc->histogram = (NBodyHistogram*) mwCalloc(sizeof(NBodyHistogram) + nBin * sizeof(HistData), sizeof(char));
+    lc->emdNetwork = emdCreateNetwork();
+
+    return lc;
+}
+
+void nbDestroyLikelihoodContext(NBodyLikelihoodContext* lc)
+{
+    if (!lc)
+        return;
+
+    free(lc->data);
+    free(lc->histogram);
+    nbFreeHistogramScratch(&lc->scratch);
+    emdDestroyNetwork(lc->emdNetwork);
+    free(lc);
+}
+
 real nbMatchHistogramFiles(const char* datHist, const char* matchHist, mwbool use_veldisp, mwbool use_betadisp)
 {
     NBodyHistogram* dat;
@@ -75,7 +122,7 @@ real nbMatchHistogramFiles(const char* datHist, const char* matchHist, mwbool us
 
     if (dat && match)
     {
-        emd = nbMatchEMD(dat, match);
+        emd = nbMatchEMD(dat, match, NULL);
         cost_component = nbCostComponent(dat, match);
         likelihood = emd + cost_component;
         
@@ -151,7 +198,7 @@ real nbSystemLikelihood(const NBodyState* st,
             return worstEMD; //Changed.  See above comment.
         }
 
-        geometry_component = nbMatchEMD(data, histogram);
+        geometry_component = nbMatchEMD(data, histogram, st->likelihoodCtx ? st->likelihoodCtx->emdNetwork : NULL);
     }
     else
     {
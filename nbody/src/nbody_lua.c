@@ -33,6 +33,11 @@
 #include "milkyway_lua.h"
 #include "nbody_check_params.h"
 #include "nbody_defaults.h"
+#include "nbody_potential_expr.h"
+
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+#endif
 
 static int getNBodyCtxFunc(lua_State* luaSt)
 {
@@ -340,11 +345,61 @@ static int nbGetPotentialClosure(lua_State* luaSt)
     return closure;
 }
 
+/* Sample points for comparing a compiled closure with the closure,
+ * from the center out past the edge of any stream */
+#define POTENTIAL_EXPR_CHECK_POINTS 256
+#define POTENTIAL_EXPR_CHECK_SEED 1984
+
+/* Check the compiled closure gives exactly what the closure does, so
+ * nothing changes if it is used */
+static int nbPotentialExprMatches(NBodyState* st, const NBodyPotentialExpr* e)
+{
+    int i;
+    dsfmt_t prng;
+    real x[POTENTIAL_EXPR_CHECK_POINTS], y[POTENTIAL_EXPR_CHECK_POINTS], z[POTENTIAL_EXPR_CHECK_POINTS];
+    real a[3][POTENTIAL_EXPR_CHECK_POINTS], b[3][POTENTIAL_EXPR_CHECK_POINTS];
+
+    dsfmt_init_gen_rand(&prng, POTENTIAL_EXPR_CHECK_SEED);
+
+    for (i = 0; i < POTENTIAL_EXPR_CHECK_POINTS; ++i)
+    {
+        mwvector v = mwRandomVector(&prng, 0.01 * mw_exp(mwXrandom(&prng, 0.0, 1.0) * mw_log(1.0e5)));
+
+        x[i] = X(v);
+        y[i] = Y(v);
+        z[i] = Z(v);
+    }
+
+    nbEvalPotentialClosureBatch(st, x, y, z, a[0], a[1], a[2], POTENTIAL_EXPR_CHECK_POINTS);
+    if (st->potentialEvalError)
+        return FALSE;
+
+    nbEvalPotentialExpr(e, x, y, z, b[0], b[1], b[2], POTENTIAL_EXPR_CHECK_POINTS);
+
+    for (i = 0; i < 3 * POTENTIAL_EXPR_CHECK_POINTS; ++i)
+    {
+        const real ai = a[i / POTENTIAL_EXPR_CHECK_POINTS][i % POTENTIAL_EXPR_CHECK_POINTS];
+        const real bi = b[i / POTENTIAL_EXPR_CHECK_POINTS][i % POTENTIAL_EXPR_CHECK_POINTS];
+
+        if (ai != bi && !(isnan(ai) && isnan(bi)))
+        {
+            mw_printf("Compiled Lua potential closure differs from the closure at (%g, %g, %g), not using it\n",
+                      x[i % POTENTIAL_EXPR_CHECK_POINTS],
+                      y[i % POTENTIAL_EXPR_CHECK_POINTS],
+                      z[i % POTENTIAL_EXPR_CHECK_POINTS]);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 int nbOpenPotentialEvalStatePerThread(NBodyState* st, const NBodyFlags* nbf)
 {
     int i;
     int* closures;
     lua_State** states;
+    NBodyPotentialExpr* expr;
     const int maxThreads = nbGetMaxThreads();
 
     states = mwCalloc(maxThreads, sizeof(lua_State*));
@@ -362,6 +417,26 @@ int nbOpenPotentialEvalStatePerThread(NBodyState* st, const NBodyFlags* nbf)
             free(closures);
             return 1;
         }
+
+        if (i > 0)
+            continue;
+
+        /* If the closure can be compiled, the other threads don't need
+         * to run the script */
+        st->potEvalStates = states;
+        st->potEvalClosures = closures;
+
+        expr = nbCompilePotentialClosure(states[0], closures[0]);
+        if (expr && nbPotentialExprMatches(st, expr))
+        {
+            st->potentialExpr = expr;
+            return 0;
+        }
+
+        nbFreePotentialExpr(expr);
+        st->potentialEvalError = FALSE;
+        st->potEvalStates = NULL;
+        st->potEvalClosures = NULL;
     }
 
     st->potEvalStates = states;
@@ -387,7 +462,15 @@ void nbEvalPotentialClosure(NBodyState* st, mwvector pos, mwvector* aOut)
     int top;
     mwvector a;
     static const mwvector badVector = mw_vec(REAL_MAX, REAL_MAX, REAL_MAX);
-    lua_State* luaSt = st->potEvalStates[tid];
+    lua_State* luaSt;
+
+    if (st->potentialExpr)
+    {
+        nbEvalPotentialExpr(st->potentialExpr, &X(pos), &Y(pos), &Z(pos), &X(*aOut), &Y(*aOut), &Z(*aOut), 1);
+        return;
+    }
+
+    luaSt = st->potEvalStates[tid];
 
     /* Push closure */
     getLuaClosure(luaSt, &st->potEvalClosures[tid]);
@@ -451,6 +534,116 @@ void nbEvalPotentialClosure(NBodyState* st, mwvector pos, mwvector* aOut)
     lua_pop(luaSt, 3);
 }
 
+/* A chunk of bodies for nbEvalPotentialChunk() */
+typedef struct
+{
+    int closure;
+    unsigned int n;
+    const real* x;
+    const real* y;
+    const real* z;
+    real* ax;
+    real* ay;
+    real* az;
+} NBodyPotentialChunk;
+
+/* Run the closure for each body of the chunk. Run with lua_cpcall(), so
+ * the closure is called unprotected and an error anywhere stops the
+ * whole chunk. */
+static int nbEvalPotentialChunk(lua_State* luaSt)
+{
+    unsigned int i;
+    const NBodyPotentialChunk* chunk = (const NBodyPotentialChunk*) lua_touserdata(luaSt, 1);
+
+    getLuaClosure(luaSt, (void*) &chunk->closure);
+
+    for (i = 0; i < chunk->n; ++i)
+    {
+        lua_pushvalue(luaSt, 2);
+        lua_pushnumber(luaSt, chunk->x[i]);
+        lua_pushnumber(luaSt, chunk->y[i]);
+        lua_pushnumber(luaSt, chunk->z[i]);
+        lua_call(luaSt, 3, 3);
+
+        if (!lua_isnumber(luaSt, -1) || !lua_isnumber(luaSt, -2) || !lua_isnumber(luaSt, -3))
+        {
+            return luaL_error(luaSt, "Expected number, number, number. Got %s, %s, %s",
+                              luaL_typename(luaSt, -3),
+                              luaL_typename(luaSt, -2),
+                              luaL_typename(luaSt, -1));
+        }
+
+        chunk->ax[i] = lua_tonumber(luaSt, -3);
+        chunk->ay[i] = lua_tonumber(luaSt, -2);
+        chunk->az[i] = lua_tonumber(luaSt, -1);
+        lua_pop(luaSt, 3);
+    }
+
+    return 0;
+}
+
+/* Evaluate the potential closure for n bodies at once, with the same
+ * results as nbEvalPotentialClosure() for each. Setting up a protected
+ * call costs about as much as a small closure, so it is done once for
+ * the chunk rather than for each body. */
+void nbEvalPotentialClosureBatch(NBodyState* st,
+                                 const real* x, const real* y, const real* z,
+                                 real* ax, real* ay, real* az,
+                                 unsigned int n)
+{
+  #ifdef _OPENMP
+    const int tid = omp_get_thread_num();
+  #else
+    const int tid = 0;
+  #endif
+
+    unsigned int i;
+    NBodyPotentialChunk chunk;
+    lua_State* luaSt;
+
+    if (st->potentialExpr)
+    {
+        nbEvalPotentialExpr(st->potentialExpr, x, y, z, ax, ay, az, n);
+        return;
+    }
+
+    luaSt = st->potEvalStates[tid];
+
+    chunk.closure = st->potEvalClosures[tid];
+    chunk.n = n;
+    chunk.x = x;
+    chunk.y = y;
+    chunk.z = z;
+    chunk.ax = ax;
+    chunk.ay = ay;
+    chunk.az = az;
+
+    if (lua_cpcall(luaSt, nbEvalPotentialChunk, &chunk))
+    {
+        /* Avoid spewing the same error billions of times */
+        if (!st->potentialEvalError)
+        {
+          #ifdef _OPENMP
+            #pragma omp critical
+          #endif
+            {
+                mw_lua_perror(luaSt, "Error evaluating potential closure");
+                st->potentialEvalError = TRUE;
+            }
+        }
+        else
+        {
+            lua_pop(luaSt, 1);
+        }
+
+        /* Make sure we break everything */
+        for (i = 0; i < n; ++i)
+        {
+            ax[i] = ay[i] = az[i] = REAL_MAX;
+        }
+    }
+}
+
 static int nbEvaluatePotential(lua_State* luaSt, NBodyCtx* ctx)
 {
     int top;
@@ -179,22 +179,31 @@ static int luaCalculateEps2(lua_State* luaSt)
 static int luaReverseOrbit(lua_State* luaSt)
 {
     mwvector finalPos, finalVel;
+    real energyDrift;
+    integrator_t integrator = Leapfrog;
     static real dt = 0.0;
     static real tstop = 0.0;
     static Potential* pot = NULL;
     static const mwvector* pos = NULL;
     static const mwvector* vel = NULL;
+    static const char* integratorName = NULL;
+    static real tolerance = 0.0;
 
     static const MWNamedArg argTable[] =
         {
-            { "potential", LUA_TUSERDATA, POTENTIAL_TYPE, TRUE, &pot   },
-            { "position",  LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE, &pos   },
-            { "velocity",  LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE, &vel   },
-            { "tstop",     LUA_TNUMBER,   NULL,           TRUE, &tstop },
-            { "dt",        LUA_TNUMBER,   NULL,           TRUE, &dt    },
+            { "potential",  LUA_TUSERDATA, POTENTIAL_TYPE, TRUE,  &pot            },
+            { "position",   LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE,  &pos            },
+            { "velocity",   LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE,  &vel            },
+            { "tstop",      LUA_TNUMBER,   NULL,           TRUE,  &tstop          },
+            { "dt",         LUA_TNUMBER,   NULL,           TRUE,  &dt             },
+            { "integrator", LUA_TSTRING,   NULL,           FALSE, &integratorName },
+            { "tolerance",  LUA_TNUMBER,   NULL,           FALSE, &tolerance      },
             END_MW_NAMED_ARG
         };
 
+    integratorName = NULL;
+    tolerance = 0.0;
+
     switch (lua_gettop(luaSt))
     {
         case 1:
@@ -217,35 +226,179 @@ static int luaReverseOrbit(lua_State* luaSt)
     if (checkPotentialConstants(pot))
         luaL_error(luaSt, "Error with potential");
 
-    nbReverseOrbit(&finalPos, &finalVel, pot, *pos, *vel, tstop, dt);
+    if (integratorName) /* Not required */
+    {
+        integrator = readIntegrator(luaSt, integratorName);
+    }
+
+    if (tolerance > 0.0)
+    {
+        if (integratorName)
+            luaL_error(luaSt, "integrator can't be used with the adaptive tolerance");
+
+        nbReverseOrbits(&finalPos, &finalVel, &energyDrift, (const Potential* const*) &pot,
+                        integrator, tolerance, pos, vel, 1, tstop, dt);
+    }
+    else
+    {
+        nbReverseOrbit(&finalPos, &finalVel, &energyDrift, pot, integrator, *pos, *vel, tstop, dt);
+    }
     pushVector(luaSt, finalPos);
     pushVector(luaSt, finalVel);
+    lua_pushnumber(luaSt, energyDrift);
 
-    return 2;
+    return 3;
+}
+
+
+/* Read an orbit table { potential, position, velocity } from the
+ * array at table */
+static void readOrbit(lua_State* luaSt, int table, int i,
+                      Potential** potOut, mwvector* posOut, mwvector* velOut)
+{
+    static Potential* pot = NULL;
+    static const mwvector* pos = NULL;
+    static const mwvector* vel = NULL;
+
+    static const MWNamedArg argTable[] =
+        {
+            { "potential", LUA_TUSERDATA, POTENTIAL_TYPE, TRUE, &pot },
+            { "position",  LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE, &pos },
+            { "velocity",  LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE, &vel },
+            END_MW_NAMED_ARG
+        };
+
+    lua_rawgeti(luaSt, table, i + 1);
+    handleNamedArgumentTable(luaSt, argTable, lua_gettop(luaSt));
+    lua_pop(luaSt, 1);
+
+    if (checkPotentialConstants(pot))
+        luaL_error(luaSt, "Error with potential of orbit %d", i + 1);
+
+    *potOut = pot;
+    *posOut = *pos;
+    *velOut = *vel;
+}
+
+/* Push an array of n vectors */
+static void pushVectorArray(lua_State* luaSt, const mwvector* v, int n)
+{
+    int i;
+
+    lua_createtable(luaSt, n, 0);
+    for (i = 0; i < n; ++i)
+    {
+        pushVector(luaSt, v[i]);
+        lua_rawseti(luaSt, -2, i + 1);
+    }
 }
 
+static int luaReverseOrbits(lua_State* luaSt)
+{
+    int i, n, orbits;
+    integrator_t integrator = Leapfrog;
+    Potential** pots;
+    mwvector* pos;
+    mwvector* vel;
+    mwvector* finalPos;
+    mwvector* finalVel;
+    real* energyDrift;
+    static real dt = 0.0;
+    static real tstop = 0.0;
+    static real tolerance = 0.0;
+    static const char* integratorName = NULL;
+
+    static const MWNamedArg argTable[] =
+        {
+            { "tstop",      LUA_TNUMBER, NULL, TRUE,  &tstop          },
+            { "dt",         LUA_TNUMBER, NULL, TRUE,  &dt             },
+            { "integrator", LUA_TSTRING, NULL, FALSE, &integratorName },
+            { "tolerance",  LUA_TNUMBER, NULL, FALSE, &tolerance      },
+            END_MW_NAMED_ARG
+        };
+
+    if (lua_gettop(luaSt) != 2)
+        return luaL_argerror(luaSt, 1, "Expected 2 arguments");
+
+    orbits = mw_lua_checktable(luaSt, 1);
+    n = luaL_getn(luaSt, orbits);
+    if (n == 0)
+        return luaL_argerror(luaSt, 1, "Expected at least one orbit");
+
+    integratorName = NULL;
+    tolerance = 0.0;
+    handleNamedArgumentTable(luaSt, argTable, 2);
+
+    if (integratorName)
+    {
+        if (tolerance > 0.0)
+            luaL_error(luaSt, "integrator can't be used with the adaptive tolerance");
+        integrator = readIntegrator(luaSt, integratorName);
+    }
+
+    /* Owned by Lua so nothing leaks if an orbit is bad */
+    pos = (mwvector*) lua_newuserdata(luaSt, n * (4 * sizeof(mwvector) + sizeof(real) + sizeof(Potential*)));
+    vel = &pos[n];
+    finalPos = &pos[2 * n];
+    finalVel = &pos[3 * n];
+    energyDrift = (real*) &pos[4 * n];
+    pots = (Potential**) &energyDrift[n];
+
+    for (i = 0; i < n; ++i)
+    {
+        readOrbit(luaSt, orbits, i, &pots[i], &pos[i], &vel[i]);
+    }
+
+    nbReverseOrbits(finalPos, finalVel, energyDrift, (const Potential* const*) pots,
+                    integrator, tolerance, pos, vel, (unsigned int) n, tstop, dt);
+
+    pushVectorArray(luaSt, finalPos, n);
+    pushVectorArray(luaSt, finalVel, n);
+
+    lua_createtable(luaSt, n, 0);
+    for (i = 0; i < n; ++i)
+    {
+        lua_pushnumber(luaSt, energyDrift[i]);
+        lua_rawseti(luaSt, -2, i + 1);
+    }
+
+    return 3;
+}
 
 static int luaPrintReverseOrbit(lua_State* luaSt)
 {
     mwvector finalPos, finalVel;
+    integrator_t integrator = Leapfrog;
     static real dt = 0.0;
     static real tstop = 0.0;
     static real tstopf = 0.0;
     static Potential* pot = NULL;
     static const mwvector* pos = NULL;
     static const mwvector* vel = NULL;
+    static const char* integratorName = NULL;
+    static NBodyOrbitOutput out = DEFAULT_ORBIT_OUTPUT;
+    static real every = 1.0;
 
     static const MWNamedArg argTable[] =
         {
-            { "potential", LUA_TUSERDATA, POTENTIAL_TYPE, TRUE, &pot    },
-            { "position",  LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE, &pos    },
-            { "velocity",  LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE, &vel    },
-            { "tstop",     LUA_TNUMBER,   NULL,           TRUE, &tstop  },
-            { "tstopf",    LUA_TNUMBER,   NULL,           TRUE, &tstopf },
-            { "dt",        LUA_TNUMBER,   NULL,           TRUE, &dt     },
+            { "potential",  LUA_TUSERDATA, POTENTIAL_TYPE, TRUE,  &pot            },
+            { "position",   LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE,  &pos            },
+            { "velocity",   LUA_TUSERDATA, MWVECTOR_TYPE,  TRUE,  &vel            },
+            { "tstop",      LUA_TNUMBER,   NULL,           TRUE,  &tstop          },
+            { "tstopf",     LUA_TNUMBER,   NULL,           TRUE,  &tstopf         },
+            { "dt",         LUA_TNUMBER,   NULL,           TRUE,  &dt             },
+            { "integrator", LUA_TSTRING,   NULL,           FALSE, &integratorName },
+            { "binary",     LUA_TBOOLEAN,  NULL,           FALSE, &out.binary     },
+            { "every",      LUA_TNUMBER,   NULL,           FALSE, &every          },
+            { "arcLength",  LUA_TNUMBER,   NULL,           FALSE, &out.arcLength  },
             END_MW_NAMED_ARG
         };
 
+    integratorName = NULL;
+    out.binary = FALSE;
+    out.arcLength = 0.0;
+    every = 1.0;
+
     switch (lua_gettop(luaSt))
     {
         case 1:
@@ -269,7 +422,17 @@ static int luaPrintReverseOrbit(lua_State* luaSt)
     if (checkPotentialConstants(pot))
         luaL_error(luaSt, "Error with potential");
 
-    nbPrintReverseOrbit(&finalPos, &finalVel, pot, *pos, *vel, tstop, tstopf, dt);
+    if (integratorName) /* Not required */
+    {
+        integrator = readIntegrator(luaSt, integratorName);
+    }
+
+    /* Also rejects NaN, and floor(every) < every for fractions */
+    if (!(every >= 1.0 && every <= (real) UINT_MAX) || mw_floor(every) < every)
+        luaL_error(luaSt, "every must be a whole number from 1 to UINT_MAX, got %f", every);
+    out.every = (unsigned int) every;
+
+    nbPrintReverseOrbit(&finalPos, &finalVel, pot, integrator, *pos, *vel, tstop, tstopf, dt, &out);
     pushVector(luaSt, finalPos);
     pushVector(luaSt, finalVel);
 
@@ -280,6 +443,7 @@ void registerModelFunctions(lua_State* luaSt)
 {
     lua_register(luaSt, "plummerTimestepIntegral", luaPlummerTimestepIntegral);
     lua_register(luaSt, "reverseOrbit", luaReverseOrbit);
+    lua_register(luaSt, "reverseOrbits", luaReverseOrbits);
     lua_register(luaSt, "PrintReverseOrbit", luaPrintReverseOrbit);
     lua_register(luaSt, "calculateEps2", luaCalculateEps2);
     lua_register(luaSt, "calculateTimestep", luaCalculateTimestep);
@@ -31,6 +31,7 @@
 #include "nbody_lua_misc.h"
 #include "nbody_util.h"
 #include "nbody_lua_util.h"
+#include "nbody_check_params.h"
 
 
 static const MWEnumAssociation criterionOptions[] =
@@ -39,6 +40,16 @@ static const MWEnumAssociation criterionOptions[] =
     { "Exact",        Exact        },
     { "BH86",         BH86         },
     { "SW93",         SW93         },
+    { "FMM",          FMM          },
+    END_MW_ENUM_ASSOCIATION
+};
+
+static const MWEnumAssociation integratorOptions[] =
+{
+    { "Leapfrog",     Leapfrog     },
+    { "ForestRuth",   ForestRuth   },
+    { "Yoshida",      ForestRuth   },
+    { "PEFRL",        PEFRL        },
     END_MW_ENUM_ASSOCIATION
 };
 
@@ -53,6 +64,17 @@ static int setCriterionT(lua_State* luaSt, void* v)
     return 0;
 }
 
+static int getIntegratorT(lua_State* luaSt, void* v)
+{
+    return pushEnum(luaSt, integratorOptions, *(integrator_t*) v);
+}
+
+static int setIntegratorT(lua_State* luaSt, void* v)
+{
+    *(integrator_t*) v = checkEnum(luaSt, integratorOptions, 3);
+    return 0;
+}
+
 NBodyCtx* checkNBodyCtx(lua_State* luaSt, int idx)
 {
     return (NBodyCtx*) mw_checknamedudata(luaSt, idx, NBODYCTX_TYPE);
@@ -78,10 +100,16 @@ criterion_t readCriterion(lua_State* luaSt, const char* name)
     return (criterion_t) readEnum(luaSt, criterionOptions, name);
 }
 
+integrator_t readIntegrator(lua_State* luaSt, const char* name)
+{
+    return (integrator_t) readEnum(luaSt, integratorOptions, name);
+}
+
 static int createNBodyCtx(lua_State* luaSt)
 {
     static NBodyCtx ctx;
     static const char* criterionName = NULL;
+    static const char* integratorName = NULL;
     real nStepf = 0.0;
 
     static const MWNamedArg argTable[] =
@@ -93,6 +121,7 @@ static int createNBodyCtx(lua_State* luaSt)
             { "treeRSize",     LUA_TNUMBER,  NULL, FALSE, &ctx.treeRSize     },
             { "sunGCDist",     LUA_TNUMBER,  NULL, FALSE, &ctx.sunGCDist     },
             { "criterion",     LUA_TSTRING,  NULL, FALSE, &criterionName     },
+            { "integrator",    LUA_TSTRING,  NULL, FALSE, &integratorName    },
             { "useQuad",       LUA_TBOOLEAN, NULL, FALSE, &ctx.useQuad       },
             { "allowIncest",   LUA_TBOOLEAN, NULL, FALSE, &ctx.allowIncest   },
             { "quietErrors",   LUA_TBOOLEAN, NULL, FALSE, &ctx.quietErrors   },
@@ -108,10 +137,22 @@ static int createNBodyCtx(lua_State* luaSt)
             { "VelSigma",      LUA_TNUMBER,  NULL, TRUE,  &ctx.VelSigma      },
             { "BetaCorrect",   LUA_TNUMBER,  NULL, TRUE,  &ctx.BetaCorrect   },
             { "VelCorrect",    LUA_TNUMBER,  NULL, TRUE,  &ctx.VelCorrect    },
+            { "useMortonTree", LUA_TBOOLEAN, NULL, FALSE, &ctx.useMortonTree },
+            { "useGroupWalk",  LUA_TBOOLEAN, NULL, FALSE, &ctx.useGroupWalk  },
+            { "useTiledExact", LUA_TBOOLEAN, NULL, FALSE, &ctx.useTiledExact },
+            { "useBlockSteps", LUA_TBOOLEAN, NULL, FALSE, &ctx.useBlockSteps },
+            { "useCausticGrid", LUA_TBOOLEAN, NULL, FALSE, &ctx.useCausticGrid },
+            { "treeRebuildInterval", LUA_TNUMBER, NULL, FALSE, &ctx.treeRebuildInterval },
+            { "fmmOrder",      LUA_TNUMBER,  NULL, FALSE, &ctx.fmmOrder      },
+            { "blockStepLevels", LUA_TNUMBER, NULL, FALSE, &ctx.blockStepLevels },
+            { "blockStepAccuracy", LUA_TNUMBER, NULL, FALSE, &ctx.blockStepAccuracy },
+            { "potentialGridTolerance", LUA_TNUMBER, NULL, FALSE, &ctx.potentialGridTolerance },
+            { "testParticleThreads", LUA_TNUMBER, NULL, FALSE, &ctx.testParticleThreads },
             END_MW_NAMED_ARG
         };
 
     criterionName = NULL;
+    integratorName = NULL;
     ctx = defaultNBodyCtx;
 
     if (lua_gettop(luaSt) != 1)
@@ -126,6 +167,11 @@ static int createNBodyCtx(lua_State* luaSt)
         ctx.criterion = readCriterion(luaSt, criterionName);
     }
 
+    if (integratorName)
+    {
+        ctx.integrator = readIntegrator(luaSt, integratorName);
+    }
+
     if ((ctx.criterion != Exact) && (ctx.theta < 0.0))
     {
         return luaL_argerror(luaSt, 1, "Theta argument required for criterion != 'Exact'");
@@ -136,6 +182,12 @@ static int createNBodyCtx(lua_State* luaSt)
         ctx.theta = 0.0;
         ctx.useQuad = FALSE;
     }
+    else if (ctx.criterion == FMM)
+    {
+        /* The multipole expansions take the place of these */
+        ctx.useQuad = FALSE;
+        ctx.useGroupWalk = FALSE;
+    }
 
     nStepf = mw_ceil(ctx.timeEvolve / ctx.timestep);
     if (nStepf >= (real) UINT_MAX)
@@ -202,6 +254,8 @@ static int addPotential(lua_State* luaSt)
 
     ctx = checkNBodyCtx(luaSt, 1);
     ctx->pot = *checkPotential(luaSt, 2);
+    if (checkPotentialConstants(&ctx->pot))
+        return luaL_argerror(luaSt, 2, "Bad potential");
 
     return 0;
 }
@@ -229,6 +283,7 @@ static const Xet_reg_pre gettersNBodyCtx[] =
     { "treeRSize",       getNumber,     offsetof(NBodyCtx, treeRSize)   },
     { "sunGCDist",       getNumber,     offsetof(NBodyCtx, sunGCDist)   },
     { "criterion",       getCriterionT, offsetof(NBodyCtx, criterion)   },
+    { "integrator",      getIntegratorT, offsetof(NBodyCtx, integrator) },
     { "useQuad",         getBool,       offsetof(NBodyCtx, useQuad)     },
     { "allowIncest",     getBool,       offsetof(NBodyCtx, allowIncest) },
     { "quietErrors",     getBool,       offsetof(NBodyCtx, quietErrors) },
@@ -244,6 +299,17 @@ static const Xet_reg_pre gettersNBodyCtx[] =
     { "VelSigma",        getNumber,     offsetof(NBodyCtx, VelSigma)    },
     { "BetaCorrect",     getNumber,     offsetof(NBodyCtx, BetaCorrect) },
     { "VelCorrect",      getNumber,     offsetof(NBodyCtx, VelCorrect)  },
+    { "useMortonTree",   getBool,       offsetof(NBodyCtx, useMortonTree) },
+    { "useGroupWalk",    getBool,       offsetof(NBodyCtx, useGroupWalk) },
+    { "useTiledExact",   getBool,       offsetof(NBodyCtx, useTiledExact) },
+    { "useBlockSteps",   getBool,       offsetof(NBodyCtx, useBlockSteps) },
+    { "useCausticGrid",  getBool,       offsetof(NBodyCtx, useCausticGrid) },
+    { "treeRebuildInterval", getNumber, offsetof(NBodyCtx, treeRebuildInterval) },
+    { "fmmOrder",        getNumber,     offsetof(NBodyCtx, fmmOrder)    },
+    { "blockStepLevels", getNumber,     offsetof(NBodyCtx, blockStepLevels) },
+    { "blockStepAccuracy", getNumber,   offsetof(NBodyCtx, blockStepAccuracy) },
+    { "potentialGridTolerance", getNumber, offsetof(NBodyCtx, potentialGridTolerance) },
+    { "testParticleThreads", getNumber, offsetof(NBodyCtx, testParticleThreads) },
     { NULL, NULL, 0 }
 };
 
@@ -256,6 +322,7 @@ static const Xet_reg_pre settersNBodyCtx[] =
     { "treeRSize",       setNumber,     offsetof(NBodyCtx, treeRSize)   },
     { "sunGCDist",       setNumber,     offsetof(NBodyCtx, sunGCDist)   },
     { "criterion",       setCriterionT, offsetof(NBodyCtx, criterion)   },
+    { "integrator",      setIntegratorT, offsetof(NBodyCtx, integrator) },
     { "useQuad",         setBool,       offsetof(NBodyCtx, useQuad)     },
     { "allowIncest",     setBool,       offsetof(NBodyCtx, allowIncest) },
     { "quietErrors",     setBool,       offsetof(NBodyCtx, quietErrors) },
@@ -271,6 +338,17 @@ static const Xet_reg_pre settersNBodyCtx[] =
     { "VelSigma",        setNumber,     offsetof(NBodyCtx, VelSigma)    },
     { "BetaCorrect",     setNumber,     offsetof(NBodyCtx, BetaCorrect) },
     { "VelCorrect",      setNumber,     offsetof(NBodyCtx, VelCorrect)  },
+    { "useMortonTree",   setBool,       offsetof(NBodyCtx, useMortonTree) },
+    { "useGroupWalk",    setBool,       offsetof(NBodyCtx, useGroupWalk) },
+    { "useTiledExact",   setBool,       offsetof(NBodyCtx, useTiledExact) },
+    { "useBlockSteps",   setBool,       offsetof(NBodyCtx, useBlockSteps) },
+    { "useCausticGrid",  setBool,       offsetof(NBodyCtx, useCausticGrid) },
+    { "treeRebuildInterval", setNumber, offsetof(NBodyCtx, treeRebuildInterval) },
+    { "fmmOrder",        setNumber,     offsetof(NBodyCtx, fmmOrder)    },
+    { "blockStepLevels", setNumber,     offsetof(NBodyCtx, blockStepLevels) },
+    { "blockStepAccuracy", setNumber,   offsetof(NBodyCtx, blockStepAccuracy) },
+    { "potentialGridTolerance", setNumber, offsetof(NBodyCtx, potentialGridTolerance) },
+    { "testParticleThreads", setNumber, offsetof(NBodyCtx, testParticleThreads) },
     { NULL, NULL, 0 }
 };
 
@@ -32,6 +32,7 @@
 #include "nbody_checkpoint.h"
 #include "nbody_lua_misc.h"
 #include "nbody_grav.h"
+#include "nbody_soa.h"
 #include "nbody.h"
 
 
@@ -122,6 +123,7 @@ static int createNBodyState(lua_State* luaSt)
         return luaL_argerror(luaSt, 2, "Expected model tables");
 
     setInitialNBodyState(&st, &ctx, bodies, nbody);
+    nbLoadBodyStore(&st);
 
     /* Run the first pseudostep to fill accelerations */
     if (nbStatusIsFatal(nbGravMap(&ctx, &st)))
@@ -159,6 +161,14 @@ static int luaWriteCheckpoint(lua_State* luaSt)
     st = checkNBodyState(luaSt, 1);
     ctx = checkNBodyCtx(luaSt, 2);
 
+    /* Returns false without writing when a resume from here would not
+     * repeat the same run */
+    if (!nbCanCheckpoint(ctx, st))
+    {
+        lua_pushboolean(luaSt, FALSE);
+        return 1;
+    }
+
     assert(st->checkpointResolved == NULL);
 
     pid = (int) getpid();
@@ -170,7 +180,11 @@ static int luaWriteCheckpoint(lua_State* luaSt)
     free(st->checkpointResolved);
     st->checkpointResolved = NULL;
 
-    return failed ? luaL_error(luaSt, "Error writing checkpoint") : 0;
+    if (failed)
+        return luaL_error(luaSt, "Error writing checkpoint");
+
+    lua_pushboolean(luaSt, TRUE);
+    return 1;
 }
 
 static int luaCloneNBodyState(lua_State* luaSt)
@@ -202,6 +216,7 @@ static int luaReadCheckpoint(lua_State* luaSt)
     st.checkpointResolved = NULL;
 
     /* Run the prestep so the accelerations are ready for the resumed state */
+    nbLoadBodyStore(&st);
     if (nbStatusIsFatal(nbGravMap(&ctx, &st)))
     {
         return luaL_error(luaSt, "Error running prestep from checkpoint");
@@ -178,228 +178,192 @@ real calc_vLOS(const mwvector v, const mwvector p, real sunGCdist)
     return vl;
 }
 
-/* Get the velocity dispersion in each bin*/
-void nbCalcVelDisp(NBodyHistogram* histogram, mwbool initial, real correction_factor)
+/* Get the velocity dispersion of one bin */
+void nbCalcBinVelDisp(HistData* bin, mwbool initial, real correction_factor)
 {
-    unsigned int i;
-    unsigned int j;
-    unsigned int Histindex;
-    
-    unsigned int lambdaBins = histogram->lambdaBins;
-    unsigned int betaBins = histogram->betaBins;
-    
-    HistData* histData = histogram->data;
-
     real count;
     real n_ratio;
     real n_new;
     real v_sum, vsq_sum, vdispsq;
+
+    count = (real) bin->rawCount;
+    count -= bin->outliersVelRemoved;
     
-    
-    for (i = 0; i < lambdaBins; ++i)
+    if(count > 10.0)//need enough counts so that bins with minimal bodies do not throw the vel disp off
     {
-        for(j = 0; j < betaBins; ++j)
+        n_new = count - 1.0; //because the mean is calculated from the same populations set
+        n_ratio = count / (n_new); 
+        
+        vsq_sum = bin->vsq_sum;
+        v_sum = bin->v_sum;
+        
+        vdispsq = (vsq_sum / n_new) - n_ratio * sqr(v_sum / count);
+        
+        /* The following requires explanation. For the first calculation of dispersions, the bool initial 
+         * needs to be set to true. After that false.
+         * It will correct if there was no outliers removed because then the distribution does not have wings
+         * It will also correct if outliers were removed because then the wings were removed. 
+         * Does one correction everytime there was an outlier removed. Corrects once if no outliers were removed. 
+         */
+        
+        if(!initial)
         {
-            Histindex = i * betaBins + j;
-            count = (real) histData[Histindex].rawCount;
-            count -= histData[Histindex].outliersVelRemoved;
-            
-            if(count > 10.0)//need enough counts so that bins with minimal bodies do not throw the vel disp off
-            {
-                n_new = count - 1.0; //because the mean is calculated from the same populations set
-                n_ratio = count / (n_new); 
-                
-                vsq_sum = histData[Histindex].vsq_sum;
-                v_sum = histData[Histindex].v_sum;
-                
-                vdispsq = (vsq_sum / n_new) - n_ratio * sqr(v_sum / count);
-                
-                /* The following requires explanation. For the first calculation of dispersions, the bool initial 
-                 * needs to be set to true. After that false.
-                 * It will correct if there was no outliers removed because then the distribution does not have wings
-                 * It will also correct if outliers were removed because then the wings were removed. 
-                 * Does one correction everytime there was an outlier removed. Corrects once if no outliers were removed. 
-                 */
-                
-                if(!initial)
-                {
-                    vdispsq *= correction_factor;
-                }//correcting for truncating the distribution when removing outliers.
+            vdispsq *= correction_factor;
+        }//correcting for truncating the distribution when removing outliers.
 
-                histData[Histindex].vdisp = mw_sqrt(vdispsq);
-                histData[Histindex].vdisperr =  mw_sqrt( (count + 1) /(count * n_new ) ) * histData[Histindex].vdisp ;
-                
-            }
-        }
+        bin->vdisp = mw_sqrt(vdispsq);
+        bin->vdisperr =  mw_sqrt( (count + 1) /(count * n_new ) ) * bin->vdisp ;
     }
-    
 }
 
-
-/* Get the beta dispersion in each bin*/
-void nbCalcBetaDisp(NBodyHistogram* histogram, mwbool initial, real correction_factor)
+/* Get the beta dispersion of one bin */
+void nbCalcBinBetaDisp(HistData* bin, mwbool initial, real correction_factor)
 {
-    unsigned int i;
-    unsigned int j;
-    unsigned int Histindex;
-    
-    unsigned int lambdaBins = histogram->lambdaBins;
-    unsigned int betaBins = histogram->betaBins;
-    
-    HistData* histData = histogram->data;
-
     real count;
     real n_ratio;
     real n_new;
-
     real beta_sum, betasq_sum, beta_dispsq;
+
+    count = (real) bin->rawCount;
+    count -= bin->outliersBetaRemoved;
     
-    for (i = 0; i < lambdaBins; ++i)
+    if(count > 10.0)//need enough counts so that bins with minimal bodies do not throw the vel disp off
     {
-        for(j = 0; j < betaBins; ++j)
+        n_new = count - 1.0; //because the mean is calculated from the same populations set
+        n_ratio = count / (n_new); 
+        
+        betasq_sum = bin->betasq_sum;
+        beta_sum = bin->beta_sum;
+        
+        beta_dispsq = (betasq_sum / n_new) - n_ratio * sqr(beta_sum / count);
+        
+        /* Corrected the same way as the velocity dispersion */
+        if(!initial)
         {
-            Histindex = i * betaBins + j;
-            count = (real) histData[Histindex].rawCount;
-            count -= histData[Histindex].outliersBetaRemoved;
-            
-            
-            if(count > 10.0)//need enough counts so that bins with minimal bodies do not throw the vel disp off
-            {
-                n_new = count - 1.0; //because the mean is calculated from the same populations set
-                n_ratio = count / (n_new); 
-                
-                betasq_sum = histData[Histindex].betasq_sum;
-                beta_sum = histData[Histindex].beta_sum;
-                
-                beta_dispsq = (betasq_sum / n_new) - n_ratio * sqr(beta_sum / count);
-                
-                /* The following requires explanation. For the first calculation of dispersions, the bool initial 
-                 * needs to be set to true. After that false.
-                 * It will correct if there was no outliers removed because then the distribution does not have wings
-                 * It will also correct if outliers were removed because then the wings were removed. 
-                 * Does one correction everytime there was an outlier removed. Corrects once if no outliers were removed. 
-                 */
-                
-                
-                if(!initial)
-                {
-                    beta_dispsq *= correction_factor; 
-                }//correcting for truncating the distribution when removing outliers.
-                
-                histData[Histindex].beta_disp = mw_sqrt(beta_dispsq);
-                histData[Histindex].beta_disperr =  mw_sqrt( (count + 1) /(count * n_new ) ) * histData[Histindex].beta_disp ;
-                
-                
-            }
-        }
+            beta_dispsq *= correction_factor; 
+        }//correcting for truncating the distribution when removing outliers.
+        
+        bin->beta_disp = mw_sqrt(beta_dispsq);
+        bin->beta_disperr =  mw_sqrt( (count + 1) /(count * n_new ) ) * bin->beta_disp ;
     }
-    
 }
 
+/* Get the velocity dispersion in each bin*/
+void nbCalcVelDisp(NBodyHistogram* histogram, mwbool initial, real correction_factor)
+{
+    unsigned int i;
+    unsigned int nBin = histogram->lambdaBins * histogram->betaBins;
 
-void nbRemoveVelOutliers(const NBodyState* st, NBodyHistogram* histogram, real * use_velbody, real * vlos, real sigma_cutoff)
+    for (i = 0; i < nBin; ++i)
+    {
+        nbCalcBinVelDisp(&histogram->data[i], initial, correction_factor);
+    }
+}
+
+
+/* Get the beta dispersion in each bin*/
+void nbCalcBetaDisp(NBodyHistogram* histogram, mwbool initial, real correction_factor)
 {
-    
-    unsigned int Histindex;
-    Body* p;
-    HistData* histData;
-    const Body* endp = st->bodytab + st->nbody;
+    unsigned int i;
+    unsigned int nBin = histogram->lambdaBins * histogram->betaBins;
 
-    unsigned int counter = 0;
-    
-    histData = histogram->data;
+    for (i = 0; i < nBin; ++i)
+    {
+        nbCalcBinBetaDisp(&histogram->data[i], initial, correction_factor);
+    }
+}
 
+
+/* Reject the line of sight velocities of the n bodies in a bin, in body
+ * order, that are too far from the bin's average, and find the velocity
+ * dispersion of the rest. The bin's sums and initial dispersion must
+ * already be there. Each round leaves only the kept velocities at the
+ * front of vlos, so later rounds don't look at the ones already gone.
+ *
+ * A round that takes nothing out after the first leaves the dispersion
+ * where it was, so every round after it would do the same. */
+void nbRemoveBinVelOutliers(HistData* bin, real* vlos, unsigned int n, real sigma_cutoff, real correction_factor)
+{
+    unsigned int i, nKept, iter;
     real v_line_of_sight;
     real bin_ave, bin_sigma, new_count;
-    
-    for (p = st->bodytab; p < endp; ++p)
+
+    for (iter = 0; iter < NBODY_OUTLIER_ITERATIONS; ++iter)
     {
-        /* Only include bodies in models we aren't ignoring */
-        if (!ignoreBody(p))
+        nKept = 0;
+        for (i = 0; i < n; ++i)
         {
-            
-            /* Check if the position is within the bounds of the histogram */
-            if (use_velbody[counter] >= 0)//if its not -1 then it was in the hist and set to the Histindex   
-            {   
-                Histindex = (int) use_velbody[counter];
-                
-                v_line_of_sight = vlos[counter];
-                /* bin count minus what was already removed */
-                new_count = ((real) histData[Histindex].rawCount - histData[Histindex].outliersVelRemoved);
-                
-                /* average bin vel */
-                bin_ave = histData[Histindex].v_sum / new_count;
-                
-                /* the sigma for the bin is the same as the dispersion */
-                bin_sigma = histData[Histindex].vdisp;
-                
-                if(mw_fabs(bin_ave - v_line_of_sight) > sigma_cutoff * bin_sigma)//if it is outside of the sigma limit
-                {
-                    histData[Histindex].v_sum -= v_line_of_sight;//remove from vel dis sums
-                    histData[Histindex].vsq_sum -= sqr(v_line_of_sight);
-                    histData[Histindex].outliersVelRemoved++;//keep track of how many are being removed
-                    use_velbody[counter] = DEFAULT_NOT_USE;//marking the body as having been rejected as outlier
-                }
-                 
+            v_line_of_sight = vlos[i];
+            /* bin count minus what was already removed */
+            new_count = ((real) bin->rawCount - bin->outliersVelRemoved);
+
+            /* average bin vel */
+            bin_ave = bin->v_sum / new_count;
+
+            /* the sigma for the bin is the same as the dispersion */
+            bin_sigma = bin->vdisp;
+
+            if(mw_fabs(bin_ave - v_line_of_sight) > sigma_cutoff * bin_sigma)//if it is outside of the sigma limit
+            {
+                bin->v_sum -= v_line_of_sight;//remove from vel dis sums
+                bin->vsq_sum -= sqr(v_line_of_sight);
+                bin->outliersVelRemoved++;//keep track of how many are being removed
+            }
+            else
+            {
+                vlos[nKept++] = v_line_of_sight;
             }
-            counter++;
         }
+
+        nbCalcBinVelDisp(bin, FALSE, correction_factor);
+
+        if (nKept == n && iter > 0)
+            break;
+        n = nKept;
     }
-    
-    
 }
 
 
-
-void nbRemoveBetaOutliers(const NBodyState* st, NBodyHistogram* histogram, real * use_betabody, real * betas, real sigma_cutoff)
+/* The same for the betas of the bodies in a bin */
+void nbRemoveBinBetaOutliers(HistData* bin, real* betas, unsigned int n, real sigma_cutoff, real correction_factor)
 {
-    
-    unsigned int Histindex;
-    Body* p;
-    HistData* histData;
-    const Body* endp = st->bodytab + st->nbody;
-
-    unsigned int counter = 0;
-    
-    histData = histogram->data;
-
+    unsigned int i, nKept, iter;
     real beta;
     real bin_ave, bin_sigma, new_count;
 
-    for (p = st->bodytab; p < endp; ++p)
+    for (iter = 0; iter < NBODY_OUTLIER_ITERATIONS; ++iter)
     {
-        /* Only include bodies in models we aren't ignoring */
-        if (!ignoreBody(p))
+        nKept = 0;
+        for (i = 0; i < n; ++i)
         {
-            /* Check if the position is within the bounds of the histogram */
-            if (use_betabody[counter] >= 0)//if its not -1 then it was in the hist and set to the Histindex   
-            {   
-                Histindex = (int) use_betabody[counter];
-                
-                beta = betas[counter];
-                /* bin count minus what was already removed */
-                new_count = ((real) histData[Histindex].rawCount - histData[Histindex].outliersBetaRemoved);
-                
-                /* average bin vel */
-                bin_ave = histData[Histindex].beta_sum / new_count;
-                
-                /* the sigma for the bin is the same as the dispersion */
-                bin_sigma = histData[Histindex].beta_disp;
-                
-                if(mw_fabs(bin_ave - beta) > sigma_cutoff * bin_sigma)//if it is outside of the sigma limit
-                {
-                    histData[Histindex].beta_sum -= beta;//remove from vel dis sums
-                    histData[Histindex].betasq_sum -= sqr(beta);
-                    histData[Histindex].outliersBetaRemoved++;//keep track of how many are being removed
-                    use_betabody[counter] = DEFAULT_NOT_USE;//marking the body as having been rejected as outlier
-                }
-                 
+            beta = betas[i];
+            /* bin count minus what was already removed */
+            new_count = ((real) bin->rawCount - bin->outliersBetaRemoved);
+
+            /* average bin beta */
+            bin_ave = bin->beta_sum / new_count;
+
+            /* the sigma for the bin is the same as the dispersion */
+            bin_sigma = bin->beta_disp;
+
+            if(mw_fabs(bin_ave - beta) > sigma_cutoff * bin_sigma)//if it is outside of the sigma limit
+            {
+                bin->beta_sum -= beta;//remove from vel dis sums
+                bin->betasq_sum -= sqr(beta);
+                bin->outliersBetaRemoved++;//keep track of how many are being removed
+            }
+            else
+            {
+                betas[nKept++] = beta;
             }
-            counter++;
         }
+
+        nbCalcBinBetaDisp(bin, FALSE, correction_factor);
+
+        if (nKept == n && iter > 0)
+            break;
+        n = nKept;
     }
-    
-    
 }
 
 real nbCostComponent(const NBodyHistogram* data, const NBodyHistogram* histogram)
@@ -0,0 +1,349 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Cache of reverse orbit results for the --orbit-cache option.
+ *
+ * Consecutive work units often only differ in the dwarf, so they run
+ * the same reverse orbit. Each entry keeps every argument of the orbit
+ * along with its hash, and a lookup only hits if all of them are the
+ * same, so a hit gives exactly what integrating again would. Entries
+ * are stamped with a counter that goes up with every use, and the one
+ * with the oldest stamp makes room for a new one when the cache is
+ * full. The file is rewritten through a temporary file at the end of
+ * the setup, so runs sharing a cache never see half of one, but the
+ * last of them to finish decides what is kept.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_orbit_cache.h"
+#include "nbody_util.h"
+#include "milkyway_util.h"
+
+#define ORBIT_CACHE_VERSION 1
+#define ORBIT_CACHE_MAGIC "mworbc"
+
+/* Parameters of the potential, initial conditions, tstop and dt */
+#define ORBIT_KEY_N_VALUE 22
+
+typedef struct
+{
+    real values[ORBIT_KEY_N_VALUE];
+    int32_t types[4];          /* spherical, disk, halo and integrator */
+} OrbitCacheKey;
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t lastUsed;
+    OrbitCacheKey key;
+    real result[7];            /* final position, velocity and energy drift */
+} OrbitCacheEntry;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint32_t nEntry;
+    uint32_t realSize;
+    uint64_t clock;
+} OrbitCacheHeader;
+
+static char* cacheFile = NULL;
+static OrbitCacheEntry* cache = NULL;
+static unsigned int cacheSize = 0;
+static unsigned int cacheMaxSize = 0;
+static uint64_t cacheClock = 0;
+static unsigned int cacheHits = 0;
+static unsigned int cacheMisses = 0;
+static int cacheChanged = FALSE;
+
+
+static void nbOrbitCacheKey(OrbitCacheKey* key,
+                            uint64_t* hash,
+                            const Potential* pot,
+                            integrator_t integrator,
+                            mwvector pos,
+                            mwvector vel,
+                            real tstop,
+                            real dt)
+{
+    const real values[ORBIT_KEY_N_VALUE] =
+        {
+            pot->sphere[0].mass, pot->sphere[0].scale,
+            pot->disk.mass, pot->disk.scaleLength, pot->disk.scaleHeight,
+            pot->halo.vhalo, pot->halo.scaleLength, pot->halo.flattenZ, pot->halo.flattenY,
+            pot->halo.flattenX, pot->halo.triaxAngle, pot->halo.c1, pot->halo.c2, pot->halo.c3,
+            X(pos), Y(pos), Z(pos),
+            X(vel), Y(vel), Z(vel),
+            tstop, dt
+        };
+
+    memset(key, 0, sizeof(*key));
+    memcpy(key->values, values, sizeof(values));
+    key->types[0] = (int32_t) pot->sphere[0].type;
+    key->types[1] = (int32_t) pot->disk.type;
+    key->types[2] = (int32_t) pot->halo.type;
+    key->types[3] = (int32_t) integrator;
+
+    *hash = 14695981039346656037ull;
+    nbHashBytes(hash, key, sizeof(*key));
+}
+
+/* Most recently used first */
+static int nbCompareLastUsed(const void* a, const void* b)
+{
+    const uint64_t ua = ((const OrbitCacheEntry*) a)->lastUsed;
+    const uint64_t ub = ((const OrbitCacheEntry*) b)->lastUsed;
+
+    return (ua < ub) - (ua > ub);
+}
+
+static void nbReadOrbitCache(const char* filename)
+{
+    FILE* f;
+    OrbitCacheHeader hdr;
+    OrbitCacheEntry* entries;
+    unsigned int n;
+
+    f = mw_fopen(filename, "rb");
+    if (!f)
+        return;   /* First use */
+
+    if (   fread(&hdr, sizeof(hdr), 1, f) != 1
+        || strncmp(hdr.magic, ORBIT_CACHE_MAGIC, sizeof(hdr.magic))
+        || hdr.version != ORBIT_CACHE_VERSION
+        || hdr.entrySize != sizeof(OrbitCacheEntry)
+        || hdr.realSize != sizeof(real))
+    {
+        mw_printf("Ignoring orbit cache '%s' from a different version\n", filename);
+        fclose(f);
+        return;
+    }
+
+    entries = (OrbitCacheEntry*) mwMalloc(MAX(hdr.nEntry, 1) * sizeof(OrbitCacheEntry));
+    n = (unsigned int) fread(entries, sizeof(OrbitCacheEntry), hdr.nEntry, f);
+    fclose(f);
+
+    if (n != hdr.nEntry)
+    {
+        mw_printf("Error reading orbit cache '%s'\n", filename);
+        free(entries);
+        return;
+    }
+
+    /* Keep the newest if the cap is smaller than it was */
+    if (n > cacheMaxSize)
+    {
+        qsort(entries, n, sizeof(OrbitCacheEntry), nbCompareLastUsed);
+        n = cacheMaxSize;
+        cacheChanged = TRUE;
+    }
+
+    memcpy(cache, entries, n * sizeof(OrbitCacheEntry));
+    cacheSize = n;
+    cacheClock = hdr.clock;
+
+    free(entries);
+}
+
+/* Write to a temporary file first, like checkpoints */
+static int nbWriteOrbitCache(const char* filename)
+{
+    FILE* f;
+    char tmpFile[4096];
+    OrbitCacheHeader hdr;
+    int failed;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, ORBIT_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = ORBIT_CACHE_VERSION;
+    hdr.entrySize = sizeof(OrbitCacheEntry);
+    hdr.nEntry = cacheSize;
+    hdr.realSize = sizeof(real);
+    hdr.clock = cacheClock;
+
+    /* Next to the cache so the rename doesn't cross file systems */
+    snprintf(tmpFile, sizeof(tmpFile), "%s_tmp_%d", filename, (int) getpid());
+
+    f = mw_fopen(tmpFile, "wb");
+    if (!f)
+    {
+        mwPerror("Failed to open orbit cache '%s'", tmpFile);
+        return TRUE;
+    }
+
+    failed = fwrite(&hdr, sizeof(hdr), 1, f) != 1
+          || fwrite(cache, sizeof(OrbitCacheEntry), cacheSize, f) != cacheSize;
+
+    if (fclose(f) || failed)
+    {
+        mw_printf("Failed to write orbit cache '%s'\n", tmpFile);
+        mw_remove(tmpFile);
+        return TRUE;
+    }
+
+    if (mw_rename(tmpFile, filename))
+    {
+        mwPerror("Failed to update orbit cache '%s'", filename);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+void nbOpenOrbitCache(const char* filename, unsigned int maxEntries)
+{
+    nbCloseOrbitCache();
+
+    cacheFile = strdup(filename);
+    cacheMaxSize = MAX(maxEntries, 1);
+    cache = (OrbitCacheEntry*) mwMalloc(cacheMaxSize * sizeof(OrbitCacheEntry));
+    cacheSize = 0;
+    cacheClock = 0;
+    cacheHits = cacheMisses = 0;
+    cacheChanged = FALSE;
+
+    nbReadOrbitCache(filename);
+}
+
+void nbCloseOrbitCache(void)
+{
+    if (!cache)
+        return;
+
+    mw_printf("Orbit cache: %u hits, %u misses, %u of %u entries\n",
+              cacheHits, cacheMisses, cacheSize, cacheMaxSize);
+
+    if (cacheChanged)
+    {
+        nbWriteOrbitCache(cacheFile);
+    }
+
+    free(cache);
+    free(cacheFile);
+    cache = NULL;
+    cacheFile = NULL;
+}
+
+static OrbitCacheEntry* nbFindOrbit(const OrbitCacheKey* key, uint64_t hash)
+{
+    unsigned int i;
+
+    for (i = 0; i < cacheSize; ++i)
+    {
+        if (cache[i].hash == hash && !memcmp(&cache[i].key, key, sizeof(*key)))
+            return &cache[i];
+    }
+
+    return NULL;
+}
+
+int nbOrbitCacheLookup(const Potential* pot,
+                       integrator_t integrator,
+                       mwvector pos,
+                       mwvector vel,
+                       real tstop,
+                       real dt,
+                       mwvector* finalPos,
+                       mwvector* finalVel,
+                       real* energyDrift)
+{
+    OrbitCacheKey key;
+    uint64_t hash;
+    OrbitCacheEntry* e;
+
+    if (!cache)
+        return FALSE;
+
+    nbOrbitCacheKey(&key, &hash, pot, integrator, pos, vel, tstop, dt);
+    e = nbFindOrbit(&key, hash);
+    if (!e)
+    {
+        ++cacheMisses;
+        return FALSE;
+    }
+
+    ++cacheHits;
+    e->lastUsed = ++cacheClock;
+    cacheChanged = TRUE;
+
+    X(*finalPos) = e->result[0];
+    Y(*finalPos) = e->result[1];
+    Z(*finalPos) = e->result[2];
+    X(*finalVel) = e->result[3];
+    Y(*finalVel) = e->result[4];
+    Z(*finalVel) = e->result[5];
+    if (energyDrift)
+        *energyDrift = e->result[6];
+
+    return TRUE;
+}
+
+void nbOrbitCacheInsert(const Potential* pot,
+                        integrator_t integrator,
+                        mwvector pos,
+                        mwvector vel,
+                        real tstop,
+                        real dt,
+                        mwvector finalPos,
+                        mwvector finalVel,
+                        real energyDrift)
+{
+    unsigned int i;
+    OrbitCacheKey key;
+    uint64_t hash;
+    OrbitCacheEntry* e;
+
+    if (!cache)
+        return;
+
+    nbOrbitCacheKey(&key, &hash, pot, integrator, pos, vel, tstop, dt);
+    e = nbFindOrbit(&key, hash);
+
+    if (!e && cacheSize < cacheMaxSize)
+    {
+        e = &cache[cacheSize++];
+    }
+    else if (!e)
+    {
+        /* Evict the least recently used */
+        e = &cache[0];
+        for (i = 1; i < cacheSize; ++i)
+        {
+            if (cache[i].lastUsed < e->lastUsed)
+                e = &cache[i];
+        }
+    }
+
+    e->hash = hash;
+    e->lastUsed = ++cacheClock;
+    e->key = key;
+    e->result[0] = X(finalPos);
+    e->result[1] = Y(finalPos);
+    e->result[2] = Z(finalPos);
+    e->result[3] = X(finalVel);
+    e->result[4] = Y(finalVel);
+    e->result[5] = Z(finalVel);
+    e->result[6] = energyDrift;
+
+    cacheChanged = TRUE;
+}
+
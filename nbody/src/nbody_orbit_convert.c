@@ -0,0 +1,149 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Convert a binary orbit from PrintReverseOrbit to the text format,
+ * which is the same as if it had been written as text:
+ *
+ *   nbody_orbit_convert reverse_orbit.bin [reverse_orbit.out]
+ *
+ * Writes to stdout if no output file is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nbody_orbit_file.h"
+
+static double readReal(const unsigned char* p, uint32_t realSize)
+{
+    if (realSize == sizeof(float))
+    {
+        float f;
+        memcpy(&f, p, sizeof(f));
+        return (double) f;
+    }
+    else
+    {
+        double d;
+        memcpy(&d, p, sizeof(d));
+        return d;
+    }
+}
+
+static int convertOrbit(FILE* in, FILE* out)
+{
+    NBodyOrbitFileHeader hdr;
+    unsigned char* columns;
+    uint32_t block[2];
+    uint32_t i;
+    size_t blockSize;
+
+    if (   fread(&hdr, sizeof(hdr), 1, in) != 1
+        || strncmp(hdr.magic, NBODY_ORBIT_FILE_MAGIC, sizeof(hdr.magic))
+        || hdr.version != NBODY_ORBIT_FILE_VERSION
+        || hdr.nColumn != NBODY_ORBIT_FILE_COLUMNS
+        || (hdr.realSize != sizeof(float) && hdr.realSize != sizeof(double))
+        || hdr.blockRows == 0)
+    {
+        fprintf(stderr, "Not a binary orbit file\n");
+        return 1;
+    }
+
+    blockSize = (size_t) hdr.nColumn * hdr.blockRows * hdr.realSize;
+    columns = (unsigned char*) malloc(blockSize);
+    if (!columns)
+    {
+        fprintf(stderr, "Failed to allocate %lu bytes\n", (unsigned long) blockSize);
+        return 1;
+    }
+
+    while (fread(block, sizeof(block), 1, in) == 1)
+    {
+        const uint32_t n = block[0];
+        const size_t colSize = (size_t) n * hdr.realSize;
+
+        if (n > hdr.blockRows || fread(columns, colSize, hdr.nColumn, in) != hdr.nColumn)
+        {
+            fprintf(stderr, "Truncated orbit file\n");
+            free(columns);
+            return 1;
+        }
+
+        for (i = 0; i < n; ++i)
+        {
+            const unsigned char* p = &columns[i * hdr.realSize];
+
+            fprintf(out, NBODY_ORBIT_TEXT_FORMAT,
+                    readReal(p + 0 * colSize, hdr.realSize),
+                    readReal(p + 1 * colSize, hdr.realSize),
+                    readReal(p + 2 * colSize, hdr.realSize),
+                    readReal(p + 3 * colSize, hdr.realSize),
+                    readReal(p + 4 * colSize, hdr.realSize),
+                    readReal(p + 5 * colSize, hdr.realSize));
+        }
+    }
+
+    free(columns);
+    return ferror(in) != 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    int rc;
+    FILE* in;
+    FILE* out = stdout;
+
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: %s <binary orbit> [text output]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 3)
+    {
+        out = fopen(argv[2], "w");
+        if (!out)
+        {
+            perror(argv[2]);
+            fclose(in);
+            return EXIT_FAILURE;
+        }
+    }
+
+    rc = convertOrbit(in, out);
+
+    fclose(in);
+    if (fclose(out) && !rc)
+    {
+        perror("Failed to write text orbit");
+        rc = 1;
+    }
+
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
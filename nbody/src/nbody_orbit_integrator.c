@@ -22,23 +22,148 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "nbody_priv.h"
 #include "nbody_orbit_integrator.h"
+#include "nbody_orbit_cache.h"
+#include "nbody_orbit_file.h"
 #include "nbody_potential.h"
 #include "nbody_io.h"
 #include "nbody_coordinates.h"
 #include "nbody_defaults.h"
+
+/* Kick first leapfrog */
+static const NBodyIntegratorScheme leapfrogScheme =
+{
+    TRUE, 1,
+    { 1.0 },
+    { 0.5, 0.5 }
+};
+
+/* Forest & Ruth (1990), which is also Yoshida's (1990) 4th order triple
+ * of leapfrog steps, theta = 1 / (2 - 2^(1/3)). Written kick first so
+ * it takes 3 force evaluations a step. */
+static const NBodyIntegratorScheme forestRuthScheme =
+{
+    TRUE, 3,
+    {  1.3512071919596578, -1.7024143839193155,  1.3512071919596578 },
+    {  0.6756035959798289, -0.1756035959798289, -0.1756035959798289, 0.6756035959798289 }
+};
+
+/* Position extended Forest-Ruth like scheme of Omelyan, Mryglod & Folk
+ * (2002), with xi = 0.1786178958448091, lambda = -0.2123418310626054,
+ * chi = -0.06626458266981849. 4 force evaluations a step, but the error
+ * is about 100 times smaller than Forest-Ruth's. */
+static const NBodyIntegratorScheme pefrlScheme =
+{
+    FALSE, 5,
+    {  0.1786178958448091, -0.06626458266981849, 0.7752933736500187, -0.06626458266981849, 0.1786178958448091 },
+    {  0.7123418310626054, -0.2123418310626054, -0.2123418310626054, 0.7123418310626054 }
+};
+
+const NBodyIntegratorScheme* nbIntegratorScheme(integrator_t integrator)
+{
+    switch (integrator)
+    {
+        case Leapfrog:
+            return &leapfrogScheme;
+        case ForestRuth:
+            return &forestRuthScheme;
+        case PEFRL:
+            return &pefrlScheme;
+        case InvalidIntegrator:
+        default:
+            mw_fail("Invalid integrator %d\n", (int) integrator);
+    }
+
+    return NULL;
+}
+
+unsigned int nbIntegratorForces(const NBodyIntegratorScheme* s)
+{
+    return s->kickFirst ? s->nDrift : s->nDrift - 1;
+}
+
+/* Advance an orbit one step. acc is the acceleration at x and is kept
+ * up to date for the next step. */
+static void nbOrbitStep(const NBodyIntegratorScheme* s,
+                        const Potential* pot,
+                        mwvector* x,
+                        mwvector* v,
+                        mwvector* acc,
+                        real dt)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nDrift; ++i)
+    {
+        if (s->kickFirst)
+        {
+            mw_incaddv_s(*v, *acc, s->kick[i] * dt);
+            mw_incaddv_s(*x, *v, s->drift[i] * dt);
+            *acc = nbExtAcceleration(pot, *x);
+        }
+        else
+        {
+            mw_incaddv_s(*x, *v, s->drift[i] * dt);
+            if (i + 1 < s->nDrift)
+            {
+                *acc = nbExtAcceleration(pot, *x);
+                mw_incaddv_s(*v, *acc, s->kick[i] * dt);
+            }
+        }
+    }
+
+    if (s->kickFirst)
+    {
+        mw_incaddv_s(*v, *acc, s->kick[s->nDrift] * dt);
+    }
+}
+
+/* Advance an orbit one step with the integrator. Leapfrog is the
+ * original kick then drift update so existing orbits don't change. */
+static inline void nbOrbitStepWith(integrator_t integrator,
+                                   const Potential* pot,
+                                   mwvector* x,
+                                   mwvector* v,
+                                   mwvector* acc,
+                                   real dt)
+{
+    if (integrator == Leapfrog)
+    {
+        // Update the velocities and positions
+        mw_incaddv_s(*v, *acc, dt);
+        mw_incaddv_s(*x, *v, dt);
+
+        // Compute the new acceleration
+        *acc = nbExtAcceleration(pot, *x);
+    }
+    else
+    {
+        nbOrbitStep(nbIntegratorScheme(integrator), pot, x, v, acc, dt);
+    }
+}
+
+static inline real nbOrbitEnergy(const Potential* pot, mwvector x, mwvector v)
+{
+    return 0.5 * mw_sqrv(v) + nbExtPotential(pot, x);
+}
+
 /* Simple orbit integrator in user-defined potential
     Written for BOINC Nbody
     willeb 10 May 2010 */
 void nbReverseOrbit(mwvector* finalPos,
                     mwvector* finalVel,
+                    real* energyDrift,
                     const Potential* pot,
+                    integrator_t integrator,
                     mwvector pos,
                     mwvector vel,
                     real tstop,
                     real dt)
 {
     mwvector acc, v, x;
-    real t;
+    real t, e0, drift;
+
+    if (nbOrbitCacheLookup(pot, integrator, pos, vel, tstop, dt, finalPos, finalVel, energyDrift))
+        return;
 
     // Set the initial conditions
     x = pos;
@@ -47,16 +172,19 @@ void nbReverseOrbit(mwvector* finalPos,
 
     // Get the initial acceleration
     acc = nbExtAcceleration(pot, x);
+    e0 = nbOrbitEnergy(pot, x, v);
 
     // Loop through time
     for (t = 0; t <= tstop; t += dt)
     {
-        // Update the velocities and positions
-        mw_incaddv_s(v, acc, dt);
-        mw_incaddv_s(x, v, dt);
-        
-        // Compute the new acceleration
-        acc = nbExtAcceleration(pot, x);
+        nbOrbitStepWith(integrator, pot, &x, &v, &acc, dt);
+    }
+
+    /* Relative change in energy over the orbit */
+    drift = mw_abs(nbOrbitEnergy(pot, x, v) - e0) / mw_abs(e0);
+    if (energyDrift)
+    {
+        *energyDrift = drift;
     }
 
     /* Report the final values (don't forget to reverse the velocities) */
@@ -64,21 +192,493 @@ void nbReverseOrbit(mwvector* finalPos,
 
     *finalPos = x;
     *finalVel = v;
+
+    nbOrbitCacheInsert(pot, integrator, pos, vel, tstop, dt, x, v, drift);
+}
+
+/* Orbits stepped together, which share a potential */
+#define NBODY_ORBIT_BATCH 64
+
+/* Smallest adaptive step, relative to tstop, taken even if it is over
+ * the tolerance so an orbit through a singular potential still ends */
+#define NBODY_ORBIT_MIN_STEP 1.0e-12
+
+typedef real NBodyOrbitComponents[3][NBODY_ORBIT_BATCH];
+
+/* Accelerations at the n positions, the same as nbExtAcceleration().
+ * Batches too small to be worth the kernels' padding are done one at
+ * a time. */
+static void nbOrbitAccelerations(const Potential* pot,
+                                 NBodyOrbitComponents x,
+                                 NBodyOrbitComponents a,
+                                 unsigned int n)
+{
+    unsigned int i;
+
+    if (n >= NBODY_POTENTIAL_PAD)
+    {
+        nbExtAccelerationBatch(pot, x[0], x[1], x[2], a[0], a[1], a[2], n);
+        return;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        mwvector pos = mw_vec(x[0][i], x[1][i], x[2][i]);
+        mwvector acc = nbExtAcceleration(pot, pos);
+
+        a[0][i] = X(acc);
+        a[1][i] = Y(acc);
+        a[2][i] = Z(acc);
+    }
+}
+
+/* y += h * dy for each component of the n orbits */
+static inline void nbOrbitIncAdd(NBodyOrbitComponents y, NBodyOrbitComponents dy, real h, unsigned int n)
+{
+    unsigned int c, i;
+
+    for (c = 0; c < 3; ++c)
+    {
+        for (i = 0; i < n; ++i)
+        {
+            y[c][i] += h * dy[c][i];
+        }
+    }
+}
+
+/* nbOrbitStepWith() for n orbits at once */
+static void nbOrbitBatchStep(integrator_t integrator,
+                             const Potential* pot,
+                             NBodyOrbitComponents x,
+                             NBodyOrbitComponents v,
+                             NBodyOrbitComponents acc,
+                             unsigned int n,
+                             real dt)
+{
+    unsigned int i;
+    const NBodyIntegratorScheme* s;
+
+    if (integrator == Leapfrog)
+    {
+        nbOrbitIncAdd(v, acc, dt, n);
+        nbOrbitIncAdd(x, v, dt, n);
+        nbOrbitAccelerations(pot, x, acc, n);
+        return;
+    }
+
+    s = nbIntegratorScheme(integrator);
+    for (i = 0; i < s->nDrift; ++i)
+    {
+        if (s->kickFirst)
+        {
+            nbOrbitIncAdd(v, acc, s->kick[i] * dt, n);
+            nbOrbitIncAdd(x, v, s->drift[i] * dt, n);
+            nbOrbitAccelerations(pot, x, acc, n);
+        }
+        else
+        {
+            nbOrbitIncAdd(x, v, s->drift[i] * dt, n);
+            if (i + 1 < s->nDrift)
+            {
+                nbOrbitAccelerations(pot, x, acc, n);
+                nbOrbitIncAdd(v, acc, s->kick[i] * dt, n);
+            }
+        }
+    }
+
+    if (s->kickFirst)
+    {
+        nbOrbitIncAdd(v, acc, s->kick[s->nDrift] * dt, n);
+    }
+}
+
+/* The same steps as nbReverseOrbit() for each of the n orbits */
+static void nbReverseOrbitBatch(const Potential* pot,
+                                integrator_t integrator,
+                                NBodyOrbitComponents x,
+                                NBodyOrbitComponents v,
+                                unsigned int n,
+                                real tstop,
+                                real dt)
+{
+    real t;
+    NBodyOrbitComponents acc;
+
+    nbOrbitAccelerations(pot, x, acc, n);
+
+    for (t = 0; t <= tstop; t += dt)
+    {
+        nbOrbitBatchStep(integrator, pot, x, v, acc, n, dt);
+    }
+}
+
+/* Dormand & Prince (1980) 5th order pair with a 4th order error
+ * estimate. The last stage is at the 5th order solution, so it is
+ * also the first stage of the next step. */
+#define NBODY_DOPRI_STAGES 7
+
+static const real dopriA[NBODY_DOPRI_STAGES][NBODY_DOPRI_STAGES - 1] =
+{
+    { 0.0 },
+    { 1.0 / 5.0 },
+    { 3.0 / 40.0, 9.0 / 40.0 },
+    { 44.0 / 45.0, -56.0 / 15.0, 32.0 / 9.0 },
+    { 19372.0 / 6561.0, -25360.0 / 2187.0, 64448.0 / 6561.0, -212.0 / 729.0 },
+    { 9017.0 / 3168.0, -355.0 / 33.0, 46732.0 / 5247.0, 49.0 / 176.0, -5103.0 / 18656.0 },
+    { 35.0 / 384.0, 0.0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0 }
+};
+
+/* Difference of the 5th and 4th order weights */
+static const real dopriE[NBODY_DOPRI_STAGES] =
+{
+    71.0 / 57600.0, 0.0, -71.0 / 16695.0, 71.0 / 1920.0, -17253.0 / 339200.0, 22.0 / 525.0, -1.0 / 40.0
+};
+
+/* Take each of the n orbits to exactly tstop with steps of the
+ * Dormand-Prince pair, each kept to an error under tolerance relative to
+ * 1 + the size of the position or velocity component. Orbits take their
+ * own step sizes, starting from dt, but the stages of all the unfinished
+ * ones are found together. */
+static void nbReverseOrbitBatchAdaptive(const Potential* pot,
+                                        NBodyOrbitComponents x,
+                                        NBodyOrbitComponents v,
+                                        unsigned int n,
+                                        real tstop,
+                                        real dt,
+                                        real tolerance)
+{
+    unsigned int i, j, k, c, l, nActive;
+    unsigned int active[NBODY_ORBIT_BATCH];
+    real t[NBODY_ORBIT_BATCH], h[NBODY_ORBIT_BATCH], hStep[NBODY_ORBIT_BATCH];
+    mwbool lastStep[NBODY_ORBIT_BATCH];     /* hStep is clamped to reach tstop */
+    NBodyOrbitComponents kx[NBODY_DOPRI_STAGES], kv[NBODY_DOPRI_STAGES];
+    NBodyOrbitComponents xs, as;
+    const real minStep = NBODY_ORBIT_MIN_STEP * tstop;
+
+    for (i = 0; i < n; ++i)
+    {
+        t[i] = 0.0;
+        h[i] = dt;
+    }
+
+    memcpy(kx[0], v, sizeof(NBodyOrbitComponents));
+    nbOrbitAccelerations(pot, x, kv[0], n);
+
+    while (TRUE)
+    {
+        for (i = 0, nActive = 0; i < n; ++i)
+        {
+            if (t[i] < tstop)
+            {
+                active[nActive++] = i;
+                lastStep[i] = h[i] >= tstop - t[i];
+                hStep[i] = lastStep[i] ? tstop - t[i] : h[i];
+            }
+        }
+
+        if (nActive == 0)
+            break;
+
+        for (k = 1; k < NBODY_DOPRI_STAGES; ++k)
+        {
+            for (c = 0; c < 3; ++c)
+            {
+                for (j = 0; j < nActive; ++j)
+                {
+                    real dx = 0.0, dv = 0.0;
+
+                    i = active[j];
+                    for (l = 0; l < k; ++l)
+                    {
+                        dx += dopriA[k][l] * kx[l][c][i];
+                        dv += dopriA[k][l] * kv[l][c][i];
+                    }
+
+                    xs[c][j] = x[c][i] + hStep[i] * dx;
+                    kx[k][c][i] = v[c][i] + hStep[i] * dv;
+                }
+            }
+
+            nbOrbitAccelerations(pot, xs, as, nActive);
+
+            for (c = 0; c < 3; ++c)
+            {
+                for (j = 0; j < nActive; ++j)
+                {
+                    kv[k][c][active[j]] = as[c][j];
+                }
+            }
+        }
+
+        for (j = 0; j < nActive; ++j)
+        {
+            real errSq = 0.0, err, factor;
+
+            i = active[j];
+            for (c = 0; c < 3; ++c)
+            {
+                real ex = 0.0, ev = 0.0;
+                const real x5 = xs[c][j];
+                const real v5 = kx[NBODY_DOPRI_STAGES - 1][c][i];
+
+                for (l = 0; l < NBODY_DOPRI_STAGES; ++l)
+                {
+                    ex += dopriE[l] * kx[l][c][i];
+                    ev += dopriE[l] * kv[l][c][i];
+                }
+
+                ex *= hStep[i] / (tolerance * (1.0 + mw_fmax(mw_abs(x[c][i]), mw_abs(x5))));
+                ev *= hStep[i] / (tolerance * (1.0 + mw_fmax(mw_abs(v[c][i]), mw_abs(v5))));
+                errSq += sqr(ex) + sqr(ev);
+            }
+
+            err = mw_sqrt(errSq / 6.0);
+            factor = err > 0.0 ? 0.9 * mw_pow(err, -0.2) : 5.0;
+
+            if (err <= 1.0 || hStep[i] <= minStep)
+            {
+                /* Accept, and start the next step from the last stage */
+                t[i] = lastStep[i] ? tstop : t[i] + hStep[i];
+                for (c = 0; c < 3; ++c)
+                {
+                    x[c][i] = xs[c][j];
+                    v[c][i] = kx[NBODY_DOPRI_STAGES - 1][c][i];
+                    kx[0][c][i] = kx[NBODY_DOPRI_STAGES - 1][c][i];
+                    kv[0][c][i] = kv[NBODY_DOPRI_STAGES - 1][c][i];
+                }
+
+                h[i] = hStep[i] * mw_fmin(5.0, mw_fmax(0.2, factor));
+            }
+            else
+            {
+                h[i] = hStep[i] * mw_fmin(1.0, mw_fmax(0.2, factor));
+            }
+        }
+    }
+}
+
+void nbReverseOrbits(mwvector* finalPos,
+                     mwvector* finalVel,
+                     real* energyDrift,
+                     const Potential* const* pots,
+                     integrator_t integrator,
+                     real tolerance,
+                     const mwvector* pos,
+                     const mwvector* vel,
+                     unsigned int n,
+                     real tstop,
+                     real dt)
+{
+    int b;
+    unsigned int i, nBatch = 0;
+    unsigned int* starts;
+
+    /* Runs of orbits with the same potential, split into batches */
+    starts = (unsigned int*) mwMalloc((n + 1) * sizeof(unsigned int));
+    for (i = 0; i < n; ++i)
+    {
+        if (i == 0 || pots[i] != pots[i - 1] || i - starts[nBatch - 1] == NBODY_ORBIT_BATCH)
+            starts[nBatch++] = i;
+    }
+    starts[nBatch] = n;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(b) schedule(dynamic, 1)
+  #endif
+    for (b = 0; b < (int) nBatch; ++b)
+    {
+        unsigned int j;
+        const unsigned int start = starts[b];
+        const unsigned int m = starts[b + 1] - start;
+        const Potential* pot = pots[start];
+        NBodyOrbitComponents x, v;
+
+        /* Reverse the velocities, and back again at the end */
+        for (j = 0; j < m; ++j)
+        {
+            x[0][j] = X(pos[start + j]);
+            x[1][j] = Y(pos[start + j]);
+            x[2][j] = Z(pos[start + j]);
+            v[0][j] = -X(vel[start + j]);
+            v[1][j] = -Y(vel[start + j]);
+            v[2][j] = -Z(vel[start + j]);
+        }
+
+        if (tolerance > 0.0)
+            nbReverseOrbitBatchAdaptive(pot, x, v, m, tstop, dt, tolerance);
+        else
+            nbReverseOrbitBatch(pot, integrator, x, v, m, tstop, dt);
+
+        for (j = 0; j < m; ++j)
+        {
+            mwvector xf = mw_vec(x[0][j], x[1][j], x[2][j]);
+            mwvector vf = mw_vec(v[0][j], v[1][j], v[2][j]);
+
+            if (energyDrift)
+            {
+                const real e0 = nbOrbitEnergy(pot, pos[start + j], vel[start + j]);
+
+                energyDrift[start + j] = mw_abs(nbOrbitEnergy(pot, xf, vf) - e0) / mw_abs(e0);
+            }
+
+            mw_incnegv(vf);
+            finalPos[start + j] = xf;
+            finalVel[start + j] = vf;
+        }
+    }
+
+    free(starts);
+}
+
+/* Writes the steps of an orbit picked by an NBodyOrbitOutput. Text
+ * goes through a large stdio buffer, and binary rows are kept in
+ * columns until a block is full. */
+typedef struct
+{
+    FILE* f;
+    NBodyOrbitOutput out;
+    unsigned int step;
+    real arc;              /* Distance along the orbit since the last row */
+    mwvector prev;         /* Position of the step before */
+    unsigned int nRow;
+    real* columns;         /* NBODY_ORBIT_FILE_BLOCK_ROWS of each column */
+} NBodyOrbitWriter;
+
+/* Size of the buffer for text output */
+#define NBODY_ORBIT_TEXT_BUFFER (1 << 20)
+
+static int nbOrbitWriterOpen(NBodyOrbitWriter* w, const char* filename, const NBodyOrbitOutput* out, mwvector start)
+{
+    memset(w, 0, sizeof(*w));
+    w->out = *out;
+    w->out.every = MAX(w->out.every, 1);
+    w->prev = start;
+
+    w->f = mw_fopen(filename, w->out.binary ? "wb" : "w");
+    if (!w->f)
+    {
+        mwPerror("Failed to open orbit file '%s'", filename);
+        return TRUE;
+    }
+
+    if (w->out.binary)
+    {
+        NBodyOrbitFileHeader hdr;
+
+        memset(&hdr, 0, sizeof(hdr));
+        strncpy(hdr.magic, NBODY_ORBIT_FILE_MAGIC, sizeof(hdr.magic));
+        hdr.version = NBODY_ORBIT_FILE_VERSION;
+        hdr.realSize = sizeof(real);
+        hdr.nColumn = NBODY_ORBIT_FILE_COLUMNS;
+        hdr.blockRows = NBODY_ORBIT_FILE_BLOCK_ROWS;
+
+        fwrite(&hdr, sizeof(hdr), 1, w->f);
+        w->columns = (real*) mwMalloc(NBODY_ORBIT_FILE_COLUMNS * NBODY_ORBIT_FILE_BLOCK_ROWS * sizeof(real));
+    }
+    else
+    {
+        setvbuf(w->f, NULL, _IOFBF, NBODY_ORBIT_TEXT_BUFFER);
+    }
+
+    return FALSE;
+}
+
+static void nbOrbitWriterFlush(NBodyOrbitWriter* w)
+{
+    unsigned int c;
+    const uint32_t block[2] = { w->nRow, 0 };
+
+    if (w->nRow == 0)
+        return;
+
+    fwrite(block, sizeof(block), 1, w->f);
+    for (c = 0; c < NBODY_ORBIT_FILE_COLUMNS; ++c)
+    {
+        fwrite(&w->columns[c * NBODY_ORBIT_FILE_BLOCK_ROWS], sizeof(real), w->nRow, w->f);
+    }
+
+    w->nRow = 0;
+}
+
+/* Position x and velocity v after a step, which may be the last */
+static void nbOrbitWriterStep(NBodyOrbitWriter* w, mwvector x, mwvector v, mwbool last)
+{
+    mwvector lbr;
+    mwbool write;
+
+    ++w->step;
+    if (w->out.arcLength > 0.0)
+    {
+        w->arc += mw_distv(x, w->prev);
+        w->prev = x;
+        write = w->arc >= w->out.arcLength;
+    }
+    else
+    {
+        write = w->step % w->out.every == 0;
+    }
+
+    if (!write && !last)
+        return;
+
+    w->arc = 0.0;
+    lbr = cartesianToLbr(x, DEFAULT_SUN_GC_DISTANCE);
+
+    if (w->out.binary)
+    {
+        const unsigned int i = w->nRow;
+        real* col = w->columns;
+
+        col[0 * NBODY_ORBIT_FILE_BLOCK_ROWS + i] = X(lbr);
+        col[1 * NBODY_ORBIT_FILE_BLOCK_ROWS + i] = Y(lbr);
+        col[2 * NBODY_ORBIT_FILE_BLOCK_ROWS + i] = Z(lbr);
+        col[3 * NBODY_ORBIT_FILE_BLOCK_ROWS + i] = X(v);
+        col[4 * NBODY_ORBIT_FILE_BLOCK_ROWS + i] = Y(v);
+        col[5 * NBODY_ORBIT_FILE_BLOCK_ROWS + i] = Z(v);
+
+        if (++w->nRow == NBODY_ORBIT_FILE_BLOCK_ROWS)
+            nbOrbitWriterFlush(w);
+    }
+    else
+    {
+        fprintf(w->f, NBODY_ORBIT_TEXT_FORMAT, X(lbr), Y(lbr), Z(lbr), X(v), Y(v), Z(v));
+    }
+}
+
+static void nbOrbitWriterClose(NBodyOrbitWriter* w)
+{
+    if (!w->f)
+        return;
+
+    if (w->out.binary)
+        nbOrbitWriterFlush(w);
+
+    if (ferror(w->f) | fclose(w->f))
+        mw_printf("Error writing orbit file\n");
+
+    free(w->columns);
+    w->f = NULL;
 }
 
 void nbPrintReverseOrbit(mwvector* finalPos,
                          mwvector* finalVel,
                          const Potential* pot,
+                         integrator_t integrator,
                          mwvector pos,
                          mwvector vel,
                          real tstop,
                          real tstopforward,
-                         real dt)
+                         real dt,
+                         const NBodyOrbitOutput* out)
 {
     mwvector acc, v, x;
     mwvector v_for, x_for;
-    mwvector lbr;
     real t;
+    NBodyOrbitWriter w;
+    const NBodyOrbitOutput defaultOut = DEFAULT_ORBIT_OUTPUT;
+
+    if (!out)
+        out = &defaultOut;
 
     // Set the initial conditions
     x = pos;
@@ -91,42 +691,31 @@ void nbPrintReverseOrbit(mwvector* finalPos,
     // Get the initial acceleration
     acc = nbExtAcceleration(pot, x);
 
-    FILE * fp;
-    fp = fopen("reverse_orbit.out", "w");
+    nbOrbitWriterOpen(&w, out->binary ? "reverse_orbit.bin" : "reverse_orbit.out", out, x);
     // Loop through time
     for (t = 0; t <= tstop; t += dt)
     {
-        // Update the velocities and positions
-        mw_incaddv_s(v, acc, dt);
-        mw_incaddv_s(x, v, dt);
-        
-        lbr = cartesianToLbr(x, DEFAULT_SUN_GC_DISTANCE);
-        fprintf(fp, "%.15f\t%.15f\t%.15f\t%.15f\t%.15f\t%.15f\n", X(lbr), Y(lbr), Z(lbr), X(v), Y(v), Z(v));
+        nbOrbitStepWith(integrator, pot, &x, &v, &acc, dt);
         
-        // Compute the new acceleration
-        acc = nbExtAcceleration(pot, x);
+        if (w.f)
+            nbOrbitWriterStep(&w, x, v, t + dt > tstop);
     }
+    nbOrbitWriterClose(&w);
 
-    fclose(fp);
-    fp = fopen("forward_orbit.out", "w");
+    nbOrbitWriterOpen(&w, out->binary ? "forward_orbit.bin" : "forward_orbit.out", out, x_for);
     acc = nbExtAcceleration(pot, x_for);
     for (t = 0; t <= tstopforward; t += dt)
     {
-        // Update the velocities and positions
-        mw_incaddv_s(v_for, acc, dt);
-        mw_incaddv_s(x_for, v_for, dt);
-        
-        lbr = cartesianToLbr(x_for, DEFAULT_SUN_GC_DISTANCE);
-        fprintf(fp, "%.15f\t%.15f\t%.15f\t%.15f\t%.15f\t%.15f\n", X(lbr), Y(lbr), Z(lbr), X(v_for), Y(v_for), Z(v_for));
+        nbOrbitStepWith(integrator, pot, &x_for, &v_for, &acc, dt);
         
-        // Compute the new acceleration
-        acc = nbExtAcceleration(pot, x_for);
+        if (w.f)
+            nbOrbitWriterStep(&w, x_for, v_for, t + dt > tstopforward);
     }
-    fclose(fp);
+    nbOrbitWriterClose(&w);
     
     /* Report the final values (don't forget to reverse the velocities) */
     mw_incnegv(v);
 
     *finalPos = x;
     *finalVel = v;
-}
\ No newline at end of file
+}
@@ -26,9 +26,13 @@
 #include "nbody_util.h"
 #include "nbody_checkpoint.h"
 #include "nbody_grav.h"
+#include "nbody_soa.h"
 #include "nbody_histogram.h"
 #include "nbody_likelihood.h"
 #include "nbody_devoptions.h"
+#include "nbody_orbit_integrator.h"
+#include "nbody_potential.h"
+#include "nbody_show.h"
 
 #ifdef NBODY_BLENDER_OUTPUT
   #include "blender_visualizer.h"
@@ -49,14 +53,32 @@ static void nbReportProgress(const NBodyCtx* ctx, NBodyState* st)
                     100.0 * frac
             );
 
+        if (ctx->treeRebuildInterval > 1.0)
+        {
+            mw_mvprintw(1, 0,
+                        "Tree refits since last build: %u, bodies relocated: %u\n",
+                        st->tree.refitCount,
+                        st->tree.nRelocated
+                );
+        }
+
+        if (ctx->useBlockSteps)
+        {
+            mw_mvprintw(2, 0,
+                        "Force evaluations saved by block timesteps: %.1f%%\n",
+                        100.0 * (double) st->forceEvalsSaved / (double) MAX(st->forceEvals + st->forceEvalsSaved, 1)
+                );
+        }
+
         mw_refresh();
     }
 }
 
 static NBodyStatus nbCheckpoint(const NBodyCtx* ctx, NBodyState* st)
 {
-    if (nbTimeToCheckpoint(ctx, st))
+    if (nbCanCheckpoint(ctx, st) && nbTimeToCheckpoint(ctx, st))
     {
+        nbSyncBodyView(st);
         if (nbWriteCheckpoint(ctx, st))
         {
             return NBODY_CHECKPOINT_ERROR;
@@ -68,108 +90,321 @@ static NBodyStatus nbCheckpoint(const NBodyCtx* ctx, NBodyState* st)
     return NBODY_SUCCESS;
 }
 
-/* Advance velocity by half a timestep */
-static inline void bodyAdvanceVel(Body* p, const mwvector a, const real dtHalf)
+/* Advance velocity by half a timestep and position by 1 timestep.
+ * Each component is a separate contiguous stream so this vectorizes */
+static inline void advancePosVel(NBodyState* st, const int nbody, const real dt)
 {
-    mwvector dv;
+    int i;
+    real dtHalf = 0.5 * dt;
+    NBodySoA* soa = &st->soa;
+
+    real* RESTRICT x = mw_assume_aligned(soa->pos[0], 16);
+    real* RESTRICT y = mw_assume_aligned(soa->pos[1], 16);
+    real* RESTRICT z = mw_assume_aligned(soa->pos[2], 16);
+    real* RESTRICT vx = mw_assume_aligned(soa->vel[0], 16);
+    real* RESTRICT vy = mw_assume_aligned(soa->vel[1], 16);
+    real* RESTRICT vz = mw_assume_aligned(soa->vel[2], 16);
+    const real* RESTRICT ax = mw_assume_aligned(soa->acc[0], 16);
+    const real* RESTRICT ay = mw_assume_aligned(soa->acc[1], 16);
+    const real* RESTRICT az = mw_assume_aligned(soa->acc[2], 16);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        vx[i] += ax[i] * dtHalf;    /* advance v by 1/2 step */
+        vy[i] += ay[i] * dtHalf;
+        vz[i] += az[i] * dtHalf;
 
-    dv = mw_mulvs(a, dtHalf);   /* get velocity increment */
-    mw_incaddv(Vel(p), dv);     /* advance v by 1/2 step */
+        x[i] += vx[i] * dt;         /* advance r by 1 step */
+        y[i] += vy[i] * dt;
+        z[i] += vz[i] * dt;
+    }
 }
 
-/* Advance body position by 1 timestep */
-static inline void bodyAdvancePos(Body* p, const real dt)
+static inline void advanceVelocities(NBodyState* st, const int nbody, const real dt)
 {
-    mwvector dr;
+    int i;
+    real dtHalf = 0.5 * dt;
+    NBodySoA* soa = &st->soa;
+
+    real* RESTRICT vx = mw_assume_aligned(soa->vel[0], 16);
+    real* RESTRICT vy = mw_assume_aligned(soa->vel[1], 16);
+    real* RESTRICT vz = mw_assume_aligned(soa->vel[2], 16);
+    const real* RESTRICT ax = mw_assume_aligned(soa->acc[0], 16);
+    const real* RESTRICT ay = mw_assume_aligned(soa->acc[1], 16);
+    const real* RESTRICT az = mw_assume_aligned(soa->acc[2], 16);
 
-    dr = mw_mulvs(Vel(p), dt);  /* get position increment */
-    mw_incaddv(Pos(p), dr);     /* advance r by 1 step */
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nbody; ++i)      /* loop over all bodies */
+    {
+        vx[i] += ax[i] * dtHalf;
+        vy[i] += ay[i] * dtHalf;
+        vz[i] += az[i] * dtHalf;
+    }
 }
 
-static inline void advancePosVel(NBodyState* st, const int nbody, const real dt)
+/* Add h times the acceleration to the velocities */
+static inline void kickVelocities(NBodyState* st, const int nbody, const real h)
 {
     int i;
-    real dtHalf = 0.5 * dt;
-    Body* bodies = mw_assume_aligned(st->bodytab, 16);
-    const mwvector* accs = mw_assume_aligned(st->acctab, 16);
+    NBodySoA* soa = &st->soa;
+
+    real* RESTRICT vx = mw_assume_aligned(soa->vel[0], 16);
+    real* RESTRICT vy = mw_assume_aligned(soa->vel[1], 16);
+    real* RESTRICT vz = mw_assume_aligned(soa->vel[2], 16);
+    const real* RESTRICT ax = mw_assume_aligned(soa->acc[0], 16);
+    const real* RESTRICT ay = mw_assume_aligned(soa->acc[1], 16);
+    const real* RESTRICT az = mw_assume_aligned(soa->acc[2], 16);
 
   #ifdef _OPENMP
-    #pragma omp parallel for private(i) shared(bodies, accs) schedule(dynamic, 4096 / sizeof(accs[0]))
+    #pragma omp parallel for private(i) schedule(static)
   #endif
     for (i = 0; i < nbody; ++i)
     {
-        bodyAdvanceVel(&bodies[i], accs[i], dtHalf);
-        bodyAdvancePos(&bodies[i], dt);
+        vx[i] += ax[i] * h;
+        vy[i] += ay[i] * h;
+        vz[i] += az[i] * h;
     }
+}
 
+/* Add h times the velocity to the positions */
+static inline void advancePositions(NBodyState* st, const int nbody, const real h)
+{
+    int i;
+    NBodySoA* soa = &st->soa;
+
+    real* RESTRICT x = mw_assume_aligned(soa->pos[0], 16);
+    real* RESTRICT y = mw_assume_aligned(soa->pos[1], 16);
+    real* RESTRICT z = mw_assume_aligned(soa->pos[2], 16);
+    const real* RESTRICT vx = mw_assume_aligned(soa->vel[0], 16);
+    const real* RESTRICT vy = mw_assume_aligned(soa->vel[1], 16);
+    const real* RESTRICT vz = mw_assume_aligned(soa->vel[2], 16);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        x[i] += vx[i] * h;
+        y[i] += vy[i] * h;
+        z[i] += vz[i] * h;
+    }
 }
 
-static inline void advanceVelocities(NBodyState* st, const int nbody, const real dt)
+
+/* Block timesteps.
+ *
+ * Each body steps by 2^level timesteps, with the level picked from its
+ * acceleration and the softening length whenever it finishes a step.
+ * A body only starts a step of 2^level timesteps on a multiple of
+ * 2^level, so steps of the same length line up and every body finishes
+ * together at the end of the longest one. All bodies drift every
+ * timestep, so positions are always current, but forces are only found
+ * for the bodies whose step just ended. Each body does the usual
+ * kick-drift-kick leapfrog over its own step.
+ */
+
+static inline uint32_t nbStepSpan(uint32_t level)
+{
+    return (uint32_t) 1 << level;
+}
+
+/* Level for body p to start a step with at timestep step */
+static inline uint32_t nbChooseStepLevel(const NBodyCtx* ctx, const NBodySoA* soa, unsigned int p, unsigned int step)
+{
+    const uint32_t maxLevel = (uint32_t) ctx->blockStepLevels - 1;
+    uint32_t level = maxLevel;
+    real aSq = sqr(soa->acc[0][p]) + sqr(soa->acc[1][p]) + sqr(soa->acc[2][p]);
+
+    if (aSq > 0.0)
+    {
+        real want = mw_sqrt(2.0 * ctx->blockStepAccuracy * mw_sqrt(ctx->eps2 / aSq));
+        real ratio = want / ctx->timestep;
+
+        level = 0;
+        while (level < maxLevel && ratio >= 2.0)
+        {
+            ratio *= 0.5;
+            ++level;
+        }
+    }
+
+    /* Longer steps have to start where all steps that long start, and
+     * not run past the end */
+    while (level > 0 && ((step & (nbStepSpan(level) - 1)) != 0 || nbStepSpan(level) > ctx->nStep - step))
+    {
+        --level;
+    }
+
+    return level;
+}
+
+static void nbChooseActiveStepLevels(const NBodyCtx* ctx, NBodyState* st, unsigned int step)
 {
     int i;
-    real dtHalf = 0.5 * dt;
-    Body* bodies = mw_assume_aligned(st->bodytab, 16);
-    const mwvector* accs = mw_assume_aligned(st->acctab, 16);
+    const int nActive = st->nActive;
+    const NBodySoA* soa = &st->soa;
 
   #ifdef _OPENMP
-    #pragma omp parallel for private(i) schedule(dynamic, 4096 / sizeof(accs[0]))
+    #pragma omp parallel for private(i) schedule(static)
   #endif
-    for (i = 0; i < nbody; ++i)      /* loop over all bodies */
+    for (i = 0; i < nActive; ++i)
     {
-        bodyAdvanceVel(&bodies[i], accs[i], dtHalf);
+        const uint32_t p = st->activeBodies[i];
+        st->stepLevel[p] = nbChooseStepLevel(ctx, soa, p, step);
     }
 }
 
+/* Half of each active body's step worth of its acceleration */
+static void nbKickActive(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i;
+    const int nActive = st->nActive;
+    NBodySoA* soa = &st->soa;
 
-static inline int get_likelihood(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf)
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nActive; ++i)
+    {
+        const uint32_t p = st->activeBodies[i];
+        const real dtHalf = 0.5 * ((real) nbStepSpan(st->stepLevel[p]) * ctx->timestep);
+
+        soa->vel[0][p] += soa->acc[0][p] * dtHalf;
+        soa->vel[1][p] += soa->acc[1][p] * dtHalf;
+        soa->vel[2][p] += soa->acc[2][p] * dtHalf;
+    }
+}
+
+/* Set up the levels for a run, unless they came from a checkpoint. Every
+ * body starts a step. */
+static void nbStartBlockSteps(const NBodyCtx* ctx, NBodyState* st)
 {
-    NBodyHistogram* data = NULL;
-    NBodyHistogram* histogram = NULL;
-    real likelihood = NAN;
-    NBodyLikelihoodMethod method;
-    HistogramParams hp;
-    
-    mwbool calculateLikelihood = (nbf->histogramFileName != NULL);
-    
-    
-    if (calculateLikelihood || nbf->histoutFileName || nbf->printHistogram)
+    int i;
+    const mwbool restored = (st->stepLevel != NULL);
+
+    if (!st->stepLevel)
+        st->stepLevel = (uint32_t*) mwMallocA(st->nbody * sizeof(uint32_t));
+    if (!st->activeBodies)
+        st->activeBodies = (uint32_t*) mwMallocA(st->nbody * sizeof(uint32_t));
+
+    for (i = 0; i < st->nbody; ++i)
     {
-        if (nbGetLikelihoodInfo(nbf, &hp, &method) || method == NBODY_INVALID_METHOD)
+        st->activeBodies[i] = (uint32_t) i;
+    }
+    st->nActive = st->nbody;
+
+    if (!restored)
+        nbChooseActiveStepLevels(ctx, st, st->step);
+
+    st->forceEvals = st->forceEvalsSaved = 0;
+}
+
+/* Advance all bodies one timestep, finishing the steps of some */
+static NBodyStatus nbStepSystemBlock(const NBodyCtx* ctx, NBodyState* st)
+{
+    NBodyStatus rc;
+    int i;
+    const int nbody = st->nbody;
+    const unsigned int next = st->step + 1;
+
+    nbKickActive(ctx, st);                    /* open the steps starting now */
+    advancePositions(st, nbody, ctx->timestep);
+
+    st->nActive = 0;
+    for (i = 0; i < nbody; ++i)
+    {
+        if ((next & (nbStepSpan(st->stepLevel[i]) - 1)) == 0)
+            st->activeBodies[st->nActive++] = (uint32_t) i;
+    }
+
+    rc = nbGravMapBodies(ctx, st, st->activeBodies, st->nActive);
+    if (nbStatusIsFatal(rc))
+        return rc;
+
+    nbKickActive(ctx, st);                    /* and close the ones ending now */
+    nbChooseActiveStepLevels(ctx, st, next);
+
+    st->forceEvals += (uint64_t) st->nActive;
+    st->forceEvalsSaved += (uint64_t) (nbody - st->nActive);
+
+    st->step++;
+    st->dirty = TRUE;
+
+    return rc;
+}
+
+/* Like nbSyncBodyView(), but in the middle of block timesteps also
+ * brings the velocities of the bodies that are part way through a step
+ * from the half kick to the current time. */
+static void nbSyncBlockBodyView(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i;
+    const mwbool wasDirty = st->dirty;
+
+    nbSyncBodyView(st);
+
+    if (!ctx->useBlockSteps || !wasDirty || st->nActive == st->nbody)
+        return;
+
+    for (i = 0; i < st->nbody; ++i)
+    {
+        const uint32_t span = nbStepSpan(st->stepLevel[i]);
+        const uint32_t into = st->step & (span - 1);
+
+        if (into != 0)
         {
-            /* this would normally return a print statement 
-             * but I do not want to overload the output since 
-             * this would run every time step.
-             */
-            return 0;
+            Body* b = &st->bodytab[i];
+            real t = ((real) into - 0.5 * (real) span) * ctx->timestep;
+
+            X(Vel(b)) += st->soa.acc[0][i] * t;
+            Y(Vel(b)) += st->soa.acc[1][i] * t;
+            Z(Vel(b)) += st->soa.acc[2][i] * t;
         }
     }
+}
+
+
+static inline int get_likelihood(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf)
+{
+    NBodyLikelihoodContext* lc;
+    real likelihood = NAN;
+    
+    mwbool calculateLikelihood = (nbf->histogramFileName != NULL);
     
     if (calculateLikelihood)
     {
-        
-        histogram = nbCreateHistogram(ctx, st, &hp);
- 
-        if (!histogram)
+        /* The script, the histogram parameters and the data histogram
+         * are the same every step, so they are only read the first time */
+        if (!st->likelihoodCtx)
         {
-            /* this would normally return a print statement 
-             * but I do not want to overload the output since 
-             * this would run every time step.
-             */
-            return 0;
+            st->likelihoodCtx = nbCreateLikelihoodContext(nbf);
+            if (!st->likelihoodCtx)
+            {
+                /* this would normally return a print statement 
+                 * but I do not want to overload the output since 
+                 * this would run every time step.
+                 */
+                return 0;
+            }
         }
+        lc = st->likelihoodCtx;
         
-        data = nbReadHistogram(nbf->histogramFileName);
-        
-        if (!data)
+        if (!lc->data)
         {
-            free(histogram);
             /* if the input histogram does not exist, I do not want the 
              * simulation to terminate as you can still get the output file
              * from it. Therefore, this function will end here but with 0
              */
             return 0;
         }
-        likelihood = nbSystemLikelihood(st, data, histogram, method);
+        
+        nbFillHistogram(lc->histogram, ctx, st, &lc->hp, &lc->histTrig, &lc->scratch);
+        likelihood = nbSystemLikelihood(st, lc->data, lc->histogram, lc->method);
 
         /*
           Used to fix Windows platform issues.  Windows' infinity is expressed as:
@@ -204,20 +439,19 @@ static inline int get_likelihood(const NBodyCtx* ctx, NBodyState* st, const NBod
             /* if it is an improvement then write out this histogram */
             if (nbf->histoutFileName)
             {
-                nbWriteHistogram(nbf->histoutFileName, ctx, st, histogram);
+                nbWriteHistogram(nbf->histoutFileName, ctx, st, lc->histogram);
             }
         }
     }
     
-    free(histogram);
-    free(data);
     return NBODY_SUCCESS;
     
 }
 
 
-/* stepSystem: advance N-body system one time-step. */
-NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st)
+/* Advance the bodies in the SoA store one time-step. bodytab is left
+ * out of date. */
+static NBodyStatus nbStepSystemSoA(const NBodyCtx* ctx, NBodyState* st)
 {
     NBodyStatus rc;
     
@@ -229,7 +463,9 @@ NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st)
     advanceVelocities(st, st->nbody, dt);
 
     st->step++;
+    st->dirty = TRUE;
     #ifdef NBODY_BLENDER_OUTPUT
+        nbSyncBodyView(st);
         blenderPrintBodies(st, ctx);
         printf("Frame: %d\n", (int)(st->step));
     #endif
@@ -237,13 +473,165 @@ NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st)
     return rc;
 }
 
+/* Advance the bodies one time-step with one of the higher order
+ * integrators, which take a force evaluation for each kick */
+static NBodyStatus nbStepSystemComposed(const NBodyCtx* ctx, NBodyState* st)
+{
+    NBodyStatus rc = NBODY_SUCCESS;
+    unsigned int i;
+    const NBodyIntegratorScheme* s = nbIntegratorScheme(ctx->integrator);
+    const int nbody = st->nbody;
+    const real dt = ctx->timestep;
+
+    for (i = 0; i < s->nDrift; ++i)
+    {
+        if (s->kickFirst)
+        {
+            kickVelocities(st, nbody, s->kick[i] * dt);
+            advancePositions(st, nbody, s->drift[i] * dt);
+            rc |= nbGravMap(ctx, st);
+        }
+        else
+        {
+            advancePositions(st, nbody, s->drift[i] * dt);
+            if (i + 1 < s->nDrift)
+            {
+                rc |= nbGravMap(ctx, st);
+                kickVelocities(st, nbody, s->kick[i] * dt);
+            }
+        }
+
+        if (nbStatusIsFatal(rc))
+            return rc;
+    }
+
+    if (s->kickFirst)
+    {
+        kickVelocities(st, nbody, s->kick[s->nDrift] * dt);
+    }
+
+    st->step++;
+    st->dirty = TRUE;
+
+    return rc;
+}
+
+static inline NBodyStatus nbStepSystemIntegrator(const NBodyCtx* ctx, NBodyState* st)
+{
+    if (ctx->integrator == Leapfrog)
+        return nbStepSystemSoA(ctx, st);
+    else
+        return nbStepSystemComposed(ctx, st);
+}
+
+/* stepSystem: advance N-body system one time-step. */
+NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st)
+{
+    NBodyStatus rc;
+
+    nbLoadBodyStore(st);
+
+    if (ctx->useBlockSteps)
+    {
+        if (!st->activeBodies)  /* New state, or just read from a checkpoint */
+            nbStartBlockSteps(ctx, st);
+        rc = nbStepSystemBlock(ctx, st);
+    }
+    else
+    {
+        rc = nbStepSystemIntegrator(ctx, st);
+    }
+
+    nbSyncBodyView(st);
+
+    return rc;
+}
+
+/* Total kinetic and potential energy of the bodies in the SoA store.
+ * The self potential is summed directly, so this is slow for many
+ * bodies. NAN if the external potential has no closed form. */
+static real nbTotalEnergy(const NBodyCtx* ctx, const NBodyState* st, real* kineticOut)
+{
+    int i;
+    const int nbody = st->nbody;
+    const NBodySoA* soa = &st->soa;
+    real kinetic = 0.0, self = 0.0, external = 0.0;
+
+    *kineticOut = NAN;
+    if (ctx->potentialType == EXTERNAL_POTENTIAL_CUSTOM_LUA)
+        return NAN;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) reduction(+ : kinetic, self, external) schedule(dynamic, 64)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        int j;
+        real phi = 0.0;
+        const real mi = soa->mass[i];
+
+        for (j = i + 1; j < nbody; ++j)
+        {
+            real drSq = sqr(soa->pos[0][j] - soa->pos[0][i])
+                      + sqr(soa->pos[1][j] - soa->pos[1][i])
+                      + sqr(soa->pos[2][j] - soa->pos[2][i]);
+
+            phi -= soa->mass[j] / mw_sqrt(drSq + ctx->eps2);
+        }
+
+        self += mi * phi;
+        kinetic += 0.5 * mi * (sqr(soa->vel[0][i]) + sqr(soa->vel[1][i]) + sqr(soa->vel[2][i]));
+
+        if (ctx->potentialType == EXTERNAL_POTENTIAL_DEFAULT)
+            external += mi * nbExtPotential(&ctx->pot, nbSoAPos(soa, i));
+    }
+
+    *kineticOut = kinetic;
+
+    return kinetic + self + external;
+}
+
+/* How well the integrator kept the energy, for picking the timestep.
+ * The zero of the external potential is arbitrary, so the change is
+ * given relative to the starting kinetic energy. */
+static void nbReportEnergyDrift(const NBodyCtx* ctx, unsigned int startStep, real energy0, real kinetic0, real energy1)
+{
+    const NBodyIntegratorScheme* s = nbIntegratorScheme(ctx->integrator);
+
+    if (!isfinite(energy0) || !isfinite(energy1))
+    {
+        mw_printf("Energy drift is not available for this potential\n");
+        return;
+    }
+
+    mw_printf("Energy drift with %s integrator over %u steps of %g: %.6e of the kinetic energy\n"
+              "  (E = %.15e to %.15e, %u force evaluations per step)\n",
+              showIntegratorT(ctx->integrator),
+              ctx->nStep - startStep,
+              ctx->timestep,
+              mw_abs(energy1 - energy0) / kinetic0,
+              energy0,
+              energy1,
+              nbIntegratorForces(s));
+}
+
 NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf)
 {
     NBodyStatus rc = NBODY_SUCCESS;
+    const unsigned int startStep = st->step;
+    real energy0 = 0.0, kinetic0 = 0.0, kinetic1;
+
+    nbLoadBodyStore(st);      /* The SoA store is used until the end of the run */
     rc |= nbGravMap(ctx, st); /* Calculate accelerations for 1st step this episode */
     if (nbStatusIsFatal(rc))
         return rc;
 
+    if (nbf->reportEnergy)
+        energy0 = nbTotalEnergy(ctx, st, &kinetic0);
+
+    if (ctx->useBlockSteps)
+        nbStartBlockSteps(ctx, st);
+
     #ifdef NBODY_BLENDER_OUTPUT
         if(mkdir("./frames", S_IRWXU | S_IRWXG) < 0)
         {
@@ -276,15 +664,20 @@ NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFla
         #ifdef NBODY_DEV_OPTIONS
             if(ctx->MultiOutput)
             {
+                nbSyncBlockBodyView(ctx, st);
                 dev_write_outputs(ctx, st, nbf, ctx->OutputFreq);
             }
                 
         #endif
-        rc |= nbStepSystemPlain(ctx, st);
+        if (ctx->useBlockSteps)
+            rc |= nbStepSystemBlock(ctx, st);
+        else
+            rc |= nbStepSystemIntegrator(ctx, st);
         curStep = st->step;
         
         if(curStep / Nstep >= ctx->BestLikeStart && ctx->useBestLike)
         {
+            nbSyncBlockBodyView(ctx, st);
             get_likelihood(ctx, st, nbf);
         }
     
@@ -297,8 +690,25 @@ NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFla
         /* We report the progress at step + 1. 0 is the original
            center of mass. */
         nbReportProgress(ctx, st);
-        nbUpdateDisplayedBodies(ctx, st);
+        if (st->scene)
+        {
+            nbSyncBlockBodyView(ctx, st);
+            nbUpdateDisplayedBodies(ctx, st);
+        }
+    }
+
+    nbSyncBodyView(st);
+
+    if (ctx->useBlockSteps)
+    {
+        mw_printf("Block timesteps found "LLU" forces and skipped "LLU" (%.1f%%)\n",
+                  st->forceEvals,
+                  st->forceEvalsSaved,
+                  100.0 * (double) st->forceEvalsSaved / (double) MAX(st->forceEvals + st->forceEvalsSaved, 1));
     }
+
+    if (nbf->reportEnergy)
+        nbReportEnergyDrift(ctx, startStep, energy0, kinetic0, nbTotalEnergy(ctx, st, &kinetic1));
     
     #ifdef NBODY_BLENDER_OUTPUT
         blenderPrintMisc(st, ctx, startCmPos, perpendicularCmPos);
@@ -22,6 +22,7 @@
 #include "nbody_potential.h"
 #include "milkyway_util.h"
 #include "nbody_caustic.h"
+#include "milkyway_cpuid.h"
 
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -165,14 +166,259 @@ mwvector nbExtAcceleration(const Potential* pot, mwvector pos)
 }
 
 
+/* MSVC can't do weak imports. */
+#if !HAVE_AVX512F || !DOUBLEPREC
+  #define nbPotentialKernel_AVX512F NULL
+#endif
+
+#if !HAVE_AVX2 || !DOUBLEPREC
+  #define nbPotentialKernel_AVX2 NULL
+#endif
+
+#if !HAVE_SSE2 || !DOUBLEPREC
+  #define nbPotentialKernel_SSE2 NULL
+#endif
+
+#if MW_IS_X86
+/* Can't use the functions themselves if defined to NULL */
+static NBodyPotentialKernel kernelAVX512F = nbPotentialKernel_AVX512F;
+static NBodyPotentialKernel kernelAVX2 = nbPotentialKernel_AVX2;
+static NBodyPotentialKernel kernelSSE2 = nbPotentialKernel_SSE2;
+#endif
+
+static NBodyPotentialKernel potentialKernel = NULL;
+static int potentialKernelSelected = FALSE;
+
+void nbSetPotentialConsts(Potential* pot)
+{
+    PotentialConsts* c = &pot->consts;
+
+    c->sphereNegMass = -pot->sphere[0].mass;
+    c->sphereScale = pot->sphere[0].scale;
+
+    c->diskNegMass = -pot->disk.mass;
+    c->diskA = pot->disk.scaleLength;
+    c->diskBSqr = sqr(pot->disk.scaleHeight);
+
+    c->haloV = (pot->halo.type == TriaxialHalo) ? -sqr(pot->halo.vhalo) : -2.0 * sqr(pot->halo.vhalo);
+    c->haloV2 = 2.0 * c->haloV;
+    c->haloDSqr = sqr(pot->halo.scaleLength);
+    c->haloQSqr = sqr(pot->halo.flattenZ);
+    c->haloC1x2 = 2.0 * pot->halo.c1;
+    c->haloC2x2 = 2.0 * pot->halo.c2;
+}
+
+/* The kernels only do the models that are just arithmetic and square
+ * roots, which come out the same at any vector width */
+static int nbPotentialHasKernel(const Potential* pot)
+{
+    return pot->disk.type == MiyamotoNagaiDisk
+        && (pot->halo.type == LogarithmicHalo || pot->halo.type == TriaxialHalo);
+}
+
+/* Use the widest kernel the processor and OS can run, if any */
+static void nbSelectPotentialKernel(void)
+{
+  #if MW_IS_X86
+    const MWSIMDLevel simd = mwBestSIMDLevel();
+
+    if (simd >= MW_SIMD_AVX512F && kernelAVX512F)
+        potentialKernel = kernelAVX512F;
+    else if (simd >= MW_SIMD_AVX2 && kernelAVX2)
+        potentialKernel = kernelAVX2;
+    else if (simd >= MW_SIMD_SSE2 && kernelSSE2)
+        potentialKernel = kernelSSE2;
+  #endif /* MW_IS_X86 */
+
+    potentialKernelSelected = TRUE;
+}
+
+/* A loop over the positions for one combination of disk and halo, so
+ * the models are inlined into it and r is found once per position. The
+ * sum is in the same order as nbExtAcceleration(). */
+#define NB_DEFINE_EXT_BATCH(name, diskAccel, haloAccel)                         \
+    static void name(const Potential* pot,                                      \
+                     const real* x, const real* y, const real* z,               \
+                     real* ax, real* ay, real* az,                              \
+                     unsigned int n)                                            \
+    {                                                                           \
+        unsigned int i;                                                         \
+                                                                                \
+        for (i = 0; i < n; ++i)                                                 \
+        {                                                                       \
+            const mwvector pos = mw_vec(x[i], y[i], z[i]);                      \
+            const real r = mw_absv(pos);                                        \
+            mwvector acc = diskAccel(&pot->disk, pos, r);                       \
+                                                                                \
+            mw_incaddv(acc, haloAccel(&pot->halo, pos, r));                     \
+            mw_incaddv(acc, sphericalAccel(&pot->sphere[0], pos, r));           \
+                                                                                \
+            ax[i] = X(acc);                                                     \
+            ay[i] = Y(acc);                                                     \
+            az[i] = Z(acc);                                                     \
+        }                                                                       \
+    }
+
+NB_DEFINE_EXT_BATCH(nbExtBatch_MN_Log, miyamotoNagaiDiskAccel, logHaloAccel)
+NB_DEFINE_EXT_BATCH(nbExtBatch_MN_NFW, miyamotoNagaiDiskAccel, nfwHaloAccel)
+NB_DEFINE_EXT_BATCH(nbExtBatch_MN_Triaxial, miyamotoNagaiDiskAccel, triaxialHaloAccel)
+NB_DEFINE_EXT_BATCH(nbExtBatch_MN_Caustic, miyamotoNagaiDiskAccel, causticHaloAccel)
+NB_DEFINE_EXT_BATCH(nbExtBatch_Exp_Log, exponentialDiskAccel, logHaloAccel)
+NB_DEFINE_EXT_BATCH(nbExtBatch_Exp_NFW, exponentialDiskAccel, nfwHaloAccel)
+NB_DEFINE_EXT_BATCH(nbExtBatch_Exp_Triaxial, exponentialDiskAccel, triaxialHaloAccel)
+NB_DEFINE_EXT_BATCH(nbExtBatch_Exp_Caustic, exponentialDiskAccel, causticHaloAccel)
+
+/* Indexed by disk type, then halo type */
+static const NBodyPotentialKernel extBatches[2][4] =
+{
+    { nbExtBatch_MN_Log,  nbExtBatch_MN_NFW,  nbExtBatch_MN_Triaxial,  nbExtBatch_MN_Caustic  },
+    { nbExtBatch_Exp_Log, nbExtBatch_Exp_NFW, nbExtBatch_Exp_Triaxial, nbExtBatch_Exp_Caustic }
+};
+
+/* Same as nbExtAcceleration() for each position, with the models
+ * looked up once for all of them */
+static void nbExtAccelerationBatchPlain(const Potential* pot,
+                                        const real* x, const real* y, const real* z,
+                                        real* ax, real* ay, real* az,
+                                        unsigned int n)
+{
+    const int disk = (int) pot->disk.type;
+    const int halo = (int) pot->halo.type;
+
+    if (disk < 0 || disk >= 2)
+        mw_fail("Invalid disk type in external acceleration\n");
+    if (halo < 0 || halo >= 4)
+        mw_fail("Invalid halo type in external acceleration\n");
+
+    extBatches[disk][halo](pot, x, y, z, ax, ay, az, n);
+}
+
+void nbExtAccelerationBatch(const Potential* pot,
+                            const real* x, const real* y, const real* z,
+                            real* ax, real* ay, real* az,
+                            unsigned int n)
+{
+    if (!potentialKernelSelected)
+        nbSelectPotentialKernel();
+
+    if (potentialKernel && nbPotentialHasKernel(pot))
+    {
+        unsigned int i;
+        const unsigned int nVec = n & ~(NBODY_POTENTIAL_PAD - 1);
+        const unsigned int nRest = n - nVec;
+
+        potentialKernel(pot, x, y, z, ax, ay, az, nVec);
+
+        if (nRest > 0)
+        {
+            /* Pad the rest with copies of the last position */
+            real px[NBODY_POTENTIAL_PAD], py[NBODY_POTENTIAL_PAD], pz[NBODY_POTENTIAL_PAD];
+            real pax[NBODY_POTENTIAL_PAD], pay[NBODY_POTENTIAL_PAD], paz[NBODY_POTENTIAL_PAD];
+
+            for (i = 0; i < NBODY_POTENTIAL_PAD; ++i)
+            {
+                const unsigned int j = nVec + MIN(i, nRest - 1);
+
+                px[i] = x[j];
+                py[i] = y[j];
+                pz[i] = z[j];
+            }
+
+            potentialKernel(pot, px, py, pz, pax, pay, paz, NBODY_POTENTIAL_PAD);
+
+            memcpy(&ax[nVec], pax, nRest * sizeof(real));
+            memcpy(&ay[nVec], pay, nRest * sizeof(real));
+            memcpy(&az[nVec], paz, nRest * sizeof(real));
+        }
+    }
+    else
+    {
+        nbExtAccelerationBatchPlain(pot, x, y, z, ax, ay, az, n);
+    }
+}
 
 
+/* Potentials of the models above, for checking energy conservation.
+ * Each one's gradient is minus the acceleration above. */
 
+static inline real sphericalPotential(const Spherical* sph, real r)
+{
+    return -sph->mass / (sph->scale + r);
+}
 
+static inline real miyamotoNagaiDiskPotential(const Disk* disk, mwvector pos)
+{
+    const real zp  = mw_sqrt(sqr(Z(pos)) + sqr(disk->scaleHeight));
+    const real azp = disk->scaleLength + zp;
 
+    return -disk->mass / mw_sqrt(sqr(X(pos)) + sqr(Y(pos)) + sqr(azp));
+}
 
+static inline real exponentialDiskPotential(const Disk* disk, real r)
+{
+    return -disk->mass * (1.0 - mw_exp(-r / disk->scaleLength)) / r;
+}
 
+static inline real logHaloPotential(const Halo* halo, mwvector pos)
+{
+    const real qsqr = sqr(halo->flattenZ);
+    const real arst = sqr(halo->scaleLength) + sqr(X(pos)) + sqr(Y(pos));
+
+    return sqr(halo->vhalo) * mw_log(arst + sqr(Z(pos)) / qsqr);
+}
+
+static inline real nfwHaloPotential(const Halo* halo, real r)
+{
+    const real a = halo->scaleLength;
 
+    /* Same constant as the acceleration */
+    return -a * sqr(a) * 237.209949228 * mw_log((r + a) / a) / r;
+}
+
+static inline real triaxialHaloPotential(const Halo* h, mwvector pos)
+{
+    const real arst = sqr(h->scaleLength) + (h->c1 * sqr(X(pos))) + (h->c3 * X(pos) * Y(pos)) + (h->c2 * sqr(Y(pos)));
+
+    return sqr(h->vhalo) * mw_log(arst + sqr(Z(pos)) / sqr(h->flattenZ));
+}
+
+/* NAN if some component has no potential here */
+real nbExtPotential(const Potential* pot, mwvector pos)
+{
+    real phi;
+    const real r = mw_absv(pos);
+
+    switch (pot->disk.type)
+    {
+        case ExponentialDisk:
+            phi = exponentialDiskPotential(&pot->disk, r);
+            break;
+        case MiyamotoNagaiDisk:
+            phi = miyamotoNagaiDiskPotential(&pot->disk, pos);
+            break;
+        case InvalidDisk:
+        default:
+            mw_fail("Invalid disk type in external potential\n");
+    }
 
+    switch (pot->halo.type)
+    {
+        case LogarithmicHalo:
+            phi += logHaloPotential(&pot->halo, pos);
+            break;
+        case NFWHalo:
+            phi += nfwHaloPotential(&pot->halo, r);
+            break;
+        case TriaxialHalo:
+            phi += triaxialHaloPotential(&pot->halo, pos);
+            break;
+        case CausticHalo:
+            return NAN;
+        case InvalidHalo:
+        default:
+            mw_fail("Invalid halo type in external potential\n");
+    }
 
+    return phi + sphericalPotential(&pot->sphere[0], r);
+}
 
@@ -0,0 +1,1116 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Native evaluation of simple Lua potential closures.
+ *
+ * Most potential closures are a list of locals computed from x, y and
+ * z with arithmetic and the math functions, then a return of the 3
+ * accelerations. The closure's source is found again in the script
+ * from its line numbers and parsed as that subset of Lua: "local a =
+ * expr", "a = expr" for a local or parameter, and "return e1, e2, e3".
+ * Numbers it uses from globals or upvalues are read once, here. Any
+ * other statement or value, or a closure loaded from anywhere but the
+ * script string, isn't compiled and the closure is called as before.
+ *
+ * It compiles to instructions on registers of POTENTIAL_EXPR_LANES
+ * bodies each, so each instruction is a short loop over bodies the
+ * compiler can vectorize. Every operation is the same C operation the
+ * Lua interpreter or milkyway_lua_math.c would have done, in the same
+ * order, so the results should be the same to the bit, and a compiled
+ * closure is only used once it has been checked that they are.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_potential_expr.h"
+#include "milkyway_util.h"
+#include "milkyway_lua.h"
+
+#include <ctype.h>
+#include <lauxlib.h>
+
+
+/* Bodies worked on together */
+#define POTENTIAL_EXPR_LANES 64
+
+/* Registers of POTENTIAL_EXPR_LANES reals on the stack */
+#define POTENTIAL_EXPR_MAX_REGS 64
+
+#define POTENTIAL_EXPR_MAX_INSTR 4096
+#define POTENTIAL_EXPR_MAX_LOCALS 256
+#define POTENTIAL_EXPR_MAX_NAME 64
+
+typedef enum
+{
+    EXPR_ADD,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_DIV,
+    EXPR_MOD,
+    EXPR_POW,       /* the ^ operator */
+    EXPR_NEG,
+
+    /* Functions from milkyway_lua_math.c */
+    EXPR_SQR,
+    EXPR_CUBE,
+    EXPR_SQRT,
+    EXPR_RSQRT,
+    EXPR_EXP,
+    EXPR_LOG,
+    EXPR_LOG10,
+    EXPR_SIN,
+    EXPR_COS,
+    EXPR_TAN,
+    EXPR_ASIN,
+    EXPR_SINH,
+    EXPR_COSH,
+    EXPR_FABS,
+    EXPR_FLOOR,
+    EXPR_CEIL,
+    EXPR_D2R,
+    EXPR_R2D,
+    EXPR_FMOD,
+    EXPR_MW_POW,
+    EXPR_HYPOT,
+    EXPR_ATAN2
+} PotentialExprOp;
+
+typedef struct
+{
+    const char* name;
+    int nArg;
+    PotentialExprOp op;
+} PotentialExprFunc;
+
+/* atan is left out since it is bound to acos, and tanh, exp2 and
+ * exp10 since which versions they are depends on the build */
+static const PotentialExprFunc exprFuncs[] =
+{
+    { "sqr",   1, EXPR_SQR     },
+    { "cube",  1, EXPR_CUBE    },
+    { "sqrt",  1, EXPR_SQRT    },
+    { "rsqrt", 1, EXPR_RSQRT   },
+    { "exp",   1, EXPR_EXP     },
+    { "log",   1, EXPR_LOG     },
+    { "log10", 1, EXPR_LOG10   },
+    { "sin",   1, EXPR_SIN     },
+    { "cos",   1, EXPR_COS     },
+    { "tan",   1, EXPR_TAN     },
+    { "asin",  1, EXPR_ASIN    },
+    { "sinh",  1, EXPR_SINH    },
+    { "cosh",  1, EXPR_COSH    },
+    { "fabs",  1, EXPR_FABS    },
+    { "floor", 1, EXPR_FLOOR   },
+    { "ceil",  1, EXPR_CEIL    },
+    { "d2r",   1, EXPR_D2R     },
+    { "r2d",   1, EXPR_R2D     },
+    { "fmod",  2, EXPR_FMOD    },
+    { "pow",   2, EXPR_MW_POW  },
+    { "hypot", 2, EXPR_HYPOT   },
+    { "atan2", 2, EXPR_ATAN2   },
+    { NULL,    0, EXPR_ADD     }
+};
+
+static const char* luaReserved[] =
+{
+    "and", "break", "do", "else", "elseif", "end", "false", "for", "function",
+    "if", "in", "local", "nil", "not", "or", "repeat", "return", "then", "true",
+    "until", "while", NULL
+};
+
+typedef struct
+{
+    int op;
+    int dst, a, b;
+} PotentialExprInstr;
+
+struct NBodyPotentialExpr
+{
+    int nInstr;
+    PotentialExprInstr* code;
+    int nConst;
+    real* constants;     /* in registers 3 to 3 + nConst - 1 */
+    int nReg;
+    int out[3];          /* registers of ax, ay, az */
+};
+
+typedef enum
+{
+    TOK_EOF,
+    TOK_NUMBER,
+    TOK_NAME,
+    TOK_OP,
+    TOK_BAD
+} PotentialExprToken;
+
+typedef struct
+{
+    char name[POTENTIAL_EXPR_MAX_NAME];
+    int reg;
+} PotentialExprLocal;
+
+typedef struct
+{
+    lua_State* luaSt;
+    int funcIdx;               /* closure on the Lua stack */
+
+    const char* p;             /* next character of the source */
+    int line;
+    PotentialExprToken tok;
+    char op;
+    real number;
+    char name[POTENTIAL_EXPR_MAX_NAME];
+
+    const char* error;         /* first reason it can't be compiled */
+
+    PotentialExprLocal locals[POTENTIAL_EXPR_MAX_LOCALS];
+    int nLocal;
+
+    /* Virtual registers: x, y, z, then a new one for each constant and
+     * instruction */
+    PotentialExprInstr code[POTENTIAL_EXPR_MAX_INSTR];
+    int nInstr;
+    real constants[POTENTIAL_EXPR_MAX_INSTR];
+    int constReg[POTENTIAL_EXPR_MAX_INSTR];
+    int nConst;
+    int nVirtual;
+} PotentialExprCompiler;
+
+
+static int nbExprFail(PotentialExprCompiler* c, const char* why)
+{
+    if (!c->error)
+        c->error = why;
+    return -1;
+}
+
+/* Lua's own newline rules: \n, \r, \n\r or \r\n */
+static const char* nbExprSkipNewline(const char* p)
+{
+    const char first = *p++;
+
+    if ((*p == '\n' || *p == '\r') && *p != first)
+        ++p;
+    return p;
+}
+
+static void nbExprNext(PotentialExprCompiler* c)
+{
+    const char* p = c->p;
+
+    for (;;)
+    {
+        if (*p == '\n' || *p == '\r')
+        {
+            p = nbExprSkipNewline(p);
+            ++c->line;
+        }
+        else if (*p == ' ' || *p == '\t' || *p == '\f' || *p == '\v')
+        {
+            ++p;
+        }
+        else if (p[0] == '-' && p[1] == '-')
+        {
+            if (p[2] == '[' && (p[3] == '[' || p[3] == '='))
+            {
+                c->tok = TOK_BAD;   /* long comment */
+                return;
+            }
+
+            while (*p != '\0' && *p != '\n' && *p != '\r')
+                ++p;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (*p == '\0')
+    {
+        c->tok = TOK_EOF;
+    }
+    else if (isdigit((unsigned char) *p) || (*p == '.' && isdigit((unsigned char) p[1])))
+    {
+        char* end;
+
+        c->number = (real) strtod(p, &end);
+        if (isalnum((unsigned char) *end) || *end == '_' || *end == '.')
+        {
+            c->tok = TOK_BAD;
+            return;
+        }
+
+        c->tok = TOK_NUMBER;
+        p = end;
+    }
+    else if (isalpha((unsigned char) *p) || *p == '_')
+    {
+        size_t len = 0;
+
+        while (isalnum((unsigned char) p[len]) || p[len] == '_')
+            ++len;
+
+        if (len >= POTENTIAL_EXPR_MAX_NAME)
+        {
+            c->tok = TOK_BAD;
+            return;
+        }
+
+        memcpy(c->name, p, len);
+        c->name[len] = '\0';
+        c->tok = TOK_NAME;
+        p += len;
+    }
+    else if (strchr("+-*/%^(),=;", *p) && !(p[0] == '=' && p[1] == '='))
+    {
+        c->op = *p++;
+        c->tok = TOK_OP;
+    }
+    else
+    {
+        c->tok = TOK_BAD;
+        return;
+    }
+
+    c->p = p;
+}
+
+static mwbool nbExprIsOp(const PotentialExprCompiler* c, char op)
+{
+    return c->tok == TOK_OP && c->op == op;
+}
+
+static mwbool nbExprIsName(const PotentialExprCompiler* c, const char* name)
+{
+    return c->tok == TOK_NAME && !strcmp(c->name, name);
+}
+
+static mwbool nbExprIsReserved(const char* name)
+{
+    int i;
+
+    for (i = 0; luaReserved[i]; ++i)
+    {
+        if (!strcmp(name, luaReserved[i]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int nbExprConstant(PotentialExprCompiler* c, real value)
+{
+    int i;
+
+    for (i = 0; i < c->nConst; ++i)
+    {
+        /* Compare the bits so -0.0 and 0.0 stay apart */
+        if (!memcmp(&c->constants[i], &value, sizeof(real)))
+            return c->constReg[i];
+    }
+
+    if (c->nVirtual >= POTENTIAL_EXPR_MAX_INSTR)
+        return nbExprFail(c, "too long");
+
+    c->constants[c->nConst] = value;
+    c->constReg[c->nConst] = c->nVirtual++;
+    return c->constReg[c->nConst++];
+}
+
+/* The constant in virtual register r, if it is one */
+static mwbool nbExprIsConstant(const PotentialExprCompiler* c, int r, real* value)
+{
+    int i;
+
+    for (i = 0; i < c->nConst; ++i)
+    {
+        if (c->constReg[i] == r)
+        {
+            *value = c->constants[i];
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* milkyway_lua_math.c is built without crlibm, so the closure gets the
+ * C library's functions and so must this */
+static real nbExprApply(int op, real a, real b)
+{
+    switch (op)
+    {
+        case EXPR_ADD:
+            return a + b;
+        case EXPR_SUB:
+            return a - b;
+        case EXPR_MUL:
+            return a * b;
+        case EXPR_DIV:
+            return a / b;
+        case EXPR_MOD:
+            return a - floor(a / b) * b;
+        case EXPR_POW:
+            return pow(a, b);
+        case EXPR_NEG:
+            return -a;
+        case EXPR_SQR:
+            return sqr(a);
+        case EXPR_CUBE:
+            return cube(a);
+        case EXPR_SQRT:
+            return mw_sqrt(a);
+        case EXPR_RSQRT:
+            return mw_rsqrt(a);
+        case EXPR_EXP:
+            return exp(a);
+        case EXPR_LOG:
+            return log(a);
+        case EXPR_LOG10:
+            return log10(a);
+        case EXPR_SIN:
+            return sin(a);
+        case EXPR_COS:
+            return cos(a);
+        case EXPR_TAN:
+            return tan(a);
+        case EXPR_ASIN:
+            return asin(a);
+        case EXPR_SINH:
+            return sinh(a);
+        case EXPR_COSH:
+            return cosh(a);
+        case EXPR_FABS:
+            return mw_fabs(a);
+        case EXPR_FLOOR:
+            return mw_floor(a);
+        case EXPR_CEIL:
+            return mw_ceil(a);
+        case EXPR_D2R:
+            return d2r(a);
+        case EXPR_R2D:
+            return r2d(a);
+        case EXPR_FMOD:
+            return mw_fmod(a, b);
+        case EXPR_MW_POW:
+            return pow(a, b);
+        case EXPR_HYPOT:
+            return mw_hypot(a, b);
+        case EXPR_ATAN2:
+            return mw_atan2(a, b);
+        default:
+            mw_panic("Unknown potential instruction %d\n", op);
+            return NAN;
+    }
+}
+
+/* Add an instruction, or work it out now if its operands are
+ * constants. Lua folds the same constants itself when it can, with
+ * the same arithmetic. */
+static int nbExprEmit(PotentialExprCompiler* c, int op, int a, int b)
+{
+    real va, vb = 0.0;
+    PotentialExprInstr* ins;
+
+    if (a < 0 || b < -1)
+        return -1;
+
+    if (nbExprIsConstant(c, a, &va) && (b < 0 || nbExprIsConstant(c, b, &vb)))
+        return nbExprConstant(c, nbExprApply(op, va, vb));
+
+    if (c->nInstr >= POTENTIAL_EXPR_MAX_INSTR || c->nVirtual >= POTENTIAL_EXPR_MAX_INSTR)
+        return nbExprFail(c, "too long");
+
+    ins = &c->code[c->nInstr++];
+    ins->op = op;
+    ins->a = a;
+    ins->b = b;
+    ins->dst = c->nVirtual++;
+
+    return ins->dst;
+}
+
+static int nbExprFindLocal(const PotentialExprCompiler* c, const char* name)
+{
+    int i;
+
+    for (i = c->nLocal - 1; i >= 0; --i)
+    {
+        if (!strcmp(c->locals[i].name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+/* Push the global the closure sees by that name, which is in its own
+ * environment */
+static void nbExprGetGlobal(const PotentialExprCompiler* c, const char* name)
+{
+    lua_getfenv(c->luaSt, c->funcIdx);
+    lua_getfield(c->luaSt, -1, name);
+    lua_remove(c->luaSt, -2);
+}
+
+/* An upvalue or global that is a number. Everything is looked up
+ * once, so the closure must not change them. */
+static int nbExprOuterNumber(PotentialExprCompiler* c, const char* name)
+{
+    int n;
+    const char* upName;
+    lua_State* luaSt = c->luaSt;
+
+    for (n = 1; (upName = lua_getupvalue(luaSt, c->funcIdx, n)) != NULL; ++n)
+    {
+        if (!strcmp(upName, name))
+        {
+            real value = (real) lua_tonumber(luaSt, -1);
+            int isNumber = (lua_type(luaSt, -1) == LUA_TNUMBER);
+
+            lua_pop(luaSt, 1);
+            return isNumber ? nbExprConstant(c, value) : nbExprFail(c, "uses an upvalue that isn't a number");
+        }
+
+        lua_pop(luaSt, 1);
+    }
+
+    nbExprGetGlobal(c, name);
+    if (lua_type(luaSt, -1) == LUA_TNUMBER)
+    {
+        real value = (real) lua_tonumber(luaSt, -1);
+
+        lua_pop(luaSt, 1);
+        return nbExprConstant(c, value);
+    }
+
+    lua_pop(luaSt, 1);
+    return nbExprFail(c, "uses a global that isn't a number");
+}
+
+static mwbool nbExprIsUpvalue(const PotentialExprCompiler* c, const char* name)
+{
+    int n;
+    const char* upName;
+
+    for (n = 1; (upName = lua_getupvalue(c->luaSt, c->funcIdx, n)) != NULL; ++n)
+    {
+        lua_pop(c->luaSt, 1);
+        if (!strcmp(upName, name))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int nbExprExpression(PotentialExprCompiler* c);
+
+/* A call of one of the math functions, if it is still the C function
+ * milkyway_lua_math.c registered */
+static int nbExprCall(PotentialExprCompiler* c, const char* name)
+{
+    int i, nArg = 0;
+    int args[2] = { -1, -1 };
+    mwbool isC;
+
+    if (nbExprFindLocal(c, name) >= 0 || nbExprIsUpvalue(c, name))
+        return nbExprFail(c, "calls a local");
+
+    nbExprGetGlobal(c, name);
+    isC = lua_iscfunction(c->luaSt, -1);
+    lua_pop(c->luaSt, 1);
+
+    for (i = 0; exprFuncs[i].name; ++i)
+    {
+        if (!strcmp(exprFuncs[i].name, name))
+            break;
+    }
+
+    if (!exprFuncs[i].name || !isC)
+        return nbExprFail(c, "calls an unsupported function");
+
+    nbExprNext(c);   /* ( */
+    if (!nbExprIsOp(c, ')'))
+    {
+        for (;;)
+        {
+            int arg = nbExprExpression(c);
+
+            if (arg < 0)
+                return -1;
+            if (nArg == 2)
+                return nbExprFail(c, "calls a function with the wrong number of arguments");
+            args[nArg++] = arg;
+
+            if (!nbExprIsOp(c, ','))
+                break;
+            nbExprNext(c);
+        }
+    }
+
+    if (!nbExprIsOp(c, ')'))
+        return nbExprFail(c, "unsupported syntax");
+    nbExprNext(c);
+
+    if (nArg != exprFuncs[i].nArg)
+        return nbExprFail(c, "calls a function with the wrong number of arguments");
+
+    return nbExprEmit(c, exprFuncs[i].op, args[0], args[1]);
+}
+
+static int nbExprUnary(PotentialExprCompiler* c);
+
+static int nbExprPrimary(PotentialExprCompiler* c)
+{
+    if (c->tok == TOK_NUMBER)
+    {
+        real value = c->number;
+
+        nbExprNext(c);
+        return nbExprConstant(c, value);
+    }
+    else if (c->tok == TOK_NAME && !nbExprIsReserved(c->name))
+    {
+        char name[POTENTIAL_EXPR_MAX_NAME];
+        int local;
+
+        strcpy(name, c->name);
+        nbExprNext(c);
+
+        if (nbExprIsOp(c, '('))
+            return nbExprCall(c, name);
+
+        local = nbExprFindLocal(c, name);
+        return local >= 0 ? c->locals[local].reg : nbExprOuterNumber(c, name);
+    }
+    else if (nbExprIsOp(c, '('))
+    {
+        int r;
+
+        nbExprNext(c);
+        r = nbExprExpression(c);
+        if (r < 0)
+            return -1;
+        if (!nbExprIsOp(c, ')'))
+            return nbExprFail(c, "unsupported syntax");
+        nbExprNext(c);
+        return r;
+    }
+
+    return nbExprFail(c, "unsupported syntax");
+}
+
+/* ^ is right associative and binds tighter than unary minus on its
+ * left, but not on its right */
+static int nbExprPower(PotentialExprCompiler* c)
+{
+    int base = nbExprPrimary(c);
+
+    if (base >= 0 && nbExprIsOp(c, '^'))
+    {
+        nbExprNext(c);
+        return nbExprEmit(c, EXPR_POW, base, nbExprUnary(c));
+    }
+
+    return base;
+}
+
+static int nbExprUnary(PotentialExprCompiler* c)
+{
+    if (nbExprIsOp(c, '-'))
+    {
+        nbExprNext(c);
+        return nbExprEmit(c, EXPR_NEG, nbExprUnary(c), -1);
+    }
+
+    return nbExprPower(c);
+}
+
+static int nbExprTerm(PotentialExprCompiler* c)
+{
+    int r = nbExprUnary(c);
+
+    while (r >= 0 && (nbExprIsOp(c, '*') || nbExprIsOp(c, '/') || nbExprIsOp(c, '%')))
+    {
+        const int op = c->op == '*' ? EXPR_MUL : (c->op == '/' ? EXPR_DIV : EXPR_MOD);
+
+        nbExprNext(c);
+        r = nbExprEmit(c, op, r, nbExprUnary(c));
+    }
+
+    return r;
+}
+
+static int nbExprExpression(PotentialExprCompiler* c)
+{
+    int r = nbExprTerm(c);
+
+    while (r >= 0 && (nbExprIsOp(c, '+') || nbExprIsOp(c, '-')))
+    {
+        const int op = c->op == '+' ? EXPR_ADD : EXPR_SUB;
+
+        nbExprNext(c);
+        r = nbExprEmit(c, op, r, nbExprTerm(c));
+    }
+
+    if (r >= 0 && c->tok == TOK_BAD)
+        return nbExprFail(c, "unsupported syntax");
+
+    return r;
+}
+
+static int nbExprAddLocal(PotentialExprCompiler* c, const char* name, int reg)
+{
+    if (c->nLocal >= POTENTIAL_EXPR_MAX_LOCALS)
+        return nbExprFail(c, "too many locals");
+
+    strcpy(c->locals[c->nLocal].name, name);
+    c->locals[c->nLocal].reg = reg;
+    ++c->nLocal;
+
+    return 0;
+}
+
+/* "function [name] (x, y, z)" */
+static int nbExprHeader(PotentialExprCompiler* c)
+{
+    int i;
+
+    if (!nbExprIsName(c, "function"))
+        return nbExprFail(c, "unsupported syntax");
+    nbExprNext(c);
+
+    if (c->tok == TOK_NAME)
+        nbExprNext(c);
+    if (!nbExprIsOp(c, '('))
+        return nbExprFail(c, "isn't a plain function");
+    nbExprNext(c);
+
+    for (i = 0; i < 3; ++i)
+    {
+        if (c->tok != TOK_NAME || nbExprIsReserved(c->name))
+            return nbExprFail(c, "doesn't take 3 arguments");
+        nbExprAddLocal(c, c->name, i);
+        nbExprNext(c);
+
+        if (i < 2 && !nbExprIsOp(c, ','))
+            return nbExprFail(c, "doesn't take 3 arguments");
+        if (i < 2)
+            nbExprNext(c);
+    }
+
+    if (!nbExprIsOp(c, ')'))
+        return nbExprFail(c, "doesn't take 3 arguments");
+    nbExprNext(c);
+
+    return 0;
+}
+
+/* Statements up to and including "return e1, e2, e3 end" */
+static int nbExprBody(PotentialExprCompiler* c, int lastLine, int out[3])
+{
+    int i;
+
+    while (!nbExprIsName(c, "return"))
+    {
+        char name[POTENTIAL_EXPR_MAX_NAME];
+        mwbool isLocal = nbExprIsName(c, "local");
+        int r, local;
+
+        if (isLocal)
+            nbExprNext(c);
+
+        if (c->tok != TOK_NAME || nbExprIsReserved(c->name))
+            return nbExprFail(c, "has a statement other than an assignment");
+
+        strcpy(name, c->name);
+        nbExprNext(c);
+        if (!nbExprIsOp(c, '='))
+            return nbExprFail(c, "has a statement other than an assignment");
+        nbExprNext(c);
+
+        r = nbExprExpression(c);
+        if (r < 0)
+            return -1;
+
+        local = nbExprFindLocal(c, name);
+        if (isLocal)
+        {
+            if (nbExprAddLocal(c, name, r))
+                return -1;
+        }
+        else if (local >= 0)
+        {
+            c->locals[local].reg = r;
+        }
+        else
+        {
+            return nbExprFail(c, "assigns to a global");
+        }
+
+        if (nbExprIsOp(c, ';'))
+            nbExprNext(c);
+    }
+
+    nbExprNext(c);
+
+    for (i = 0; i < 3; ++i)
+    {
+        out[i] = nbExprExpression(c);
+        if (out[i] < 0)
+            return -1;
+
+        if (i < 2 && !nbExprIsOp(c, ','))
+            return nbExprFail(c, "doesn't return 3 values");
+        if (i < 2)
+            nbExprNext(c);
+    }
+
+    if (nbExprIsOp(c, ';'))
+        nbExprNext(c);
+
+    if (!nbExprIsName(c, "end"))
+        return nbExprFail(c, "doesn't end after the return");
+
+    if (c->line != lastLine)
+        return nbExprFail(c, "couldn't be found in the script");
+
+    return 0;
+}
+
+/* Start of the line'th line of s, counting from 1 */
+static const char* nbExprFindLine(const char* s, int line)
+{
+    int n = 1;
+
+    while (*s != '\0' && n < line)
+    {
+        if (*s == '\n' || *s == '\r')
+        {
+            s = nbExprSkipNewline(s);
+            ++n;
+        }
+        else
+        {
+            ++s;
+        }
+    }
+
+    return n == line ? s : NULL;
+}
+
+/* The one "function" on the line, before any comment */
+static const char* nbExprFindFunction(const char* line)
+{
+    const char* p;
+    const char* found = NULL;
+
+    for (p = line; *p != '\0' && *p != '\n' && *p != '\r'; ++p)
+    {
+        if (p[0] == '-' && p[1] == '-')
+            break;
+
+        if (   !strncmp(p, "function", 8)
+            && (p == line || !(isalnum((unsigned char) p[-1]) || p[-1] == '_'))
+            && !(isalnum((unsigned char) p[8]) || p[8] == '_'))
+        {
+            if (found)
+                return NULL;
+            found = p;
+        }
+    }
+
+    return found;
+}
+
+/* Map the virtual registers to as few real ones as possible, dropping
+ * instructions nothing uses */
+static NBodyPotentialExpr* nbExprAllocate(const PotentialExprCompiler* c, const int out[3])
+{
+    int i, j;
+    int nFree = 0, nReg;
+    const int nVirtual = c->nVirtual;
+    int* lastUse = (int*) mwMalloc(nVirtual * sizeof(int));
+    int* phys = (int*) mwMalloc(nVirtual * sizeof(int));
+    int* freeRegs = (int*) mwMalloc(nVirtual * sizeof(int));
+    mwbool* live = (mwbool*) mwCalloc(nVirtual, sizeof(mwbool));
+    NBodyPotentialExpr* e = (NBodyPotentialExpr*) mwCalloc(1, sizeof(NBodyPotentialExpr));
+
+    for (i = 0; i < 3; ++i)
+        live[out[i]] = TRUE;
+
+    for (i = c->nInstr - 1; i >= 0; --i)
+    {
+        const PotentialExprInstr* ins = &c->code[i];
+
+        if (live[ins->dst])
+        {
+            live[ins->a] = TRUE;
+            if (ins->b >= 0)
+                live[ins->b] = TRUE;
+        }
+    }
+
+    /* x, y, z and the constants stay in the same registers throughout */
+    for (i = 0; i < nVirtual; ++i)
+    {
+        lastUse[i] = -1;
+        phys[i] = -1;
+    }
+
+    phys[0] = 0;
+    phys[1] = 1;
+    phys[2] = 2;
+    nReg = 3;
+
+    e->constants = (real*) mwMalloc(MAX(c->nConst, 1) * sizeof(real));
+    for (i = 0; i < c->nConst; ++i)
+    {
+        phys[c->constReg[i]] = nReg++;
+        e->constants[e->nConst++] = c->constants[i];
+    }
+
+    for (i = 0; i < c->nInstr; ++i)
+    {
+        const PotentialExprInstr* ins = &c->code[i];
+
+        if (!live[ins->dst])
+            continue;
+
+        lastUse[ins->a] = i;
+        if (ins->b >= 0)
+            lastUse[ins->b] = i;
+    }
+
+    e->code = (PotentialExprInstr*) mwMalloc(MAX(c->nInstr, 1) * sizeof(PotentialExprInstr));
+
+    for (i = 0; i < c->nInstr; ++i)
+    {
+        const PotentialExprInstr* ins = &c->code[i];
+        PotentialExprInstr* outIns;
+        const int operands[2] = { ins->a, ins->b };
+
+        if (!live[ins->dst])
+            continue;
+
+        outIns = &e->code[e->nInstr++];
+        outIns->op = ins->op;
+        outIns->a = phys[ins->a];
+        outIns->b = ins->b >= 0 ? phys[ins->b] : -1;
+
+        /* Operands used for the last time can hold the result, since
+         * each lane is read before it is written */
+        for (j = 0; j < 2; ++j)
+        {
+            const int v = operands[j];
+
+            if (v > 2 && lastUse[v] == i && phys[v] >= 3 + c->nConst
+                && !(j == 1 && operands[0] == v))
+            {
+                freeRegs[nFree++] = phys[v];
+            }
+        }
+
+        phys[ins->dst] = nFree > 0 ? freeRegs[--nFree] : nReg++;
+        outIns->dst = phys[ins->dst];
+
+        /* Returned values aren't used again but must not be reused */
+        for (j = 0; j < 3; ++j)
+        {
+            if (out[j] == ins->dst)
+                lastUse[ins->dst] = c->nInstr;
+        }
+    }
+
+    for (i = 0; i < 3; ++i)
+        e->out[i] = phys[out[i]];
+    e->nReg = nReg;
+
+    free(lastUse);
+    free(phys);
+    free(freeRegs);
+    free(live);
+
+    return e;
+}
+
+NBodyPotentialExpr* nbCompilePotentialClosure(lua_State* luaSt, int closure)
+{
+    lua_Debug ar;
+    const char* start;
+    int out[3];
+    int failed;
+    PotentialExprCompiler* c;
+    NBodyPotentialExpr* e = NULL;
+
+    getLuaClosure(luaSt, &closure);
+    lua_pushvalue(luaSt, -1);
+    if (!lua_getinfo(luaSt, ">S", &ar))
+    {
+        lua_pop(luaSt, 1);
+        return NULL;
+    }
+
+    /* Scripts are loaded from a string, which is then the source */
+    if (ar.source[0] == '=' || ar.source[0] == '@' || ar.linedefined <= 0)
+    {
+        mw_printf("Lua potential closure can't be compiled: it isn't in the script\n");
+        lua_pop(luaSt, 1);
+        return NULL;
+    }
+
+    start = nbExprFindLine(ar.source, ar.linedefined);
+    start = start ? nbExprFindFunction(start) : NULL;
+    if (!start)
+    {
+        mw_printf("Lua potential closure can't be compiled: it couldn't be found in the script\n");
+        lua_pop(luaSt, 1);
+        return NULL;
+    }
+
+    c = (PotentialExprCompiler*) mwCalloc(1, sizeof(PotentialExprCompiler));
+    c->luaSt = luaSt;
+    c->funcIdx = lua_gettop(luaSt);
+    c->p = start;
+    c->line = ar.linedefined;
+    c->nVirtual = 3;
+
+    nbExprNext(c);
+    failed = nbExprHeader(c) || nbExprBody(c, ar.lastlinedefined, out);
+
+    lua_pop(luaSt, 1);
+
+    if (!failed)
+    {
+        e = nbExprAllocate(c, out);
+        if (e->nReg > POTENTIAL_EXPR_MAX_REGS)
+        {
+            c->error = "too long";
+            nbFreePotentialExpr(e);
+            e = NULL;
+        }
+    }
+
+    if (e)
+    {
+        mw_printf("Compiled Lua potential closure to %d instructions on %d registers\n", e->nInstr, e->nReg);
+    }
+    else
+    {
+        mw_printf("Lua potential closure can't be compiled: %s, line %d\n",
+                  c->error ? c->error : "unsupported syntax",
+                  c->line);
+    }
+
+    free(c);
+    return e;
+}
+
+void nbFreePotentialExpr(NBodyPotentialExpr* e)
+{
+    if (!e)
+        return;
+
+    free(e->code);
+    free(e->constants);
+    free(e);
+}
+
+#define EXPR_LANES(expr)                                \
+    for (l = 0; l < POTENTIAL_EXPR_LANES; ++l)          \
+    {                                                   \
+        d[l] = (expr);                                  \
+    }                                                   \
+    break
+
+static void nbExprRun(const NBodyPotentialExpr* e, real reg[][POTENTIAL_EXPR_LANES])
+{
+    int i, l;
+
+    for (i = 0; i < e->nInstr; ++i)
+    {
+        const PotentialExprInstr* ins = &e->code[i];
+        const real* a = reg[ins->a];
+        const real* b = reg[ins->b >= 0 ? ins->b : ins->a];
+        real* d = reg[ins->dst];
+
+        switch (ins->op)
+        {
+            case EXPR_ADD:
+                EXPR_LANES(a[l] + b[l]);
+            case EXPR_SUB:
+                EXPR_LANES(a[l] - b[l]);
+            case EXPR_MUL:
+                EXPR_LANES(a[l] * b[l]);
+            case EXPR_DIV:
+                EXPR_LANES(a[l] / b[l]);
+            case EXPR_NEG:
+                EXPR_LANES(-a[l]);
+            case EXPR_SQR:
+                EXPR_LANES(sqr(a[l]));
+            case EXPR_CUBE:
+                EXPR_LANES(cube(a[l]));
+            case EXPR_SQRT:
+                EXPR_LANES(mw_sqrt(a[l]));
+            default:
+                EXPR_LANES(nbExprApply(ins->op, a[l], b[l]));
+        }
+    }
+}
+
+void nbEvalPotentialExpr(const NBodyPotentialExpr* e,
+                         const real* x, const real* y, const real* z,
+                         real* ax, real* ay, real* az,
+                         unsigned int n)
+{
+    unsigned int start;
+    int c, l;
+    real reg[POTENTIAL_EXPR_MAX_REGS][POTENTIAL_EXPR_LANES];
+
+    for (c = 0; c < e->nConst; ++c)
+    {
+        for (l = 0; l < POTENTIAL_EXPR_LANES; ++l)
+            reg[3 + c][l] = e->constants[c];
+    }
+
+    for (start = 0; start < n; start += POTENTIAL_EXPR_LANES)
+    {
+        const unsigned int m = MIN(POTENTIAL_EXPR_LANES, n - start);
+
+        /* Fill a short block with copies of its last body */
+        for (l = 0; l < POTENTIAL_EXPR_LANES; ++l)
+        {
+            const unsigned int i = start + MIN((unsigned int) l, m - 1);
+
+            reg[0][l] = x[i];
+            reg[1][l] = y[i];
+            reg[2][l] = z[i];
+        }
+
+        nbExprRun(e, reg);
+
+        for (l = 0; l < (int) m; ++l)
+        {
+            ax[start + l] = reg[e->out[0]][l];
+            ay[start + l] = reg[e->out[1]][l];
+            az[start + l] = reg[e->out[2]][l];
+        }
+    }
+}
+
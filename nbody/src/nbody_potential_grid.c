@@ -0,0 +1,528 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Nested grids of a Lua potential closure's acceleration, for the
+ * potentialGridTolerance option.
+ *
+ * The levels are cubes centred on the Galactic Center, each twice the
+ * width of the one inside it, so the spacing is finest where the
+ * bulge and disk change fastest. A point is interpolated with
+ * tricubic Catmull-Rom splines from the smallest level it is in, and
+ * points outside the largest call the closure. Each level has an
+ * extra layer of nodes on every side, so every cell has the 4 x 4 x 4
+ * nodes around it.
+ *
+ * Each level starts with POTENTIAL_GRID_START_CELLS cells on a side.
+ * The error across cells in x and y and the error across cells in z
+ * are measured separately, and whichever is over the tolerance gets
+ * about twice the cells, up to POTENTIAL_GRID_MAX_CELLS and
+ * POTENTIAL_GRID_MAX_CELLS_Z. Disks need a lot more in z than in x and
+ * y. The error at random points is printed once the grid is built.
+ *
+ * The number of cells is odd, so no node is at the center, where
+ * closures often divide by the radius.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_potential_grid.h"
+#include "nbody_lua.h"
+#include "nbody_util.h"
+#include "milkyway_util.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+
+/* Half width of the smallest level in kpc. The largest is this times
+ * 2^(POTENTIAL_GRID_N_LEVEL - 1), 256 kpc. */
+#define POTENTIAL_GRID_INNER 0.25
+#define POTENTIAL_GRID_N_LEVEL 11
+
+/* Cells on a side of a level */
+#define POTENTIAL_GRID_START_CELLS 15
+#define POTENTIAL_GRID_MAX_CELLS 63
+#define POTENTIAL_GRID_MAX_CELLS_Z 255
+#define POTENTIAL_GRID_MAX_NODES_Z (POTENTIAL_GRID_MAX_CELLS_Z + 3)
+
+/* Points given to the closure at once */
+#define POTENTIAL_GRID_CHUNK 256
+
+/* Cell centres checked per level while refining */
+#define POTENTIAL_GRID_REFINE_SAMPLES 4096
+
+/* Random points compared with the closure once the grid is built */
+#define POTENTIAL_GRID_VERIFY_SAMPLES 8192
+#define POTENTIAL_GRID_VERIFY_SEED 1984
+
+typedef struct
+{
+    real halfWidth;     /* lookups in |x|, |y|, |z| <= halfWidth */
+    real h;             /* node spacing in x and y */
+    real hz;            /* node spacing in z */
+    uint32_t nNode;     /* nodes in x and y, starting at -halfWidth - h */
+    uint32_t nNodeZ;    /* nodes in z, starting at -halfWidth - hz */
+    real* acc;          /* ax, ay, az of each node, z fastest */
+} PotentialGridLevel;
+
+static PotentialGridLevel* potentialGrid = NULL;
+
+
+/* Smallest level containing the point, or -1 */
+static int nbPotentialGridFind(const PotentialGridLevel* grid, real x, real y, real z)
+{
+    int k;
+    const real m = mw_fmax(mw_abs(x), mw_fmax(mw_abs(y), mw_abs(z)));
+
+    for (k = 0; k < POTENTIAL_GRID_N_LEVEL; ++k)
+    {
+        if (m <= grid[k].halfWidth)
+            return k;
+    }
+
+    return -1;
+}
+
+static void nbPotentialLevelAccel(const PotentialGridLevel* p, real x, real y, real z, real* aOut)
+{
+    int a, b, c, i, j, k;
+    real wx[4], wy[4], wz[4];
+    real ax = 0.0, ay = 0.0, az = 0.0;
+    const int n = (int) p->nNode;
+    const int nz = (int) p->nNodeZ;
+    const real u = (x + p->halfWidth) / p->h + 1.0;
+    const real v = (y + p->halfWidth) / p->h + 1.0;
+    const real w = (z + p->halfWidth) / p->hz + 1.0;
+
+    i = MIN(MAX((int) u, 1), n - 3);
+    j = MIN(MAX((int) v, 1), n - 3);
+    k = MIN(MAX((int) w, 1), nz - 3);
+
+    nbCubicWeights(u - (real) i, wx);
+    nbCubicWeights(v - (real) j, wy);
+    nbCubicWeights(w - (real) k, wz);
+
+    for (a = 0; a < 4; ++a)
+    {
+        for (b = 0; b < 4; ++b)
+        {
+            const real wab = wx[a] * wy[b];
+            const real* node = &p->acc[3 * (((size_t) (i - 1 + a) * n + (size_t) (j - 1 + b)) * nz + (size_t) (k - 1))];
+
+            for (c = 0; c < 4; ++c)
+            {
+                const real wabc = wab * wz[c];
+
+                ax += wabc * node[3 * c];
+                ay += wabc * node[3 * c + 1];
+                az += wabc * node[3 * c + 2];
+            }
+        }
+    }
+
+    aOut[0] = ax;
+    aOut[1] = ay;
+    aOut[2] = az;
+}
+
+/* The closure's acceleration at n points, spread over the threads */
+static int nbPotentialGridExact(NBodyState* st, const real* x, const real* y, const real* z, real* acc, int n)
+{
+    int c;
+    const int nChunk = (n + POTENTIAL_GRID_CHUNK - 1) / POTENTIAL_GRID_CHUNK;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(c) schedule(dynamic, 1)
+  #endif
+    for (c = 0; c < nChunk; ++c)
+    {
+        int i;
+        const int start = c * POTENTIAL_GRID_CHUNK;
+        const int m = MIN(POTENTIAL_GRID_CHUNK, n - start);
+        real ax[POTENTIAL_GRID_CHUNK], ay[POTENTIAL_GRID_CHUNK], az[POTENTIAL_GRID_CHUNK];
+
+        nbEvalPotentialClosureBatch(st, &x[start], &y[start], &z[start], ax, ay, az, (unsigned int) m);
+
+        for (i = 0; i < m; ++i)
+        {
+            acc[3 * (start + i)] = ax[i];
+            acc[3 * (start + i) + 1] = ay[i];
+            acc[3 * (start + i) + 2] = az[i];
+        }
+    }
+
+    return st->potentialEvalError;
+}
+
+static real nbPotentialGridRelError(const real* a, const real* exact)
+{
+    real norm = mw_sqrt(sqr(exact[0]) + sqr(exact[1]) + sqr(exact[2]));
+    real diff = mw_sqrt(sqr(a[0] - exact[0]) + sqr(a[1] - exact[1]) + sqr(a[2] - exact[2]));
+
+    return norm > 0.0 ? diff / norm : diff;
+}
+
+static int nbFillPotentialLevel(NBodyState* st, PotentialGridLevel* p, uint32_t nCell, uint32_t nCellZ)
+{
+    int row;
+    const int n = (int) nCell + 3;
+    const int nz = (int) nCellZ + 3;
+
+    p->h = 2.0 * p->halfWidth / (real) nCell;
+    p->hz = 2.0 * p->halfWidth / (real) nCellZ;
+    p->nNode = (uint32_t) n;
+    p->nNodeZ = (uint32_t) nz;
+
+    free(p->acc);
+    p->acc = (real*) mwMalloc(3 * (size_t) n * n * nz * sizeof(real));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(row) schedule(dynamic, 1)
+  #endif
+    for (row = 0; row < n * n; ++row)
+    {
+        int k;
+        real x[POTENTIAL_GRID_MAX_NODES_Z], y[POTENTIAL_GRID_MAX_NODES_Z], z[POTENTIAL_GRID_MAX_NODES_Z];
+        real ax[POTENTIAL_GRID_MAX_NODES_Z], ay[POTENTIAL_GRID_MAX_NODES_Z], az[POTENTIAL_GRID_MAX_NODES_Z];
+        real* node = &p->acc[3 * (size_t) row * nz];
+
+        for (k = 0; k < nz; ++k)
+        {
+            x[k] = -p->halfWidth + ((real) (row / n) - 1.0) * p->h;
+            y[k] = -p->halfWidth + ((real) (row % n) - 1.0) * p->h;
+            z[k] = -p->halfWidth + ((real) k - 1.0) * p->hz;
+        }
+
+        nbEvalPotentialClosureBatch(st, x, y, z, ax, ay, az, (unsigned int) nz);
+
+        for (k = 0; k < nz; ++k)
+        {
+            node[3 * k] = ax[k];
+            node[3 * k + 1] = ay[k];
+            node[3 * k + 2] = az[k];
+        }
+    }
+
+    return st->potentialEvalError;
+}
+
+/* rms error over a spread of cells in level L outside level L - 1,
+ * leaving out any points where the closure isn't finite. errXY is from
+ * the middle of each cell in x and y on its lower z face, and errZ
+ * from the middle in z on its lower x and y edge, so each only has the
+ * error of interpolating across the cells in those directions. */
+static int nbPotentialLevelError(NBodyState* st, const PotentialGridLevel* grid, int L, real* errXY, real* errZ)
+{
+    int k, nUsed = 0;
+    int nFinite[2] = { 0, 0 };
+    real sumSq[2] = { 0.0, 0.0 };
+    const PotentialGridLevel* p = &grid[L];
+    const uint64_t nCell1 = p->nNode - 3;
+    const uint64_t nCellZ = p->nNodeZ - 3;
+    const uint64_t nCell = nCell1 * nCell1 * nCellZ;
+    const uint64_t stride = MAX(nCell / POTENTIAL_GRID_REFINE_SAMPLES, 1);
+    const int nSample = (int) MIN(nCell, POTENTIAL_GRID_REFINE_SAMPLES);
+    const real inner = L > 0 ? grid[L - 1].halfWidth : 0.0;
+    real* x = (real*) mwMalloc(2 * nSample * sizeof(real));
+    real* y = (real*) mwMalloc(2 * nSample * sizeof(real));
+    real* z = (real*) mwMalloc(2 * nSample * sizeof(real));
+    real* exact = (real*) mwMalloc(6 * nSample * sizeof(real));
+
+    for (k = 0; k < nSample; ++k)
+    {
+        const uint64_t cell = (uint64_t) k * stride + ((uint64_t) k * 7919) % stride;
+        const real x0 = -p->halfWidth + (real) (cell / (nCell1 * nCellZ)) * p->h;
+        const real y0 = -p->halfWidth + (real) ((cell / nCellZ) % nCell1) * p->h;
+        const real z0 = -p->halfWidth + (real) (cell % nCellZ) * p->hz;
+        const real cx = x0 + 0.5 * p->h;
+        const real cy = y0 + 0.5 * p->h;
+        const real cz = z0 + 0.5 * p->hz;
+
+        if (mw_fmax(mw_abs(cx), mw_fmax(mw_abs(cy), mw_abs(cz))) <= inner)
+            continue;
+
+        x[2 * nUsed] = cx;
+        y[2 * nUsed] = cy;
+        z[2 * nUsed] = z0;
+
+        x[2 * nUsed + 1] = x0;
+        y[2 * nUsed + 1] = y0;
+        z[2 * nUsed + 1] = cz;
+        ++nUsed;
+    }
+
+    if (nbPotentialGridExact(st, x, y, z, exact, 2 * nUsed))
+    {
+        free(x);
+        free(y);
+        free(z);
+        free(exact);
+        return TRUE;
+    }
+
+    for (k = 0; k < 2 * nUsed; ++k)
+    {
+        real a[3];
+
+        if (!isfinite(exact[3 * k]) || !isfinite(exact[3 * k + 1]) || !isfinite(exact[3 * k + 2]))
+            continue;
+
+        nbPotentialLevelAccel(p, x[k], y[k], z[k], a);
+        sumSq[k % 2] += sqr(nbPotentialGridRelError(a, &exact[3 * k]));
+        ++nFinite[k % 2];
+    }
+
+    *errXY = nFinite[0] > 0 ? mw_sqrt(sumSq[0] / (real) nFinite[0]) : 0.0;
+    *errZ = nFinite[1] > 0 ? mw_sqrt(sumSq[1] / (real) nFinite[1]) : 0.0;
+
+    free(x);
+    free(y);
+    free(z);
+    free(exact);
+
+    return FALSE;
+}
+
+static void nbFreePotentialLevels(PotentialGridLevel* grid)
+{
+    int k;
+
+    if (!grid)
+        return;
+
+    for (k = 0; k < POTENTIAL_GRID_N_LEVEL; ++k)
+    {
+        free(grid[k].acc);
+    }
+
+    free(grid);
+}
+
+/* Double the cells of each level from the start in whichever
+ * directions need it until it is good enough */
+static PotentialGridLevel* nbBuildPotentialGrid(NBodyState* st, real tolerance)
+{
+    int k;
+    const real tol = tolerance / mw_sqrt(2.0);   /* for each of errXY, errZ */
+    PotentialGridLevel* grid = (PotentialGridLevel*) mwCalloc(POTENTIAL_GRID_N_LEVEL, sizeof(PotentialGridLevel));
+
+    for (k = 0; k < POTENTIAL_GRID_N_LEVEL; ++k)
+    {
+        PotentialGridLevel* p = &grid[k];
+        uint32_t nCell = POTENTIAL_GRID_START_CELLS;
+        uint32_t nCellZ = POTENTIAL_GRID_START_CELLS;
+        real errXY, errZ;
+
+        p->halfWidth = POTENTIAL_GRID_INNER * (real) (1 << k);
+
+        if (nbFillPotentialLevel(st, p, nCell, nCellZ) || nbPotentialLevelError(st, grid, k, &errXY, &errZ))
+        {
+            nbFreePotentialLevels(grid);
+            return NULL;
+        }
+
+        for (;;)
+        {
+            const mwbool moreXY = errXY > tol && 2 * nCell + 1 <= POTENTIAL_GRID_MAX_CELLS;
+            const mwbool moreZ = errZ > tol && 2 * nCellZ + 1 <= POTENTIAL_GRID_MAX_CELLS_Z;
+
+            if (!moreXY && !moreZ)
+                break;
+
+            if (moreXY)
+                nCell = 2 * nCell + 1;
+            if (moreZ)
+                nCellZ = 2 * nCellZ + 1;
+
+            if (nbFillPotentialLevel(st, p, nCell, nCellZ) || nbPotentialLevelError(st, grid, k, &errXY, &errZ))
+            {
+                nbFreePotentialLevels(grid);
+                return NULL;
+            }
+        }
+
+        if (errXY > tol || errZ > tol)
+        {
+            mw_printf("Lua potential grid level out to %g kpc has rms error %g with %u x %u x %u cells, over the tolerance\n",
+                      p->halfWidth,
+                      mw_sqrt(sqr(errXY) + sqr(errZ)),
+                      nCell, nCell, nCellZ);
+        }
+    }
+
+    return grid;
+}
+
+/* Compare with the closure at random points over the grid, evenly
+ * spread in log radius */
+static int nbVerifyPotentialGrid(NBodyState* st, const PotentialGridLevel* grid)
+{
+    int k;
+    dsfmt_t prng;
+    const int nSample = POTENTIAL_GRID_VERIFY_SAMPLES;
+    const real rMin = 0.25 * grid[0].halfWidth;
+    const real rMax = grid[POTENTIAL_GRID_N_LEVEL - 1].halfWidth;
+    real* x = (real*) mwMalloc(nSample * sizeof(real));
+    real* y = (real*) mwMalloc(nSample * sizeof(real));
+    real* z = (real*) mwMalloc(nSample * sizeof(real));
+    real* exact = (real*) mwMalloc(3 * nSample * sizeof(real));
+    real sumSq = 0.0, maxErr = 0.0;
+    int failed;
+
+    dsfmt_init_gen_rand(&prng, POTENTIAL_GRID_VERIFY_SEED);
+
+    for (k = 0; k < nSample; ++k)
+    {
+        real r = rMin * mw_exp(mwXrandom(&prng, 0.0, 1.0) * mw_log(rMax / rMin));
+        mwvector v = mwRandomVector(&prng, r);
+
+        x[k] = X(v);
+        y[k] = Y(v);
+        z[k] = Z(v);
+    }
+
+    failed = nbPotentialGridExact(st, x, y, z, exact, nSample);
+    if (!failed)
+    {
+        for (k = 0; k < nSample; ++k)
+        {
+            real a[3], err;
+
+            nbPotentialLevelAccel(&grid[nbPotentialGridFind(grid, x[k], y[k], z[k])], x[k], y[k], z[k], a);
+            err = nbPotentialGridRelError(a, &exact[3 * k]);
+
+            sumSq += sqr(err);
+            maxErr = mw_fmax(maxErr, err);
+        }
+
+        mw_printf("Lua potential grid relative error over %d random points: rms = %g, max = %g\n",
+                  nSample,
+                  mw_sqrt(sumSq / (real) nSample),
+                  maxErr);
+    }
+
+    free(x);
+    free(y);
+    free(z);
+    free(exact);
+
+    return failed;
+}
+
+int nbSetupPotentialGrid(const NBodyCtx* ctx, NBodyState* st)
+{
+    int k;
+    uint64_t nNode = 0;
+    double ts;
+
+    if (!(ctx->potentialGridTolerance > 0.0)
+        || ctx->potentialType != EXTERNAL_POTENTIAL_CUSTOM_LUA
+        || potentialGrid)
+    {
+        return FALSE;
+    }
+
+    ts = mwGetTime();
+
+    potentialGrid = nbBuildPotentialGrid(st, ctx->potentialGridTolerance);
+    if (!potentialGrid)
+    {
+        return TRUE;
+    }
+
+    for (k = 0; k < POTENTIAL_GRID_N_LEVEL; ++k)
+    {
+        nNode += (uint64_t) potentialGrid[k].nNode * potentialGrid[k].nNode * potentialGrid[k].nNodeZ;
+    }
+
+    mw_printf("Sampled Lua potential onto grid of "LLU" nodes in %.2f seconds\n", nNode, mwGetTime() - ts);
+
+    return nbVerifyPotentialGrid(st, potentialGrid);
+}
+
+void nbFreePotentialGrid(void)
+{
+    nbFreePotentialLevels(potentialGrid);
+    potentialGrid = NULL;
+}
+
+/* Call the closure for the points outside the grid, gathered in m */
+static void nbPotentialGridMissed(NBodyState* st,
+                                  const unsigned int* miss, unsigned int nMiss,
+                                  const real* mx, const real* my, const real* mz,
+                                  real* ax, real* ay, real* az)
+{
+    unsigned int j;
+    real max[POTENTIAL_GRID_CHUNK], may[POTENTIAL_GRID_CHUNK], maz[POTENTIAL_GRID_CHUNK];
+
+    nbEvalPotentialClosureBatch(st, mx, my, mz, max, may, maz, nMiss);
+
+    for (j = 0; j < nMiss; ++j)
+    {
+        ax[miss[j]] = max[j];
+        ay[miss[j]] = may[j];
+        az[miss[j]] = maz[j];
+    }
+}
+
+int nbPotentialGridAccel(NBodyState* st,
+                         const real* x, const real* y, const real* z,
+                         real* ax, real* ay, real* az,
+                         unsigned int n)
+{
+    unsigned int i, nMiss = 0;
+    unsigned int miss[POTENTIAL_GRID_CHUNK];
+    real mx[POTENTIAL_GRID_CHUNK], my[POTENTIAL_GRID_CHUNK], mz[POTENTIAL_GRID_CHUNK];
+
+    if (!potentialGrid)
+        return FALSE;
+
+    for (i = 0; i < n; ++i)
+    {
+        const int L = nbPotentialGridFind(potentialGrid, x[i], y[i], z[i]);
+        real a[3];
+
+        if (L < 0)
+        {
+            miss[nMiss] = i;
+            mx[nMiss] = x[i];
+            my[nMiss] = y[i];
+            mz[nMiss] = z[i];
+
+            if (++nMiss == POTENTIAL_GRID_CHUNK)
+            {
+                nbPotentialGridMissed(st, miss, nMiss, mx, my, mz, ax, ay, az);
+                nMiss = 0;
+            }
+
+            continue;
+        }
+
+        nbPotentialLevelAccel(&potentialGrid[L], x[i], y[i], z[i], a);
+        ax[i] = a[0];
+        ay[i] = a[1];
+        az[i] = a[2];
+    }
+
+    if (nMiss > 0)
+        nbPotentialGridMissed(st, miss, nMiss, mx, my, mz, ax, ay, az);
+
+    return TRUE;
+}
+
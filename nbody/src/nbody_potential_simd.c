@@ -0,0 +1,135 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Built once for each of SSE2, AVX2 and AVX-512F. The dispatch in
+ * nbody_potential.c picks one at runtime.
+ *
+ * Each step is the same operation in the same order as the one body
+ * version in nbody_potential.c, and there are only adds, multiplies,
+ * divides and square roots, so every width gives the same answer.
+ * This has to be built without contracting to fused multiply-adds. */
+
+#include "nbody_config.h"
+#include "nbody_potential.h"
+
+#ifndef NB_POTENTIAL_KERNEL
+  #error "Potential kernel needs to be built with SSE2 or better"
+#endif
+
+#include "nbody_simd.h"
+
+#if NBODY_POTENTIAL_PAD % VWIDTH != 0
+  #error "Batches must be padded to a multiple of the vector width"
+#endif
+
+
+void NB_POTENTIAL_KERNEL(const Potential* pot,
+                         const real* x, const real* y, const real* z,
+                         real* ax, real* ay, real* az,
+                         unsigned int n)
+{
+    unsigned int i;
+    const PotentialConsts* c = &pot->consts;
+    const int triaxial = (pot->halo.type == TriaxialHalo);
+
+    const vreal sphereNegMass = v_set1(c->sphereNegMass);
+    const vreal sphereScale = v_set1(c->sphereScale);
+    const vreal diskNegMass = v_set1(c->diskNegMass);
+    const vreal diskA = v_set1(c->diskA);
+    const vreal diskBSqr = v_set1(c->diskBSqr);
+    const vreal haloV = v_set1(c->haloV);
+    const vreal haloV2 = v_set1(c->haloV2);
+    const vreal haloDSqr = v_set1(c->haloDSqr);
+    const vreal haloQSqr = v_set1(c->haloQSqr);
+    const vreal c1 = v_set1(pot->halo.c1);
+    const vreal c2 = v_set1(pot->halo.c2);
+    const vreal c3 = v_set1(pot->halo.c3);
+    const vreal c1x2 = v_set1(c->haloC1x2);
+    const vreal c2x2 = v_set1(c->haloC2x2);
+
+    for (i = 0; i < n; i += VWIDTH)
+    {
+        const vreal px = v_load(&x[i]);
+        const vreal py = v_load(&y[i]);
+        const vreal pz = v_load(&z[i]);
+
+        const vreal xsqr = v_mul(px, px);
+        const vreal ysqr = v_mul(py, py);
+        const vreal zsqr = v_mul(pz, pz);
+
+        vreal accX, accY, accZ;
+        vreal hx, hy, hz;
+
+        /* Miyamoto-Nagai disk */
+        {
+            const vreal zp = v_sqrt(v_add(zsqr, diskBSqr));
+            const vreal azp = v_add(diskA, zp);
+            const vreal rp = v_add(v_add(xsqr, ysqr), v_mul(azp, azp));
+            const vreal rth = v_sqrt(v_mul(v_mul(rp, rp), rp));
+
+            accX = v_div(v_mul(diskNegMass, px), rth);
+            accY = v_div(v_mul(diskNegMass, py), rth);
+            accZ = v_div(v_mul(v_mul(diskNegMass, pz), azp), v_mul(zp, rth));
+        }
+
+        /* Logarithmic or triaxial halo */
+        if (triaxial)
+        {
+            const vreal arst = v_add(v_add(v_add(haloDSqr, v_mul(c1, xsqr)),
+                                           v_mul(v_mul(c3, px), py)),
+                                     v_mul(c2, ysqr));
+            const vreal arst2 = v_add(v_div(zsqr, haloQSqr), arst);
+
+            hx = v_div(v_mul(haloV, v_add(v_mul(c1x2, px), v_mul(c3, py))), arst2);
+            hy = v_div(v_mul(haloV, v_add(v_mul(c2x2, py), v_mul(c3, px))), arst2);
+            hz = v_div(v_mul(haloV2, pz), v_add(v_mul(haloQSqr, arst), zsqr));
+        }
+        else
+        {
+            const vreal arst = v_add(v_add(haloDSqr, xsqr), ysqr);
+            const vreal denom = v_add(v_div(zsqr, haloQSqr), arst);
+
+            hx = v_div(v_mul(haloV, px), denom);
+            hy = v_div(v_mul(haloV, py), denom);
+            hz = v_div(v_mul(haloV, pz), v_add(v_mul(haloQSqr, arst), zsqr));
+        }
+
+        accX = v_add(accX, hx);
+        accY = v_add(accY, hy);
+        accZ = v_add(accZ, hz);
+
+        /* Spherical bulge */
+        {
+            const vreal r = v_sqrt(v_add(zsqr, v_add(ysqr, xsqr)));
+            const vreal tmp = v_add(sphereScale, r);
+            const vreal factor = v_div(sphereNegMass, v_mul(r, v_mul(tmp, tmp)));
+
+            accX = v_add(accX, v_mul(px, factor));
+            accY = v_add(accY, v_mul(py, factor));
+            accZ = v_add(accZ, v_mul(pz, factor));
+        }
+
+        v_store(&ax[i], accX);
+        v_store(&ay[i], accY);
+        v_store(&az[i], accZ);
+    }
+}
+
@@ -44,6 +44,8 @@ const char* showCriterionT(criterion_t x)
     {
         case Exact:
             return "Exact";
+        case FMM:
+            return "FMM";
         case TreeCode:
             return "TreeCode";
         case BH86:
@@ -57,6 +59,23 @@ const char* showCriterionT(criterion_t x)
     }
 }
 
+const char* showIntegratorT(integrator_t x)
+{
+    switch (x)
+    {
+        case Leapfrog:
+            return "Leapfrog";
+        case ForestRuth:
+            return "ForestRuth";
+        case PEFRL:
+            return "PEFRL";
+        case InvalidIntegrator:
+            return "InvalidIntegrator";
+        default:
+            return "Bad integrator_t";
+    }
+}
+
 const char* showSphericalT(spherical_t x)
 {
     switch (x)
@@ -318,12 +337,12 @@ char* showCell(const NBodyCell* c)
                      "NBodyCell = {\n"
                      "  cellnode = {\n"
                      "    pos  = %s\n"
-                     "    next = %p\n"
+                     "    next = 0x%08x\n"
                      "    mass = %f\n"
                      "    type = %d\n"
                      "  }\n"
                      "  rcrit2   = %f\n"
-                     "  more     = %p\n"
+                     "  more     = 0x%08x\n"
                      "  stuff    = {\n"
                      "    .quad = {\n"
                      "      .xx = %f, .xy = %f, .xz = %f,\n"
@@ -332,25 +351,25 @@ char* showCell(const NBodyCell* c)
                      "    },\n"
                      "\n"
                      "    .subp = {\n"
-                     "      %p, %p, %p, %p,\n"
-                     "      %p, %p, %p, %p\n"
+                     "      0x%08x, 0x%08x, 0x%08x, 0x%08x,\n"
+                     "      0x%08x, 0x%08x, 0x%08x, 0x%08x\n"
                      "    }\n"
                      "  }\n"
                      "}\n",
                      posBuf,
-                     (void*) Next(c),
+                     Next(c),
                      Mass(c),
                      Type(c),
 
                      Rcrit2(c),
-                     (void*) More(c),
+                     More(c),
 
                      Quad(c).xx, Quad(c).xy, Quad(c).xz,
                      Quad(c).yy, Quad(c).yz,
                      Quad(c).zz,
 
-                     (void*) Subp(c)[0], (void*) Subp(c)[1], (void*) Subp(c)[2], (void*) Subp(c)[3],
-                     (void*) Subp(c)[5], (void*) Subp(c)[5], (void*) Subp(c)[6], (void*) Subp(c)[7]
+                     Subp(c)[0], Subp(c)[1], Subp(c)[2], Subp(c)[3],
+                     Subp(c)[4], Subp(c)[5], Subp(c)[6], Subp(c)[7]
             ))
     {
         mw_fail("asprintf() failed\n");
@@ -462,8 +481,20 @@ char* showNBodyCtx(const NBodyCtx* ctx)
                      "  treeRSize       = %f\n"
                      "  sunGCDist       = %f\n"
                      "  criterion       = %s\n"
+                     "  integrator      = %s\n"
                      "  useQuad         = %s\n"
                      "  allowIncest     = %s\n"
+                     "  useMortonTree   = %s\n"
+                     "  useGroupWalk    = %s\n"
+                     "  useTiledExact   = %s\n"
+                     "  useBlockSteps   = %s\n"
+                     "  useCausticGrid  = %s\n"
+                     "  treeRebuildInterval = %g\n"
+                     "  fmmOrder        = %g\n"
+                     "  blockStepLevels = %g\n"
+                     "  blockStepAccuracy = %g\n"
+                     "  potentialGridTolerance = %g\n"
+                     "  testParticleThreads = %g\n"
                      "  checkpointT     = %d\n"
                      "  nStep           = %u\n"
                      "  potentialType   = %s\n"
@@ -476,8 +507,20 @@ char* showNBodyCtx(const NBodyCtx* ctx)
                      ctx->treeRSize,
                      ctx->sunGCDist,
                      showCriterionT(ctx->criterion),
+                     showIntegratorT(ctx->integrator),
                      showBool(ctx->useQuad),
                      showBool(ctx->allowIncest),
+                     showBool(ctx->useMortonTree),
+                     showBool(ctx->useGroupWalk),
+                     showBool(ctx->useTiledExact),
+                     showBool(ctx->useBlockSteps),
+                     showBool(ctx->useCausticGrid),
+                     ctx->treeRebuildInterval,
+                     ctx->fmmOrder,
+                     ctx->blockStepLevels,
+                     ctx->blockStepAccuracy,
+                     ctx->potentialGridTolerance,
+                     ctx->testParticleThreads,
                      (int) ctx->checkpointT,
                      ctx->nStep,
                      showExternalPotentialType(ctx->potentialType),
@@ -580,14 +623,18 @@ char* showNBodyTree(const NBodyTree* t)
 
     if (0 > asprintf(&buf,
                      "  Tree %p = {\n"
-                     "    root     = %p\n"
-                     "    rsize    = %g\n"
-                     "    cellUsed = %u\n"
-                     "    maxDepth = %u\n"
+                     "    root      = %p\n"
+                     "    rsize     = %g\n"
+                     "    cells     = %p\n"
+                     "    cellAlloc = %u\n"
+                     "    cellUsed  = %u\n"
+                     "    maxDepth  = %u\n"
                      "  };\n",
                      t,
                      t->root,
                      t->rsize,
+                     t->cells,
+                     t->cellAlloc,
                      t->cellUsed,
                      t->maxDepth))
     {
@@ -614,22 +661,20 @@ char* showNBodyState(const NBodyState* st)
     if (0 > asprintf(&buf,
                      "NBodyState %p = {\n"
                      "  tree           = %s\n"
-                     "  freeCell       = %p\n"
                      "  lastCheckpoint = %d\n"
                      "  step           = %u\n"
                      "  nbody          = %u\n"
                      "  bodytab        = %p\n"
-                     "  acctab         = %p\n"
+                     "  soa.mass       = %p\n"
                      "  treeIncest     = %s\n"
                      "};\n",
                      st,
                      treeBuf,
-                     st->freeCell,
                      (int) st->lastCheckpoint,
                      st->step,
                      st->nbody,
                      st->bodytab,
-                     st->acctab,
+                     st->soa.mass,
                      showBool(st->treeIncest)
             ))
     {
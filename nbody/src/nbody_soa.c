@@ -0,0 +1,207 @@
+/*
+ *  Copyright (c) 2010-2011 Rensselaer Polytechnic Institute
+ *  Copyright (c) 2010-2011 Matthew Arsenault
+ *
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nbody_soa.h"
+#include "nbody_util.h"
+#include "milkyway_util.h"
+
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+#endif
+
+/* Accelerations start out 0'ed since the tests may step the system
+ * from an arbitrary place */
+void nbAllocSoA(NBodySoA* soa, int nbody)
+{
+    int i;
+
+    for (i = 0; i < 3; ++i)
+    {
+        soa->pos[i] = (real*) mwMallocA(nbody * sizeof(real));
+        soa->vel[i] = (real*) mwMallocA(nbody * sizeof(real));
+        soa->acc[i] = (real*) mwCallocA(nbody, sizeof(real));
+    }
+
+    soa->mass = (real*) mwMallocA(nbody * sizeof(real));
+    soa->next = (noderef_t*) mwMallocA(nbody * sizeof(noderef_t));
+    soa->type = (body_t*) mwMallocA(nbody * sizeof(body_t));
+    soa->id = (unsigned int*) mwMallocA(nbody * sizeof(unsigned int));
+}
+
+void nbFreeSoA(NBodySoA* soa)
+{
+    static const NBodySoA emptySoA = EMPTY_SOA;
+    int i;
+
+    for (i = 0; i < 3; ++i)
+    {
+        mwFreeA(soa->pos[i]);
+        mwFreeA(soa->vel[i]);
+        mwFreeA(soa->acc[i]);
+    }
+
+    mwFreeA(soa->mass);
+    mwFreeA(soa->next);
+    mwFreeA(soa->type);
+    mwFreeA(soa->id);
+
+    *soa = emptySoA;
+}
+
+void nbCopySoA(NBodySoA* dest, const NBodySoA* src, int nbody)
+{
+    int i;
+
+    for (i = 0; i < 3; ++i)
+    {
+        memcpy(dest->pos[i], src->pos[i], nbody * sizeof(real));
+        memcpy(dest->vel[i], src->vel[i], nbody * sizeof(real));
+        memcpy(dest->acc[i], src->acc[i], nbody * sizeof(real));
+    }
+
+    memcpy(dest->mass, src->mass, nbody * sizeof(real));
+    memcpy(dest->next, src->next, nbody * sizeof(noderef_t));
+    memcpy(dest->type, src->type, nbody * sizeof(body_t));
+    memcpy(dest->id, src->id, nbody * sizeof(unsigned int));
+}
+
+/* Copy the bodies into the store. The accelerations are left alone */
+void nbBodiesToSoA(NBodySoA* soa, const Body* bodies, int nbody)
+{
+    int i;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        const Body* b = &bodies[i];
+
+        soa->pos[0][i] = X(Pos(b));
+        soa->pos[1][i] = Y(Pos(b));
+        soa->pos[2][i] = Z(Pos(b));
+
+        soa->vel[0][i] = X(Vel(b));
+        soa->vel[1][i] = Y(Vel(b));
+        soa->vel[2][i] = Z(Vel(b));
+
+        soa->mass[i] = Mass(b);
+        soa->type[i] = Type(b);
+        soa->id[i] = idBody(b);
+    }
+}
+
+void nbSoAToBodies(Body* bodies, const NBodySoA* soa, int nbody)
+{
+    int i;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        Body* b = &bodies[i];
+
+        X(Pos(b)) = soa->pos[0][i];
+        Y(Pos(b)) = soa->pos[1][i];
+        Z(Pos(b)) = soa->pos[2][i];
+
+        X(Vel(b)) = soa->vel[0][i];
+        Y(Vel(b)) = soa->vel[1][i];
+        Z(Vel(b)) = soa->vel[2][i];
+
+        Mass(b) = soa->mass[i];
+        Type(b) = soa->type[i];
+        idBody(b) = soa->id[i];
+    }
+}
+
+/* Move the test particles in bodytab after the bodies with mass,
+ * keeping the order of each, and return how many have mass. Nothing
+ * moves if they are already in that order. */
+static int nbPartitionTestParticles(Body* bodies, int nbody)
+{
+    int i, j, nMassive = 0;
+    int firstTest = -1;
+    mwbool inOrder = TRUE;
+    Body* tmp;
+
+    for (i = 0; i < nbody; ++i)
+    {
+        if (Mass(&bodies[i]) != 0.0)
+        {
+            ++nMassive;
+            if (firstTest >= 0)
+                inOrder = FALSE;
+        }
+        else if (firstTest < 0)
+        {
+            firstTest = i;
+        }
+    }
+
+    if (inOrder)
+        return nMassive;
+
+    tmp = (Body*) mwMallocA((nbody - firstTest) * sizeof(Body));
+    memcpy(tmp, &bodies[firstTest], (nbody - firstTest) * sizeof(Body));
+
+    /* The massive bodies after the first test particle, then the rest */
+    j = firstTest;
+    for (i = 0; i < nbody - firstTest; ++i)
+    {
+        if (Mass(&tmp[i]) != 0.0)
+            bodies[j++] = tmp[i];
+    }
+
+    for (i = 0; i < nbody - firstTest; ++i)
+    {
+        if (Mass(&tmp[i]) == 0.0)
+            bodies[j++] = tmp[i];
+    }
+
+    mwFreeA(tmp);
+    return nMassive;
+}
+
+/* Make the SoA store the authoritative copy of the bodies, starting
+ * from the current bodytab */
+void nbLoadBodyStore(NBodyState* st)
+{
+    assert(!st->usesCL);
+
+    st->nMassive = nbPartitionTestParticles(st->bodytab, st->nbody);
+    nbBodiesToSoA(&st->soa, st->bodytab, st->nbody);
+    st->dirty = FALSE;
+}
+
+/* Bring bodytab up to date with the SoA store if it has changed since
+ * the last time */
+void nbSyncBodyView(NBodyState* st)
+{
+    assert(!st->usesCL);
+
+    if (st->dirty)
+    {
+        nbSoAToBodies(st->bodytab, &st->soa, st->nbody);
+        st->dirty = FALSE;
+    }
+}
+
@@ -25,6 +25,7 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #include <lua.h>
 #include <lauxlib.h>
 #include "nbody_lua_types.h"
+#include "nbody_soa.h"
 #include "milkyway_util.h"
 
 #if defined(__GNUC__) && !defined(__INTEL_COMPILER)
@@ -32,25 +33,31 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 
-/* subIndex: compute subcell index for body p in cell q. */
-static inline int nbSubIndex(Body* p, NBodyCell* q)
+/* subIndex: compute subcell index for position pos in a cell with midpoint mid. */
+static inline int nbSubIndexPos(const mwvector pos, const mwvector mid)
 {
     int ind = 0;
 
     /* accumulate subcell index */
     /* loop over dimensions */
-    if (X(Pos(q)) <= X(Pos(p)))     /* if beyond midpoint */
+    if (X(mid) <= X(pos))           /* if beyond midpoint */
         ind += NSUB >> (0 + 1);     /* skip over subcells */
 
-    if (Y(Pos(q)) <= Y(Pos(p)))
+    if (Y(mid) <= Y(pos))
         ind += NSUB >> (1 + 1);
 
-    if (Z(Pos(q)) <= Z(Pos(p)))
+    if (Z(mid) <= Z(pos))
         ind += NSUB >> (2 + 1);
 
     return ind;
 }
 
+/* subIndex: compute subcell index for position pos in cell q. */
+static inline int nbSubIndex(const mwvector pos, const NBodyCell* q)
+{
+    return nbSubIndexPos(pos, Pos(q));
+}
+
 static inline void nbIncAddNBodyQuadMatrix(NBodyQuadMatrix* RESTRICT a, NBodyQuadMatrix* RESTRICT b)
 {
     a->xx += b->xx;
@@ -63,15 +70,15 @@ static inline void nbIncAddNBodyQuadMatrix(NBodyQuadMatrix* RESTRICT a, NBodyQua
     a->zz += b->zz;
 }
 
-/* hackQuad: descend tree, evaluating quadrupole moments.  Note that this
- * routine is coded so that the Subp() and Quad() components of a cell can
- * share the same memory locations.
+/* Quadrupole moment of cell p from its children, whose moments are
+ * already known. Note that this routine is coded so that the Subp()
+ * and Quad() components of a cell can share the same memory locations.
  */
-static void hackQuad(NBodyCell* p)
+static void nbCellQuad(NBodyTree* t, const NBodySoA* soa, NBodyCell* p)
 {
     unsigned int ndesc, i;
-    NBodyNode* desc[NSUB];
-    NBodyNode* q;
+    noderef_t desc[NSUB];
+    noderef_t q;
     mwvector dr;
     real drsq;
     NBodyQuadMatrix quad = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
@@ -79,27 +86,32 @@ static void hackQuad(NBodyCell* p)
     ndesc = 0;                                  /* count occupied subnodes  */
     for (i = 0; i < NSUB; ++i)                  /* loop over all subnodes   */
     {
-        if (Subp(p)[i] != NULL)                 /* if this one's occupied   */
+        if (Subp(p)[i] != NODE_NULL)            /* if this one's occupied   */
         {
             desc[ndesc++] = Subp(p)[i];         /* copy it to safety        */
         }
     }
 
+    Quad(p) = quad;                             /* clear the moment         */
+
     for (i = 0; i < ndesc; ++i)                 /* loop over real subnodes  */
     {
         q = desc[i];                            /* access each one in turn  */
-        if (isCell(q))                          /* if it's also a cell      */
+        if (isCellRef(q))                       /* if it's also a cell      */
+        {
+            dr = mw_subv(Pos(CellPtr(t, q)), Pos(p)); /* find displacement vect. */
+        }
+        else
         {
-            hackQuad((NBodyCell*) q);           /* then process it first    */
+            dr = mw_subv(nbSoAPos(soa, q), Pos(p));
         }
 
-        dr = mw_subv(Pos(q), Pos(p));           /* find displacement vect.  */
         drsq = mw_sqrv(dr);                     /* and dot prod. (dr . dr)  */
 
         /* Outer product scaled by 3, then subtract drsq off the
          * diagonal to form quad moment*/
         {
-            real m = Mass(q);   /* from CM of subnode */
+            real m = isCellRef(q) ? Mass(CellPtr(t, q)) : soa->mass[q]; /* from CM of subnode */
 
             quad.xx = m * (3.0 * (X(dr) * X(dr)) - drsq);
             quad.xy = m * (3.0 * (X(dr) * Y(dr)));
@@ -111,115 +123,291 @@ static void hackQuad(NBodyCell* p)
             quad.zz = m * (3.0 * (Z(dr) * Z(dr)) - drsq);
         }
 
-        if (isCell(q)) /* if subnode is cell       */
+        if (isCellRef(q)) /* if subnode is cell       */
         {
-            nbIncAddNBodyQuadMatrix(&quad, &Quad(q));     /* then include its moment  */
+            nbIncAddNBodyQuadMatrix(&quad, &Quad(CellPtr(t, q)));  /* then include its moment  */
         }
 
         nbIncAddNBodyQuadMatrix(&Quad(p), &quad); /* increment moment of cell */
     }
 }
 
-
-/* threadTree: do a recursive treewalk starting from node p,
- * with next stop n, installing Next and More links.
+/* hackQuad: evaluate the quadrupole moments a level at a time from the
+ * bottom of the tree up. The cells of a level only depend on the level
+ * below, so they can be done in parallel, and each cell adds up its
+ * children in the same order as always.
  */
-static void threadTree(NBodyNode* p, NBodyNode* n)
+static void hackQuad(NBodyTree* t, const NBodySoA* soa)
+{
+    int lev, k;
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(lev, k)
+  #endif
+    for (lev = (int) t->maxDepth; lev >= 0; --lev)
+    {
+        const int start = (int) t->levelStart[lev];
+        const int end = (int) t->levelStart[lev + 1];
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(static)
+      #endif
+        for (k = start; k < end; ++k)
+        {
+            nbCellQuad(t, soa, &t->cells[t->levelCells[k]]);
+        }
+    }
+}
+
+
+/* Install the More link of cell pp, and the Next links of its
+ * children. The Next link of pp itself must already be set. */
+static void nbThreadCell(NBodyTree* t, NBodySoA* soa, NBodyCell* pp)
 {
     unsigned int ndesc, i;
-    NBodyNode* desc[NSUB+1];
+    noderef_t desc[NSUB+1];
 
-    Next(p) = n;                                /* link to next node */
-    if (isCell(p))                              /* any children to thread? */
+    ndesc = 0;                                  /* count extant children */
+    for (i = 0; i < NSUB; ++i)                  /* loop over subnodes */
     {
-        ndesc = 0;                              /* count extant children */
-        for (i = 0; i < NSUB; ++i)              /* loop over subnodes */
+        if (Subp(pp)[i] != NODE_NULL)           /* found a live one? */
         {
-            if (Subp(p)[i] != NULL)             /* found a live one? */
-            {
-                desc[ndesc++] = Subp(p)[i];     /* store in table */
-            }
+            desc[ndesc++] = Subp(pp)[i];        /* store in table */
         }
-        More(p) = desc[0];                      /* link to first child */
-        desc[ndesc] = n;                        /* end table with next */
-        for (i = 0; i < ndesc; i++)             /* loop over children */
+    }
+    More(pp) = desc[0];                         /* link to first child */
+    desc[ndesc] = Next(pp);                     /* end table with next */
+    for (i = 0; i < ndesc; i++)                 /* loop over children */
+    {
+        if (isCellRef(desc[i]))                 /* thread each w/ next */
+            Next(CellPtr(t, desc[i])) = desc[i + 1];
+        else
+            soa->next[desc[i]] = desc[i + 1];
+    }
+}
+
+/* threadTree: install the Next and More links from the root down, a
+ * level at a time, giving the same links as a recursive treewalk.
+ */
+static void threadTree(NBodyTree* t, NBodySoA* soa)
+{
+    int lev, k;
+    const int nLevel = (int) t->maxDepth + 1;
+
+    Next(&t->cells[0]) = NODE_NULL;             /* root is the last stop */
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(lev, k)
+  #endif
+    for (lev = 0; lev < nLevel; ++lev)
+    {
+        const int start = (int) t->levelStart[lev];
+        const int end = (int) t->levelStart[lev + 1];
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(static)
+      #endif
+        for (k = start; k < end; ++k)
         {
-            threadTree(desc[i], desc[i + 1]);     /* thread each w/ next */
+            nbThreadCell(t, soa, &t->cells[t->levelCells[k]]);
         }
     }
 }
 
+/* Sort the cells by level for the passes over the finished tree. Within
+ * a level they stay in arena order. */
+static void nbSortCellsByLevel(NBodyTree* t)
+{
+    unsigned int i, lev;
+    const unsigned int nLevel = t->maxDepth + 1;
+
+    if (t->levelAlloc < nLevel + 1)
+    {
+        free(t->levelStart);
+        t->levelStart = (unsigned int*) mwMalloc((nLevel + 1) * sizeof(unsigned int));
+        t->levelAlloc = nLevel + 1;
+    }
+
+    memset(t->levelStart, 0, (nLevel + 1) * sizeof(unsigned int));
+    for (i = 0; i < t->cellUsed; ++i)           /* count cells of each level */
+    {
+        assert(t->cellLevel[i] < nLevel);
+        ++t->levelStart[t->cellLevel[i] + 1];
+    }
+
+    for (lev = 0; lev < nLevel; ++lev)
+    {
+        t->levelStart[lev + 1] += t->levelStart[lev];
+    }
+
+    for (i = 0; i < t->cellUsed; ++i)           /* advances each start to the next */
+    {
+        t->levelCells[t->levelStart[t->cellLevel[i]]++] = i;
+    }
+
+    for (lev = nLevel; lev > 0; --lev)          /* and put them back */
+    {
+        t->levelStart[lev] = t->levelStart[lev - 1];
+    }
+    t->levelStart[0] = 0;
+}
+
 /* expandBox: find range of coordinate values (with respect to root)
  * and expand root cell to fit. The size is doubled at each step to
  * take advantage of exact representation of powers of two.
  */
-static void expandBox(NBodyTree* t, const Body* btab, int nbody)
+static real nbMaxRootDist(const NBodySoA* soa, int nbody, const mwvector rootPos)
 {
     real xyzmax;
-    const Body* p;
-    const NBodyCell* root = t->root;
-
-    assert(t->rsize > 0.0);
+    int i;
 
     xyzmax = 0.0;
-    for (p = btab; p < btab + nbody; ++p)
+    for (i = 0; i < nbody; ++i)
     {
-        xyzmax = mw_fmax(xyzmax, mw_abs(X(Pos(p)) - X(Pos(root))));
-        xyzmax = mw_fmax(xyzmax, mw_abs(Y(Pos(p)) - Y(Pos(root))));
-        xyzmax = mw_fmax(xyzmax, mw_abs(Z(Pos(p)) - Z(Pos(root))));
+        xyzmax = mw_fmax(xyzmax, mw_abs(soa->pos[0][i] - X(rootPos)));
+        xyzmax = mw_fmax(xyzmax, mw_abs(soa->pos[1][i] - Y(rootPos)));
+        xyzmax = mw_fmax(xyzmax, mw_abs(soa->pos[2][i] - Z(rootPos)));
     }
 
+    return xyzmax;
+}
+
+static void expandBox(NBodyTree* t, const NBodySoA* soa, int nbody)
+{
+    real xyzmax;
+
+    assert(t->rsize > 0.0);
+
+    xyzmax = nbMaxRootDist(soa, nbody, Pos(&t->cells[0]));
     while (t->rsize < 2.0 * xyzmax)
     {
         t->rsize *= 2.0;
     }
 }
 
-/* makecell: return pointer to free cell. */
-static NBodyCell* nbMakeCell(NBodyState* st, NBodyTree* t)
+/* Resize the cell arena to hold n cells, keeping the cells in use */
+static void nbResizeCellArena(NBodyTree* t, unsigned int n)
 {
-    NBodyCell* c;
+    NBodyCell* cells = (NBodyCell*) mwMallocA(n * sizeof(NBodyCell));
+    unsigned int* cellLevel = (unsigned int*) mwMallocA(n * sizeof(unsigned int));
 
-    if (st->freeCell == NULL)                   /* no free cells left? */
+    if (t->cellUsed > 0)
     {
-        c = (NBodyCell*) mwMallocA(sizeof(*c)); /* allocate a new one */
+        memcpy(cells, t->cells, t->cellUsed * sizeof(NBodyCell));
+        memcpy(cellLevel, t->cellLevel, t->cellUsed * sizeof(unsigned int));
     }
-    else                                        /* use existing free cell */
+
+    mwFreeA(t->cells);
+    mwFreeA(t->cellsTmp);       /* reallocated at the new size if needed */
+    mwFreeA(t->cellLevel);
+    mwFreeA(t->levelCells);
+    mwFreeA(t->cellsBuilt);     /* only valid for the cells it was kept with */
+    t->cells = cells;
+    t->cellsBuilt = NULL;
+    t->cellsTmp = NULL;
+    t->cellLevel = cellLevel;
+    t->levelCells = (unsigned int*) mwMallocA(n * sizeof(unsigned int));
+    t->cellAlloc = n;
+}
+
+/* makecell: return index of a new cell in the arena. Growing the arena
+ * moves the cells, so pointers to cells must not be held across this. */
+static unsigned int nbMakeCell(NBodyTree* t)
+{
+    NBodyCell* c;
+    unsigned int i;
+
+    if (t->cellUsed == t->cellAlloc)            /* no free cells left? */
     {
-        c = (NBodyCell*) st->freeCell;          /* take one on front */
-        st->freeCell = Next(c);                 /* go on to next one */
+        nbResizeCellArena(t, 2 * t->cellAlloc);  /* make room for more */
     }
+
+    c = &t->cells[t->cellUsed];
     Type(c) = CELL(0);                          /* initialize cell type */
-    More(c) = NULL;
-    memset(&c->stuff, 0, sizeof(c->stuff));     /* empty sub cells */
-    t->cellUsed++;                              /* count one more cell */
-    return c;
+    More(c) = NODE_NULL;
+    for (i = 0; i < NSUB; ++i)                  /* empty sub cells */
+    {
+        Subp(c)[i] = NODE_NULL;
+    }
+
+    return t->cellUsed++;                       /* count one more cell */
 }
 
 /* reclaim cells in tree, prepare to build new one. */
 static void nbNewTree(NBodyState* st, NBodyTree* t)
 {
-    NBodyNode* p = (NBodyNode*) t->root;              /* start with the root */
+    unsigned int estCells;
 
-    while (p != NULL)                       /* loop scanning tree */
+    /* Size the arena from the last tree, with some room to grow.  The
+     * first tree has about one cell for every two bodies. */
+    if (t->cellUsed > 0)
+        estCells = t->cellUsed + t->cellUsed / 8 + 1;
+    else
+        estCells = (unsigned int) st->nbody / 2 + 1;
+
+    t->cellUsed = 0;   /* init count of cells, levels */
+    t->maxDepth = 0;
+    t->root = NULL;
+
+    if (t->cellAlloc < estCells)
     {
-        if (isCell(p))                      /* found cell to free? */
-        {
-            Next(p) = st->freeCell;         /* link to front of */
-            st->freeCell = p;               /* ...existing list */
-            p = More(p);                    /* scan down tree */
-        }
-        else                                /* skip over bodies */
+        nbResizeCellArena(t, estCells);
+    }
+
+    nbMakeCell(t);                    /* allocate the root cell */
+    mw_zerov(Pos(&t->cells[0]));      /* initialize the midpoint */
+    t->cellLevel[0] = 0;
+}
+
+/* Copy the subtree of cell i at level lev in src to dst in depth first
+ * order, starting at index *n, and return the new link to it. The
+ * levels of the copies are recorded in levels. */
+static noderef_t nbCopyCellsDepthFirst(const NBodyCell* RESTRICT src,
+                                       NBodyCell* RESTRICT dst,
+                                       unsigned int* RESTRICT levels,
+                                       unsigned int i,
+                                       unsigned int lev,
+                                       unsigned int* n)
+{
+    unsigned int j;
+    unsigned int k = (*n)++;
+    NBodyCell* c = &dst[k];
+
+    *c = src[i];
+    levels[k] = lev;
+    for (j = 0; j < NSUB; ++j)
+    {
+        noderef_t r = Subp(c)[j];
+        if (r != NODE_NULL && isCellRef(r))
         {
-            p = Next(p);                    /* go on to next */
+            Subp(c)[j] = nbCopyCellsDepthFirst(src, dst, levels, refIndex(r), lev + 1, n);
         }
     }
 
-    t->cellUsed = 0;   /* init count of cells, levels */
-    t->maxDepth = 0;
+    return cellRef(k);
+}
 
-    t->root = nbMakeCell(st, t);      /* allocate the root cell */
-    mw_zerov(Pos(t->root));           /* initialize the midpoint */
+/* Cells are created in the order bodies happen to be inserted. Lay
+ * them out in the order the force calculation visits them instead, so
+ * walking the tree moves forward through memory. Cells no longer
+ * linked into the tree are dropped. */
+static void nbSortCellsDepthFirst(NBodyTree* t)
+{
+    NBodyCell* tmp;
+    unsigned int n = 0;
+
+    if (!t->cellsTmp)
+    {
+        t->cellsTmp = (NBodyCell*) mwMallocA(t->cellAlloc * sizeof(NBodyCell));
+    }
+
+    nbCopyCellsDepthFirst(t->cells, t->cellsTmp, t->cellLevel, 0, 0, &n);
+    assert(n <= t->cellUsed);
+    t->cellUsed = n;
+
+    tmp = t->cells;
+    t->cells = t->cellsTmp;
+    t->cellsTmp = tmp;
 }
 
 
@@ -231,27 +419,24 @@ static inline real calcOffset(real pPos, real qPos, real qsize)
 }
 
 ALWAYS_INLINE
-static inline void nbInitMidpoint(NBodyCell* c, const Body* p, const NBodyCell* q, real qsize)
+static inline void nbInitMidpoint(NBodyCell* c, const mwvector pos, const NBodyCell* q, real qsize)
 {
-    X(Pos(c)) = calcOffset(X(Pos(p)), X(Pos(q)), qsize);
-    Y(Pos(c)) = calcOffset(Y(Pos(p)), Y(Pos(q)), qsize);
-    Z(Pos(c)) = calcOffset(Z(Pos(p)), Z(Pos(q)), qsize);
+    X(Pos(c)) = calcOffset(X(pos), X(Pos(q)), qsize);
+    Y(Pos(c)) = calcOffset(Y(pos), Y(Pos(q)), qsize);
+    Z(Pos(c)) = calcOffset(Z(pos), Z(Pos(q)), qsize);
 }
 
-/* loadBody: descend tree and insert body p in appropriate place. */
-static void nbLoadBody(NBodyState* st, NBodyTree* t, Body* p)
+/* loadBody: descend tree from cell qi of size qsize at level lev and
+ * insert body p in appropriate place. */
+static void nbLoadBodyFrom(const NBodySoA* soa, NBodyTree* t, unsigned int qi, real qsize, unsigned int lev, unsigned int p)
 {
-    NBodyCell* q;
-    NBodyCell* c;
+    unsigned int ci;
+    noderef_t sub;
     size_t qind;
-    unsigned int lev;
-    real qsize;
+    const mwvector pos = nbSoAPos(soa, p);
 
-    q = t->root;                                /* start with tree t.root */
-    qind = nbSubIndex(p, q);                    /* get index of subcell */
-    qsize = t->rsize;                           /* keep track of cell size */
-    lev = 0;                                    /* count levels descended */
-    while (Subp(q)[qind] != NULL)               /* loop descending tree */
+    qind = nbSubIndex(pos, &t->cells[qi]);      /* get index of subcell */
+    while ((sub = Subp(&t->cells[qi])[qind]) != NODE_NULL) /* loop descending tree */
     {
         if (qsize <= REAL_EPSILON)
         {
@@ -263,24 +448,362 @@ static void nbLoadBody(NBodyState* st, NBodyTree* t, Body* p)
             return;
         }
 
-        if (isBody(Subp(q)[qind]))              /* reached a "leaf"? */
+        if (!isCellRef(sub))                    /* reached a "leaf"? */
         {
-            c = nbMakeCell(st, t);             /* allocate new cell */
-            nbInitMidpoint(c, p, q, qsize);    /* initialize midpoint */
+            ci = nbMakeCell(t);                 /* allocate new cell */
+            nbInitMidpoint(&t->cells[ci], pos, &t->cells[qi], qsize); /* initialize midpoint */
 
-            Subp(c)[nbSubIndex((Body*) Subp(q)[qind], c)] = Subp(q)[qind];
+            Subp(&t->cells[ci])[nbSubIndex(nbSoAPos(soa, sub), &t->cells[ci])] = sub;
             /* put body in cell */
-            Subp(q)[qind] = (NBodyNode*) c;    /* link cell in tree */
+            sub = cellRef(ci);
+            Subp(&t->cells[qi])[qind] = sub;    /* link cell in tree */
         }
-        q = (NBodyCell*) Subp(q)[qind];   /* advance to next level */
-        qind = nbSubIndex(p, q);          /* get index to examine */
-        qsize *= 0.5;                     /* shrink current cell */
-        ++lev;                            /* count another level */
+        qi = refIndex(sub);                     /* advance to next level */
+        qind = nbSubIndex(pos, &t->cells[qi]);  /* get index to examine */
+        qsize *= 0.5;                           /* shrink current cell */
+        ++lev;                                  /* count another level */
     }
-    Subp(q)[qind] = (NBodyNode*) p;            /* found place, store p */
+    Subp(&t->cells[qi])[qind] = p;              /* found place, store p */
     t->maxDepth = MAX(t->maxDepth, lev);  /* remember maximum level */
 }
 
+/* loadBody: descend tree and insert body p in appropriate place. */
+static void nbLoadBody(const NBodySoA* soa, NBodyTree* t, unsigned int p)
+{
+    nbLoadBodyFrom(soa, t, 0, t->rsize, 0, p);
+}
+
+
+/* Morton key tree build.
+ *
+ * Each body gets a key made of the subcell indices it would pass
+ * through descending the first NBODY_MORTON_LEVELS levels of the
+ * tree, 3 bits per level with the root's index in the most
+ * significant digit. Sorting the bodies by key puts every cell's
+ * bodies next to each other in the same order threadTree() visits
+ * them, so the cells can then be created in a single pass over the
+ * sorted keys, which also creates them in depth first order. The key
+ * digits are found by comparing against the same
+ * midpoints nbLoadBody() uses rather than by scaling the coordinates,
+ * so the resulting tree is identical to the one built by insertion.
+ */
+
+#define NBODY_MORTON_LEVELS 21
+#define NBODY_MORTON_NO_KEY UINT64_MAX   /* Sorts after every real key */
+#define NBODY_RADIX_BITS 8
+#define NBODY_RADIX_SIZE (1 << NBODY_RADIX_BITS)
+
+static inline uint64_t nbMortonKey(const mwvector pos, mwvector mid, real qsize)
+{
+    unsigned int lev;
+    uint64_t key = 0;
+
+    for (lev = 0; lev < NBODY_MORTON_LEVELS; ++lev)
+    {
+        key = (key << 3) | (uint64_t) nbSubIndexPos(pos, mid);
+
+        /* Same as nbInitMidpoint() */
+        X(mid) = calcOffset(X(pos), X(mid), qsize);
+        Y(mid) = calcOffset(Y(pos), Y(mid), qsize);
+        Z(mid) = calcOffset(Z(pos), Z(mid), qsize);
+        qsize *= 0.5;
+    }
+
+    return key;
+}
+
+/* Subcell index used at level lev */
+static inline int nbMortonDigit(uint64_t key, unsigned int lev)
+{
+    return (int) ((key >> (3 * (NBODY_MORTON_LEVELS - 1 - lev))) & (NSUB - 1));
+}
+
+/* Number of leading levels two keys share */
+static inline unsigned int nbMortonCommonLevels(uint64_t a, uint64_t b)
+{
+    uint64_t x = a ^ b;
+
+    if (x == 0)
+        return NBODY_MORTON_LEVELS;
+
+  #if defined(__GNUC__)
+    /* Keys only use the low 63 bits */
+    return ((unsigned int) __builtin_clzll(x) - 1) / 3;
+  #else
+    {
+        unsigned int lev = 0;
+        while (nbMortonDigit(a, lev) == nbMortonDigit(b, lev))
+            ++lev;
+        return lev;
+    }
+  #endif
+}
+
+static void nbReserveMortonKeys(NBodyTree* t, unsigned int n)
+{
+    if (t->keysAlloc >= n)
+        return;
+
+    mwFreeA(t->keys);
+    mwFreeA(t->keysTmp);
+    mwFreeA(t->keyOrder);
+    mwFreeA(t->keyOrderTmp);
+
+    t->keys = (uint64_t*) mwMallocA(n * sizeof(uint64_t));
+    t->keysTmp = (uint64_t*) mwMallocA(n * sizeof(uint64_t));
+    t->keyOrder = (unsigned int*) mwMallocA(n * sizeof(unsigned int));
+    t->keyOrderTmp = (unsigned int*) mwMallocA(n * sizeof(unsigned int));
+    t->keysAlloc = n;
+}
+
+/* Stable LSD radix sort of the keys and their body indices. Each
+ * thread histograms and scatters its own contiguous chunk, so the
+ * result doesn't depend on the number of threads. Passes where every
+ * key has the same digit are skipped, which for a compact dwarf is
+ * most of the high ones.
+ */
+static void nbRadixSortMortonKeys(NBodyTree* t, unsigned int n)
+{
+    unsigned int shift;
+    int nThreadMax = nbGetMaxThreads();
+    size_t* counts = (size_t*) mwMalloc(nThreadMax * NBODY_RADIX_SIZE * sizeof(size_t));
+
+    for (shift = 0; shift < 64; shift += NBODY_RADIX_BITS)
+    {
+        mwbool skipPass = FALSE;
+        int nThread = 1;
+
+      #ifdef _OPENMP
+        #pragma omp parallel shared(skipPass, nThread)
+      #endif
+        {
+            int tid = 0;
+            int d;
+            unsigned int i, lo, hi;
+            size_t* count;
+
+          #ifdef _OPENMP
+            tid = omp_get_thread_num();
+            #pragma omp single
+            nThread = omp_get_num_threads();
+          #endif
+
+            lo = (unsigned int) (((uint64_t) n * tid) / nThread);
+            hi = (unsigned int) (((uint64_t) n * (tid + 1)) / nThread);
+            count = &counts[tid * NBODY_RADIX_SIZE];
+
+            memset(count, 0, NBODY_RADIX_SIZE * sizeof(size_t));
+            for (i = lo; i < hi; ++i)
+            {
+                ++count[(t->keys[i] >> shift) & (NBODY_RADIX_SIZE - 1)];
+            }
+
+          #ifdef _OPENMP
+            #pragma omp barrier
+            #pragma omp single
+          #endif
+            {
+                /* Turn the counts into the scatter offset of each thread's digits */
+                size_t offset = 0;
+                int th;
+
+                for (d = 0; d < NBODY_RADIX_SIZE; ++d)
+                {
+                    size_t total = 0;
+                    for (th = 0; th < nThread; ++th)
+                    {
+                        size_t c = counts[th * NBODY_RADIX_SIZE + d];
+                        counts[th * NBODY_RADIX_SIZE + d] = offset;
+                        offset += c;
+                        total += c;
+                    }
+
+                    if (total == n)
+                        skipPass = TRUE;
+                }
+            }
+
+            if (!skipPass)
+            {
+                for (i = lo; i < hi; ++i)
+                {
+                    size_t j = count[(t->keys[i] >> shift) & (NBODY_RADIX_SIZE - 1)]++;
+                    t->keysTmp[j] = t->keys[i];
+                    t->keyOrderTmp[j] = t->keyOrder[i];
+                }
+            }
+        }
+
+        if (!skipPass)
+        {
+            uint64_t* tmpKeys = t->keys;
+            unsigned int* tmpOrder = t->keyOrder;
+
+            t->keys = t->keysTmp;
+            t->keyOrder = t->keyOrderTmp;
+            t->keysTmp = tmpKeys;
+            t->keyOrderTmp = tmpOrder;
+        }
+    }
+
+    free(counts);
+}
+
+/* Create the cells from the sorted keys. A body sits in the deepest
+ * cell it shares with either neighbor in key order, so walking the
+ * keys in order only requires keeping the chain of cells from the
+ * root to the current body. Returns FALSE if any cells had to be
+ * created out of depth first order.
+ */
+static mwbool nbLoadSortedBodies(const NBodySoA* soa, NBodyTree* t, unsigned int nMassive)
+{
+    unsigned int cells[NBODY_MORTON_LEVELS + 1];  /* Open cells at each level */
+    real sizes[NBODY_MORTON_LEVELS + 1];
+    unsigned int top = 0;
+    unsigned int i, lev, depth, lcpPrev, lcpNext;
+    mwbool inOrder = TRUE;
+    const uint64_t* keys = t->keys;
+
+    cells[0] = 0;
+    sizes[0] = t->rsize;
+
+    for (i = 0; i < nMassive; ++i)
+    {
+        unsigned int p = t->keyOrder[i];
+        const mwvector pos = nbSoAPos(soa, p);
+
+        lcpPrev = (i > 0) ? nbMortonCommonLevels(keys[i - 1], keys[i]) : 0;
+        lcpNext = (i + 1 < nMassive) ? nbMortonCommonLevels(keys[i], keys[i + 1]) : 0;
+        depth = MAX(lcpPrev, lcpNext);
+
+        top = MIN(top, lcpPrev);             /* close cells the body isn't in */
+        for (lev = top + 1; lev <= depth; ++lev)
+        {
+            unsigned int c = nbMakeCell(t);
+            NBodyCell* q = &t->cells[cells[lev - 1]];
+
+            nbInitMidpoint(&t->cells[c], pos, q, sizes[lev - 1]);
+            Subp(q)[nbMortonDigit(keys[i], lev - 1)] = cellRef(c);
+            t->cellLevel[c] = lev;
+
+            cells[lev] = c;
+            sizes[lev] = 0.5 * sizes[lev - 1];
+        }
+        top = depth;
+
+        if (depth < NBODY_MORTON_LEVELS)
+        {
+            Subp(&t->cells[cells[depth]])[nbMortonDigit(keys[i], depth)] = p;
+            t->maxDepth = MAX(t->maxDepth, depth);
+        }
+        else
+        {
+            /* Bodies closer together than the key resolution. Insert
+             * them the normal way below the deepest key level. */
+            nbLoadBodyFrom(soa, t, cells[depth], sizes[depth], depth, p);
+            inOrder = FALSE;
+        }
+    }
+
+    return inOrder;
+}
+
+static mwbool nbLoadBodiesMorton(const NBodySoA* soa, NBodyTree* t, int nbody)
+{
+    int i;
+    int nMassive = 0;
+    const mwvector rootPos = Pos(&t->cells[0]);
+    const real rsize = t->rsize;
+
+    nbReserveMortonKeys(t, (unsigned int) nbody);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static) reduction(+:nMassive)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        if (soa->mass[i] != 0.0)             /* exclude test particles */
+        {
+            t->keys[i] = nbMortonKey(nbSoAPos(soa, i), rootPos, rsize);
+            ++nMassive;
+        }
+        else
+        {
+            t->keys[i] = NBODY_MORTON_NO_KEY;
+        }
+
+        t->keyOrder[i] = (unsigned int) i;
+    }
+
+    nbRadixSortMortonKeys(t, (unsigned int) nbody);
+    return nbLoadSortedBodies(soa, t, (unsigned int) nMassive);
+}
+
+/* The key levels need to still be representable */
+static inline mwbool nbMortonKeysUsable(const NBodyTree* t)
+{
+    return mw_ldexp(t->rsize, -NBODY_MORTON_LEVELS) > REAL_EPSILON;
+}
+
+/* Sort the given test particles, or the n from first on if bodies is
+ * NULL, by Morton key in the cube around them, so that runs of them
+ * are close together. Uses the Morton build's scratch space, so the
+ * order returned is only good until the next tree is built.
+ */
+const unsigned int* nbOrderTestParticles(NBodyTree* t,
+                                         const NBodySoA* soa,
+                                         const uint32_t* bodies,
+                                         unsigned int first,
+                                         unsigned int n)
+{
+    int i;
+    real minX, minY, minZ, maxX, maxY, maxZ;
+    mwvector mid;
+    real size;
+
+    if (n == 0)
+        return NULL;
+
+    nbReserveMortonKeys(t, n);
+
+    for (i = 0; i < (int) n; ++i)
+    {
+        t->keyOrder[i] = bodies ? bodies[i] : first + (unsigned int) i;
+    }
+
+    minX = maxX = soa->pos[0][t->keyOrder[0]];
+    minY = maxY = soa->pos[1][t->keyOrder[0]];
+    minZ = maxZ = soa->pos[2][t->keyOrder[0]];
+    for (i = 1; i < (int) n; ++i)
+    {
+        const unsigned int p = t->keyOrder[i];
+
+        minX = mw_fmin(minX, soa->pos[0][p]);
+        minY = mw_fmin(minY, soa->pos[1][p]);
+        minZ = mw_fmin(minZ, soa->pos[2][p]);
+        maxX = mw_fmax(maxX, soa->pos[0][p]);
+        maxY = mw_fmax(maxY, soa->pos[1][p]);
+        maxZ = mw_fmax(maxZ, soa->pos[2][p]);
+    }
+
+    X(mid) = 0.5 * (minX + maxX);
+    Y(mid) = 0.5 * (minY + maxY);
+    Z(mid) = 0.5 * (minZ + maxZ);
+    size = mw_fmax(maxX - minX, mw_fmax(maxY - minY, maxZ - minZ));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < (int) n; ++i)
+    {
+        t->keys[i] = nbMortonKey(nbSoAPos(soa, t->keyOrder[i]), mid, size);
+    }
+
+    nbRadixSortMortonKeys(t, n);
+
+    return t->keyOrder;
+}
+
 ALWAYS_INLINE
 static inline real bmax2Inc(real cmPos, real pPos, real psize)
 {
@@ -333,6 +856,9 @@ static inline real findRCrit(const NBodyCtx* ctx, const NBodyCell* p, real treeR
             rc = psize / ctx->theta;        /* using size of cell */
             return sqr(rc);
 
+        case FMM:                           /* theta is applied to pairs of cells */
+            return calcSW93MaxDist2(p, cmpos, psize);   /* so just the cell radius */
+
         case InvalidCriterion:
         case Exact: /* Uses separate path */
         default:
@@ -348,6 +874,9 @@ static inline void nbCheckTreeDim(NBodyTree* tree, real pPos, real cmPos, real h
     if (   cmPos < pPos - halfPsize       /* if out of bounds */
         || cmPos > pPos + halfPsize)      /* in either direction */
     {
+      #ifdef _OPENMP
+        #pragma omp critical
+      #endif
         if (!tree->structureError)
         {
             /* Only print if we don't know about the error
@@ -380,13 +909,12 @@ static inline void nbCheckTreeStructure(NBodyTree* tree, const mwvector pPos, co
 }
 
 
-/* hackCofM: descend tree finding center-of-mass coordinates and
- * setting critical cell radii.
- */
-static void hackCofM(const NBodyCtx* ctx, NBodyTree* tree, NBodyCell* p, real psize)
+/* Center of mass and critical radius of cell p of size psize, from
+ * its children which are already done. */
+static void nbCellCofM(const NBodyCtx* ctx, NBodyTree* tree, const NBodySoA* soa, NBodyCell* p, real psize)
 {
     int i;
-    NBodyNode* q;
+    noderef_t q;
     mwvector cmpos = ZERO_VECTOR;                /* init center of mass */
 
     assert(psize >= REAL_EPSILON);
@@ -394,16 +922,23 @@ static void hackCofM(const NBodyCtx* ctx, NBodyTree* tree, NBodyCell* p, real ps
     Mass(p) = 0.0;                              /* init total mass... */
     for (i = 0; i < NSUB; ++i)                  /* loop over subnodes */
     {
-        if ((q = Subp(p)[i]) != NULL)           /* does subnode exist? */
+        if ((q = Subp(p)[i]) != NODE_NULL)      /* does subnode exist? */
         {
-            if (isCell(q))                     /* and is it a cell? */
+            if (isCellRef(q))                   /* and is it a cell? */
             {
-                hackCofM(ctx, tree, (NBodyCell*) q, 0.5 * psize); /* find subcell cm */
+                const NBodyCell* c = CellPtr(tree, q);
+
+                Mass(p) += Mass(c);                       /* sum total mass */
+                                                          /* weight pos by mass */
+                mw_incaddv_s(cmpos, Pos(c), Mass(c));     /* sum c-of-m position */
             }
+            else
+            {
+                mwvector pos = nbSoAPos(soa, q);
 
-            Mass(p) += Mass(q);                       /* sum total mass */
-                                                      /* weight pos by mass */
-            mw_incaddv_s(cmpos, Pos(q), Mass(q));     /* sum c-of-m position */
+                Mass(p) += soa->mass[q];
+                mw_incaddv_s(cmpos, pos, soa->mass[q]);
+            }
         }
     }
 
@@ -423,38 +958,396 @@ static void hackCofM(const NBodyCtx* ctx, NBodyTree* tree, NBodyCell* p, real ps
     Pos(p) = cmpos;             /* and center-of-mass pos */
 }
 
+/* hackCofM: find center-of-mass coordinates and set critical cell
+ * radii, a level at a time from the bottom of the tree up. Cells of
+ * one level are independent so they are done in parallel.
+ */
+static void hackCofM(const NBodyCtx* ctx, NBodyTree* tree, const NBodySoA* soa)
+{
+    int lev, k;
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(lev, k)
+  #endif
+    for (lev = (int) tree->maxDepth; lev >= 0; --lev)
+    {
+        const int start = (int) tree->levelStart[lev];
+        const int end = (int) tree->levelStart[lev + 1];
+        const real psize = mw_ldexp(tree->rsize, -lev);  /* halved at each level */
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(static)
+      #endif
+        for (k = start; k < end; ++k)
+        {
+            nbCellCofM(ctx, tree, soa, &tree->cells[tree->levelCells[k]], psize);
+        }
+    }
+}
+
+static void nbReserveGroups(NBodyTree* t, unsigned int n)
+{
+    if (t->groupAlloc >= n)
+        return;
+
+    mwFreeA(t->groups);
+    mwFreeA(t->groupBodies);
+    mwFreeA(t->groupOf);
+
+    t->groups = (NBodyGroup*) mwMallocA(n * sizeof(NBodyGroup));
+    t->groupBodies = (unsigned int*) mwMallocA(n * sizeof(unsigned int));
+    t->groupOf = (unsigned int*) mwMallocA(n * sizeof(unsigned int));
+    t->groupAlloc = n;
+}
+
+static void nbAddGroup(NBodyTree* t, unsigned int start, unsigned int count)
+{
+    unsigned int i;
+    NBodyGroup* g = &t->groups[t->nGroup];
+
+    g->start = start;
+    g->count = count;
+
+    for (i = start; i < start + count; ++i)
+    {
+        t->groupOf[t->groupBodies[i]] = t->nGroup;
+    }
+
+    ++t->nGroup;
+}
+
+/* Append the bodies under cell r to groupBodies in depth first order
+ * and return how many there are. Nothing is decided until a cell turns
+ * out to have too many bodies for one group, and then its small
+ * children become groups. The bodies of neighbouring children are
+ * next to each other, so runs of them are merged while they fit.
+ */
+static unsigned int nbFindGroups(NBodyTree* t, const NBodySoA* soa, noderef_t r, unsigned int* nFilled)
+{
+    unsigned int start[NSUB], count[NSUB];
+    unsigned int nChild = 0, total = 0;
+    unsigned int i, runStart = 0, run = 0;
+    const NBodyCell* c = CellPtr(t, r);
+    noderef_t q = More(c);
+
+    while (q != Next(c))                  /* children end at the cell's next */
+    {
+        start[nChild] = *nFilled;
+        if (isCellRef(q))
+        {
+            count[nChild] = nbFindGroups(t, soa, q, nFilled);
+            q = Next(CellPtr(t, q));
+        }
+        else
+        {
+            t->groupBodies[(*nFilled)++] = q;
+            count[nChild] = 1;
+            q = soa->next[q];
+        }
+
+        total += count[nChild++];
+    }
+
+    if (total <= NBODY_GROUP_SIZE)        /* let the parent decide */
+        return total;
+
+    for (i = 0; i < nChild; ++i)
+    {
+        if (run != 0 && (count[i] > NBODY_GROUP_SIZE || run + count[i] > NBODY_GROUP_SIZE))
+        {
+            nbAddGroup(t, runStart, run);
+            run = 0;
+        }
+
+        if (count[i] > NBODY_GROUP_SIZE)  /* already split up */
+            continue;
+
+        if (run == 0)
+            runStart = start[i];
+        run += count[i];
+    }
+
+    if (run != 0)
+        nbAddGroup(t, runStart, run);
+
+    return total;
+}
+
+/* Split the bodies into groups of nearby bodies for nbGravMap. Needs
+ * the threaded tree. Test particles aren't in the tree, so they are
+ * left to nbMapForceTestParticles(). */
+void nbMakeTreeGroups(NBodyTree* t, const NBodySoA* soa, int nbody)
+{
+    unsigned int nFilled = 0;
+    unsigned int nInTree;
+
+    nbReserveGroups(t, (unsigned int) nbody);
+    t->nGroup = 0;
+
+    nInTree = nbFindGroups(t, soa, cellRef(0), &nFilled);
+    if (nInTree != 0 && nInTree <= NBODY_GROUP_SIZE)
+        nbAddGroup(t, 0, nInTree);
+}
+
+
+/* Tree refit.
+ *
+ * From one step to the next only a few bodies leave the cell they
+ * were in, once the cells are moved along with the center of mass of
+ * the system. Instead of building a new tree every step, the cells as
+ * they were built are kept and moved, and only the bodies that left
+ * their cell are taken out and inserted again from the root. Cells
+ * left empty are dropped, and the usual passes then recompute the
+ * masses, centers of mass, critical radii and quadrupole moments from
+ * the bottom up. Cells left with a single child aren't merged into
+ * their parent, so the tree slowly gets deeper than a new one would
+ * be. A full build is done every treeRebuildInterval steps, or sooner
+ * once too many bodies have been moved or a body leaves the root.
+ */
+
+/* Fraction of the bodies that may be moved between full builds */
+#define NBODY_REFIT_MAX_RELOCATED 0.05
+
+/* Is pos still in subcell i of the cell with midpoint mid? */
+static inline mwbool nbInSubcell(const mwvector pos, const mwvector mid, real halfPsize, int i)
+{
+    return nbSubIndexPos(pos, mid) == i
+        && mw_abs(X(pos) - X(mid)) <= halfPsize
+        && mw_abs(Y(pos) - Y(mid)) <= halfPsize
+        && mw_abs(Z(pos) - Z(mid)) <= halfPsize;
+}
+
+static mwvector nbMassCenter(const NBodySoA* soa, int nbody)
+{
+    int i;
+    real x = 0.0, y = 0.0, z = 0.0, m = 0.0;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static) reduction(+:x, y, z, m)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        x += soa->mass[i] * soa->pos[0][i];
+        y += soa->mass[i] * soa->pos[1][i];
+        z += soa->mass[i] * soa->pos[2][i];
+        m += soa->mass[i];
+    }
+
+    {
+        mwvector cm = mw_vec(x / m, y / m, z / m);
+        return cm;
+    }
+}
+
+static void nbKeepBuiltCells(NBodyTree* t, mwvector cm)
+{
+    if (!t->cellsBuilt)
+    {
+        t->cellsBuilt = (NBodyCell*) mwMallocA(t->cellAlloc * sizeof(NBodyCell));
+    }
+
+    memcpy(t->cellsBuilt, t->cells, t->cellUsed * sizeof(NBodyCell));
+    t->cmBuilt = cm;
+}
+
+/* Restore the kept cells, moved by shift */
+static void nbRestoreBuiltCells(NBodyTree* t, mwvector shift)
+{
+    int k;
+    const int nCell = (int) t->cellUsed;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(static)
+  #endif
+    for (k = 0; k < nCell; ++k)
+    {
+        t->cells[k] = t->cellsBuilt[k];
+        mw_incaddv(Pos(&t->cells[k]), shift);
+    }
+}
+
+/* Take the bodies that left their cell out of the tree and mark them
+ * to be inserted again. Returns how many there are. */
+static unsigned int nbRemoveRelocated(NBodyTree* t, const NBodySoA* soa)
+{
+    int k, i;
+    int nMoved = 0;
+    const int nCell = (int) t->cellUsed;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k, i) schedule(static) reduction(+:nMoved)
+  #endif
+    for (k = 0; k < nCell; ++k)
+    {
+        NBodyCell* c = &t->cells[k];
+        const real halfPsize = mw_ldexp(t->rsize, -(int) t->cellLevel[k] - 1);
+
+        for (i = 0; i < NSUB; ++i)
+        {
+            noderef_t q = Subp(c)[i];
+
+            if (   q != NODE_NULL && !isCellRef(q)
+                && !nbInSubcell(nbSoAPos(soa, q), Pos(c), halfPsize, i))
+            {
+                Subp(c)[i] = NODE_NULL;
+                t->relocate[q] = TRUE;
+                ++nMoved;
+            }
+        }
+    }
+
+    return (unsigned int) nMoved;
+}
+
+/* Unlink the cells below cell i left without any bodies. Returns TRUE
+ * if cell i itself is now empty. */
+static mwbool nbPruneEmptyCells(NBodyTree* t, unsigned int i)
+{
+    unsigned int j;
+    mwbool empty = TRUE;
+
+    for (j = 0; j < NSUB; ++j)
+    {
+        noderef_t r = Subp(&t->cells[i])[j];
+
+        if (r == NODE_NULL)
+            continue;
+
+        if (isCellRef(r) && nbPruneEmptyCells(t, refIndex(r)))
+            Subp(&t->cells[i])[j] = NODE_NULL;
+        else
+            empty = FALSE;
+    }
+
+    return empty;
+}
+
+/* Refit the tree kept from the last step to the new positions. Returns
+ * FALSE if the tree needs to be built from scratch instead. */
+static mwbool nbRefitTree(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i;
+    mwvector cm, shift;
+    mwbool canRefit = FALSE;
+    NBodyTree* t = &st->tree;
+    const NBodySoA* soa = &st->soa;
+
+    if (   t->cellsBuilt
+        && (real) (t->refitCount + 1) < ctx->treeRebuildInterval
+        && (real) t->nRelocatedTotal <= NBODY_REFIT_MAX_RELOCATED * (real) st->nbody)
+    {
+        cm = nbMassCenter(soa, st->nbody);
+        shift = mw_subv(cm, t->cmBuilt);
+
+        /* The root can't grow without changing every cell */
+        canRefit = t->rsize >= 2.0 * nbMaxRootDist(soa, st->nbody, mw_addv(Pos(&t->cellsBuilt[0]), shift));
+    }
+
+    if (!canRefit)
+    {
+        t->refitCount = 0;
+        t->nRelocated = 0;
+        t->nRelocatedTotal = 0;
+        return FALSE;
+    }
+
+    if (t->relocateAlloc < (unsigned int) st->nbody)
+    {
+        mwFreeA(t->relocate);
+        t->relocate = (mwbool*) mwCallocA(st->nbody, sizeof(mwbool));
+        t->relocateAlloc = (unsigned int) st->nbody;
+    }
+
+    nbRestoreBuiltCells(t, shift);
+
+    t->nRelocated = nbRemoveRelocated(t, soa);
+    t->nRelocatedTotal += t->nRelocated;
+    ++t->refitCount;
+
+    if (t->nRelocated > 0)
+    {
+        for (i = 0; i < st->nbody; ++i)             /* in order, so the tree doesn't depend on threads */
+        {
+            if (t->relocate[i])
+            {
+                t->relocate[i] = FALSE;
+                nbLoadBody(soa, t, (unsigned int) i);
+            }
+        }
+
+        if (t->structureError)
+            return TRUE;
+
+        nbPruneEmptyCells(t, 0);
+        nbSortCellsDepthFirst(t);                   /* also finds the new levels */
+        nbSortCellsByLevel(t);
+    }
+
+    nbKeepBuiltCells(t, cm);
+
+    return TRUE;
+}
+
 /* nbMakeTree: initialize tree structure for hierarchical force calculation
  * from body array btab, which contains ctx.nbody bodies.
  */
 NBodyStatus nbMakeTree(const NBodyCtx* ctx, NBodyState* st)
 {
-    Body* p;
-    const Body* endp = st->bodytab + st->nbody;
+    int i;
     NBodyTree* t = &st->tree;
+    NBodySoA* soa = &st->soa;
+    mwbool inOrder;
 
-    nbNewTree(st, t);                                /* flush existing tree, etc */
-
-    expandBox(t, st->bodytab, st->nbody);            /* and expand cell to fit */
-    for (p = st->bodytab; p < endp; p++)             /* loop over bodies... */
+    if (nbRefitTree(ctx, st))                        /* move bodies in last step's tree */
     {
-        if (Mass(p) != 0.0)                  /* exclude test particles */
-            nbLoadBody(st, t, p);              /* and insert into tree */
+        if (st->tree.structureError)
+            return NBODY_TREE_STRUCTURE_ERROR;
     }
+    else
+    {
+        nbNewTree(st, t);                            /* flush existing tree, etc */
 
-    /* Check if tree structure error occured */
-    if (st->tree.structureError)
-        return NBODY_TREE_STRUCTURE_ERROR;
+        expandBox(t, soa, st->nbody);                /* and expand cell to fit */
+        if (ctx->useMortonTree && nbMortonKeysUsable(t))
+        {
+            inOrder = nbLoadBodiesMorton(soa, t, st->nbody); /* sort bodies and build all at once */
+        }
+        else
+        {
+            for (i = 0; i < st->nbody; ++i)          /* loop over bodies... */
+            {
+                if (soa->mass[i] != 0.0)     /* exclude test particles */
+                    nbLoadBody(soa, t, (unsigned int) i); /* and insert into tree */
+            }
+            inOrder = FALSE;
+        }
 
+        /* Check if tree structure error occured */
+        if (st->tree.structureError)
+            return NBODY_TREE_STRUCTURE_ERROR;
 
-    hackCofM(ctx, &st->tree, t->root, t->rsize);   /* find c-of-m coordinates */
+        if (!inOrder)
+            nbSortCellsDepthFirst(t);                /* lay out cells in walk order */
+        nbSortCellsByLevel(t);
+
+        if (ctx->treeRebuildInterval > 1.0)
+            nbKeepBuiltCells(t, nbMassCenter(soa, st->nbody)); /* to refit in the next steps */
+    }
+
+    t->root = &t->cells[0];
+
+    hackCofM(ctx, &st->tree, soa);              /* find c-of-m coordinates */
 
     /* Check if tree structure error occured */
     if (st->tree.structureError)
         return NBODY_TREE_STRUCTURE_ERROR;
 
-    threadTree((NBodyNode*) t->root, NULL);        /* add Next and More links */
+    threadTree(t, soa);                         /* add Next and More links */
     if (ctx->useQuad)                           /* including quad moments? */
-        hackQuad(t->root);                      /* assign Quad moments */
+        hackQuad(t, soa);                       /* assign Quad moments */
+
+    if (ctx->useGroupWalk)
+        nbMakeTreeGroups(t, soa, st->nbody);    /* share walks between nearby bodies */
 
     return NBODY_SUCCESS;
 }
@@ -25,6 +25,10 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #include "nbody_types.h"
 #include "nbody_show.h"
 #include "nbody_defaults.h"
+#include "nbody_soa.h"
+#include "nbody_fmm.h"
+#include "nbody_potential_expr.h"
+#include "nbody_likelihood.h"
 
 #if NBODY_OPENCL
   #include "nbody_cl.h"
@@ -36,41 +40,45 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 
 static void freeNBodyTree(NBodyTree* t)
 {
-    NBodyNode* p;
-    NBodyNode* tmp;
-
-    p = (NBodyNode*) t->root;
-    while (p != NULL)
-    {
-        if (isCell(p))
-        {
-            tmp = More(p);
-            mwFreeA(p);
-            p = tmp;
-        }
-        else                        /* skip over bodies */
-        {
-            p = Next(p);
-        }
-    }
+    mwFreeA(t->cells);
+    mwFreeA(t->cellsTmp);
+    t->cells = t->cellsTmp = NULL;
+    t->cellAlloc = 0;
 
     t->root = NULL;
     t->cellUsed = 0;
     t->maxDepth = 0;
-}
-
-static void freeFreeCells(NBodyNode* freeCell)
-{
-    NBodyNode* p;
-    NBodyNode* tmp;
 
-    p = freeCell;
-    while (p)
-    {
-        tmp = Next(p);
-        mwFreeA(p);
-        p = tmp;
-    }
+    mwFreeA(t->cellLevel);
+    mwFreeA(t->levelCells);
+    free(t->levelStart);
+    t->cellLevel = t->levelCells = t->levelStart = NULL;
+    t->levelAlloc = 0;
+
+    mwFreeA(t->keys);
+    mwFreeA(t->keysTmp);
+    mwFreeA(t->keyOrder);
+    mwFreeA(t->keyOrderTmp);
+    t->keys = t->keysTmp = NULL;
+    t->keyOrder = t->keyOrderTmp = NULL;
+    t->keysAlloc = 0;
+
+    mwFreeA(t->groups);
+    mwFreeA(t->groupBodies);
+    mwFreeA(t->groupOf);
+    t->groups = NULL;
+    t->groupBodies = t->groupOf = NULL;
+    t->nGroup = 0;
+    t->groupAlloc = 0;
+
+    mwFreeA(t->cellsBuilt);
+    mwFreeA(t->relocate);
+    t->cellsBuilt = NULL;
+    t->relocate = NULL;
+    t->relocateAlloc = 0;
+    t->refitCount = 0;
+
+    nbFreeFMM(&t->fmm);
 }
 
 int nbDetachSharedScene(NBodyState* st)
@@ -107,9 +115,11 @@ int destroyNBodyState(NBodyState* st)
     int i;
 
     freeNBodyTree(&st->tree);
-    freeFreeCells(st->freeCell);
     mwFreeA(st->bodytab);
-    mwFreeA(st->acctab);
+    nbFreeSoA(&st->soa);
+    mwFreeA(st->threadAcc);
+    mwFreeA(st->stepLevel);
+    mwFreeA(st->activeBodies);
     mwFreeA(st->orbitTrace);
 
     free(st->checkpointResolved);
@@ -118,12 +128,16 @@ int destroyNBodyState(NBodyState* st)
     {
         for (i = 0; i < nThread; ++i)
         {
-            lua_close(st->potEvalStates[i]);
+            if (st->potEvalStates[i])
+                lua_close(st->potEvalStates[i]);
         }
         free(st->potEvalClosures);
         free(st->potEvalStates);
     }
 
+    nbFreePotentialExpr(st->potentialExpr);
+    nbDestroyLikelihoodContext(st->likelihoodCtx);
+
   #if NBODY_OPENCL
 
     if (st->ci)
@@ -170,7 +184,6 @@ void setInitialNBodyState(NBodyState* st, const NBodyCtx* ctx, Body* bodies, int
     static const NBodyTree emptyTree = EMPTY_TREE;
 
     st->tree = emptyTree;
-    st->freeCell = NULL;
     st->usesQuad = ctx->useQuad;
     st->usesExact = (ctx->criterion == Exact);
 
@@ -186,8 +199,7 @@ void setInitialNBodyState(NBodyState* st, const NBodyCtx* ctx, Body* bodies, int
     st->nOrbitTrace = ctx->nStep + 1;
     st->orbitTrace = (mwvector*) mwCallocA(st->nOrbitTrace, sizeof(mwvector));
 
-    /* The tests may step the system from an arbitrary place, so make sure this is 0'ed */
-    st->acctab = (mwvector*) mwCallocA(nbody, sizeof(mwvector));
+    nbAllocSoA(&st->soa, nbody);
 }
 
 NBodyState* newNBodyState()
@@ -334,7 +346,7 @@ int equalBody(const Body* a, const Body* b)
     return TRUE;
 }
 
-static int equalVectorArray(const mwvector* a, const mwvector* b, size_t n)
+static int equalRealArray(const real* a, const real* b, size_t n)
 {
     size_t i;
 
@@ -346,7 +358,7 @@ static int equalVectorArray(const mwvector* a, const mwvector* b, size_t n)
 
     for (i = 0; i < n; ++i)
     {
-        if (!equalVector(&a[i], &b[i]))
+        if (a[i] != b[i])
         {
             return FALSE;
         }
@@ -394,7 +406,9 @@ int equalNBodyState(const NBodyState* st1, const NBodyState* st2)
         return FALSE;
     }
 
-    return equalVectorArray(st1->acctab, st2->acctab, st1->nbody);
+    return equalRealArray(st1->soa.acc[0], st2->soa.acc[0], st1->nbody)
+        && equalRealArray(st1->soa.acc[1], st2->soa.acc[1], st1->nbody)
+        && equalRealArray(st1->soa.acc[2], st2->soa.acc[2], st1->nbody);
 }
 
 /* TODO: Doesn't clone tree or CL stuffs */
@@ -406,12 +420,11 @@ void cloneNBodyState(NBodyState* st, const NBodyState* oldSt)
     st->tree = emptyTree;
     st->tree.rsize = oldSt->tree.rsize;
 
-    st->freeCell = NULL;
-
     st->lastCheckpoint = oldSt->lastCheckpoint;
     st->step           = oldSt->step;
     st->nbody          = oldSt->nbody;
     st->effNBody       = oldSt->effNBody;
+    st->nMassive       = oldSt->nMassive;
     st->bestLikelihood = oldSt->bestLikelihood;
     st->bestLikelihood_count = oldSt->bestLikelihood_count;
     
@@ -426,13 +439,13 @@ void cloneNBodyState(NBodyState* st, const NBodyState* oldSt)
     st->tree.structureError = oldSt->tree.structureError;
 
     assert(nbody > 0);
-    assert(st->bodytab == NULL && st->acctab == NULL);
+    assert(st->bodytab == NULL && st->soa.mass == NULL);
 
     st->bodytab = (Body*) mwMallocA(nbody * sizeof(Body));
     memcpy(st->bodytab, oldSt->bodytab, nbody * sizeof(Body));
 
-    st->acctab = (mwvector*) mwMallocA(nbody * sizeof(mwvector));
-    memcpy(st->acctab, oldSt->acctab, nbody * sizeof(mwvector));
+    nbAllocSoA(&st->soa, nbody);
+    nbCopySoA(&st->soa, &oldSt->soa, nbody);
 
     if (oldSt->orbitTrace)
     {
@@ -441,6 +454,19 @@ void cloneNBodyState(NBodyState* st, const NBodyState* oldSt)
         st->nOrbitTrace = oldSt->nOrbitTrace;
     }
 
+    if (oldSt->stepLevel)
+    {
+        st->stepLevel = (uint32_t*) mwMallocA(nbody * sizeof(uint32_t));
+        memcpy(st->stepLevel, oldSt->stepLevel, nbody * sizeof(uint32_t));
+    }
+
+    if (oldSt->activeBodies)
+    {
+        st->activeBodies = (uint32_t*) mwMallocA(nbody * sizeof(uint32_t));
+        memcpy(st->activeBodies, oldSt->activeBodies, nbody * sizeof(uint32_t));
+        st->nActive = oldSt->nActive;
+    }
+
     if (st->ci)
     {
         mw_panic("OpenCL NBodyState cloning not implemented\n");
@@ -601,6 +627,7 @@ int equalNBodyCtx(const NBodyCtx* ctx1, const NBodyCtx* ctx2)
         && feqWithNan(ctx1->treeRSize, ctx2->treeRSize)
         && feqWithNan(ctx1->sunGCDist, ctx2->sunGCDist)
         && feqWithNan(ctx1->criterion, ctx2->criterion)
+        && (ctx1->integrator == ctx2->integrator)
         && (ctx1->potentialType == ctx2->potentialType)
         && feqWithNan(ctx1->useQuad, ctx2->useQuad)
         && feqWithNan(ctx1->allowIncest, ctx2->allowIncest)
@@ -617,6 +644,17 @@ int equalNBodyCtx(const NBodyCtx* ctx1, const NBodyCtx* ctx2)
         && feqWithNan(ctx1->BetaCorrect, ctx2->BetaCorrect)
         && feqWithNan(ctx1->VelCorrect, ctx2->VelCorrect)
         && feqWithNan(ctx1->quietErrors, ctx2->quietErrors)
+        && feqWithNan(ctx1->useMortonTree, ctx2->useMortonTree)
+        && feqWithNan(ctx1->useGroupWalk, ctx2->useGroupWalk)
+        && feqWithNan(ctx1->useTiledExact, ctx2->useTiledExact)
+        && feqWithNan(ctx1->useBlockSteps, ctx2->useBlockSteps)
+        && feqWithNan(ctx1->useCausticGrid, ctx2->useCausticGrid)
+        && feqWithNan(ctx1->treeRebuildInterval, ctx2->treeRebuildInterval)
+        && feqWithNan(ctx1->fmmOrder, ctx2->fmmOrder)
+        && feqWithNan(ctx1->blockStepLevels, ctx2->blockStepLevels)
+        && feqWithNan(ctx1->blockStepAccuracy, ctx2->blockStepAccuracy)
+        && feqWithNan(ctx1->potentialGridTolerance, ctx2->potentialGridTolerance)
+        && feqWithNan(ctx1->testParticleThreads, ctx2->testParticleThreads)
         && ctx1->checkpointT == ctx2->checkpointT
         && feqWithNan(ctx1->nStep, ctx2->nStep)
         && equalPotential(&ctx1->pot, &ctx2->pot);
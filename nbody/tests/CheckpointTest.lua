@@ -27,16 +27,26 @@ function randomNBodyCtx(prng)
       prng = DSFMT.create()
    end
 
+   local criterion = prng:randomListItem({"TreeCode", "SW93", "BH86", "Exact", "FMM"})
+
    return NBodyCtx.create{
       timestep    = prng:random(1.0e-5, 1.0e-4),
       timeEvolve  = prng:random(0, 10),
       theta       = prng:random(0, 1),
       eps2        = prng:random(1.0e-9, 1.0e-3),
       treeRSize   = prng:randomListItem({ 4, 8, 2, 16 }),
-      criterion   = prng:randomListItem({"TreeCode", "SW93", "BH86", "Exact"}),
+      criterion   = criterion,
       useQuad     = prng:randomBool(),
+      treeRebuildInterval = prng:randomListItem({ 1, 4, 20 }),
+      useBlockSteps   = criterion ~= "FMM" and prng:randomBool(),  -- FMM has no single body forces
+      blockStepLevels = prng:randomListItem({ 2, 3, 5 }),
       allowIncest = true,
-      quietErrors = true
+      quietErrors = true,
+      BestLikeStart = 0.98,
+      BetaSigma     = 2.5,
+      VelSigma      = 2.5,
+      BetaCorrect   = 1.111,
+      VelCorrect    = 1.111
    }
 end
 
@@ -55,9 +65,12 @@ function runInterruptedSteps(st, totalSteps, ctx, prng)
       st:step(ctx)
       if prng:randomBool() then
          local tmp = tmpDir .. os.tmpname()
-         st:writeCheckpoint(ctx, checkpoint, tmp)
-         ctx, st = NBodyState.readCheckpoint(checkpoint)
-         os.remove(checkpoint)
+         -- Refused between full tree builds or in the middle of a
+         -- block step cycle, as a real run's would be
+         if st:writeCheckpoint(ctx, checkpoint, tmp) then
+            ctx, st = NBodyState.readCheckpoint(checkpoint)
+            os.remove(checkpoint)
+         end
       end
    end
 
@@ -77,8 +90,9 @@ for i = 1, nTests do
    ctx:addPotential(SP.randomPotential(prng))
 
 
+   -- Not a clone, which would drop the tree the first refit needs
    st = NBodyState.create(ctx, m)
-   stClone = st:clone()
+   stClone = NBodyState.create(ctx, m)
 
    testSteps = floor(prng:random(0, 51))
 
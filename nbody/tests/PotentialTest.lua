@@ -81,6 +81,51 @@ function checkPotentialTests()
    end
 end
 
+-- Compiled potential closures must give exactly what calling the
+-- closure does, and the ones that can't be must be left to Lua
+function checkPotentialExprTests()
+   local prng = DSFMT.create(1984)
+   local points = { }
+
+   for i = 1, 300 do
+      points[i] = prng:randomVector(prng:random(0.01, 100))
+   end
+
+   -- Loaded without a chunk name, so the string is the source the
+   -- compiler reads the closure from
+   for name, src in pairs(SP.compiledClosures) do
+      local f = assert(loadstring(src))()
+      local accels = compiledPotentialAccelerations(f, points)
+
+      assert(accels ~= nil, string.format("Potential closure '%s' was not compiled", name))
+
+      for i, r in ipairs(points) do
+         local ax, ay, az = f(r.x, r.y, r.z)
+         local a = accels[i]
+
+         assert(a.x == ax and a.y == ay and a.z == az,
+                string.format("Compiled potential closure '%s' differs at %s:\n"
+                              .. "closure  = (%.17g, %.17g, %.17g)\n"
+                              .. "compiled = (%.17g, %.17g, %.17g)\n",
+                              name, tostring(r), ax, ay, az, a.x, a.y, a.z))
+      end
+   end
+
+   for name, src in pairs(SP.fallbackClosures) do
+      local f = assert(loadstring(src))()
+
+      assert(compiledPotentialAccelerations(f, points) == nil,
+             string.format("Potential closure '%s' should not have been compiled", name))
+   end
+end
+
+
+local args = { ... }
+
+checkPotentialExprTests()
+if args[1] == "exprOnly" then
+   return
+end
 
 if generatingResults then
    generatePotentialComboTests()
@@ -59,3 +59,14 @@ runStandardPlummer(100000, "true", "BH86", 0.5)
 runStandardPlummer(100000, "false", "BH86", 0.5)
 
 
+-- The force loop and external potential for the usual Milky Way model
+function runMilkyWayPlummer(n, quad, crit, theta)
+   local name
+   name = string.format("Plummer_MilkyWay_m=16_r=0.2__n=%d__quad=%s_%s=%.2f",
+                        n, quad, crit, theta)
+   runBenchmark(name, sampleSeeds[1], n, nTimestep, crit, theta, quad, 16, 0.2, "MilkyWay")
+end
+
+runMilkyWayPlummer(100000, "true", "BH86", 0.6)
+runMilkyWayPlummer(100000, "false", "BH86", 0.6)
+
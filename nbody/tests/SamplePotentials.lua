@@ -297,6 +297,101 @@ SamplePotentials.randomPotential = function(prng)
 end
 
 
+-- Sources of Lua potential closures, each a chunk returning the
+-- closure. These use only what nbody_potential_expr.c compiles.
+SamplePotentials.compiledClosures = {
+   locals = [[
+return function(x, y, z)
+   local r2 = x * x + y * y + z * z
+   local r = sqrt(r2)
+   local f = -1.0e5 / (r2 * r)
+   return f * x, f * y, f * z
+end
+]],
+
+   upvalues = [[
+local mass, scale = 3.0e5, 1.5
+return function(x, y, z)
+   local r = sqrt(x * x + y * y + z * z)
+   local f = -mass / (r * sqr(r + scale))
+   return f * x, f * y, f * z
+end
+]],
+
+   globals = [[
+return function(x, y, z)
+   local r2 = x * x + y * y + z * z
+   local f = -pi * ee * 1.0e4 / (r2 * sqrt(r2))
+   return f * x, f * y, f * z
+end
+]],
+
+   powerAndMinus = [[
+return function(x, y, z)
+   local r2 = x ^ 2 + y ^ 2 + z ^ 2 + 0.25
+   local f = -2.0e5 * r2 ^ -1.5
+   local g = -x ^ 2 / r2
+   return -f * -x, f * y + g, -(f * z) - -g
+end
+]],
+
+   mathFunctions = [[
+return function(x, y, z)
+   local R = hypot(x, y)
+   local phi = atan2(y, x)
+   local r = sqrt(sqr(R) + sqr(z))
+   local f = -1.0e5 * exp(-r / 10.0) / cube(r) + log(r) * log10(r + 1.0) * 1.0e-3
+   R = pow(R, 1.5) * fabs(cos(phi)) + fmod(r, 3.0) + floor(r) - ceil(z) + sinh(z * 0.01)
+   return f * x + R * 1.0e-6, f * y + sin(phi) * 1.0e-3, f * z + tan(d2r(r2d(phi * 0.1)))
+end
+]]
+}
+
+-- Closures that must be left to Lua, since the compiled closure would
+-- not do the same
+SamplePotentials.fallbackClosures = {
+   globalAssignment = [[
+return function(x, y, z)
+   local r2 = x * x + y * y + z * z
+   lastR2 = r2
+   return -x / r2, -y / r2, -z / r2
+end
+]],
+
+   nonAssignment = [[
+return function(x, y, z)
+   local r2 = x * x + y * y + z * z
+   if r2 < 1.0 then r2 = 1.0 end
+   return -x / r2, -y / r2, -z / r2
+end
+]],
+
+   wrongArgCount = [[
+return function(x, y, z)
+   local r = sqrt(x * x + y * y + z * z, 2.0)
+   return -x / r, -y / r, -z / r
+end
+]],
+
+   shadowedByUpvalue = [[
+local sqrt = function(a) return a end
+return function(x, y, z)
+   local r = sqrt(x * x + y * y + z * z)
+   return -x / r, -y / r, -z / r
+end
+]],
+
+   shadowedInEnvironment = [[
+local f = function(x, y, z)
+   local r = sqrt(x * x + y * y + z * z)
+   return -x / r, -y / r, -z / r
+end
+setfenv(f, setmetatable({ sqrt = function(a) return a end }, { __index = _G }))
+return f
+]]
+}
+
+
 return SamplePotentials
 
 
@@ -1,6 +1,7 @@
 --
--- Run a single Plummer sphere with no external potential for
--- benchmarking
+-- Run a single Plummer sphere for benchmarking, with no external
+-- potential or on a circular orbit in the Miyamoto-Nagai disk and
+-- logarithmic halo if the optional last argument is "MilkyWay"
 --
 
 args = {...}
@@ -14,6 +15,7 @@ useQuad = (args[5] == "true")
 
 mass = args[6]
 radius = args[7]
+potentialName = args[8] or "none"
 
 
 assert(nbody, "Nbody not set")
@@ -25,6 +27,8 @@ assert(args[5] == "true" or args[5] == "false", "useQuad must be \"true\" or \"f
 
 assert(mass, "mass not set")
 assert(radius, "radius not set")
+assert(potentialName == "none" or potentialName == "MilkyWay",
+       "potential must be \"none\" or \"MilkyWay\"")
 
 
 
@@ -36,6 +40,14 @@ function makeHistogram()
 end
 
 function makePotential()
+   if potentialName == "MilkyWay" then
+      return Potential.create{
+         spherical = Spherical.spherical{ mass = 1.52954402e5, scale = 0.7 },
+         disk      = Disk.miyamotoNagai{ mass = 4.45865888e5, scaleLength = 6.5, scaleHeight = 0.26 },
+         halo      = Halo.logarithmic{ vhalo = 73, scaleLength = 12.0, flattenZ = 1.0 }
+      }
+   end
+
    return nil
 end
 
@@ -46,16 +58,28 @@ function makeContext()
       eps2       = calculateEps2(nbody, radius),
       criterion  = criterion,
       useQuad    = useQuad,
-      theta      = theta
+      theta      = theta,
+      BestLikeStart = 0.98,
+      BetaSigma     = 2.5,
+      VelSigma      = 2.5,
+      BetaCorrect   = 1.111,
+      VelCorrect    = 1.111
    }
 end
 
 function makeBodies(ctx, potential)
+   local position, velocity = Vector.create(0, 0, 0), Vector.create(0, 0, 0)
+
+   if potential ~= nil then
+      position = Vector.create(20, 0, 0)
+      velocity = Vector.create(0, 200, 0)
+   end
+
    return predefinedModels.plummer{
       nbody       = nbody,
       prng        = DSFMT.create(argSeed),
-      position    = Vector.create(0, 0, 0),
-      velocity    = Vector.create(0, 0, 0),
+      position    = position,
+      velocity    = velocity,
       mass        = mass,
       scaleRadius = radius
    }
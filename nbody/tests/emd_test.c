@@ -27,6 +27,14 @@ static dsfmt_t _prng;
 
 #define ZERO_THRESHOLD 1.0e-4
 
+/* nbMatchEMD() rounds to this, so both solvers must agree to it */
+#define SOLVER_THRESHOLD 1.0e-9
+
+/* emdCalc() stops once no step would save more than this times the
+ * largest distance, EMD_EPS in nbody_emd.c */
+#define TRANSPORTATION_EPS 1.0e-5
+#define SOLVER_TRIALS 5
+
 /* Function which assigns a sample distribution to arr1 and arr2 to
  * match of size n. Returns expected EMD for the distribution */
 typedef float (*EMDTestDistribFunc)(WeightPos* RESTRICT arr1, WeightPos* RESTRICT arr2, unsigned int n);
@@ -255,6 +263,228 @@ static int testDistributionEMD(const char* distName, EMDTestDistribFunc distribf
     return differs;
 }
 
+/* Random histogram of total bodies in whole numbers, like raw counts,
+ * with about half the bins empty. The totals and every difference of
+ * the weights are exact, which emdCalc() needs to be exact too: it
+ * counts a supply within EMD_EPS of a demand as used up. */
+static void randomCounts(WeightPos* RESTRICT arr, unsigned int n, unsigned int total)
+{
+    unsigned int i, k;
+    unsigned int nUsed = 0;
+    unsigned int* used;
+
+    used = mwCalloc(n, sizeof(unsigned int));
+
+    for (i = 0; i < n; ++i)
+    {
+        arr[i].weight = 0.0;
+        if (dsfmt_genrand_open_open(&_prng) < 0.5)
+        {
+            used[nUsed++] = i;
+        }
+    }
+
+    if (nUsed == 0)
+    {
+        used[nUsed++] = 0;
+    }
+
+    for (k = 0; k < total; ++k)
+    {
+        i = used[(unsigned int) mwXrandom(&_prng, 0, nUsed)];
+        arr[i].weight += 1.0;
+    }
+
+    free(used);
+}
+
+/* Compare the network simplex solver with emdCalc() on random
+ * histograms with the same and with different totals. The network
+ * simplex is exact, so emdCalc() may only be above it by as much as
+ * it stops short of the optimum. */
+static int testNetworkSimplexEMD(unsigned int dim1, unsigned int dim2)
+{
+    unsigned int n = dim1 * dim2;
+    unsigned int total = 4 * 16 * n;
+    unsigned int trial;
+    WeightPos* arr1;
+    WeightPos* arr2;
+    real result1 = 0.0;
+    real result2 = 0.0;
+    real slack;
+    int fails = 0;
+
+    arr1 = mwCalloc(n, sizeof(WeightPos));
+    arr2 = mwCalloc(n, sizeof(WeightPos));
+
+    generatePositions(arr1, arr2, dim1, dim2);
+    slack = TRANSPORTATION_EPS * distMetric(arr1, arr2, 0, n - 1) + SOLVER_THRESHOLD;
+
+    for (trial = 0; trial < 2 * SOLVER_TRIALS; ++trial)
+    {
+        randomCounts(arr1, n, total);
+        randomCounts(arr2, n, trial < SOLVER_TRIALS ? total : 3 * total / 4);
+
+        result1 = emdCalc((const real*) arr1, (const real*) arr2, n, n, NULL);
+        result2 = emdCalcNetworkSimplex((const real*) arr1, (const real*) arr2, n, n, NULL);
+
+        if (!(result1 - result2 > -SOLVER_THRESHOLD && result1 - result2 < slack))
+        {
+            mw_printf("ERROR: EMD solvers differ with %u x %u bins:\n"
+                      "  Transportation %.15f, Network simplex %.15f, |Diff| = %g\n",
+                      dim1, dim2,
+                      result1, result2, fabs(result1 - result2)
+                );
+            ++fails;
+        }
+    }
+
+    if (fails == 0)
+    {
+        mw_printf("EMD test [%u,%u] %-20s = %f, %f\n",
+                  dim1, dim2, "networkSimplex", result1, result2
+            );
+    }
+
+    free(arr1);
+    free(arr2);
+
+    return fails;
+}
+
+/* Along a line the EMD is the area between the cumulative histograms,
+ * so the network simplex solver must get it for any weights */
+static int testNetworkSimplexLineEMD(unsigned int n)
+{
+    unsigned int i, trial;
+    WeightPos* arr1;
+    WeightPos* arr2;
+    double total1, total2, cumulative, expected;
+    real actual = 0.0;
+    int fails = 0;
+
+    arr1 = mwCalloc(n, sizeof(WeightPos));
+    arr2 = mwCalloc(n, sizeof(WeightPos));
+
+    generatePositions(arr1, arr2, n, 1);
+
+    for (trial = 0; trial < SOLVER_TRIALS; ++trial)
+    {
+        randomDist(arr1, n);
+        randomDist(arr2, n);
+
+        /* Make the totals the same in double precision */
+        total1 = total2 = 0.0;
+        for (i = 0; i < n; ++i)
+        {
+            total1 += arr1[i].weight;
+            total2 += arr2[i].weight;
+        }
+
+        for (i = 0; i < n; ++i)
+        {
+            arr2[i].weight *= total1 / total2;
+        }
+
+        expected = cumulative = 0.0;
+        for (i = 0; i + 1 < n; ++i)
+        {
+            cumulative += arr1[i].weight - arr2[i].weight;
+            expected += fabs(cumulative);
+        }
+        expected /= total1;
+
+        actual = emdCalcNetworkSimplex((const real*) arr1, (const real*) arr2, n, n, NULL);
+
+        if (!(fabs(expected - actual) < SOLVER_THRESHOLD))
+        {
+            mw_printf("ERROR: Network simplex EMD wrong along %u bins:\n"
+                      "  Expected %.15f, Actual %.15f, |Diff| = %g\n",
+                      n, expected, actual, fabs(expected - actual)
+                );
+            ++fails;
+        }
+    }
+
+    if (fails == 0)
+    {
+        mw_printf("EMD test [%u,1] %-20s = %f, %f\n", n, "networkSimplexLine", expected, actual);
+    }
+
+    free(arr1);
+    free(arr2);
+
+    return fails;
+}
+
+/* Move a few bodies of the histogram around like a step of the
+ * simulation does, and check that starting from the last solve gives
+ * the same as starting over, including when the total changes */
+static int testWarmStartEMD(unsigned int dim1, unsigned int dim2)
+{
+    unsigned int n = dim1 * dim2;
+    unsigned int total = 4 * 16 * n;
+    unsigned int step, k, i, j;
+    WeightPos* arr1;
+    WeightPos* arr2;
+    EMDNetwork* net;
+    real cold = 0.0;
+    real warm = 0.0;
+    int fails = 0;
+
+    arr1 = mwCalloc(n, sizeof(WeightPos));
+    arr2 = mwCalloc(n, sizeof(WeightPos));
+    net = emdCreateNetwork();
+
+    generatePositions(arr1, arr2, dim1, dim2);
+    randomCounts(arr1, n, total);
+    randomCounts(arr2, n, total);
+
+    for (step = 0; step < 4 * SOLVER_TRIALS; ++step)
+    {
+        for (k = 0; k < 1 + n / 10; ++k)
+        {
+            i = (unsigned int) mwXrandom(&_prng, 0, n);
+            j = (unsigned int) mwXrandom(&_prng, 0, n);
+
+            if (arr2[i].weight > 0.0)
+            {
+                arr2[i].weight -= 1.0;
+                if (step % 2 == 0)
+                {
+                    arr2[j].weight += 1.0;
+                }
+            }
+        }
+
+        cold = emdCalcNetworkSimplex((const real*) arr1, (const real*) arr2, n, n, NULL);
+        warm = emdCalcNetworkSimplexWarm(net, (const real*) arr1, (const real*) arr2, n, n);
+
+        if (!(fabs(cold - warm) < SOLVER_THRESHOLD))
+        {
+            mw_printf("ERROR: Warm started EMD differs with %u x %u bins at step %u:\n"
+                      "  Cold %.15f, Warm %.15f, |Diff| = %g\n",
+                      dim1, dim2, step,
+                      cold, warm, fabs(cold - warm)
+                );
+            ++fails;
+        }
+    }
+
+    if (fails == 0)
+    {
+        mw_printf("EMD test [%u,%u] %-20s = %f, %f\n",
+                  dim1, dim2, "warmStart", cold, warm
+            );
+    }
+
+    emdDestroyNetwork(net);
+    free(arr1);
+    free(arr2);
+
+    return fails;
+}
+
 int runTestsEMD(unsigned int dim1, unsigned int dim2)
 {
     int fails = 0;
@@ -266,6 +496,8 @@ int runTestsEMD(unsigned int dim1, unsigned int dim2)
     fails += testDistributionEMD("allInDifferentBins", allInDifferentBins, dim1, dim2);
 
     fails += testConsistentEMD(dim1, dim2);
+    fails += testNetworkSimplexEMD(dim1, dim2);
+    fails += testWarmStartEMD(dim1, dim2);
 
     return fails;
 }
@@ -285,6 +517,14 @@ int main(int argc, const char* argv[])
     fails += runTestsEMD(11, 34);
     fails += runTestsEMD(34, 11);
 
+    /* The shapes of the histograms we fit */
+    fails += runTestsEMD(50, 1);
+    fails += runTestsEMD(20, 20);
+
+    fails += testNetworkSimplexLineEMD(7);
+    fails += testNetworkSimplexLineEMD(50);
+    fails += testNetworkSimplexLineEMD(400);
+
     if (fails != 0)
     {
         mw_printf("%d EMD test distributions failed\n", fails);
@@ -38,6 +38,7 @@
 #include "nbody_plummer.h"
 #include "nbody_defaults.h"
 #include "nbody_tree.h"
+#include "nbody_potential_expr.h"
 
 
 /* things in NBodyCtx which influence individual steps that aren't the potential. */
@@ -319,6 +320,59 @@ static int statusIsFatal(lua_State* luaSt)
     return 1;
 }
 
+/* The accelerations the potential closure compiles to at each Vector
+ * of the table, all evaluated together, or nil if it doesn't compile */
+static int compiledPotentialAccelerations(lua_State* luaSt)
+{
+    int i, n, closure;
+    real* buf;
+    NBodyPotentialExpr* e;
+
+    luaL_checktype(luaSt, 1, LUA_TFUNCTION);
+    luaL_checktype(luaSt, 2, LUA_TTABLE);
+
+    lua_pushvalue(luaSt, 1);
+    closure = luaL_ref(luaSt, LUA_REGISTRYINDEX);
+    e = nbCompilePotentialClosure(luaSt, closure);
+    luaL_unref(luaSt, LUA_REGISTRYINDEX, closure);
+
+    if (!e)
+    {
+        lua_pushnil(luaSt);
+        return 1;
+    }
+
+    n = (int) lua_objlen(luaSt, 2);
+    buf = (real*) mwMalloc(6 * MAX(n, 1) * sizeof(real));
+
+    for (i = 0; i < n; ++i)
+    {
+        mwvector* r;
+
+        lua_rawgeti(luaSt, 2, i + 1);
+        r = checkVector(luaSt, -1);
+        buf[i] = X(*r);
+        buf[n + i] = Y(*r);
+        buf[2 * n + i] = Z(*r);
+        lua_pop(luaSt, 1);
+    }
+
+    nbEvalPotentialExpr(e, &buf[0], &buf[n], &buf[2 * n], &buf[3 * n], &buf[4 * n], &buf[5 * n], (unsigned int) n);
+    nbFreePotentialExpr(e);
+
+    lua_createtable(luaSt, n, 0);
+    for (i = 0; i < n; ++i)
+    {
+        mwvector a = mw_vec(buf[3 * n + i], buf[4 * n + i], buf[5 * n + i]);
+
+        pushVector(luaSt, a);
+        lua_rawseti(luaSt, -2, i + 1);
+    }
+
+    free(buf);
+    return 1;
+}
+
 static void registerNBodyTestFunctions(lua_State* luaSt)
 {
   #if USE_SSL_TESTS
@@ -465,6 +519,7 @@ static int runNBodyTest(const char* file, const char** args, unsigned int nArgs)
      * to not include useless / and or less safe versions of
      * functions. */
     registerNBodyState(luaSt);
+    lua_register(luaSt, "compiledPotentialAccelerations", compiledPotentialAccelerations);
 
   #if USE_SSL_TESTS
     installHashFunctions(luaSt);